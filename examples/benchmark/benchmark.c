@@ -0,0 +1,110 @@
+/*
+	Layer decoder benchmark
+	Loads each map from memory (no I/O) several times and reports the load time.
+	Build libTMX with different options (WANT_LIBDEFLATE, WANT_ZSTD, ...) to
+	compare the decoders, use maps with different layer encodings.
+*/
+
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <tmx.h>
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
+}
+
+static char* read_file(const char *path, long *size) {
+	FILE *file;
+	char *buffer;
+
+	if (!(file = fopen(path, "rb"))) {
+		perror(path);
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	buffer = (char*)malloc(*size);
+	if (buffer && fread(buffer, 1, *size, file) != (size_t)*size) {
+		perror(path);
+		free(buffer);
+		buffer = NULL;
+	}
+	fclose(file);
+	return buffer;
+}
+
+/* counts tiles in tile layers (including layers in groups) */
+static unsigned long count_tiles(const tmx_map *map, tmx_layer *layer) {
+	unsigned long res = 0;
+	for (; layer; layer = layer->next) {
+		if (layer->type == L_LAYER) {
+			res += map->width * map->height;
+		}
+		else if (layer->type == L_GROUP) {
+			res += count_tiles(map, layer->content.group_head);
+		}
+	}
+	return res;
+}
+
+static int bench(const char *path, int iterations) {
+	tmx_map *map;
+	char *buffer;
+	long size;
+	int it;
+	unsigned long tiles = 0;
+	double start, elapsed, best = -1., total = 0.;
+
+	if (!(buffer = read_file(path, &size))) return 0;
+
+	for (it = 0; it < iterations; it++) {
+		start = now_ms();
+		map = tmx_rcmgr_load_buffer_vpath(NULL, buffer, (int)size, path);
+		elapsed = now_ms() - start;
+		if (!map) {
+			tmx_perror(path);
+			free(buffer);
+			return 0;
+		}
+		tiles = count_tiles(map, map->ly_head);
+		tmx_map_free(map);
+
+		total += elapsed;
+		if (best < 0. || elapsed < best) best = elapsed;
+	}
+
+	printf("%-32s %9.2f KiB %8.2f ms (best) %8.2f ms (mean) %8.2f MiB/s %8.2f Mtiles/s\n",
+	       path, size / 1024., best, total / iterations,
+	       (size / 1048576.) / (best / 1000.), (tiles / 1000000.) / (best / 1000.));
+
+	free(buffer);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	int it = 1, iterations = 10, res = EXIT_SUCCESS;
+
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		iterations = atoi(argv[2]);
+		it = 3;
+	}
+	if (it >= argc || iterations < 1) {
+		fprintf(stderr, "usage: %s [-n iterations] <map.tmx>...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (; it < argc; it++) {
+		if (!bench(argv[it], iterations)) res = EXIT_FAILURE;
+	}
+
+	return res;
+}
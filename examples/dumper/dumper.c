@@ -324,7 +324,8 @@ void dump_tileset(tmx_tileset_list *tsl, int depth) {
 }
 
 void dump_layer(tmx_layer *l, unsigned int tc, int depth) {
-	unsigned int i;
+	unsigned int i, c;
+	tmx_chunk *chunk;
 	char padding[11]; mk_padding(padding, depth);
 
 	printf("\n%slayer={", padding);
@@ -346,6 +347,15 @@ void dump_layer(tmx_layer *l, unsigned int tc, int depth) {
 			for (i=0; i<tc; i++) {
 				printf("%u,", l->content.gids[i] & TMX_FLIP_BITS_REMOVAL);
 			}
+		} else if (l->type == L_LAYER && l->chunks) {
+			printf("\n%s\t" "type=Layer" "\n%s\t" "chunks=%u", padding, padding, l->chunks->count);
+			for (c=0; c<l->chunks->count; c++) {
+				chunk = l->chunks->list[c];
+				printf("\n%s\t" "chunk={x=%d, y=%d, width=%d, height=%d}" "\n%s\t\t" "tiles=", padding, chunk->x, chunk->y, chunk->width, chunk->height, padding);
+				for (i=0; chunk->gids && i<(unsigned int)(chunk->width * chunk->height); i++) {
+					printf("%u,", chunk->gids[i] & TMX_FLIP_BITS_REMOVAL);
+				}
+			}
 		} else if (l->type == L_OBJGR) {
 			printf("\n%s\t" "color=#%.6X", padding, l->content.objgr->color);
 			printf("\n%s\t" "draworder=", padding); print_draworder(l->content.objgr->draworder);
@@ -429,11 +439,11 @@ int isOption(const char *arg) {
 
 int isMap(const char *arg) {
 	int len = strlen(arg);
-	return !strncmp(".tmx", arg+len-4, 4);
+	return len >= 4 && (!strncmp(".tmx", arg+len-4, 4) || !strncmp(".tmj", arg+len-4, 4));
 }
 
 void printUsage(const char *arg0) {
-	fprintf(stderr, "usage: %s [--use-rc-mgr] { [--fd|--buffer|--callback] <map.tmx|tileset.tsx> }...\n", arg0);
+	fprintf(stderr, "usage: %s [--use-rc-mgr] { [--fd|--buffer|--callback] <map.tmx|map.tmj|tileset.tsx|tileset.tsj> }...\n", arg0);
 }
 
 int main(int argc, char *argv[]) {
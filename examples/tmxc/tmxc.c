@@ -0,0 +1,76 @@
+/*
+	Map compiler
+	Saves maps (TMX or JSON) as compiled maps (see tmx_save_binary), by default next to
+	the map with the extension .tmxb, and checks that the compiled map loads.
+	Compiled maps are specific to the platform and to the version of libTMX.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <tmx.h>
+
+/* replaces the extension of `path` by .tmxb */
+static char* output_path(const char *path) {
+	const char *ext = strrchr(path, '.');
+	size_t len = strlen(path);
+	char *res;
+
+	if (ext && !strpbrk(ext, "/\\")) len = ext - path;
+	if ((res = (char*)malloc(len + 6))) {
+		memcpy(res, path, len);
+		strcpy(res + len, ".tmxb");
+	}
+	return res;
+}
+
+static int compile(const char *path, const char *output) {
+	tmx_map *map;
+	int res;
+
+	if (!(map = tmx_load(path))) {
+		tmx_perror(path);
+		return 0;
+	}
+	res = tmx_save_binary(map, output);
+	tmx_map_free(map);
+	if (!res) {
+		tmx_perror(output);
+		return 0;
+	}
+
+	if (!(map = tmx_load_binary(output))) {
+		tmx_perror(output);
+		return 0;
+	}
+	tmx_map_free(map);
+	printf("%s -> %s\n", path, output);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	char *output;
+	int it, res = EXIT_SUCCESS;
+
+	if (argc < 2 || !strcmp(argv[1], "--help")) {
+		fprintf(stderr, "usage: %s <map.tmx> [-o <map.tmxb>]\n"
+		                "       %s <map.tmx>...\n", argv[0], argv[0]);
+		return argc < 2? EXIT_FAILURE: EXIT_SUCCESS;
+	}
+
+	if (argc == 4 && !strcmp(argv[2], "-o")) {
+		return compile(argv[1], argv[3])? EXIT_SUCCESS: EXIT_FAILURE;
+	}
+
+	for (it = 1; it < argc; it++) {
+		if (!(output = output_path(argv[it]))) {
+			perror(argv[it]);
+			return EXIT_FAILURE;
+		}
+		if (!compile(argv[it], output)) res = EXIT_FAILURE;
+		free(output);
+	}
+
+	return res;
+}
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "tmx.h"
 #include "tmx_utils.h"
@@ -12,6 +14,11 @@ void* (*tmx_alloc_func) (void *address, size_t len) = NULL;
 void  (*tmx_free_func ) (void *address) = NULL;
 void* (*tmx_img_load_func) (const char *p) = NULL;
 void  (*tmx_img_free_func) (void *address) = NULL;
+int tmx_shape_float32 = 0;
+int tmx_thread_count = 1;
+int tmx_lazy_decoding = 0;
+int tmx_arena_allocation = 0;
+int (*tmx_async_run_func) (void (*task)(void *arg), void *arg) = NULL;
 
 /*
 	Public functions
@@ -20,15 +27,42 @@ void  (*tmx_img_free_func) (void *address) = NULL;
 tmx_map* tmx_load(const char *path) {
 	tmx_map *map = NULL;
 	set_alloc_functions();
-	map = parse_xml(NULL, path);
+	map = is_json_file(path)? parse_json(NULL, path, NULL): parse_xml(NULL, path);
 	map_post_parsing(&map);
 	return map;
 }
 
+tmx_map* tmx_load_mmap(const char *path) {
+	tmx_map *map = NULL;
+	set_alloc_functions();
+	map = is_json_file(path)? parse_json(NULL, path, NULL): parse_xml_mmap(NULL, path);
+	map_post_parsing(&map);
+	return map;
+}
+
+/* checks the region, its cells are addressed with ints */
+static int mk_region(data_region *region, int x, int y, int w, int h) {
+	if (w <= 0 || h <= 0 || (size_t)w * (size_t)h > INT_MAX / sizeof(uint32_t) ||
+	    (long)x + w > INT_MAX || (long)y + h > INT_MAX) {
+		tmx_err(E_INVAL, "tmx_load_region: invalid region %dx%d at (%d, %d)", w, h, x, y);
+		return 0;
+	}
+	region->x = x;
+	region->y = y;
+	region->width = w;
+	region->height = h;
+	return 1;
+}
+
+tmx_map* tmx_load_region(const char *path, int x, int y, int w, int h) {
+	return tmx_rcmgr_load_region(NULL, path, x, y, w, h);
+}
+
 tmx_map* tmx_load_buffer(const char *buffer, int len) {
 	tmx_map *map = NULL;
 	set_alloc_functions();
-	map = parse_xml_buffer(NULL, buffer, len);
+	map = len > 0 && is_json_buffer(buffer, (size_t)len)? parse_json_buffer(NULL, buffer, (size_t)len, NULL):
+	                                                      parse_xml_buffer(NULL, buffer, len);
 	map_post_parsing(&map);
 	return map;
 }
@@ -49,16 +83,116 @@ tmx_map* tmx_load_callback(tmx_read_functor callback, void *userdata) {
 	return map;
 }
 
+/* makes the allocator of `map` that of the calling thread, swap_load_options(options) restores the previous one */
+static void swap_map_options(tmx_map *map, tmx_load_options *options) {
+	if (map->options) {
+		*options = *(tmx_load_options*)(map->options);
+	} else {
+		memset(options, 0, sizeof(tmx_load_options));
+	}
+	swap_load_options(options);
+}
+
+/* makes the allocator and the arena of `map` those of the calling thread, until leave_map */
+static mem_arena* enter_map(tmx_map *map, tmx_load_options *options) {
+	swap_map_options(map, options);
+	return arena_enter((mem_arena*)map->arena);
+}
+
+static void leave_map(mem_arena *prev, tmx_load_options *options) {
+	arena_enter(prev);
+	swap_load_options(options);
+}
+
 void tmx_map_free(tmx_map *map) {
-	if (map) {
+	tmx_load_options options;
+	mem_arena *arena;
+	void *map_options;
+	if (!map) return;
+	map_options = map->options;
+	/* not its arena: a map that failed to load is freed in the arena of the load */
+	swap_map_options(map, &options);
+	if (map->binary) {
+		free_binary_map(map);
+	}
+	else if (map->arena) {
+		/* the nodes are released with the blocks of the arena */
+		arena = (mem_arena*)map->arena;
+		free_data_decoder((data_decoder*)map->decoder);
+		free_arena_images(arena);
+		free_arena(arena);
+	}
+	else {
 		free_ts_list(map->ts_head);
 		free_props(map->properties);
 		free_layers(map->ly_head);
-		tmx_free_func(map->tiles);
-		if (map->format_version) tmx_free_func(map->format_version);
-		if (map->class_type) tmx_free_func(map->class_type);
-		tmx_free_func(map);
+		mem_free(map->tiles);
+		if (map->format_version) mem_free(map->format_version);
+		if (map->class_type) mem_free(map->class_type);
+		free_data_decoder((data_decoder*)map->decoder);
+		mem_free(map);
+	}
+	raw_free(map_options);
+	swap_load_options(&options);
+}
+
+uint32_t* tmx_layer_gids(tmx_map *map, tmx_layer *layer) {
+	tmx_load_options options;
+	mem_arena *prev;
+	int res;
+	if (!map) {
+		tmx_err(E_INVAL, "tmx_layer_gids: invalid argument: map is NULL");
+		return NULL;
+	}
+	if (!layer || layer->type != L_LAYER) {
+		tmx_err(E_INVAL, "tmx_layer_gids: invalid argument: layer is not a tile layer");
+		return NULL;
+	}
+	if (layer->chunks) {
+		tmx_err(E_INVAL, "tmx_layer_gids: invalid argument: layer is made of chunks, use tmx_layer_chunks");
+		return NULL;
+	}
+	if (!(layer->content.gids) && map->decoder) {
+		prev = enter_map(map, &options);
+		res = data_decoder_decode_lazy((data_decoder*)map->decoder, &(layer->content.gids));
+		leave_map(prev, &options);
+		if (!res) return NULL;
+	}
+	return layer->content.gids;
+}
+
+tmx_chunks* tmx_layer_chunks(tmx_map *map, tmx_layer *layer) {
+	tmx_load_options options;
+	mem_arena *prev;
+	unsigned int i;
+	int res = 1;
+	if (!map) {
+		tmx_err(E_INVAL, "tmx_layer_chunks: invalid argument: map is NULL");
+		return NULL;
+	}
+	if (!layer || layer->type != L_LAYER || !(layer->chunks)) {
+		tmx_err(E_INVAL, "tmx_layer_chunks: invalid argument: layer is not a tile layer of an infinite map");
+		return NULL;
+	}
+	if (map->decoder) {
+		prev = enter_map(map, &options);
+		for (i=0; res && i<layer->chunks->count; i++) {
+			if (!(layer->chunks->list[i]->gids)) {
+				res = data_decoder_decode_lazy((data_decoder*)map->decoder, &(layer->chunks->list[i]->gids));
+			}
+		}
+		leave_map(prev, &options);
+		if (!res) return NULL;
+	}
+	return layer->chunks;
+}
+
+tmx_chunk* tmx_find_chunk(const tmx_chunks *chunks, int x, int y) {
+	if (!chunks) {
+		tmx_err(E_INVAL, "tmx_find_chunk: invalid argument: chunks is NULL");
+		return NULL;
 	}
+	return find_chunk(chunks, x, y);
 }
 
 tmx_tile* tmx_get_tile(tmx_map *map, unsigned int gid) {
@@ -207,12 +341,12 @@ void tmx_free_resource_manager(tmx_resource_manager *h) {
 
 int tmx_load_tileset(tmx_resource_manager *rc_mgr, const char *path) {
 	if (rc_mgr == NULL) return 0;
-	return add_tileset(rc_mgr, path, parse_tsx_xml(path));
+	return add_tileset(rc_mgr, path, is_json_file(path)? parse_tsj(path): parse_tsx_xml(path));
 }
 
 int tmx_load_tileset_buffer(tmx_resource_manager *rc_mgr, const char *buffer, int len, const char *key) {
 	if (rc_mgr == NULL) return 0;
-	return add_tileset(rc_mgr, key, parse_tsx_xml_buffer(buffer, len));
+	return add_tileset(rc_mgr, key, len > 0 && is_json_buffer(buffer, (size_t)len)? parse_tsj_buffer(buffer, (size_t)len): parse_tsx_xml_buffer(buffer, len));
 }
 
 int tmx_load_tileset_fd(tmx_resource_manager *rc_mgr, int fd, const char *key) {
@@ -227,12 +361,12 @@ int tmx_load_tileset_callback(tmx_resource_manager *rc_mgr, tmx_read_functor cal
 
 int tmx_load_template(tmx_resource_manager *rc_mgr, const char *path) {
 	if (rc_mgr == NULL) return 0;
-	return add_template(rc_mgr, path, parse_tx_xml(rc_mgr, path));
+	return add_template(rc_mgr, path, is_json_file(path)? parse_tj(rc_mgr, path): parse_tx_xml(rc_mgr, path));
 }
 
 int tmx_load_template_buffer(tmx_resource_manager *rc_mgr, const char *buffer, int len, const char *key) {
 	if (rc_mgr == NULL) return 0;
-	return add_template(rc_mgr, key, parse_tx_xml_buffer(rc_mgr, buffer, len));
+	return add_template(rc_mgr, key, len > 0 && is_json_buffer(buffer, (size_t)len)? parse_tj_buffer(rc_mgr, buffer, (size_t)len): parse_tx_xml_buffer(rc_mgr, buffer, len));
 }
 
 int tmx_load_template_fd(tmx_resource_manager *rc_mgr, int fd, const char *key) {
@@ -245,10 +379,56 @@ int tmx_load_template_callback(tmx_resource_manager *rc_mgr, tmx_read_functor ca
 	return add_template(rc_mgr, key, parse_tx_xml_callback(rc_mgr, callback, userdata));
 }
 
+int tmx_load_zstd_dict(tmx_resource_manager *rc_mgr, const char *path) {
+	if (rc_mgr == NULL) return 0;
+	set_alloc_functions();
+	return add_zstd_dict(rc_mgr, path, load_zstd_dict(path));
+}
+
+int tmx_load_zstd_dict_buffer(tmx_resource_manager *rc_mgr, const char *buffer, int len, const char *key) {
+	if (rc_mgr == NULL || len <= 0) return 0;
+	set_alloc_functions();
+	return add_zstd_dict(rc_mgr, key, mk_zstd_dict(buffer, (size_t)len));
+}
+
+int tmx_register_zstd_dict(const char *buffer, int len) {
+	if (len <= 0) return 0;
+	set_alloc_functions();
+	return register_zstd_dict(mk_zstd_dict(buffer, (size_t)len));
+}
+
+void tmx_free_zstd_dicts(void) {
+	free_zstd_dict_registry();
+}
+
 tmx_map* tmx_rcmgr_load(tmx_resource_manager *rc_mgr, const char *path) {
 	tmx_map *map = NULL;
+	map_cache *cache;
+	set_alloc_functions();
+	if ((cache = get_map_cache(rc_mgr)) && (map = load_cached_map(cache, path))) return map;
+	map = is_json_file(path)? parse_json(rc_mgr, path, NULL): parse_xml(rc_mgr, path);
+	map_post_parsing(&map);
+	if (cache && map) save_cached_map(cache, map, path);
+	return map;
+}
+
+tmx_map* tmx_rcmgr_load_mmap(tmx_resource_manager *rc_mgr, const char *path) {
+	tmx_map *map = NULL;
+	map_cache *cache;
+	set_alloc_functions();
+	if ((cache = get_map_cache(rc_mgr)) && (map = load_cached_map(cache, path))) return map;
+	map = is_json_file(path)? parse_json(rc_mgr, path, NULL): parse_xml_mmap(rc_mgr, path);
+	map_post_parsing(&map);
+	if (cache && map) save_cached_map(cache, map, path);
+	return map;
+}
+
+tmx_map* tmx_rcmgr_load_region(tmx_resource_manager *rc_mgr, const char *path, int x, int y, int w, int h) {
+	tmx_map *map = NULL;
+	data_region region;
+	if (!mk_region(&region, x, y, w, h)) return NULL;
 	set_alloc_functions();
-	map = parse_xml(rc_mgr, path);
+	map = is_json_file(path)? parse_json(rc_mgr, path, &region): parse_xml_region(rc_mgr, path, &region);
 	map_post_parsing(&map);
 	return map;
 }
@@ -268,7 +448,8 @@ tmx_map* tmx_rcmgr_load_callback(tmx_resource_manager *rc_mgr, tmx_read_functor
 tmx_map* tmx_rcmgr_load_buffer_vpath(tmx_resource_manager *rc_mgr, const char *buffer, int len, const char *vpath) {
 	tmx_map *map = NULL;
 	set_alloc_functions();
-	map = parse_xml_buffer_vpath(rc_mgr, buffer, len, vpath);
+	map = len > 0 && is_json_buffer(buffer, (size_t)len)? parse_json_buffer(rc_mgr, buffer, (size_t)len, vpath):
+	                                                      parse_xml_buffer_vpath(rc_mgr, buffer, len, vpath);
 	map_post_parsing(&map);
 	return map;
 }
@@ -287,4 +468,204 @@ tmx_map* tmx_rcmgr_load_callback_vpath(tmx_resource_manager *rc_mgr, tmx_read_fu
 	map = parse_xml_callback_vpath(rc_mgr, callback, vpath, userdata);
 	map_post_parsing(&map);
 	return map;
-}
\ No newline at end of file
+}
+/*
+	Asynchronous loading
+*/
+
+enum async_state {AS_RUNNING, AS_READY, AS_OVER};
+
+struct _tmx_async_load {
+	char *path;
+	tmx_resource_manager *rc_mgr;
+	tmx_async_functor on_done;
+	void *userdata;
+	FILE *file;
+	thread_handle *thread; /* NULL if the load runs on a thread of tmx_async_run_func */
+	tmx_load_options options; /* of the thread that started the load, the handle is allocated with it */
+	/* fields below are protected by `sync` */
+	thread_sync *sync;
+	enum async_state state; /* AS_READY: result set, on_done is running, AS_OVER: the loading thread is done with the handle */
+	int cancelled;
+	tmx_map *map;
+	error_state err; /* of the loading thread */
+};
+
+static int async_cancelled(tmx_async_load *load) {
+	int res;
+	thread_sync_lock(load->sync);
+	res = load->cancelled;
+	thread_sync_unlock(load->sync);
+	return res;
+}
+
+/* the cancellation is checked every time the parser reads the file */
+static int async_read(void *userdata, char *buffer, int len) {
+	tmx_async_load *load = (tmx_async_load*)userdata;
+	size_t res;
+	if (async_cancelled(load)) return -1;
+	res = fread(buffer, 1, (size_t)len, load->file);
+	if (res == 0 && ferror(load->file)) return -1;
+	return (int)res;
+}
+
+static void async_load_task(void *arg) {
+	tmx_async_load *load = (tmx_async_load*)arg;
+	tmx_load_options options = load->options;
+	tmx_map *map = NULL;
+	map_cache *cache;
+
+	swap_load_options(&options);
+	if ((cache = get_map_cache(load->rc_mgr)) && (map = load_cached_map(cache, load->path))) {
+		cache = NULL; /* loaded from the cache, nothing to save */
+	}
+	else if (!(load->file = fopen(load->path, "rb"))) {
+		tmx_err(errno == EACCES? E_ACCESS: E_NOENT, "cannot open '%s': %s", load->path, strerror(errno));
+	}
+	else {
+		if (is_json_file(load->path)) {
+			map = parse_json_callback(load->rc_mgr, async_read, load, load->path);
+		} else {
+			map = parse_xml_callback_vpath(load->rc_mgr, async_read, load->path, load);
+		}
+		map_post_parsing(&map);
+		fclose(load->file);
+		load->file = NULL;
+	}
+
+	if (cache && map && !async_cancelled(load)) save_cached_map(cache, map, load->path);
+
+	thread_sync_lock(load->sync);
+	if (load->cancelled) {
+		tmx_map_free(map);
+		map = NULL;
+		tmx_err(E_CANCEL, "load of %s cancelled", load->path);
+	}
+	if (!map) save_error(&(load->err));
+	load->map = map;
+	load->state = AS_READY;
+	thread_sync_broadcast(load->sync);
+	thread_sync_unlock(load->sync);
+	swap_load_options(&options);
+
+	if (load->on_done) {
+		load->on_done(load, load->userdata);
+	}
+
+	/* the handle may be freed as soon as the lock is released */
+	thread_sync_lock(load->sync);
+	load->state = AS_OVER;
+	thread_sync_broadcast(load->sync);
+	thread_sync_unlock(load->sync);
+}
+
+static void free_async_load(tmx_async_load *load) {
+	free_thread_sync(load->sync);
+	raw_free(load->path);
+	raw_free(load);
+}
+
+tmx_async_load* tmx_load_async(const char *path, tmx_resource_manager *rc_mgr, tmx_async_functor on_done, void *userdata) {
+	tmx_async_load *load;
+
+	if (!path) {
+		tmx_err(E_INVAL, "tmx_load_async: invalid argument: path is NULL");
+		return NULL;
+	}
+
+	set_alloc_functions();
+	setup_libxml_mem();
+
+	if (!(load = (tmx_async_load*)raw_alloc(NULL, sizeof(tmx_async_load)))) {
+		tmx_err_code(E_ALLOC);
+		return NULL;
+	}
+	memset(load, 0, sizeof(tmx_async_load));
+	get_load_options(&(load->options));
+	load->rc_mgr = rc_mgr;
+	load->on_done = on_done;
+	load->userdata = userdata;
+	load->state = AS_RUNNING;
+	load->err.code = E_NONE;
+
+	if (!(load->path = tmx_strdup(path)) || !(load->sync = mk_thread_sync())) {
+		if (!load->path) tmx_err_code(E_ALLOC);
+		free_async_load(load);
+		return NULL;
+	}
+
+	if (tmx_async_run_func) {
+		if (!tmx_async_run_func(async_load_task, load)) {
+			tmx_err(E_UNKN, "tmx_load_async: tmx_async_run_func failed to run the load of %s", path);
+			free_async_load(load);
+			return NULL;
+		}
+	}
+	else if (!(load->thread = start_thread(async_load_task, load))) {
+		free_async_load(load);
+		return NULL;
+	}
+
+	return load;
+}
+
+int tmx_async_poll(tmx_async_load *load) {
+	int res;
+	if (!load) {
+		tmx_err(E_INVAL, "tmx_async_poll: invalid argument: load is NULL");
+		return 0;
+	}
+	thread_sync_lock(load->sync);
+	res = load->state != AS_RUNNING;
+	thread_sync_unlock(load->sync);
+	return res;
+}
+
+tmx_map* tmx_async_wait(tmx_async_load *load) {
+	tmx_map *res;
+	if (!load) {
+		tmx_err(E_INVAL, "tmx_async_wait: invalid argument: load is NULL");
+		return NULL;
+	}
+	thread_sync_lock(load->sync);
+	while (load->state == AS_RUNNING) {
+		thread_sync_wait(load->sync);
+	}
+	res = load->map;
+	load->map = NULL;
+	if (!res && load->err.code != E_NONE) {
+		/* report the error of the load on the calling thread */
+		restore_error(&(load->err));
+	}
+	else if (!res) {
+		tmx_err(E_INVAL, "tmx_async_wait: invalid argument: the map was already taken");
+	}
+	thread_sync_unlock(load->sync);
+	return res;
+}
+
+void tmx_async_cancel(tmx_async_load *load) {
+	if (load) {
+		thread_sync_lock(load->sync);
+		load->cancelled = 1;
+		thread_sync_unlock(load->sync);
+	}
+}
+
+void tmx_async_free(tmx_async_load *load) {
+	tmx_load_options options;
+	if (load) {
+		thread_sync_lock(load->sync);
+		load->cancelled = 1;
+		while (load->state != AS_OVER) {
+			thread_sync_wait(load->sync);
+		}
+		thread_sync_unlock(load->sync);
+		tmx_map_free(load->map);
+		options = load->options;
+		swap_load_options(&options);
+		join_thread(load->thread);
+		free_async_load(load);
+		swap_load_options(&options);
+	}
+}
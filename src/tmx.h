@@ -37,11 +37,44 @@ extern "C" {
 TMXEXPORT extern void* (*tmx_alloc_func) (void *address, size_t len); /* realloc */
 TMXEXPORT extern void  (*tmx_free_func ) (void *address);             /* free */
 
+/* Allocator of the loads run by a thread, see tmx_set_load_options */
+typedef struct _tmx_load_options {
+	void* (*alloc_func)(void *userdata, void *address, size_t len); /* realloc */
+	void  (*free_func )(void *userdata, void *address);             /* free */
+	void *userdata;
+} tmx_load_options;
+
+/* Sets the allocator of the loads run by the calling thread (with any load function, worker threads of these
+   loads use it too), `options` is copied, NULL restores tmx_alloc_func and tmx_free_func.
+   Maps keep the allocator they were loaded with and tmx_map_free uses it; tilesets, templates and resource
+   managers must be used and freed with the allocator they were created with.
+   libxml's own parser allocations still use tmx_alloc_func and tmx_free_func */
+TMXEXPORT void tmx_set_load_options(const tmx_load_options *options);
+
 /* load/free tmx_image->resource_image, you should set this if you want
    the library to load/free images */
 TMXEXPORT extern void* (*tmx_img_load_func) (const char *path);
 TMXEXPORT extern void  (*tmx_img_free_func) (void *address);
 
+/* set to 1 to store the points of polygons and polylines in single precision,
+   in tmx_shape->fcoords instead of tmx_shape->coords and tmx_shape->points */
+TMXEXPORT extern int tmx_shape_float32;
+
+/* maximum number of threads used to load a map (layers are decoded, external tilesets and templates are loaded in parallel)
+   0: one per processor, 1 (default): everything is done on the calling thread
+   if not 1, tmx_alloc_func and tmx_free_func (or the allocator of tmx_set_load_options) must be thread-safe */
+TMXEXPORT extern int tmx_thread_count;
+
+/* set to 1 to decode the data of tile layers on first access (see tmx_layer_gids) instead of at load time,
+   `layer->content.gids` is NULL until then, corrupted layer data is only detected when the layer is decoded */
+TMXEXPORT extern int tmx_lazy_decoding;
+
+/* set to 1 to allocate the nodes of the maps (and their strings, arrays and properties) in a few large blocks
+   owned by the map instead of one by one with tmx_alloc_func: tmx_map_free releases these blocks, the nodes of
+   these maps must not be freed or reallocated individually; tilesets and templates of a resource manager are not
+   allocated in the blocks of the maps */
+TMXEXPORT extern int tmx_arena_allocation;
+
 /*
 	Data Structures
 */
@@ -72,6 +105,8 @@ typedef struct _tmx_text tmx_text;
 typedef struct _tmx_obj tmx_object;
 typedef struct _tmx_objgr tmx_object_group;
 typedef struct _tmx_templ tmx_template;
+typedef struct _tmx_chunk tmx_chunk;
+typedef struct _tmx_chunks tmx_chunks;
 typedef struct _tmx_layer tmx_layer;
 typedef struct _tmx_map tmx_map;
 typedef void tmx_properties; /* hashtable, use function tmx_get_property(...) */
@@ -151,6 +186,8 @@ struct _tmx_ts { /* <tileset> and <tileoffset> */
 	tmx_user_data user_data;
 	tmx_properties *properties;
 	tmx_tile *tiles;
+
+	tmx_anim_frame *frames; /* used internally: the frames of all animations, see tmx_tile.animation */
 };
 
 struct _tmx_ts_list { /* Linked list */
@@ -164,6 +201,8 @@ struct _tmx_ts_list { /* Linked list */
 struct _tmx_shape { /* <polygon> and <polyline> */
 	double **points; /* point[i][x,y]; x=0 y=1 */
 	int points_len;
+	double *coords; /* coords[2*i] = x, coords[2*i+1] = y; same buffer as points[0] */
+	float *fcoords; /* same as coords, only if tmx_shape_float32 (then points and coords are NULL) */
 };
 
 struct _tmx_text { /* <text> */
@@ -218,6 +257,21 @@ struct _tmx_templ { /* <template> */
 	tmx_object *object; /* never null */
 };
 
+struct _tmx_chunk { /* <chunk> (cells of a tile layer of an infinite map) */
+	int x, y; /* coordinates of the top left cell, in tiles */
+	int width, height; /* in tiles */
+	uint32_t *gids; /* width * height cells */
+};
+
+struct _tmx_chunks { /* chunks of a tile layer of an infinite map, use tmx_find_chunk(...) to get the chunk of a cell */
+	unsigned int count;
+	tmx_chunk **list; /* all the chunks, in document order */
+	int chunk_width, chunk_height; /* all the chunks have the same size, 0 if there is no chunk */
+	int origin_x, origin_y; /* the chunks are aligned on a grid that starts at these coordinates */
+	unsigned int slots_mask;
+	tmx_chunk **slots; /* private: chunks indexed by their coordinates in the grid (open addressing) */
+};
+
 struct _tmx_layer { /* <layer> or <imagelayer> or <objectgroup> */
 	int id;
 	char *name;
@@ -240,6 +294,8 @@ struct _tmx_layer { /* <layer> or <imagelayer> or <objectgroup> */
 	tmx_user_data user_data;
 	tmx_properties *properties;
 	tmx_layer *next;
+
+	tmx_chunks *chunks; /* tile layers of infinite maps, `content.gids` is then NULL */
 };
 
 struct _tmx_map { /* <map> (Head of the data structure) */
@@ -268,16 +324,39 @@ struct _tmx_map { /* <map> (Head of the data structure) */
 	tmx_tile **tiles; /* GID indexed tile array (array of pointers to tmx_tile) */
 
 	tmx_user_data user_data;
+
+	int infinite; /* tile layers are made of chunks, see tmx_layer.chunks */
+	int region_x, region_y; /* position of the first cell of the layers, see tmx_load_region */
+
+	void *decoder; /* private: payloads of the layers not yet decoded, see tmx_lazy_decoding */
+	void *binary; /* private: file of a map loaded by tmx_load_binary */
+	void *arena; /* private: blocks of the nodes of a map loaded with tmx_arena_allocation set */
+	void *options; /* private: allocator the map was loaded with (see tmx_set_load_options), NULL for the defaults */
 };
 
 /*
 	Functions
+	Maps, tilesets and templates are loaded from TMX (XML) or JSON (.tmj, .tsj, .tj) documents, files with another
+	extension and buffers are loaded as JSON if they start with '{', the fd and callback functions only load XML
 */
 
 /* Loads a map from file at `path` and returns the head of the data structure
    returns NULL if an error occurred and set tmx_errno */
 TMXEXPORT tmx_map* tmx_load(const char *path);
 
+/* Same as tmx_load, but the file (and external tilesets and templates) is mapped
+   in memory and parsed from the mapping instead of being read in buffers
+   The files must not be truncated while the map is loading
+   returns NULL if an error occurred and set tmx_errno */
+TMXEXPORT tmx_map* tmx_load_mmap(const char *path);
+
+/* Same as tmx_load, but only keeps the `w`x`h` cells at (`x`, `y`) (in tiles) of the tile layers: `map->width`
+   and `map->height` are set to `w` and `h`, `map->region_x` and `map->region_y` to `x` and `y`, the cells of the
+   region out of the map are 0; layers of infinite maps only keep the chunks that overlap the region, objects out
+   of the region are removed, chunks and objects keep their position in the whole map
+   returns NULL if an error occurred and set tmx_errno */
+TMXEXPORT tmx_map* tmx_load_region(const char *path, int x, int y, int w, int h);
+
 /* Loads a map from file at `path` and returns the head of the data structure
    returns NULL if an error occurred and set tmx_errno */
 TMXEXPORT tmx_map* tmx_load_buffer(const char *buffer, int len);
@@ -299,6 +378,33 @@ TMXEXPORT tmx_map* tmx_load_callback(tmx_read_functor callback, void *userdata);
 /* Frees the map data structure */
 TMXEXPORT void tmx_map_free(tmx_map *map);
 
+/* Saves the map as a compiled map (its data structure as it is in memory) at `path`, decodes the layers first if
+   the map was loaded with tmx_lazy_decoding set; compiled maps only load on the platform and with the version of
+   libTMX that wrote them, and the sources of their images are relative to the compiled map: write it in the
+   directory of the map
+   returns 1 on success, 0 if an error occurred and set tmx_errno */
+TMXEXPORT int tmx_save_binary(tmx_map *map, const char *path);
+
+/* Loads a compiled map written by tmx_save_binary: the file is mapped in memory and its pointers relocated, the
+   map must be freed with tmx_map_free and its nodes must not be freed or reallocated individually, compiled maps
+   are trusted build artifacts (their offsets are bounds checked, not their content)
+   returns NULL if an error occurred and set tmx_errno */
+TMXEXPORT tmx_map* tmx_load_binary(const char *path);
+
+/* Returns the gids of a tile layer (`layer->content.gids`), decodes them on first call if the map was loaded
+   with tmx_lazy_decoding set, must not be called concurrently on layers of the same map
+   returns NULL if an error occurred and set tmx_errno */
+TMXEXPORT uint32_t* tmx_layer_gids(tmx_map *map, tmx_layer *layer);
+
+/* Returns the chunks of a tile layer of an infinite map (`layer->chunks`), decodes them on first call if the map
+   was loaded with tmx_lazy_decoding set, must not be called concurrently on layers of the same map
+   returns NULL if an error occurred and set tmx_errno */
+TMXEXPORT tmx_chunks* tmx_layer_chunks(tmx_map *map, tmx_layer *layer);
+
+/* Returns the chunk that holds the cell at (`x`, `y`) (in tiles), or NULL if there is no such chunk
+   the cell is then `chunk->gids[(x - chunk->x) + (y - chunk->y) * chunk->width]` */
+TMXEXPORT tmx_chunk* tmx_find_chunk(const tmx_chunks *chunks, int x, int y);
+
 /* DEPRECATED: use `map->tiles[gid]` instead.
    Returns the tile associated with this gid, returns NULL if it fails */
 TMXEXPORT tmx_tile* tmx_get_tile(tmx_map *map, unsigned int gid);
@@ -340,15 +446,15 @@ TMXEXPORT tmx_col_floats tmx_col_to_floats(uint32_t color);
 typedef void tmx_resource_manager;
 
 /* Creates a Resource Manager that holds a hashtable of loaded resources
-   Only external tilesets (in .TSX files) and object templates (in .TX files)
-   are indexed in a Resource Manager
+   Only external tilesets (in .TSX files), object templates (in .TX files)
+   and zstd dictionaries are indexed in a Resource Manager
    This is particularly useful to load only once tilesets and templates
    referenced in multiple maps
    The key is the `source` attribute of a tileset element or the `template`
    attribute of an object element */
 TMXEXPORT tmx_resource_manager* tmx_make_resource_manager();
 
-/* Frees the Resource Manager and all its loaded tilesets and object templates
+/* Frees the Resource Manager and all its loaded tilesets, object templates and dictionaries
    All maps holding a pointer to external tileset or an object template loaded
    by the given manager now hold a pointer to freed memory */
 TMXEXPORT void tmx_free_resource_manager(tmx_resource_manager *rc_mgr);
@@ -397,6 +503,34 @@ TMXEXPORT int tmx_load_template_fd(tmx_resource_manager *rc_mgr, int fd, const c
    Returns 1 on success */
 TMXEXPORT int tmx_load_template_callback(tmx_resource_manager *rc_mgr, tmx_read_functor callback, void *userdata, const char *key);
 
+/*
+	zstd dictionaries
+	Layers compressed with zstd using a dictionary reference it by its ID (stored in
+	each frame), dictionaries are looked up in this order:
+	. the dictionary referenced by the `zstd_dictionary` property of the map (a path
+	  relative to the map, also used as the key in the Resource Manager), it is also
+	  used for frames without a dictionary ID,
+	. the dictionaries pre-loaded in the Resource Manager,
+	. the dictionaries registered with tmx_register_zstd_dict.
+*/
+
+/* Loads a zstd dictionary from file at `path` and stores it into given Resource Manager
+   `path` will be used as the key
+   Returns 1 on success */
+TMXEXPORT int tmx_load_zstd_dict(tmx_resource_manager *rc_mgr, const char *path);
+
+/* Loads a zstd dictionary from a buffer and stores it into given Resource Manager
+   Returns 1 on success */
+TMXEXPORT int tmx_load_zstd_dict_buffer(tmx_resource_manager *rc_mgr, const char *buffer, int len, const char *key);
+
+/* Registers a zstd dictionary for all the maps, replaces the dictionary with the same ID
+   Please register dictionaries once before you use tmx_load
+   Returns 1 on success */
+TMXEXPORT int tmx_register_zstd_dict(const char *buffer, int len);
+
+/* Frees all the registered zstd dictionaries */
+TMXEXPORT void tmx_free_zstd_dicts(void);
+
 /*
 	Load map using a Resource Manager
 */
@@ -404,6 +538,12 @@ TMXEXPORT int tmx_load_template_callback(tmx_resource_manager *rc_mgr, tmx_read_
 /* Same as tmx_load (tmx.h) but with a Resource Manager. */
 TMXEXPORT tmx_map* tmx_rcmgr_load(tmx_resource_manager *rc_mgr, const char *path);
 
+/* Same as tmx_load_mmap (tmx.h) but with a Resource Manager. */
+TMXEXPORT tmx_map* tmx_rcmgr_load_mmap(tmx_resource_manager *rc_mgr, const char *path);
+
+/* Same as tmx_load_region (tmx.h) but with a Resource Manager. */
+TMXEXPORT tmx_map* tmx_rcmgr_load_region(tmx_resource_manager *rc_mgr, const char *path, int x, int y, int w, int h);
+
 /* Same as tmx_load_buffer (tmx.h) but with a Resource Manager. */
 TMXEXPORT tmx_map* tmx_rcmgr_load_buffer(tmx_resource_manager *rc_mgr, const char *buffer, int len);
 
@@ -413,6 +553,17 @@ TMXEXPORT tmx_map* tmx_rcmgr_load_fd(tmx_resource_manager *rc_mgr, int fd);
 /* Same as tmx_load_callback (tmx.h) but with a Resource Manager. */
 TMXEXPORT tmx_map* tmx_rcmgr_load_callback(tmx_resource_manager *rc_mgr, tmx_read_functor callback, void *userdata);
 
+/* Enables the compiled maps cache of the Resource Manager in directory `dir` (it must exist), NULL disables it
+   tmx_rcmgr_load, tmx_rcmgr_load_mmap and tmx_load_async then save the maps they load as compiled maps (see
+   tmx_save_binary) in the cache, and load the compiled map instead of parsing the map as long as the map and the
+   tilesets, templates and zstd dictionary it references did not change (their content is hashed at each load)
+   The other load functions (tmx_rcmgr_load_region, buffers, file descriptors and callbacks) do not use the cache
+   A map loaded from the cache holds its own copies of its external tilesets and templates: they are not the ones
+   of the Resource Manager (pointers differ from those of a map parsed with it, and from those of the other maps
+   loaded from the cache) and they are not added to it
+   Returns 1 on success */
+TMXEXPORT int tmx_rcmgr_set_cache_dir(tmx_resource_manager *rc_mgr, const char *dir);
+
 /*
 	Load map with virtual paths
 */
@@ -430,9 +581,46 @@ TMXEXPORT tmx_map* tmx_rcmgr_load_fd_vpath(tmx_resource_manager *rc_mgr, int fd,
    returns NULL if an error occurred and set tmx_errno */
 TMXEXPORT tmx_map* tmx_rcmgr_load_callback_vpath(tmx_resource_manager *rc_mgr, tmx_read_functor callback, const char* vpath, void *userdata);
 
+/*
+	Asynchronous loading
+	The map is loaded on another thread, the calling thread never blocks unless it waits for the load
+	tmx_alloc_func, tmx_free_func and tmx_img_load_func must be thread-safe
+	Without WANT_THREADS, tmx_load_async loads the map before it returns
+*/
+
+/* Asynchronous load handle (private type) */
+typedef struct _tmx_async_load tmx_async_load;
+
+/* Callback called on the loading thread once the load is over (successful, failed or cancelled)
+   the result is ready: tmx_async_wait(load) returns without blocking, do not call tmx_async_free(load) from here */
+typedef void (*tmx_async_functor)(tmx_async_load *load, void *userdata);
+
+/* Runs `task(arg)` on a thread of your own thread pool, returns 1 on success
+   if NULL (default) each asynchronous load starts its own thread */
+TMXEXPORT extern int (*tmx_async_run_func)(void (*task)(void *arg), void *arg);
+
+/* Starts loading the map at `path`, `rc_mgr` (may be NULL) must not be used until the load is over
+   `on_done` (may be NULL) is called with `userdata` once the load is over
+   returns NULL if the load could not be started and set tmx_errno */
+TMXEXPORT tmx_async_load* tmx_load_async(const char *path, tmx_resource_manager *rc_mgr, tmx_async_functor on_done, void *userdata);
+
+/* Returns 1 if the load is over, 0 if it is still running */
+TMXEXPORT int tmx_async_poll(tmx_async_load *load);
+
+/* Waits for the load to be over and returns the map, the caller then owns it (later calls return NULL, E_INVAL)
+   returns NULL if the load failed or was cancelled and set tmx_errno (E_CANCEL if cancelled) */
+TMXEXPORT tmx_map* tmx_async_wait(tmx_async_load *load);
+
+/* Asks the load to stop as soon as possible (checked while the map file is read, XML or JSON), does not block */
+TMXEXPORT void tmx_async_cancel(tmx_async_load *load);
+
+/* Cancels the load if it is still running, waits for it to end, frees the map if it was not taken and the handle */
+TMXEXPORT void tmx_async_free(tmx_async_load *load);
+
 /*
 	Error handling
 	each time a function fails, tmx_errno is set
+	tmx_errno is shared by all threads, tmx_last_error returns the error of the calling thread
 */
 
 /* Possible values for `tmx_errno` */
@@ -441,6 +629,7 @@ typedef enum _tmx_error_codes {
 	E_NONE   = 0,     /* No error so far */
 	E_UNKN   = 1,     /* See the message for more details */
 	E_INVAL  = 2,     /* Invalid argument */
+	E_CANCEL = 3,     /* Asynchronous load cancelled */
 	E_ALLOC  = 8,     /* Mem alloc */
 	/* I/O */
 	E_ACCESS = 10,    /* privileges needed */
@@ -453,15 +642,26 @@ typedef enum _tmx_error_codes {
 	E_XDATA  = 22,    /* XML corrupted data */
 	E_ZSDATA = 23,    /* Zstd corrupted data */
 	E_CDATA  = 24,    /* CSV corrupted data */
+	E_JDATA  = 25,    /* JSON corrupted data */
 	E_MISSEL = 30     /* Missing element, incomplete source */
 } tmx_error_codes;
 
 extern tmx_error_codes tmx_errno;
 
+/* Last error of the calling thread */
+typedef struct _tmx_error {
+	tmx_error_codes code;
+	const char *message;
+	const char *file;     /* source file of libTMX the error was raised from, NULL if unknown */
+	int line;
+} tmx_error;
+
 /* Prints the error message prefixed with the parameter */
 TMXEXPORT void tmx_perror(const char*);
 /* Returns the error message for the current value of `tmx_errno` */
 TMXEXPORT const char* tmx_strerr(void); /* FIXME errno parameter ? (as strerror) */
+/* Returns the last error of the calling thread, overwritten by the next call on this thread */
+TMXEXPORT const tmx_error* tmx_last_error(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,867 @@
+/*
+	Compiled maps
+	tmx_save_binary writes an image of the data structure of a map: the nodes as they are in memory, their
+	pointers replaced by offsets in the file. tmx_load_binary maps the file (copy on write) and relocates the
+	pointers, the only allocations are the property hashtables (stored as arrays) and the images.
+	Nodes (that hold pointers, thus are written at load) come first, followed by the bulk data (strings, gids,
+	coordinates and frames) whose pages stay shared with the page cache, then the tables of the loader.
+	The format is specific to the platform (pointer size, byte order) and to the layout of the data structures,
+	BIN_VERSION must be incremented when they change.
+	Compiled maps are build artifacts, the loader only checks the bounds of the offsets it relocates.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+#define BIN_MAGIC "TMXB"
+#define BIN_VERSION 3
+#define BIN_ALIGN 8 /* of the nodes and of the tables */
+#define BIN_ALIGNED(n) (((n) + (BIN_ALIGN-1)) & ~(size_t)(BIN_ALIGN-1))
+#define BIN_BULK 1  /* tags the entries of bin_writer.relocs that point to the bulk area */
+
+typedef struct _bin_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t layout; /* see layout_id */
+	uint32_t reserved;
+	uint64_t size; /* of the file */
+	uint64_t map; /* the offsets below are from the start of the file */
+	uint64_t relocs, relocs_count; /* offsets of the pointers to relocate */
+	uint64_t props, props_count; /* offsets of the `tmx_properties*` members, they point to a bin_props */
+	uint64_t images, images_count; /* offsets of the tmx_image nodes */
+} bin_header;
+
+#define BIN_HEADER_SIZE BIN_ALIGNED(sizeof(bin_header))
+
+/* properties are stored as an array of `count` tmx_property, that follows this header */
+typedef struct _bin_props {
+	size_t count;
+} bin_props;
+
+#define BIN_PROPS_ITEMS(p) ((tmx_property*)((char*)(p) + BIN_ALIGNED(sizeof(bin_props))))
+
+/* identifies the platform and the size of the data structures */
+static uint32_t layout_id(void) {
+	size_t sizes[] = {
+		sizeof(void*), sizeof(size_t), sizeof(double), sizeof(tmx_map), sizeof(tmx_layer), sizeof(tmx_chunks),
+		sizeof(tmx_chunk), sizeof(tmx_object_group), sizeof(tmx_object), sizeof(tmx_shape), sizeof(tmx_text),
+		sizeof(tmx_template), sizeof(tmx_tileset_list), sizeof(tmx_tileset), sizeof(tmx_tile),
+		sizeof(tmx_anim_frame), sizeof(tmx_image), sizeof(tmx_property), sizeof(bin_props)
+	};
+	uint32_t one = 1, hash = 2166136261u; /* FNV-1a */
+	unsigned int i;
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		hash = (hash ^ (uint32_t)sizes[i]) * 16777619u;
+	}
+	return (hash ^ *(unsigned char*)&one) * 16777619u;
+}
+
+/*
+	Writer
+	The nodes and the bulk data are written in two growable buffers, pointers hold offsets in their area
+	until the areas are laid out in the file.
+*/
+
+/* nodes referenced more than once (tilesets, arrays of tiles, templates and chunks), open addressing */
+typedef struct _bin_ref {
+	const void *ptr;
+	size_t offset;
+} bin_ref;
+
+typedef struct _bin_writer {
+	char *nodes, *bulk;
+	size_t nodes_len, nodes_cap, bulk_len, bulk_cap;
+	size_t *relocs, *props, *images; /* offsets in the nodes area */
+	unsigned int relocs_len, relocs_cap, props_len, props_cap, images_len, images_cap;
+	bin_ref *refs;
+	unsigned int refs_len, refs_mask;
+} bin_writer;
+
+#define BIN_NODE(w, type, offset) ((type*)((w)->nodes + (offset)))
+
+/* reserves `size` zeroed bytes aligned on `align` (a power of 2) in the nodes or in the `bulk` area */
+static int bin_alloc(bin_writer *w, int bulk, size_t size, size_t align, size_t *offset) {
+	char **buf = bulk? &(w->bulk): &(w->nodes);
+	size_t *len = bulk? &(w->bulk_len): &(w->nodes_len);
+	size_t *cap = bulk? &(w->bulk_cap): &(w->nodes_cap);
+	size_t off, new_cap;
+	char *res;
+
+	off = (*len + (align-1)) & ~(align-1);
+	if (off + size < off) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	if (off + size > *cap) {
+		for (new_cap = *cap? *cap: 4096; new_cap < off + size; new_cap *= 2);
+		if (!(res = (char*)raw_alloc(*buf, new_cap))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+		*buf = res;
+		*cap = new_cap;
+	}
+	memset(*buf + *len, 0, off + size - *len);
+	*len = off + size;
+	*offset = off;
+	return 1;
+}
+
+/* sets the pointer at `field` (in the nodes area) to `target`, an offset in the nodes or in the `bulk` area */
+static int bin_link(bin_writer *w, size_t field, size_t target, int bulk) {
+	uintptr_t value = (uintptr_t)target;
+	if (!grow_array((void**)&(w->relocs), &(w->relocs_cap), w->relocs_len, sizeof(size_t))) return 0;
+	w->relocs[w->relocs_len++] = field | (bulk? BIN_BULK: 0); /* fields are aligned on pointers */
+	memcpy(w->nodes + field, &value, sizeof(uintptr_t));
+	return 1;
+}
+
+/* copies an array without pointers in the bulk area, links `field` to it */
+static int bin_data(bin_writer *w, const void *data, size_t size, size_t align, size_t field, size_t *offset) {
+	size_t off;
+	if (!bin_alloc(w, 1, size, align, &off)) return 0;
+	memcpy(w->bulk + off, data, size);
+	if (offset) *offset = off;
+	return bin_link(w, field, off, 1);
+}
+
+static int bin_string(bin_writer *w, const char *str, size_t field) {
+	if (!str) return 1;
+	return bin_data(w, str, strlen(str)+1, 1, field, NULL);
+}
+
+static unsigned int bin_ref_slot(const bin_writer *w, const void *ptr) {
+	unsigned int i = (unsigned int)(((uintptr_t)ptr >> 4) * 2654435761u) & w->refs_mask;
+	while (w->refs[i].ptr && w->refs[i].ptr != ptr) {
+		i = (i + 1) & w->refs_mask;
+	}
+	return i;
+}
+
+static int bin_ref_add(bin_writer *w, const void *ptr, size_t offset) {
+	bin_ref *old = w->refs, *res;
+	unsigned int i, old_size = w->refs? w->refs_mask + 1: 0;
+	if (2 * (w->refs_len + 1) > old_size) {
+		if (!(res = (bin_ref*)raw_alloc(NULL, (old_size? old_size * 2: 64) * sizeof(bin_ref)))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+		memset(res, 0, (old_size? old_size * 2: 64) * sizeof(bin_ref));
+		w->refs = res;
+		w->refs_mask = (old_size? old_size * 2: 64) - 1;
+		for (i=0; i<old_size; i++) {
+			if (old[i].ptr) w->refs[bin_ref_slot(w, old[i].ptr)] = old[i];
+		}
+		raw_free(old);
+	}
+	i = bin_ref_slot(w, ptr);
+	w->refs[i].ptr = ptr;
+	w->refs[i].offset = offset;
+	w->refs_len++;
+	return 1;
+}
+
+/* returns 1 and sets `offset` if the node at `ptr` was already written */
+static int bin_ref_get(const bin_writer *w, const void *ptr, size_t *offset) {
+	unsigned int i;
+	if (!(w->refs)) return 0;
+	i = bin_ref_slot(w, ptr);
+	if (!(w->refs[i].ptr)) return 0;
+	*offset = w->refs[i].offset;
+	return 1;
+}
+
+struct props_list {
+	tmx_property **items;
+	unsigned int len, cap;
+	int failed;
+};
+
+static void collect_props(void *val, void *userdata, const char *key) {
+	struct props_list *list = (struct props_list*)userdata;
+	(void)key;
+	if (list->failed || !grow_array((void**)&(list->items), &(list->cap), list->len, sizeof(tmx_property*))) {
+		list->failed = 1;
+		return;
+	}
+	list->items[list->len++] = (tmx_property*)val;
+}
+
+static int write_props(bin_writer *w, tmx_properties *props, size_t field) {
+	struct props_list list;
+	tmx_property *prop;
+	size_t off, item;
+	unsigned int i;
+	int res = 0;
+
+	if (!props) return 1;
+	memset(&list, 0, sizeof(list));
+	hashtable_foreach(props, collect_props, &list);
+	if (list.failed) goto cleanup;
+
+	if (!bin_alloc(w, 0, BIN_ALIGNED(sizeof(bin_props)) + list.len * sizeof(tmx_property), BIN_ALIGN, &off)) goto cleanup;
+	BIN_NODE(w, bin_props, off)->count = list.len;
+	if (!grow_array((void**)&(w->props), &(w->props_cap), w->props_len, sizeof(size_t))) goto cleanup;
+	w->props[w->props_len++] = field;
+	if (!bin_link(w, field, off, 0)) goto cleanup;
+
+	for (i=0; i<list.len; i++) {
+		item = off + BIN_ALIGNED(sizeof(bin_props)) + i * sizeof(tmx_property);
+		prop = BIN_NODE(w, tmx_property, item);
+		memcpy(prop, list.items[i], sizeof(tmx_property));
+		prop->name = prop->propertytype = NULL;
+		if (prop->type == PT_NONE || prop->type == PT_STRING || prop->type == PT_FILE || prop->type == PT_CUSTOM) {
+			prop->value.string = NULL;
+		}
+		if (!bin_string(w, list.items[i]->name, item + offsetof(tmx_property, name))) goto cleanup;
+		if (!bin_string(w, list.items[i]->propertytype, item + offsetof(tmx_property, propertytype))) goto cleanup;
+		if (list.items[i]->type == PT_CUSTOM) {
+			if (!write_props(w, list.items[i]->value.properties, item + offsetof(tmx_property, value))) goto cleanup;
+		}
+		else if (list.items[i]->type == PT_NONE || list.items[i]->type == PT_STRING || list.items[i]->type == PT_FILE) {
+			if (!bin_string(w, list.items[i]->value.string, item + offsetof(tmx_property, value))) goto cleanup;
+		}
+	}
+	res = 1;
+
+cleanup:
+	if (list.failed) tmx_err_code(E_ALLOC);
+	raw_free(list.items);
+	return res;
+}
+
+/* `base` is the path of the document of the image relative to the map, NULL for the map itself */
+static int write_image(bin_writer *w, tmx_image *image, size_t field, const char *base) {
+	char *source;
+	size_t off;
+	int res;
+
+	if (!image) return 1;
+	if (!bin_alloc(w, 0, sizeof(tmx_image), BIN_ALIGN, &off)) return 0;
+	memcpy(BIN_NODE(w, tmx_image, off), image, sizeof(tmx_image));
+	BIN_NODE(w, tmx_image, off)->source = NULL;
+	BIN_NODE(w, tmx_image, off)->resource_image = NULL;
+	if (!grow_array((void**)&(w->images), &(w->images_cap), w->images_len, sizeof(size_t))) return 0;
+	w->images[w->images_len++] = off;
+	if (!bin_link(w, field, off, 0)) return 0;
+
+	if (!(image->source)) return 1;
+	if (!(source = mk_absolute_path(base, image->source))) return 0;
+	res = bin_string(w, source, off + offsetof(tmx_image, source));
+	raw_free(source);
+	return res;
+}
+
+static int write_shape(bin_writer *w, tmx_shape *shape, size_t field) {
+	size_t off, points, coords;
+	int i;
+
+	if (!shape) return 1;
+	if (!bin_alloc(w, 0, sizeof(tmx_shape), BIN_ALIGN, &off)) return 0;
+	memcpy(BIN_NODE(w, tmx_shape, off), shape, sizeof(tmx_shape));
+	BIN_NODE(w, tmx_shape, off)->points = NULL;
+	BIN_NODE(w, tmx_shape, off)->coords = NULL;
+	BIN_NODE(w, tmx_shape, off)->fcoords = NULL;
+	if (!bin_link(w, field, off, 0)) return 0;
+
+	if (shape->fcoords) {
+		return bin_data(w, shape->fcoords, 2 * shape->points_len * sizeof(float), sizeof(float),
+		                off + offsetof(tmx_shape, fcoords), NULL);
+	}
+	if (!(shape->coords) || !(shape->points)) return 1;
+	if (!bin_data(w, shape->coords, 2 * shape->points_len * sizeof(double), sizeof(double),
+	              off + offsetof(tmx_shape, coords), &coords)) return 0;
+	if (!bin_alloc(w, 0, shape->points_len * sizeof(double*), BIN_ALIGN, &points)) return 0;
+	if (!bin_link(w, off + offsetof(tmx_shape, points), points, 0)) return 0;
+	for (i=0; i<shape->points_len; i++) {
+		if (!bin_link(w, points + i * sizeof(double*), coords + 2 * i * sizeof(double), 1)) return 0;
+	}
+	return 1;
+}
+
+static int write_text(bin_writer *w, tmx_text *text, size_t field) {
+	size_t off;
+
+	if (!text) return 1;
+	if (!bin_alloc(w, 0, sizeof(tmx_text), BIN_ALIGN, &off)) return 0;
+	memcpy(BIN_NODE(w, tmx_text, off), text, sizeof(tmx_text));
+	BIN_NODE(w, tmx_text, off)->fontfamily = NULL;
+	BIN_NODE(w, tmx_text, off)->text = NULL;
+	if (!bin_link(w, field, off, 0)) return 0;
+
+	return bin_string(w, text->fontfamily, off + offsetof(tmx_text, fontfamily))
+	    && bin_string(w, text->text, off + offsetof(tmx_text, text));
+}
+
+static int write_template(bin_writer *w, tmx_template *tmpl, size_t field, const char *base);
+
+static int write_objects(bin_writer *w, tmx_object *obj, size_t field, const char *base) {
+	tmx_object *node;
+	size_t off;
+
+	for (; obj; obj = obj->next) {
+		if (!bin_alloc(w, 0, sizeof(tmx_object), BIN_ALIGN, &off)) return 0;
+		node = BIN_NODE(w, tmx_object, off);
+		memcpy(node, obj, sizeof(tmx_object));
+		if (obj->obj_type != OT_TILE) node->content.shape = NULL;
+		node->name = node->type = NULL;
+		node->template_ref = NULL;
+		node->properties = NULL;
+		node->next = NULL;
+		if (!bin_link(w, field, off, 0)) return 0;
+
+		if (obj->obj_type == OT_POLYGON || obj->obj_type == OT_POLYLINE) {
+			if (!write_shape(w, obj->content.shape, off + offsetof(tmx_object, content))) return 0;
+		}
+		else if (obj->obj_type == OT_TEXT) {
+			if (!write_text(w, obj->content.text, off + offsetof(tmx_object, content))) return 0;
+		}
+		if (!bin_string(w, obj->name, off + offsetof(tmx_object, name))) return 0;
+		if (!bin_string(w, obj->type, off + offsetof(tmx_object, type))) return 0;
+		if (!write_template(w, obj->template_ref, off + offsetof(tmx_object, template_ref), base)) return 0;
+		if (!write_props(w, obj->properties, off + offsetof(tmx_object, properties))) return 0;
+		field = off + offsetof(tmx_object, next);
+	}
+	return 1;
+}
+
+static int write_tileset(bin_writer *w, tmx_tileset *ts, size_t field, const char *base) {
+	tmx_tileset *node;
+	tmx_tile *tile;
+	size_t off, tiles, frames, item;
+	unsigned int i, frames_len;
+
+	if (!ts) return 1;
+	if (bin_ref_get(w, ts, &off)) return bin_link(w, field, off, 0);
+	if (!bin_alloc(w, 0, sizeof(tmx_tileset), BIN_ALIGN, &off)) return 0;
+	if (!bin_ref_add(w, ts, off)) return 0;
+	node = BIN_NODE(w, tmx_tileset, off);
+	memcpy(node, ts, sizeof(tmx_tileset));
+	node->name = node->class_type = NULL;
+	node->image = NULL;
+	node->user_data.pointer = NULL;
+	node->properties = NULL;
+	node->tiles = NULL;
+	node->frames = NULL;
+	if (!bin_link(w, field, off, 0)) return 0;
+
+	if (!bin_string(w, ts->name, off + offsetof(tmx_tileset, name))) return 0;
+	if (!bin_string(w, ts->class_type, off + offsetof(tmx_tileset, class_type))) return 0;
+	if (!write_image(w, ts->image, off + offsetof(tmx_tileset, image), base)) return 0;
+	if (!write_props(w, ts->properties, off + offsetof(tmx_tileset, properties))) return 0;
+	if (!(ts->tiles)) return 1;
+
+	/* the frames of all the animations are stored in one array, as in the loaded tileset */
+	frames_len = 0;
+	for (i=0; i<ts->tilecount; i++) {
+		if (ts->tiles[i].animation) frames_len += ts->tiles[i].animation_len;
+	}
+	frames = 0;
+	if (frames_len) {
+		if (!bin_alloc(w, 1, frames_len * sizeof(tmx_anim_frame), BIN_ALIGN, &frames)) return 0;
+		if (!bin_link(w, off + offsetof(tmx_tileset, frames), frames, 1)) return 0;
+	}
+
+	if (!bin_alloc(w, 0, ts->tilecount * sizeof(tmx_tile), BIN_ALIGN, &tiles)) return 0;
+	if (!bin_ref_add(w, ts->tiles, tiles)) return 0;
+	if (!bin_link(w, off + offsetof(tmx_tileset, tiles), tiles, 0)) return 0;
+	for (i=0; i<ts->tilecount; i++) {
+		tile = ts->tiles + i;
+		item = tiles + i * sizeof(tmx_tile);
+		memcpy(BIN_NODE(w, tmx_tile, item), tile, sizeof(tmx_tile));
+		BIN_NODE(w, tmx_tile, item)->tileset = NULL;
+		BIN_NODE(w, tmx_tile, item)->image = NULL;
+		BIN_NODE(w, tmx_tile, item)->collision = NULL;
+		BIN_NODE(w, tmx_tile, item)->animation = NULL;
+		BIN_NODE(w, tmx_tile, item)->type = NULL;
+		BIN_NODE(w, tmx_tile, item)->properties = NULL;
+		BIN_NODE(w, tmx_tile, item)->user_data.pointer = NULL;
+
+		if (tile->tileset && !bin_link(w, item + offsetof(tmx_tile, tileset), off, 0)) return 0;
+		if (!write_image(w, tile->image, item + offsetof(tmx_tile, image), base)) return 0;
+		if (!write_objects(w, tile->collision, item + offsetof(tmx_tile, collision), base)) return 0;
+		if (tile->animation && tile->animation_len) {
+			memcpy(w->bulk + frames, tile->animation, tile->animation_len * sizeof(tmx_anim_frame));
+			if (!bin_link(w, item + offsetof(tmx_tile, animation), frames, 1)) return 0;
+			frames += tile->animation_len * sizeof(tmx_anim_frame);
+		}
+		if (!bin_string(w, tile->type, item + offsetof(tmx_tile, type))) return 0;
+		if (!write_props(w, tile->properties, item + offsetof(tmx_tile, properties))) return 0;
+	}
+	return 1;
+}
+
+static int write_ts_list(bin_writer *w, tmx_tileset_list *list, size_t field, const char *base) {
+	char *ts_base;
+	size_t off;
+	int res;
+
+	for (; list; list = list->next) {
+		if (!bin_alloc(w, 0, sizeof(tmx_tileset_list), BIN_ALIGN, &off)) return 0;
+		memcpy(BIN_NODE(w, tmx_tileset_list, off), list, sizeof(tmx_tileset_list));
+		BIN_NODE(w, tmx_tileset_list, off)->source = NULL;
+		BIN_NODE(w, tmx_tileset_list, off)->tileset = NULL;
+		BIN_NODE(w, tmx_tileset_list, off)->next = NULL;
+		if (!bin_link(w, field, off, 0)) return 0;
+
+		if (!bin_string(w, list->source, off + offsetof(tmx_tileset_list, source))) return 0;
+		/* the images of external tilesets are relative to their document */
+		ts_base = NULL;
+		if (list->source && !(ts_base = mk_absolute_path(base, list->source))) return 0;
+		res = write_tileset(w, list->tileset, off + offsetof(tmx_tileset_list, tileset), ts_base? ts_base: base);
+		raw_free(ts_base);
+		if (!res) return 0;
+		field = off + offsetof(tmx_tileset_list, next);
+	}
+	return 1;
+}
+
+static int write_template(bin_writer *w, tmx_template *tmpl, size_t field, const char *base) {
+	size_t off;
+
+	if (!tmpl) return 1;
+	if (bin_ref_get(w, tmpl, &off)) return bin_link(w, field, off, 0);
+	if (!bin_alloc(w, 0, sizeof(tmx_template), BIN_ALIGN, &off)) return 0;
+	if (!bin_ref_add(w, tmpl, off)) return 0;
+	memcpy(BIN_NODE(w, tmx_template, off), tmpl, sizeof(tmx_template));
+	BIN_NODE(w, tmx_template, off)->tileset_ref = NULL;
+	BIN_NODE(w, tmx_template, off)->object = NULL;
+	if (!bin_link(w, field, off, 0)) return 0;
+
+	return write_ts_list(w, tmpl->tileset_ref, off + offsetof(tmx_template, tileset_ref), base)
+	    && write_objects(w, tmpl->object, off + offsetof(tmx_template, object), base);
+}
+
+static int write_chunks(bin_writer *w, tmx_chunks *chunks, size_t field) {
+	tmx_chunk *chunk;
+	size_t off, list, slots, item;
+	unsigned int i;
+
+	if (!chunks) return 1;
+	if (!bin_alloc(w, 0, sizeof(tmx_chunks), BIN_ALIGN, &off)) return 0;
+	memcpy(BIN_NODE(w, tmx_chunks, off), chunks, sizeof(tmx_chunks));
+	BIN_NODE(w, tmx_chunks, off)->list = NULL;
+	BIN_NODE(w, tmx_chunks, off)->slots = NULL;
+	if (!bin_link(w, field, off, 0)) return 0;
+
+	if (chunks->list) {
+		if (!bin_alloc(w, 0, chunks->count * sizeof(tmx_chunk*), BIN_ALIGN, &list)) return 0;
+		if (!bin_link(w, off + offsetof(tmx_chunks, list), list, 0)) return 0;
+		for (i=0; i<chunks->count; i++) {
+			chunk = chunks->list[i];
+			if (!bin_alloc(w, 0, sizeof(tmx_chunk), BIN_ALIGN, &item)) return 0;
+			if (!bin_ref_add(w, chunk, item)) return 0;
+			memcpy(BIN_NODE(w, tmx_chunk, item), chunk, sizeof(tmx_chunk));
+			BIN_NODE(w, tmx_chunk, item)->gids = NULL;
+			if (!bin_link(w, list + i * sizeof(tmx_chunk*), item, 0)) return 0;
+			if (chunk->gids && !bin_data(w, chunk->gids, (size_t)chunk->width * chunk->height * sizeof(uint32_t),
+			                             sizeof(uint32_t), item + offsetof(tmx_chunk, gids), NULL)) return 0;
+		}
+	}
+	if (chunks->slots) {
+		if (!bin_alloc(w, 0, ((size_t)chunks->slots_mask + 1) * sizeof(tmx_chunk*), BIN_ALIGN, &slots)) return 0;
+		if (!bin_link(w, off + offsetof(tmx_chunks, slots), slots, 0)) return 0;
+		for (i=0; i<=chunks->slots_mask; i++) {
+			if (chunks->slots[i] && bin_ref_get(w, chunks->slots[i], &item)) {
+				if (!bin_link(w, slots + i * sizeof(tmx_chunk*), item, 0)) return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int write_layers(bin_writer *w, tmx_map *map, tmx_layer *layer, size_t field) {
+	tmx_layer *node;
+	size_t off, content;
+
+	for (; layer; layer = layer->next) {
+		if (!bin_alloc(w, 0, sizeof(tmx_layer), BIN_ALIGN, &off)) return 0;
+		node = BIN_NODE(w, tmx_layer, off);
+		memcpy(node, layer, sizeof(tmx_layer));
+		node->name = node->class_type = NULL;
+		node->content.gids = NULL;
+		node->chunks = NULL;
+		node->user_data.pointer = NULL;
+		node->properties = NULL;
+		node->next = NULL;
+		if (!bin_link(w, field, off, 0)) return 0;
+
+		content = off + offsetof(tmx_layer, content);
+		if (!bin_string(w, layer->name, off + offsetof(tmx_layer, name))) return 0;
+		if (!bin_string(w, layer->class_type, off + offsetof(tmx_layer, class_type))) return 0;
+		if (layer->type == L_LAYER) {
+			if (layer->content.gids && !bin_data(w, layer->content.gids, (size_t)map->width * map->height * sizeof(uint32_t),
+			                                     sizeof(uint32_t), content, NULL)) return 0;
+			if (!write_chunks(w, layer->chunks, off + offsetof(tmx_layer, chunks))) return 0;
+		}
+		else if (layer->type == L_OBJGR && layer->content.objgr) {
+			if (!bin_alloc(w, 0, sizeof(tmx_object_group), BIN_ALIGN, &content)) return 0;
+			memcpy(BIN_NODE(w, tmx_object_group, content), layer->content.objgr, sizeof(tmx_object_group));
+			BIN_NODE(w, tmx_object_group, content)->head = NULL;
+			if (!bin_link(w, off + offsetof(tmx_layer, content), content, 0)) return 0;
+			if (!write_objects(w, layer->content.objgr->head, content + offsetof(tmx_object_group, head), NULL)) return 0;
+		}
+		else if (layer->type == L_IMAGE) {
+			if (!write_image(w, layer->content.image, content, NULL)) return 0;
+		}
+		else if (layer->type == L_GROUP) {
+			if (!write_layers(w, map, layer->content.group_head, content)) return 0;
+		}
+		if (!write_props(w, layer->properties, off + offsetof(tmx_layer, properties))) return 0;
+		field = off + offsetof(tmx_layer, next);
+	}
+	return 1;
+}
+
+static int write_map(bin_writer *w, tmx_map *map) {
+	tmx_map *node;
+	tmx_tile *tile;
+	size_t off, tiles, item;
+	unsigned int i;
+
+	if (!bin_alloc(w, 0, sizeof(tmx_map), BIN_ALIGN, &off)) return 0;
+	node = BIN_NODE(w, tmx_map, off);
+	memcpy(node, map, sizeof(tmx_map));
+	node->format_version = node->class_type = NULL;
+	node->properties = NULL;
+	node->ts_head = NULL;
+	node->ly_head = NULL;
+	node->tiles = NULL;
+	node->user_data.pointer = NULL;
+	node->decoder = NULL;
+	node->binary = NULL;
+	node->arena = NULL;
+	node->options = NULL;
+
+	if (!bin_string(w, map->format_version, off + offsetof(tmx_map, format_version))) return 0;
+	if (!bin_string(w, map->class_type, off + offsetof(tmx_map, class_type))) return 0;
+	if (!write_props(w, map->properties, off + offsetof(tmx_map, properties))) return 0;
+	if (!write_ts_list(w, map->ts_head, off + offsetof(tmx_map, ts_head), NULL)) return 0;
+	if (!write_layers(w, map, map->ly_head, off + offsetof(tmx_map, ly_head))) return 0;
+
+	if (!(map->tiles)) return 1;
+	if (!bin_alloc(w, 0, map->tilecount * sizeof(tmx_tile*), BIN_ALIGN, &tiles)) return 0;
+	if (!bin_link(w, off + offsetof(tmx_map, tiles), tiles, 0)) return 0;
+	for (i=0; i<map->tilecount; i++) {
+		tile = map->tiles[i];
+		if (!tile || !(tile->tileset) || !bin_ref_get(w, tile->tileset->tiles, &item)) continue;
+		item += (size_t)(tile - tile->tileset->tiles) * sizeof(tmx_tile);
+		if (!bin_link(w, tiles + i * sizeof(tmx_tile*), item, 0)) return 0;
+	}
+	return 1;
+}
+
+/* decodes the layers not yet decoded of a map loaded with tmx_lazy_decoding */
+static int decode_layers(tmx_map *map, tmx_layer *layer) {
+	for (; layer; layer = layer->next) {
+		if (layer->type == L_GROUP && !decode_layers(map, layer->content.group_head)) return 0;
+		if (layer->type != L_LAYER) continue;
+		if (layer->chunks) {
+			if (!tmx_layer_chunks(map, layer)) return 0;
+		}
+		else if (!tmx_layer_gids(map, layer)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* lays the areas out in the file and writes it */
+static int write_file(bin_writer *w, const char *path) {
+	static const char padding[BIN_ALIGN] = {0};
+	bin_header hdr;
+	FILE *file;
+	uint64_t *table = NULL;
+	uintptr_t value;
+	size_t nodes_len, bulk_len, tables_len, i, field;
+	int res = 0;
+
+	nodes_len = BIN_ALIGNED(w->nodes_len);
+	bulk_len = BIN_ALIGNED(w->bulk_len + 1); /* ends with a zero byte, see bin_file_string */
+	tables_len = ((size_t)w->relocs_len + w->props_len + w->images_len) * sizeof(uint64_t);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BIN_MAGIC, 4);
+	hdr.version = BIN_VERSION;
+	hdr.layout = layout_id();
+	hdr.map = BIN_HEADER_SIZE;
+	hdr.relocs = BIN_HEADER_SIZE + nodes_len + bulk_len;
+	hdr.relocs_count = w->relocs_len;
+	hdr.props = hdr.relocs + w->relocs_len * sizeof(uint64_t);
+	hdr.props_count = w->props_len;
+	hdr.images = hdr.props + w->props_len * sizeof(uint64_t);
+	hdr.images_count = w->images_len;
+	hdr.size = hdr.images + w->images_len * sizeof(uint64_t);
+
+	if (tables_len && !(table = (uint64_t*)raw_alloc(NULL, tables_len))) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	/* offsets in the areas to offsets in the file */
+	for (i=0; i<w->relocs_len; i++) {
+		field = w->relocs[i] & ~(size_t)BIN_BULK;
+		memcpy(&value, w->nodes + field, sizeof(uintptr_t));
+		value += BIN_HEADER_SIZE + ((w->relocs[i] & BIN_BULK)? nodes_len: 0);
+		memcpy(w->nodes + field, &value, sizeof(uintptr_t));
+		table[i] = BIN_HEADER_SIZE + field;
+	}
+	for (i=0; i<w->props_len; i++) {
+		table[w->relocs_len + i] = BIN_HEADER_SIZE + w->props[i];
+	}
+	for (i=0; i<w->images_len; i++) {
+		table[w->relocs_len + w->props_len + i] = BIN_HEADER_SIZE + w->images[i];
+	}
+	/* the areas are padded with the zeroed bytes of their buffers */
+	if ((nodes_len > w->nodes_len && !bin_alloc(w, 0, nodes_len - w->nodes_len, 1, &field))
+	    || (bulk_len > w->bulk_len && !bin_alloc(w, 1, bulk_len - w->bulk_len, 1, &field))) {
+		goto cleanup;
+	}
+
+	if (!(file = fopen(path, "wb"))) {
+		tmx_err(E_ACCESS, "cannot write '%s'", path);
+		goto cleanup;
+	}
+	res = fwrite(&hdr, sizeof(hdr), 1, file) == 1
+	   && fwrite(padding, 1, BIN_HEADER_SIZE - sizeof(hdr), file) == BIN_HEADER_SIZE - sizeof(hdr)
+	   && fwrite(w->nodes, 1, nodes_len, file) == nodes_len
+	   && (!bulk_len || fwrite(w->bulk, 1, bulk_len, file) == bulk_len)
+	   && (!tables_len || fwrite(table, 1, tables_len, file) == tables_len);
+	if (fclose(file) || !res) {
+		tmx_err(E_UNKN, "cannot write '%s'", path);
+		res = 0;
+	}
+
+cleanup:
+	raw_free(table);
+	return res;
+}
+
+int tmx_save_binary(tmx_map *map, const char *path) {
+	bin_writer w;
+	int res;
+
+	if (!map || !path) {
+		tmx_err(E_INVAL, "tmx_save_binary: invalid argument: map or path is NULL");
+		return 0;
+	}
+	set_alloc_functions();
+	if (map->decoder && !decode_layers(map, map->ly_head)) return 0;
+
+	memset(&w, 0, sizeof(w));
+	res = write_map(&w, map) && write_file(&w, path);
+
+	raw_free(w.nodes);
+	raw_free(w.bulk);
+	raw_free(w.relocs);
+	raw_free(w.props);
+	raw_free(w.images);
+	raw_free(w.refs);
+	return res;
+}
+
+/*
+	Loader
+*/
+
+typedef struct _bin_file {
+	mapped_file file;
+	size_t props_built, images_loaded; /* the first entries of the tables, freed by free_bin_file */
+} bin_file;
+
+static const bin_header* bin_file_header(const bin_file *bf) {
+	return (const bin_header*)(bf->file.data);
+}
+
+static const uint64_t* bin_file_table(const bin_file *bf, uint64_t offset) {
+	return (const uint64_t*)(bf->file.data + offset);
+}
+
+static int check_table(const bin_header *hdr, uint64_t offset, uint64_t count) {
+	return offset >= BIN_HEADER_SIZE && offset % BIN_ALIGN == 0 && offset <= hdr->size
+	    && count <= (hdr->size - offset) / sizeof(uint64_t);
+}
+
+static int check_node(const bin_header *hdr, uint64_t offset, size_t size) {
+	return offset >= BIN_HEADER_SIZE && offset % sizeof(void*) == 0 && offset < hdr->size
+	    && size <= hdr->size - offset;
+}
+
+/* strings read by the loader must be in the areas, that end with a zero byte */
+static int bin_file_string(const bin_file *bf, const char *str) {
+	return str >= bf->file.data + BIN_HEADER_SIZE && str < bf->file.data + bin_file_header(bf)->relocs;
+}
+
+static int check_header(const bin_file *bf, const char *path) {
+	const bin_header *hdr = bin_file_header(bf);
+
+	if (bf->file.len < BIN_HEADER_SIZE || memcmp(hdr->magic, BIN_MAGIC, 4)) {
+		tmx_err(E_FORMAT, "'%s' is not a compiled map", path);
+		return 0;
+	}
+	if (hdr->version != BIN_VERSION || hdr->layout != layout_id()) {
+		tmx_err(E_FORMAT, "'%s' was compiled by another version of libTMX or for another platform", path);
+		return 0;
+	}
+	if (hdr->size != bf->file.len || !check_node(hdr, hdr->map, sizeof(tmx_map))
+	    || !check_table(hdr, hdr->relocs, hdr->relocs_count) || !check_table(hdr, hdr->props, hdr->props_count)
+	    || !check_table(hdr, hdr->images, hdr->images_count)
+	    || hdr->relocs <= BIN_HEADER_SIZE || bf->file.data[hdr->relocs - 1] != '\0') {
+		tmx_err(E_FORMAT, "compiled map '%s' is truncated or corrupted", path);
+		return 0;
+	}
+	return 1;
+}
+
+static int relocate(bin_file *bf, const char *path) {
+	const bin_header *hdr = bin_file_header(bf);
+	const uint64_t *relocs = bin_file_table(bf, hdr->relocs);
+	char *data = (char*)(bf->file.data), *ptr;
+	uintptr_t value;
+	uint64_t i;
+
+	for (i=0; i<hdr->relocs_count; i++) {
+		if (!check_node(hdr, relocs[i], sizeof(void*))) break;
+		memcpy(&value, data + relocs[i], sizeof(uintptr_t));
+		if (value < BIN_HEADER_SIZE || value >= hdr->size) break;
+		ptr = data + value;
+		memcpy(data + relocs[i], &ptr, sizeof(char*));
+	}
+	if (i < hdr->relocs_count) {
+		tmx_err(E_FORMAT, "compiled map '%s' is corrupted", path);
+		return 0;
+	}
+	return 1;
+}
+
+/* replaces the arrays of properties by hashtables */
+static int build_properties(bin_file *bf, const char *path) {
+	const bin_header *hdr = bin_file_header(bf);
+	const uint64_t *slots = bin_file_table(bf, hdr->props);
+	char *data = (char*)(bf->file.data);
+	bin_props *props;
+	tmx_property *items;
+	void *hashtable;
+	size_t i;
+
+	for (; bf->props_built < hdr->props_count; bf->props_built++) {
+		if (!check_node(hdr, slots[bf->props_built], sizeof(void*))) break;
+		memcpy(&props, data + slots[bf->props_built], sizeof(bin_props*));
+		if (!props) continue;
+		if (!check_node(hdr, (char*)props - data, BIN_ALIGNED(sizeof(bin_props)))
+		    || props->count > (hdr->size - ((char*)props - data) - BIN_ALIGNED(sizeof(bin_props))) / sizeof(tmx_property)) break;
+
+		items = BIN_PROPS_ITEMS(props);
+		if (!(hashtable = mk_hashtable(props->count? (unsigned int)props->count: 1))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+		for (i=0; i<props->count && bin_file_string(bf, items[i].name); i++) {
+			hashtable_set(hashtable, items[i].name, (void*)(items + i), NULL);
+		}
+		if (i < props->count) {
+			free_hashtable(hashtable, NULL);
+			break;
+		}
+		memcpy(data + slots[bf->props_built], &hashtable, sizeof(void*));
+	}
+	if (bf->props_built < hdr->props_count) {
+		tmx_err(E_FORMAT, "compiled map '%s' is corrupted", path);
+		return 0;
+	}
+	return 1;
+}
+
+static int load_images(bin_file *bf, const char *path, const char *images_base) {
+	const bin_header *hdr = bin_file_header(bf);
+	const uint64_t *images = bin_file_table(bf, hdr->images);
+	tmx_image *image;
+
+	for (; bf->images_loaded < hdr->images_count; bf->images_loaded++) {
+		if (!check_node(hdr, images[bf->images_loaded], sizeof(tmx_image))) {
+			tmx_err(E_FORMAT, "compiled map '%s' is corrupted", path);
+			return 0;
+		}
+		image = (tmx_image*)(bf->file.data + images[bf->images_loaded]);
+		image->resource_image = NULL;
+		if (image->source && !bin_file_string(bf, image->source)) {
+			tmx_err(E_FORMAT, "compiled map '%s' is corrupted", path);
+			return 0;
+		}
+		if (image->source && !load_image(&(image->resource_image), images_base, image->source)) {
+			tmx_err(E_UNKN, "an error occured in the delegated image loading function");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void free_bin_file(bin_file *bf) {
+	const bin_header *hdr = bin_file_header(bf);
+	const uint64_t *table;
+	tmx_image *image;
+	void *hashtable;
+	size_t i;
+
+	table = bin_file_table(bf, hdr->props);
+	for (i=0; i<bf->props_built; i++) {
+		memcpy(&hashtable, bf->file.data + table[i], sizeof(void*));
+		if (hashtable) free_hashtable(hashtable, NULL);
+	}
+	table = bin_file_table(bf, hdr->images);
+	for (i=0; i<bf->images_loaded; i++) {
+		image = (tmx_image*)(bf->file.data + table[i]);
+		if (image->resource_image && tmx_img_free_func) tmx_img_free_func(image->resource_image);
+	}
+	unmap_file(&(bf->file));
+	raw_free(bf);
+}
+
+tmx_map* load_binary_map(const char *path, const char *images_base) {
+	bin_file *bf;
+	tmx_map *map;
+
+	if (!(bf = (bin_file*)raw_alloc(NULL, sizeof(bin_file)))) {
+		tmx_err_code(E_ALLOC);
+		return NULL;
+	}
+	memset(bf, 0, sizeof(bin_file));
+	if (!map_file_cow(path, &(bf->file))) {
+		raw_free(bf);
+		return NULL;
+	}
+	if (!check_header(bf, path)) {
+		unmap_file(&(bf->file));
+		raw_free(bf);
+		return NULL;
+	}
+	if (!relocate(bf, path) || !build_properties(bf, path) || !load_images(bf, path, images_base)) {
+		free_bin_file(bf);
+		return NULL;
+	}
+	map = (tmx_map*)(bf->file.data + bin_file_header(bf)->map);
+	if (!keep_load_options(&(map->options))) {
+		free_bin_file(bf);
+		return NULL;
+	}
+	map->binary = bf;
+	return map;
+}
+
+/* the images are relative to the compiled map */
+tmx_map* tmx_load_binary(const char *path) {
+	set_alloc_functions();
+	if (!path) {
+		tmx_err(E_INVAL, "tmx_load_binary: invalid argument: path is NULL");
+		return NULL;
+	}
+	return load_binary_map(path, path);
+}
+
+void free_binary_map(tmx_map *map) {
+	free_bin_file((bin_file*)(map->binary));
+}
@@ -0,0 +1,335 @@
+/*
+	Compiled maps cache
+	Maps loaded with tmx_rcmgr_load are saved as compiled maps (see tmx_bin.c) in the cache directory of the
+	resource manager, with the list of the files they were loaded from (the map, its external tilesets and
+	templates and its zstd dictionary) and the hashes of their content. The next loads hash these files again
+	and load the compiled map if none of them changed.
+	Each map has one entry, two files named after the hash of its path: `<hash>.tmxb` (the compiled map) and
+	`<hash>.deps` (the files and their hashes, one per line, the map first). Both are replaced by renaming a
+	new file, named after the process and a counter so writers sharing the directory do not clash: processes
+	that mapped the previous compiled map keep it.
+	The files are hashed once the map is saved, an entry is only written if none of them was modified since
+	the load started (the map may have been parsed from their previous content).
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#if defined(WIN32) || defined(__WIN32__) || defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+#define CACHE_KEY "\001cache" /* key of the cache in the resource manager, not a valid XML attribute value */
+#define DEPS_MAGIC "tmx-deps 1\n"
+
+struct _map_cache {
+	char *dir; /* with a trailing path separator */
+	char **deps; /* paths of the documents referenced by the last map loaded, see record_cache_deps */
+	unsigned int deps_len, deps_cap;
+	int deps_failed;
+	time_t load_start; /* of the last map loaded, see load_cached_map */
+};
+
+/* 64-bit hash, 8 bytes per step (not cryptographic) */
+static uint64_t hash_bytes(const char *data, size_t len) {
+	const uint64_t k1 = UINT64_C(0x9E3779B185EBCA87), k2 = UINT64_C(0xC2B2AE3D27D4EB4F);
+	uint64_t h = (uint64_t)len * k1, w;
+
+	for (; len >= 8; data += 8, len -= 8) {
+		memcpy(&w, data, 8);
+		w *= k2;
+		h ^= ((w << 31) | (w >> 33)) * k1;
+		h = ((h << 27) | (h >> 37)) * k1 + k2;
+	}
+	w = 0;
+	memcpy(&w, data, len);
+	w *= k2;
+	h ^= ((w << 31) | (w >> 33)) * k1;
+
+	h ^= h >> 33;
+	h *= k2;
+	h ^= h >> 29;
+	h *= k1;
+	h ^= h >> 32;
+	return h;
+}
+
+static int hash_file(const char *path, uint64_t *hash) {
+	mapped_file file;
+	if (!map_file(path, &file)) return 0;
+	*hash = hash_bytes(file.data, file.len);
+	unmap_file(&file);
+	return 1;
+}
+
+static void format_hash(uint64_t hash, char *str) {
+	sprintf(str, "%08lx%08lx", (unsigned long)(hash >> 32), (unsigned long)(hash & 0xFFFFFFFFu));
+}
+
+static int parse_hash(const char *str, uint64_t *hash) {
+	int i, digit;
+	*hash = 0;
+	for (i=0; i<16; i++) {
+		if (str[i] >= '0' && str[i] <= '9') digit = str[i] - '0';
+		else if (str[i] >= 'a' && str[i] <= 'f') digit = str[i] - 'a' + 10;
+		else return 0;
+		*hash = (*hash << 4) | (uint64_t)digit;
+	}
+	return 1;
+}
+
+/* `<dir><hash of path><ext>` */
+static char* entry_path(const map_cache *cache, const char *path, const char *ext) {
+	size_t dir_len = strlen(cache->dir);
+	char *res;
+
+	if (!(res = (char*)raw_alloc(NULL, dir_len + 16 + strlen(ext) + 1))) {
+		tmx_err_code(E_ALLOC);
+		return NULL;
+	}
+	memcpy(res, cache->dir, dir_len);
+	format_hash(hash_bytes(path, strlen(path)), res + dir_len);
+	strcpy(res + dir_len + 16, ext);
+	return res;
+}
+
+static void reset_deps(map_cache *cache) {
+	unsigned int i;
+	for (i=0; i<cache->deps_len; i++) {
+		raw_free(cache->deps[i]);
+	}
+	cache->deps_len = 0;
+	cache->deps_failed = 0;
+}
+
+/* takes ownership of `path` */
+static void add_dep(map_cache *cache, char *path) {
+	unsigned int i;
+	if (!path) {
+		cache->deps_failed = 1;
+		return;
+	}
+	for (i=0; i<cache->deps_len; i++) {
+		if (!strcmp(cache->deps[i], path)) {
+			raw_free(path);
+			return;
+		}
+	}
+	if (!grow_array((void**)&(cache->deps), &(cache->deps_cap), cache->deps_len, sizeof(char*))) {
+		raw_free(path);
+		cache->deps_failed = 1;
+		return;
+	}
+	cache->deps[cache->deps_len++] = path;
+}
+
+map_cache* get_map_cache(tmx_resource_manager *rc_mgr) {
+	resource_holder *rc_holder;
+	if (!rc_mgr) return NULL;
+	rc_holder = (resource_holder*)hashtable_get((void*)rc_mgr, CACHE_KEY);
+	return rc_holder && rc_holder->type == RC_CACHE? rc_holder->resource.cache: NULL;
+}
+
+void free_map_cache(map_cache *cache) {
+	if (cache) {
+		reset_deps(cache);
+		raw_free(cache->deps);
+		raw_free(cache->dir);
+		raw_free(cache);
+	}
+}
+
+void record_cache_deps(tmx_resource_manager *rc_mgr, parse_context *ctx) {
+	map_cache *cache = get_map_cache(rc_mgr);
+	tmx_template *tmpl;
+	unsigned int i;
+
+	if (!cache) return;
+	for (i=0; i<ctx->refs_len; i++) {
+		add_dep(cache, tmx_strdup(ctx->refs[i].path));
+		/* a template already in the resource manager was not parsed again, neither were its references */
+		if (ctx->refs[i].type == RC_TX && ctx->refs[i].user.object && (tmpl = ctx->refs[i].user.object->template_ref)
+		    && tmpl->tileset_ref && tmpl->tileset_ref->source) {
+			add_dep(cache, mk_absolute_path(ctx->refs[i].path, tmpl->tileset_ref->source));
+		}
+	}
+}
+
+/* returns 1 if the files listed in the deps file `deps` (NUL terminated) did not change */
+static int check_deps(char *deps, const char *path) {
+	char *line, *end;
+	uint64_t expected, hash;
+	int first = 1;
+
+	if (strncmp(deps, DEPS_MAGIC, strlen(DEPS_MAGIC))) return 0;
+	for (line = deps + strlen(DEPS_MAGIC); *line; line = end + 1) {
+		if (!(end = strchr(line, '\n'))) return 0;
+		*end = '\0';
+		if (end - line < 18 || line[16] != ' ' || !parse_hash(line, &expected)) return 0;
+		if (first && strcmp(line + 17, path)) return 0; /* another map with the same hash of its path */
+		if (!hash_file(line + 17, &hash) || hash != expected) return 0;
+		first = 0;
+	}
+	return !first;
+}
+
+tmx_map* load_cached_map(map_cache *cache, const char *path) {
+	char *deps_path, *bin_path = NULL, *deps = NULL;
+	FILE *file = NULL;
+	long len;
+	tmx_map *res = NULL;
+
+	reset_deps(cache);
+	cache->load_start = time(NULL);
+	if (!path || !(deps_path = entry_path(cache, path, ".deps"))) return NULL;
+
+	if (!(file = fopen(deps_path, "rb")) || fseek(file, 0, SEEK_END) || (len = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET)) {
+		goto cleanup;
+	}
+	if (!(deps = (char*)raw_alloc(NULL, (size_t)len + 1)) || fread(deps, 1, (size_t)len, file) != (size_t)len) {
+		goto cleanup;
+	}
+	deps[len] = '\0';
+
+	if (check_deps(deps, path) && (bin_path = entry_path(cache, path, ".tmxb"))) {
+		res = load_binary_map(bin_path, path);
+	}
+
+cleanup:
+	if (file) fclose(file);
+	raw_free(deps);
+	raw_free(deps_path);
+	raw_free(bin_path);
+	return res;
+}
+
+/* hashes the file at `path`, fails if it was modified since the load started
+   the time is checked after the hash, the hashed content is the one of the start of the load */
+static int hash_dep(const map_cache *cache, const char *path, uint64_t *hash) {
+	struct stat st;
+	return hash_file(path, hash) && !stat(path, &st) && st.st_mtime < cache->load_start;
+}
+
+/* writes the deps file at `tmp_path` */
+static int write_deps(map_cache *cache, const char *path, const char *tmp_path) {
+	FILE *file;
+	uint64_t hash;
+	char hex[17];
+	unsigned int i;
+	int res;
+
+	if (!(file = fopen(tmp_path, "w"))) return 0;
+	res = hash_dep(cache, path, &hash) && (format_hash(hash, hex), fprintf(file, "%s%s %s\n", DEPS_MAGIC, hex, path) > 0);
+	for (i=0; res && i<cache->deps_len; i++) {
+		res = hash_dep(cache, cache->deps[i], &hash) && (format_hash(hash, hex), fprintf(file, "%s %s\n", hex, cache->deps[i]) > 0);
+	}
+	if (fclose(file)) res = 0;
+	return res;
+}
+
+/* `<path>.<pid>-<count>.tmp`, a new file that no other writer uses */
+static char* temp_path(const char *path) {
+	static unsigned int count = 0;
+	unsigned int n;
+	char *res;
+
+	lock_globals();
+	n = count++;
+	unlock_globals();
+	if (!(res = (char*)raw_alloc(NULL, strlen(path) + 40))) {
+		tmx_err_code(E_ALLOC);
+		return NULL;
+	}
+	sprintf(res, "%s.%lu-%u.tmp", path, (unsigned long)getpid(), n);
+	return res;
+}
+
+/* replaces `path` by `tmp_path` */
+static int replace_file(const char *tmp_path, const char *path) {
+	remove(path); /* rename does not replace files on Windows */
+	if (rename(tmp_path, path)) {
+		remove(tmp_path);
+		return 0;
+	}
+	return 1;
+}
+
+void save_cached_map(map_cache *cache, tmx_map *map, const char *path) {
+	char *deps_path, *bin_path = NULL, *bin_tmp = NULL, *deps_tmp = NULL;
+	tmx_property *dict;
+
+	if ((dict = tmx_get_property(map->properties, "zstd_dictionary")) && (dict->type == PT_FILE || dict->type == PT_STRING)) {
+		add_dep(cache, mk_absolute_path(path, dict->value.string));
+	}
+	if (cache->deps_failed || !(deps_path = entry_path(cache, path, ".deps"))) return;
+	if (!(bin_path = entry_path(cache, path, ".tmxb")) || !(bin_tmp = temp_path(bin_path)) || !(deps_tmp = temp_path(deps_path))) {
+		goto cleanup;
+	}
+
+	/* the entry is invalid until the new deps file is in place */
+	remove(deps_path);
+	if (!tmx_save_binary(map, bin_tmp)) {
+		remove(bin_tmp);
+		goto cleanup;
+	}
+	if (!replace_file(bin_tmp, bin_path)) goto cleanup;
+	if (!write_deps(cache, path, deps_tmp)) {
+		remove(deps_tmp);
+		goto cleanup;
+	}
+	replace_file(deps_tmp, deps_path);
+
+cleanup:
+	reset_deps(cache);
+	raw_free(deps_path);
+	raw_free(bin_path);
+	raw_free(bin_tmp);
+	raw_free(deps_tmp);
+}
+
+int tmx_rcmgr_set_cache_dir(tmx_resource_manager *rc_mgr, const char *dir) {
+	resource_holder *rc_holder;
+	map_cache *cache;
+	size_t len;
+
+	if (!rc_mgr) {
+		tmx_err(E_INVAL, "tmx_rcmgr_set_cache_dir: invalid argument: rc_mgr is NULL");
+		return 0;
+	}
+	set_alloc_functions();
+	if (!dir) {
+		hashtable_rm((void*)rc_mgr, CACHE_KEY, resource_deallocator);
+		return 1;
+	}
+
+	if (!(cache = (map_cache*)raw_alloc(NULL, sizeof(map_cache)))) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	memset(cache, 0, sizeof(map_cache));
+	len = strlen(dir);
+	if (!(cache->dir = (char*)raw_alloc(NULL, len + 2))) {
+		tmx_err_code(E_ALLOC);
+		free_map_cache(cache);
+		return 0;
+	}
+	memcpy(cache->dir, dir, len);
+	if (len && dir[len-1] != '/' && dir[len-1] != '\\') cache->dir[len++] = '/';
+	cache->dir[len] = '\0';
+
+	if (!(rc_holder = pack_cache_resource(cache))) {
+		free_map_cache(cache);
+		return 0;
+	}
+	hashtable_set((void*)rc_mgr, CACHE_KEY, (void*)rc_holder, resource_deallocator);
+	return 1;
+}
@@ -1,7 +1,10 @@
 #include <stdio.h>
+#include <stdarg.h>
 
 #include "tmx.h"
+#include "tmx_utils.h"
 
+/* a plain global, read by the programs built before tmx_last_error, set under lock_globals */
 tmx_error_codes tmx_errno = E_NONE;
 
 static char *errmsgs[] = {
@@ -9,24 +12,86 @@ static char *errmsgs[] = {
 	"Memory alloc failed",
 	"Missing privileges to access the file",
 	"File not found",
-	"Unsupproted/Unknown map file format"
+	"Unsupproted/Unknown map file format",
+	"Load cancelled"
 };
 
-char _tmx_custom_msg[256];
+/* error of the calling thread, returned by tmx_last_error */
+static TMX_THREAD_LOCAL error_state thread_error;
+static TMX_THREAD_LOCAL tmx_error last_error;
 
-const char* tmx_strerr(void) {
+/* the name of the source file, without the directories of the build */
+static const char* file_name(const char *path) {
+	const char *res = path, *c;
+	for (c=path; *c; c++) {
+		if (*c == '/' || *c == '\\') res = c + 1;
+	}
+	return res;
+}
+
+static void set_errno(tmx_error_codes code) {
+	lock_globals();
+	tmx_errno = code;
+	unlock_globals();
+}
+
+void set_error(tmx_error_codes code, const char *file, int line, const char *fmt, ...) {
+	va_list args;
+	if (fmt) {
+		va_start(args, fmt);
+		vsnprintf(thread_error.msg, sizeof(thread_error.msg), fmt, args);
+		va_end(args);
+	}
+	else {
+		thread_error.msg[0] = '\0'; /* fixed message, see error_message */
+	}
+	thread_error.code = code;
+	thread_error.file = file_name(file);
+	thread_error.line = line;
+	set_errno(code);
+}
+
+void save_error(error_state *err) {
+	*err = thread_error;
+}
+
+void restore_error(const error_state *err) {
+	thread_error = *err;
+	set_errno(err->code);
+}
+
+/* the message formatted by set_error if it was raised for `code`, the fixed message of `code` otherwise */
+static const char* error_message(tmx_error_codes code) {
 	char *msg;
-	switch(tmx_errno) {
+	if (thread_error.code == code && thread_error.msg[0] != '\0') return thread_error.msg;
+	switch(code) {
 		case E_NONE:   msg = errmsgs[0]; break;
 		case E_ALLOC:  msg = errmsgs[1]; break;
 		case E_ACCESS: msg = errmsgs[2]; break;
 		case E_NOENT:  msg = errmsgs[3]; break;
 		case E_FORMAT: msg = errmsgs[4]; break;
-		default: msg = _tmx_custom_msg;
+		case E_CANCEL: msg = errmsgs[5]; break;
+		default: msg = thread_error.msg;
 	}
 	return msg;
 }
 
+const char* tmx_strerr(void) {
+	tmx_error_codes code;
+	lock_globals();
+	code = tmx_errno;
+	unlock_globals();
+	return error_message(code);
+}
+
+const tmx_error* tmx_last_error(void) {
+	last_error.code = thread_error.code;
+	last_error.message = error_message(thread_error.code);
+	last_error.file = thread_error.file;
+	last_error.line = thread_error.line;
+	return &last_error;
+}
+
 void tmx_perror(const char *pos) {
 	const char *msg = tmx_strerr();
 	fprintf(stderr, "%s: %s\n", pos, msg);
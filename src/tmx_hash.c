@@ -10,13 +10,21 @@
 
 void* mk_hashtable(unsigned int initial_size) {
 	// Auto-resize is supported
+	// Hashtables are allocated with mem_alloc: in the arena of a map, resources of a resource manager are not (see arena_suspend)
+	void *res;
+	int prev;
 	setup_libxml_mem();
-	return (void*)xmlHashCreate(initial_size);
+	prev = arena_libxml(1);
+	res = (void*)xmlHashCreate(initial_size);
+	arena_libxml(prev);
+	return res;
 }
 
 void hashtable_set(void *hashtable, const char *key, void *val, hashtable_entry_deallocator deallocator) {
 	// Set or update value, key string is duplicated, deallocator may be NULL if values were not allocated
+	int prev = arena_libxml(1);
 	xmlHashUpdateEntry((xmlHashTablePtr)hashtable, (const xmlChar*)key, val, (xmlHashDeallocator)deallocator);
+	arena_libxml(prev);
 }
 
 void* hashtable_get(void *hashtable, const char *key) {
@@ -24,11 +32,15 @@ void* hashtable_get(void *hashtable, const char *key) {
 }
 
 void hashtable_rm(void *hashtable, const char *key, hashtable_entry_deallocator deallocator) {
+	int prev = arena_libxml(1);
 	xmlHashRemoveEntry((xmlHashTablePtr)hashtable, (const xmlChar*)key, (xmlHashDeallocator)deallocator);
+	arena_libxml(prev);
 }
 
 void free_hashtable(void *hashtable, hashtable_entry_deallocator deallocator) {
+	int prev = arena_libxml(1);
 	xmlHashFree((xmlHashTablePtr)hashtable, (xmlHashDeallocator)deallocator);
+	arena_libxml(prev);
 }
 
 void hashtable_foreach(void *hashtable, hashtable_foreach_functor functor, void *userdata) {
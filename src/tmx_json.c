@@ -0,0 +1,1969 @@
+/*
+	JSON Parser
+	Loads the JSON format of Tiled (.tmj maps, .tsj tilesets and .tj templates)
+	in the same structures as the XML parser (see tmx_xml.c).
+	The document is read in a buffer where the pull parser (see json_reader) reads
+	it in place: strings are unescaped and terminated in the buffer, no token is
+	allocated. The members of an object may come in any order, values that depend
+	on members that may come after them (the data of tile layers, the tiles of
+	tilesets) are located during the pass and read once their object is complete.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+/*
+	Pull parser
+	Functions that read a value at the current position return 1 on success and 0
+	on failure. json_member and json_item iterate over the members of an object and
+	the items of an array: they return 1 for each one (whose value must then be read
+	or skipped), 0 at the end of the object or array, and -1 on failure.
+	On failure tmx_errno is set and and an error message is generated.
+*/
+
+#define JSON_MAX_DEPTH 256
+
+typedef struct _json_reader {
+	char *buffer; /* the document, NUL terminated, modified in place */
+	char *pos;
+	int first;    /* no member or item has been read yet in the current object or array */
+	int depth;
+} json_reader;
+
+static int json_error(json_reader *r, const char *what) {
+	const char *c;
+	int line = 1;
+	for (c = r->buffer; c < r->pos && *c; c++) {
+		if (*c == '\n') line++;
+	}
+	tmx_err(E_JDATA, "json parser: %s at line %d", what, line);
+	return 0;
+}
+
+static void json_space(json_reader *r) {
+	while (*r->pos == ' ' || *r->pos == '\n' || *r->pos == '\r' || *r->pos == '\t') r->pos++;
+}
+
+/* first char of the next value */
+static char json_peek(json_reader *r) {
+	json_space(r);
+	return *r->pos;
+}
+
+static int json_open(json_reader *r, char c) {
+	if (json_peek(r) != c) return json_error(r, c == '{'? "object expected": "array expected");
+	if (++(r->depth) > JSON_MAX_DEPTH) return json_error(r, "values nested too deeply");
+	r->pos++;
+	r->first = 1;
+	return 1;
+}
+
+static int json_object(json_reader *r) {
+	return json_open(r, '{');
+}
+
+static int json_array(json_reader *r) {
+	return json_open(r, '[');
+}
+
+static int json_hex4(json_reader *r, unsigned long *value) {
+	int i;
+	char c;
+	*value = 0;
+	for (i=0; i<4; i++) {
+		c = *r->pos;
+		if (c >= '0' && c <= '9') *value = *value * 16 + (unsigned long)(c - '0');
+		else if (c >= 'a' && c <= 'f') *value = *value * 16 + (unsigned long)(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F') *value = *value * 16 + (unsigned long)(c - 'A' + 10);
+		else return json_error(r, "invalid unicode escape sequence");
+		r->pos++;
+	}
+	return 1;
+}
+
+static char* utf8_put(char *out, unsigned long cp) {
+	if (cp < 0x80) {
+		*out++ = (char)cp;
+	} else if (cp < 0x800) {
+		*out++ = (char)(0xC0 | (cp >> 6));
+		*out++ = (char)(0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		*out++ = (char)(0xE0 | (cp >> 12));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (cp & 0x3F));
+	} else {
+		*out++ = (char)(0xF0 | (cp >> 18));
+		*out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+		*out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+		*out++ = (char)(0x80 | (cp & 0x3F));
+	}
+	return out;
+}
+
+/* Reads a string, unescaped in place (escape sequences are longer than the chars they stand for),
+   returns NULL on failure, its length is set in `*len` if not NULL */
+static char* json_string(json_reader *r, size_t *len) {
+	char *res, *out;
+	unsigned long cp, low;
+
+	if (json_peek(r) != '"') {
+		json_error(r, "string expected");
+		return NULL;
+	}
+	res = ++(r->pos);
+
+	/* nothing to move until the first escape sequence */
+	while ((unsigned char)*r->pos >= 0x20 && *r->pos != '"' && *r->pos != '\\') r->pos++;
+	out = r->pos;
+
+	while (*r->pos != '"') {
+		if ((unsigned char)*r->pos < 0x20) {
+			json_error(r, *r->pos? "control character in a string": "unterminated string");
+			return NULL;
+		}
+		if (*r->pos != '\\') {
+			*out++ = *(r->pos)++;
+			continue;
+		}
+		r->pos++;
+		switch (*(r->pos)++) {
+			case '"':  *out++ = '"';  break;
+			case '\\': *out++ = '\\'; break;
+			case '/':  *out++ = '/';  break;
+			case 'b':  *out++ = '\b'; break;
+			case 'f':  *out++ = '\f'; break;
+			case 'n':  *out++ = '\n'; break;
+			case 'r':  *out++ = '\r'; break;
+			case 't':  *out++ = '\t'; break;
+			case 'u':
+				if (!json_hex4(r, &cp)) return NULL;
+				if (cp >= 0xD800 && cp < 0xDC00) { /* surrogate pair */
+					if (r->pos[0] != '\\' || r->pos[1] != 'u') {
+						json_error(r, "invalid surrogate pair");
+						return NULL;
+					}
+					r->pos += 2;
+					if (!json_hex4(r, &low)) return NULL;
+					if (low < 0xDC00 || low >= 0xE000) {
+						json_error(r, "invalid surrogate pair");
+						return NULL;
+					}
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				}
+				out = utf8_put(out, cp);
+				break;
+			default:
+				r->pos--;
+				json_error(r, "invalid escape sequence");
+				return NULL;
+		}
+	}
+	*out = '\0';
+	r->pos++;
+	if (len) *len = (size_t)(out - res);
+	return res;
+}
+
+/* Next member of the current object, its name is set in `*name` */
+static int json_member(json_reader *r, const char **name) {
+	json_space(r);
+	if (*r->pos == '}') {
+		r->pos++;
+		r->depth--;
+		r->first = 0;
+		return 0;
+	}
+	if (!r->first) {
+		if (*r->pos != ',') {
+			json_error(r, "',' or '}' expected");
+			return -1;
+		}
+		r->pos++;
+	}
+	r->first = 0;
+	if (!(*name = json_string(r, NULL))) return -1;
+	json_space(r);
+	if (*r->pos != ':') {
+		json_error(r, "':' expected");
+		return -1;
+	}
+	r->pos++;
+	return 1;
+}
+
+/* Next item of the current array */
+static int json_item(json_reader *r) {
+	json_space(r);
+	if (*r->pos == ']') {
+		r->pos++;
+		r->depth--;
+		r->first = 0;
+		return 0;
+	}
+	if (!r->first) {
+		if (*r->pos != ',') {
+			json_error(r, "',' or ']' expected");
+			return -1;
+		}
+		r->pos++;
+	}
+	r->first = 0;
+	return 1;
+}
+
+static int json_number(json_reader *r, double *value) {
+	const char *end;
+	char c = json_peek(r);
+	if (c != '-' && (c < '0' || c > '9')) return json_error(r, "number expected");
+	*value = str_to_double(r->pos, &end);
+	if (end == r->pos) return json_error(r, "number expected");
+	r->pos += end - r->pos;
+	return 1;
+}
+
+static int json_int(json_reader *r, int *value) {
+	double res;
+	if (!json_number(r, &res)) return 0;
+	if (res < INT_MIN || res > INT_MAX) return json_error(r, "integer out of range");
+	*value = (int)res;
+	return 1;
+}
+
+/* global tile ids use the 32 bits (flip flags) */
+static int json_gid(json_reader *r, uint32_t *value) {
+	double res;
+	if (!json_number(r, &res)) return 0;
+	if (res < 0 || res > 0xFFFFFFFFu) return json_error(r, "invalid gid");
+	*value = (uint32_t)res;
+	return 1;
+}
+
+/* also accepts numbers (0 is false) */
+static int json_bool(json_reader *r, int *value) {
+	double number;
+	if (json_peek(r) == 't' && !strncmp(r->pos, "true", 4)) {
+		*value = 1;
+		r->pos += 4;
+	} else if (*r->pos == 'f' && !strncmp(r->pos, "false", 5)) {
+		*value = 0;
+		r->pos += 5;
+	} else {
+		if (*r->pos != '-' && (*r->pos < '0' || *r->pos > '9')) return json_error(r, "boolean expected");
+		if (!json_number(r, &number)) return 0;
+		*value = number != 0;
+	}
+	return 1;
+}
+
+/* Skips the value at the current position */
+static int json_skip(json_reader *r) {
+	const char *name;
+	double number;
+	int ret;
+
+	switch (json_peek(r)) {
+		case '{':
+			if (!json_object(r)) return 0;
+			while ((ret = json_member(r, &name)) == 1) {
+				if (!json_skip(r)) return 0;
+			}
+			return ret == 0;
+		case '[':
+			if (!json_array(r)) return 0;
+			while ((ret = json_item(r)) == 1) {
+				if (!json_skip(r)) return 0;
+			}
+			return ret == 0;
+		case '"':
+			return json_string(r, NULL) != NULL;
+		case 't':
+		case 'f':
+			return json_bool(r, &ret);
+		case 'n':
+			if (strncmp(r->pos, "null", 4)) return json_error(r, "value expected");
+			r->pos += 4;
+			return 1;
+		default:
+			return json_number(r, &number);
+	}
+}
+
+/* Skips the object or array at the current position without reading it (it is left as is to be read later),
+   `*begin` and `*end` are set to its bounds */
+static int json_locate(json_reader *r, char **begin, char **end) {
+	int depth = 0;
+
+	json_space(r);
+	*begin = r->pos;
+	if (*r->pos != '[' && *r->pos != '{') return json_error(r, "object or array expected");
+	do {
+		r->pos += strcspn(r->pos, "[]{}\"");
+		switch (*r->pos) {
+			case '[':
+			case '{':
+				depth++;
+				break;
+			case ']':
+			case '}':
+				depth--;
+				break;
+			case '"':
+				for (r->pos++; *r->pos != '"'; r->pos++) {
+					if (*r->pos == '\0') return json_error(r, "unterminated string");
+					if (*r->pos == '\\' && r->pos[1] != '\0') r->pos++;
+				}
+				break;
+			default:
+				return json_error(r, "unterminated value");
+		}
+		r->pos++;
+	} while (depth > 0);
+	*end = r->pos;
+	return 1;
+}
+
+/* only whitespaces may follow the root value */
+static int json_end(json_reader *r) {
+	if (json_peek(r) != '\0') return json_error(r, "unexpected content after the document");
+	return 1;
+}
+
+static int json_strdup(json_reader *r, char **str) {
+	const char *value;
+	if (!(value = json_string(r, NULL))) return 0;
+	mem_free(*str);
+	return (*str = tmx_strdup(value)) != NULL;
+}
+
+/*
+	 - Parsers -
+	Each function is called when the reader is on the value to parse.
+	Each function return 1 on succes and 0 on failure.
+	This parser is strict, the entry file MUST respect the file format.
+	On failure tmx_errno is set and and an error message is generated.
+*/
+
+/* data of a tile layer or of a chunk, decoded once the map is parsed */
+typedef struct _layer_data {
+	uint32_t **gids;
+	char *source;        /* an unescaped string, or the items of an array of gids, read as CSV */
+	size_t len;
+	int is_array;
+	enum enccmp_t type;  /* set at the end of the layer */
+	size_t gids_count;   /* 0 for the layers of finite maps, sized as the map (or its region) */
+} layer_data;
+
+typedef struct _json_doc {
+	parse_context ctx;
+	const char *filename;
+	layer_data *data;
+	unsigned int data_len, data_cap;
+} json_doc;
+
+static int parse_properties(json_reader *r, tmx_properties **prop_hashptr);
+
+/* members of a class property and properties of the former format (an object), their type is
+   inferred from their value */
+static int parse_property_members(json_reader *r, tmx_properties **prop_hashptr) {
+	tmx_property *prop;
+	const char *name;
+	char *value;
+	double number;
+	int ret;
+
+	if (*prop_hashptr == NULL) {
+		if (!(*prop_hashptr = (tmx_properties*)mk_hashtable(5))) return 0;
+	}
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		if (json_peek(r) == '[' || json_peek(r) == 'n') { /* no such property type */
+			if (!json_skip(r)) return 0;
+			continue;
+		}
+		if (!(prop = alloc_prop())) return 0;
+		if (!(prop->name = tmx_strdup(name))) {
+			free_property(prop);
+			return 0;
+		}
+		switch (json_peek(r)) {
+			case '"':
+				prop->type = PT_STRING;
+				ret = (value = json_string(r, NULL)) && (prop->value.string = tmx_strdup(value));
+				break;
+			case '{':
+				prop->type = PT_CUSTOM;
+				ret = parse_property_members(r, &(prop->value.properties));
+				break;
+			case 't':
+			case 'f':
+				prop->type = PT_BOOL;
+				ret = json_bool(r, &(prop->value.integer));
+				break;
+			default:
+				if ((ret = json_number(r, &number))) {
+					if (number == (int)number) {
+						prop->type = PT_INT;
+						prop->value.integer = (int)number;
+					} else {
+						prop->type = PT_FLOAT;
+						prop->value.decimal = (float)number;
+					}
+				}
+				break;
+		}
+		if (!ret) {
+			free_property(prop);
+			return 0;
+		}
+		hashtable_set((void*)*prop_hashptr, prop->name, (void*)prop, NULL);
+	}
+	return ret == 0;
+}
+
+/* the value may come before the type */
+static int parse_property(json_reader *r, tmx_property *prop) {
+	const char *name, *type = NULL;
+	char *string = NULL;
+	double number = 0;
+	int ret, flag, has_value = 0;
+	tmx_properties *members = NULL;
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_NAME: /* name */
+				if (!json_strdup(r, &(prop->name))) goto cleanup;
+				break;
+			case K_TYPE: /* type */
+				if (!(type = json_string(r, NULL))) goto cleanup;
+				break;
+			case K_PROPERTYTYPE: /* propertytype */
+				if (!json_strdup(r, &(prop->propertytype))) goto cleanup;
+				break;
+			case K_VALUE: /* value */
+				switch (json_peek(r)) {
+					case '"':
+						if (!(string = json_string(r, NULL))) goto cleanup;
+						break;
+					case '{':
+						if (!parse_property_members(r, &members)) goto cleanup;
+						break;
+					case 't':
+					case 'f':
+						if (!json_bool(r, &flag)) goto cleanup;
+						number = flag;
+						break;
+					default:
+						if (!json_number(r, &number)) goto cleanup;
+						break;
+				}
+				has_value = 1;
+				break;
+			default:
+				if (!json_skip(r)) goto cleanup;
+				break;
+		}
+	}
+	if (ret < 0) goto cleanup;
+
+	if (!(prop->name)) {
+		tmx_err(E_MISSEL, "json parser: missing 'name' member in a property");
+		goto cleanup;
+	}
+	prop->type = parse_property_type(type);
+	if (!has_value && prop->type != PT_CUSTOM) {
+		tmx_err(E_MISSEL, "json parser: missing 'value' member in property '%s'", prop->name);
+		goto cleanup;
+	}
+
+	switch (prop->type) {
+		case PT_OBJECT:
+		case PT_INT:
+			prop->value.integer = string? atoi(string): (int)number;
+			break;
+		case PT_FLOAT:
+			prop->value.decimal = (float)(string? atof(string): number);
+			break;
+		case PT_BOOL:
+			prop->value.integer = string? parse_boolean(string): number != 0;
+			break;
+		case PT_COLOR:
+			prop->value.integer = string? (int)get_color_rgb(string): (int)number;
+			break;
+		case PT_CUSTOM:
+			prop->value.properties = members;
+			members = NULL;
+			break;
+		case PT_NONE:
+		case PT_STRING:
+		case PT_FILE:
+		default:
+			if (!string) {
+				tmx_err(E_JDATA, "json parser: the value of property '%s' is not a string", prop->name);
+				goto cleanup;
+			}
+			if (!(prop->value.string = tmx_strdup(string))) goto cleanup;
+			break;
+	}
+	free_props(members);
+	return 1;
+cleanup:
+	free_props(members);
+	return 0;
+}
+
+/* an array of properties, or an object (former format) */
+static int parse_properties(json_reader *r, tmx_properties **prop_hashptr) {
+	tmx_property *res;
+	int ret;
+
+	if (json_peek(r) == '{') {
+		return parse_property_members(r, prop_hashptr);
+	}
+
+	/* Create hashtable */
+	if (*prop_hashptr == NULL) {
+		if (!(*prop_hashptr = (tmx_properties*)mk_hashtable(5))) return 0;
+	}
+
+	if (!json_array(r)) return 0;
+	while ((ret = json_item(r)) == 1) {
+		if (!(res = alloc_prop())) return 0;
+		if (!parse_property(r, res)) {
+			free_property(res);
+			return 0;
+		}
+		hashtable_set((void*)*prop_hashptr, res->name, (void*)res, NULL);
+	}
+	return ret == 0;
+}
+
+static int parse_point(json_reader *r, double *point) {
+	const char *name;
+	int ret, has_x = 0, has_y = 0;
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_X:
+				if (!json_number(r, point)) return 0;
+				has_x = 1;
+				break;
+			case K_Y:
+				if (!json_number(r, point + 1)) return 0;
+				has_y = 1;
+				break;
+			default:
+				if (!json_skip(r)) return 0;
+				break;
+		}
+	}
+	if (ret < 0) return 0;
+	if (!has_x || !has_y) {
+		tmx_err(E_MISSEL, "json parser: missing '%s' member in a point", has_x? "y": "x");
+		return 0;
+	}
+	return 1;
+}
+
+static int parse_points(json_reader *r, tmx_shape *shape) {
+	double *coords = NULL;
+	void *block;
+	unsigned int len = 0, cap = 0;
+	int i, ret;
+
+	if (!json_array(r)) return 0;
+	while ((ret = json_item(r)) == 1) {
+		if (!grow_array((void**)&coords, &cap, len, 2 * sizeof(double))) goto cleanup;
+		if (!parse_point(r, coords + len * 2)) goto cleanup;
+		len++;
+	}
+	if (ret < 0) goto cleanup;
+	if (len == 0 || len > INT_MAX / 2) {
+		tmx_err(E_JDATA, "json parser: corrupted point list");
+		goto cleanup;
+	}
+	shape->points_len = (int)len;
+
+	/* a single block: the coordinates followed by the (double precision only) points[i] array */
+	if (tmx_shape_float32) {
+		if (!(shape->fcoords = (float*)mem_alloc(NULL, len * 2 * sizeof(float)))) {
+			tmx_err_code(E_ALLOC);
+			goto cleanup;
+		}
+		for (i=0; i<shape->points_len * 2; i++) {
+			shape->fcoords[i] = (float)coords[i];
+		}
+		mem_free(coords);
+	}
+	else {
+		if (!(block = mem_alloc(coords, len * (2 * sizeof(double) + sizeof(double*))))) {
+			tmx_err_code(E_ALLOC);
+			goto cleanup;
+		}
+		shape->coords = (double*)block;
+		shape->points = (double**)(shape->coords + len * 2); /* points[i][x,y] */
+		for (i=0; i<shape->points_len; i++) {
+			shape->points[i] = shape->coords + i * 2;
+		}
+	}
+	return 1;
+cleanup:
+	mem_free(coords);
+	return 0;
+}
+
+static int parse_text(json_reader *r, tmx_text *text) {
+	const char *name, *value;
+	int ret;
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_TEXT: /* text */
+				if (!json_strdup(r, &(text->text))) return 0;
+				break;
+			case K_FONTFAMILY: /* fontfamily */
+				if (!json_strdup(r, &(text->fontfamily))) return 0;
+				break;
+			case K_PIXELSIZE: /* pixelsize */
+				if (!json_int(r, &(text->pixelsize))) return 0;
+				break;
+			case K_COLOR: /* color */
+				if (!(value = json_string(r, NULL))) return 0;
+				text->color = get_color_rgb(value);
+				break;
+			case K_WRAP: /* wrap */
+				if (!json_bool(r, &(text->wrap))) return 0;
+				break;
+			case K_BOLD: /* bold */
+				if (!json_bool(r, &(text->bold))) return 0;
+				break;
+			case K_ITALIC: /* italic */
+				if (!json_bool(r, &(text->italic))) return 0;
+				break;
+			case K_UNDERLINE: /* underline */
+				if (!json_bool(r, &(text->underline))) return 0;
+				break;
+			case K_STRIKEOUT: /* strikeout */
+				if (!json_bool(r, &(text->strikeout))) return 0;
+				break;
+			case K_KERNING: /* kerning */
+				if (!json_bool(r, &(text->kerning))) return 0;
+				break;
+			case K_HALIGN: /* halign */
+				if (!(value = json_string(r, NULL))) return 0;
+				text->halign = parse_horizontal_align(value);
+				break;
+			case K_VALIGN: /* valign */
+				if (!(value = json_string(r, NULL))) return 0;
+				text->valign = parse_vertical_align(value);
+				break;
+			default:
+				if (!json_skip(r)) return 0;
+				break;
+		}
+	}
+	if (ret < 0) return 0;
+
+	if (!(text->fontfamily) && !(text->fontfamily = tmx_strdup("sans-serif"))) return 0;
+	return 1;
+}
+
+/* the type of the object: its shape, then gid, then height, then its template (see link_templates) */
+static int parse_object(json_reader *r, tmx_object *obj, int is_on_map, json_doc *doc) {
+	int ret, flag, has_id = 0, has_x = 0, has_y = 0, has_height = 0, has_gid = 0, has_type = 0, has_template = 0;
+	int is_ellipse = 0, is_point = 0;
+	const char *name, *value;
+	enum keyword kw;
+	uint32_t gid = 0;
+	ext_ref *ref;
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (kw = keyword_lookup(name)) {
+			case K_ID: /* id */
+				if (!json_int(r, &flag)) return 0;
+				obj->id = (unsigned int)flag;
+				has_id = 1;
+				break;
+			case K_X: /* x */
+				if (!json_number(r, &(obj->x))) return 0;
+				has_x = 1;
+				break;
+			case K_Y: /* y */
+				if (!json_number(r, &(obj->y))) return 0;
+				has_y = 1;
+				break;
+			case K_TEMPLATE: /* template, loaded once the document has been parsed */
+				if (!(value = json_string(r, NULL))) return 0;
+				if (!(ref = add_ext_ref(&(doc->ctx), RC_TX, value, doc->filename))) return 0;
+				ref->user.object = obj;
+				has_template = 1;
+				break;
+			case K_NAME: /* name */
+				if (!json_strdup(r, &(obj->name))) return 0;
+				break;
+			case K_CLASS: /* class */
+				if (!(value = json_string(r, NULL))) return 0;
+				if (has_type) break; /* `type` prevails over `class` */
+				mem_free(obj->type);
+				if (!(obj->type = tmx_strdup(value))) return 0;
+				break;
+			case K_TYPE: /* type */
+				if (!json_strdup(r, &(obj->type))) return 0;
+				has_type = 1;
+				break;
+			case K_VISIBLE: /* visible */
+				if (!json_bool(r, &(obj->visible))) return 0;
+				break;
+			case K_HEIGHT: /* height */
+				if (!json_number(r, &(obj->height))) return 0;
+				has_height = 1;
+				break;
+			case K_WIDTH: /* width */
+				if (!json_number(r, &(obj->width))) return 0;
+				break;
+			case K_GID: /* gid */
+				if (!json_gid(r, &gid)) return 0;
+				has_gid = 1;
+				break;
+			case K_ROTATION: /* rotation */
+				if (!json_number(r, &(obj->rotation))) return 0;
+				break;
+			case K_ELLIPSE: /* ellipse */
+				if (!json_bool(r, &is_ellipse)) return 0;
+				break;
+			case K_POINT: /* point */
+				if (!json_bool(r, &is_point)) return 0;
+				break;
+			case K_PROPERTIES: /* properties */
+				if (!parse_properties(r, &(obj->properties))) return 0;
+				break;
+			case K_POLYGON: /* polygon */
+			case K_POLYLINE: /* polyline */
+			case K_TEXT: /* text */
+				if (obj->obj_type != OT_NONE) return json_error(r, "object with several shapes");
+				if (kw == K_TEXT) {
+					obj->obj_type = OT_TEXT;
+					if (obj->content.text = alloc_text(), !(obj->content.text)) return 0;
+					if (!parse_text(r, obj->content.text)) return 0;
+				}
+				else {
+					obj->obj_type = kw == K_POLYGON? OT_POLYGON: OT_POLYLINE;
+					if (obj->content.shape = alloc_shape(), !(obj->content.shape)) return 0;
+					if (!parse_points(r, obj->content.shape)) return 0;
+				}
+				break;
+			default:
+				if (!json_skip(r)) return 0;
+				break;
+		}
+	}
+	if (ret < 0) return 0;
+
+	if (is_on_map) {
+		if (!has_id) {
+			tmx_err(E_MISSEL, "json parser: missing 'id' member in an object");
+			return 0;
+		}
+		if (!has_x) {
+			tmx_err(E_MISSEL, "json parser: missing 'x' member in object %u", obj->id);
+			return 0;
+		}
+		if (!has_y) {
+			tmx_err(E_MISSEL, "json parser: missing 'y' member in object %u", obj->id);
+			return 0;
+		}
+	}
+
+	if (obj->obj_type == OT_NONE) {
+		if (is_ellipse) {
+			obj->obj_type = OT_ELLIPSE;
+		} else if (is_point) {
+			obj->obj_type = OT_POINT;
+		} else if (has_gid) {
+			obj->obj_type = OT_TILE;
+			obj->content.gid = (int)gid;
+		} else if (has_height) {
+			obj->obj_type = OT_SQUARE;
+		} else if (!has_template) {
+			obj->obj_type = OT_POINT;
+		}
+	}
+	return 1;
+}
+
+/* objects are prepended, as the XML parser does */
+static int parse_objects(json_reader *r, tmx_object **obj_headadr, int is_on_map, json_doc *doc) {
+	tmx_object *obj;
+	int ret;
+
+	if (!json_array(r)) return 0;
+	while ((ret = json_item(r)) == 1) {
+		if (!(obj = alloc_object())) return 0;
+		obj->next = *obj_headadr;
+		*obj_headadr = obj;
+		if (!parse_object(r, obj, is_on_map, doc)) return 0;
+	}
+	return ret == 0;
+}
+
+/* `image_path` is not empty */
+static int mk_image(tmx_image **img_adr, const char *image_path, int width, int height, const char *trans, json_doc *doc) {
+	tmx_image *res;
+
+	if (!(res = alloc_image())) return 0;
+	*img_adr = res;
+	res->width = width;
+	res->height = height;
+	if (trans) {
+		res->trans = get_color_rgb(trans);
+		res->uses_trans = 1;
+	}
+	if (!(res->source = tmx_strdup(image_path))) return 0;
+	return load_or_defer_image(&(doc->ctx), res, doc->filename);
+}
+
+/* the data is an array of gids or an encoded string */
+static int locate_data(json_reader *r, layer_data *data) {
+	char *end;
+	memset(data, 0, sizeof(layer_data));
+	if (json_peek(r) == '[') {
+		if (!json_locate(r, &(data->source), &end)) return 0;
+		data->source++; /* the items */
+		data->len = (size_t)(end - 1 - data->source);
+		data->is_array = 1;
+		return 1;
+	}
+	return (data->source = json_string(r, &(data->len))) != NULL;
+}
+
+static int add_layer_data(json_doc *doc, layer_data *data, uint32_t **gids, size_t gids_count) {
+	if (!grow_array((void**)&(doc->data), &(doc->data_cap), doc->data_len, sizeof(layer_data))) return 0;
+	data->gids = gids;
+	data->gids_count = gids_count;
+	doc->data[doc->data_len++] = *data;
+	return 1;
+}
+
+/* sets the type of the data of the layer (and of its chunks) from its encoding and compression */
+static int set_data_type(json_doc *doc, unsigned int first, const char *encoding, const char *compression) {
+	enum enccmp_t type;
+	unsigned int i;
+
+	switch (encoding? keyword_lookup(encoding): K_CSV) {
+		case K_CSV:
+			type = CSV;
+			break;
+		case K_BASE64:
+			if (!compression || !*compression) {
+				type = B64;
+				break;
+			}
+			switch (keyword_lookup(compression)) {
+				case K_ZSTD:
+					type = B64ZSTD;
+					break;
+				case K_ZLIB:
+				case K_GZIP:
+					type = B64Z;
+					break;
+				default:
+					tmx_err(E_ENCCMP, "json parser: unsupported data compression: '%s'", compression); /* unsupported compression */
+					return 0;
+			}
+			break;
+		default:
+			tmx_err(E_ENCCMP, "json parser: unknown data encoding: %s", encoding);
+			return 0;
+	}
+
+	for (i=first; i<doc->data_len; i++) {
+		if (doc->data[i].is_array != (type == CSV)) {
+			tmx_err(E_JDATA, "json parser: the data of a layer encoded in %s must be %s", type == CSV? "csv": "base64",
+			        type == CSV? "an array": "a string");
+			return 0;
+		}
+		doc->data[i].type = type;
+	}
+	return 1;
+}
+
+/* chunks out of the region (if any) are skipped */
+static int parse_chunk(json_reader *r, tmx_chunks *chunks, unsigned int *chunks_cap, json_doc *doc) {
+	tmx_chunk *res;
+	const char *name;
+	layer_data data;
+	data_region *region = doc->ctx.region;
+	int ret, has_x = 0, has_y = 0, has_width = 0, has_height = 0, has_data = 0;
+
+	if (!grow_array((void**)&(chunks->list), chunks_cap, chunks->count, sizeof(tmx_chunk*))) return 0;
+	if (!(res = alloc_chunk())) return 0;
+	chunks->list[chunks->count++] = res;
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_X: /* x */
+				if (!json_int(r, &(res->x))) return 0;
+				has_x = 1;
+				break;
+			case K_Y: /* y */
+				if (!json_int(r, &(res->y))) return 0;
+				has_y = 1;
+				break;
+			case K_WIDTH: /* width */
+				if (!json_int(r, &(res->width))) return 0;
+				has_width = 1;
+				break;
+			case K_HEIGHT: /* height */
+				if (!json_int(r, &(res->height))) return 0;
+				has_height = 1;
+				break;
+			case K_DATA: /* data */
+				if (!locate_data(r, &data)) return 0;
+				has_data = 1;
+				break;
+			default:
+				if (!json_skip(r)) return 0;
+				break;
+		}
+	}
+	if (ret < 0) return 0;
+
+	if (!has_x || !has_y || !has_width || !has_height || !has_data) {
+		tmx_err(E_MISSEL, "json parser: missing '%s' member in a chunk",
+		        !has_x? "x": !has_y? "y": !has_width? "width": !has_height? "height": "data");
+		return 0;
+	}
+	if (res->width <= 0 || res->height <= 0 || (size_t)res->width * (size_t)res->height > INT_MAX / sizeof(uint32_t)) {
+		tmx_err(E_JDATA, "json parser: invalid size %dx%d of the chunk at (%d, %d)", res->width, res->height, res->x, res->y);
+		return 0;
+	}
+
+	if (region && ((long)res->x + res->width <= region->x || res->x >= (long)region->x + region->width ||
+	               (long)res->y + res->height <= region->y || res->y >= (long)region->y + region->height)) {
+		chunks->count--;
+		mem_free(res);
+		return 1;
+	}
+
+	return add_layer_data(doc, &data, &(res->gids), (size_t)res->width * (size_t)res->height);
+}
+
+/* the type of a layer is set by its `type` member or by its content, whichever comes first */
+static int set_layer_type(json_reader *r, tmx_layer *layer, enum tmx_layer_type type) {
+	if (layer->type == type) return 1;
+	if (layer->type != L_NONE) return json_error(r, "the content of the layer does not match its type");
+	layer->type = type;
+	if (type == L_OBJGR) {
+		if (!(layer->content.objgr = alloc_objgr())) return 0;
+		layer->content.objgr->draworder = parse_objgr_draworder(NULL);
+	}
+	return 1;
+}
+
+static int parse_layers(json_reader *r, tmx_layer **layer_headadr, json_doc *doc);
+
+static int parse_layer(json_reader *r, tmx_layer **layer_headadr, json_doc *doc) {
+	tmx_layer *res;
+	const char *name, *value, *encoding = NULL, *compression = NULL, *draworder = NULL, *image = NULL, *trans = NULL;
+	int ret, flag, has_color = 0, has_data = 0, image_width = 0, image_height = 0;
+	unsigned int chunks_cap = 0, data_first = doc->data_len;
+	uint32_t color = 0;
+	layer_data data;
+	enum tmx_layer_type type;
+
+	if (!(res = alloc_layer())) return 0;
+	while(*layer_headadr) {
+		layer_headadr = &((*layer_headadr)->next);
+	}
+	*layer_headadr = res;
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_TYPE: /* type */
+				if (!(value = json_string(r, NULL))) return 0;
+				switch (keyword_lookup(value)) {
+					case K_TILELAYER:   type = L_LAYER; break;
+					case K_OBJECTGROUP: type = L_OBJGR; break;
+					case K_IMAGELAYER:  type = L_IMAGE; break;
+					case K_GROUP:       type = L_GROUP; break;
+					default:
+						tmx_err(E_JDATA, "json parser: unknown layer type '%s'", value);
+						return 0;
+				}
+				if (!set_layer_type(r, res, type)) return 0;
+				break;
+			case K_ID: /* id */
+				if (!json_int(r, &(res->id))) return 0;
+				break;
+			case K_NAME: /* name */
+				if (!json_strdup(r, &(res->name))) return 0;
+				break;
+			case K_CLASS: /* class */
+				if (!json_strdup(r, &(res->class_type))) return 0;
+				break;
+			case K_VISIBLE: /* visible */
+				if (!json_bool(r, &flag)) return 0;
+				res->visible = (char)flag;
+				break;
+			case K_OPACITY: /* opacity */
+				if (!json_number(r, &(res->opacity))) return 0;
+				break;
+			case K_OFFSETX: /* offsetx */
+				if (!json_int(r, &(res->offsetx))) return 0;
+				break;
+			case K_OFFSETY: /* offsety */
+				if (!json_int(r, &(res->offsety))) return 0;
+				break;
+			case K_PARALLAXX: /* parallaxx */
+				if (!json_number(r, &(res->parallaxx))) return 0;
+				break;
+			case K_PARALLAXY: /* parallaxy */
+				if (!json_number(r, &(res->parallaxy))) return 0;
+				break;
+			case K_TINTCOLOR: /* tintcolor */
+				if (!(value = json_string(r, NULL))) return 0;
+				res->tintcolor = get_color_rgb(value);
+				break;
+			case K_COLOR: /* color */
+				if (!(value = json_string(r, NULL))) return 0;
+				color = get_color_rgb(value);
+				has_color = 1;
+				break;
+			case K_DRAWORDER: /* draworder */
+				if (!(draworder = json_string(r, NULL))) return 0;
+				break;
+			case K_REPEATX: /* repeatx */
+				if (!json_bool(r, &(res->repeatx))) return 0;
+				break;
+			case K_REPEATY: /* repeaty */
+				if (!json_bool(r, &(res->repeaty))) return 0;
+				break;
+			case K_PROPERTIES: /* properties */
+				if (!parse_properties(r, &(res->properties))) return 0;
+				break;
+			case K_DATA: /* data of a finite tile layer, decoded once the map is parsed */
+				if (has_data) return json_error(r, "duplicate 'data' member in the layer");
+				if (!set_layer_type(r, res, L_LAYER) || !locate_data(r, &data)) return 0;
+				has_data = 1;
+				break;
+			case K_CHUNKS: /* chunks of a tile layer of an infinite map */
+				if (!set_layer_type(r, res, L_LAYER)) return 0;
+				if (res->chunks) return json_error(r, "duplicate 'chunks' member in the layer");
+				if (!(res->chunks = alloc_chunks())) return 0;
+				if (!json_array(r)) return 0;
+				while ((ret = json_item(r)) == 1) {
+					if (!parse_chunk(r, res->chunks, &chunks_cap, doc)) return 0;
+				}
+				if (ret < 0) return 0;
+				break;
+			case K_ENCODING: /* encoding */
+				if (!(encoding = json_string(r, NULL))) return 0;
+				break;
+			case K_COMPRESSION: /* compression */
+				if (!(compression = json_string(r, NULL))) return 0;
+				break;
+			case K_IMAGE: /* image */
+				if (!set_layer_type(r, res, L_IMAGE) || !(image = json_string(r, NULL))) return 0;
+				break;
+			case K_IMAGEWIDTH: /* imagewidth */
+				if (!json_int(r, &image_width)) return 0;
+				break;
+			case K_IMAGEHEIGHT: /* imageheight */
+				if (!json_int(r, &image_height)) return 0;
+				break;
+			case K_TRANSPARENTCOLOR: /* transparentcolor */
+				if (!(trans = json_string(r, NULL))) return 0;
+				break;
+			case K_OBJECTS: /* objects */
+				if (!set_layer_type(r, res, L_OBJGR)) return 0;
+				if (!parse_objects(r, &(res->content.objgr->head), 1, doc)) return 0;
+				break;
+			case K_LAYERS: /* layers of a group */
+				if (!set_layer_type(r, res, L_GROUP)) return 0;
+				if (!parse_layers(r, &(res->content.group_head), doc)) return 0;
+				break;
+			default:
+				if (!json_skip(r)) return 0;
+				break;
+		}
+	}
+	if (ret < 0) return 0;
+
+	if (!(res->name)) {
+		tmx_err(E_MISSEL, "json parser: missing 'name' member in a layer");
+		return 0;
+	}
+
+	switch (res->type) {
+		case L_LAYER:
+			if (res->chunks && has_data) {
+				tmx_err(E_JDATA, "json parser: layer '%s' has both 'data' and 'chunks'", res->name);
+				return 0;
+			}
+			else if (has_data) {
+				if (!add_layer_data(doc, &data, &(res->content.gids), 0)) return 0;
+			}
+			else if (res->chunks && !index_chunks(res->chunks)) return 0;
+			return set_data_type(doc, data_first, encoding, compression);
+		case L_OBJGR:
+			if (has_color) res->content.objgr->color = color;
+			if (draworder) res->content.objgr->draworder = parse_objgr_draworder(draworder);
+			return 1;
+		case L_IMAGE:
+			if (image && *image) { /* Tiled saves an empty path for image layers without image */
+				return mk_image(&(res->content.image), image, image_width, image_height, trans, doc);
+			}
+			return 1;
+		case L_GROUP:
+			return 1;
+		default:
+			tmx_err(E_MISSEL, "json parser: missing 'type' member in layer '%s'", res->name);
+			return 0;
+	}
+}
+
+/* layers are appended, in document order */
+static int parse_layers(json_reader *r, tmx_layer **layer_headadr, json_doc *doc) {
+	int ret;
+	if (!json_array(r)) return 0;
+	while ((ret = json_item(r)) == 1) {
+		if (!parse_layer(r, layer_headadr, doc)) return 0;
+	}
+	return ret == 0;
+}
+
+static int parse_tileoffset(json_reader *r, int *x, int *y) {
+	const char *name;
+	int ret, has_x = 0, has_y = 0;
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_X: /* x offset */
+				if (!json_int(r, x)) return 0;
+				has_x = 1;
+				break;
+			case K_Y: /* y offset */
+				if (!json_int(r, y)) return 0;
+				has_y = 1;
+				break;
+			default:
+				if (!json_skip(r)) return 0;
+				break;
+		}
+	}
+	if (ret < 0) return 0;
+	if (!has_x || !has_y) {
+		tmx_err(E_MISSEL, "json parser: missing '%s' member in the 'tileoffset' object", has_x? "y": "x");
+		return 0;
+	}
+	return 1;
+}
+
+static int parse_animation(json_reader *r, tileset_state *state, unsigned int *length) {
+	const char *name;
+	int ret, value, has_tileid, has_duration;
+	tmx_anim_frame frame;
+
+	*length = 0;
+	if (!json_array(r)) return 0;
+	while ((ret = json_item(r)) == 1) {
+		has_tileid = has_duration = 0;
+		if (!json_object(r)) return 0;
+		while ((ret = json_member(r, &name)) == 1) {
+			switch (keyword_lookup(name)) {
+				case K_TILEID: /* tileid */
+					if (!json_int(r, &value)) return 0;
+					frame.tile_id = (unsigned int)value;
+					has_tileid = 1;
+					break;
+				case K_DURATION: /* duration */
+					if (!json_int(r, &value)) return 0;
+					frame.duration = (unsigned int)value;
+					has_duration = 1;
+					break;
+				default:
+					if (!json_skip(r)) return 0;
+					break;
+			}
+		}
+		if (ret < 0) return 0;
+		if (!has_tileid || !has_duration) {
+			tmx_err(E_MISSEL, "json parser: missing '%s' member in an animation frame", has_tileid? "duration": "tileid");
+			return 0;
+		}
+		if (!add_anim_frame(state, frame)) return 0;
+		*length += 1;
+	}
+	return ret == 0;
+}
+
+/* the tile is read in `tile`, then moved to its slot once its id is known */
+static int parse_tile(json_reader *r, tileset_state *state, json_doc *doc) {
+	tmx_tile tile, *res;
+	const char *name, *value, *image = NULL;
+	int ret, id = 0, has_id = 0, has_type = 0, x = 0, y = 0, width = -1, height = -1, image_width = 0, image_height = 0;
+
+	memset(&tile, 0, sizeof(tmx_tile));
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_ID: /* id */
+				if (!json_int(r, &id)) goto cleanup;
+				has_id = 1;
+				break;
+			case K_TYPE: /* type */
+				if (!json_strdup(r, &(tile.type))) goto cleanup;
+				has_type = 1;
+				break;
+			case K_CLASS: /* class, `type` prevails */
+				if (!(value = json_string(r, NULL))) goto cleanup;
+				if (has_type) break;
+				mem_free(tile.type);
+				if (!(tile.type = tmx_strdup(value))) goto cleanup;
+				break;
+			case K_X: /* x */
+				if (!json_int(r, &x)) goto cleanup;
+				break;
+			case K_Y: /* y */
+				if (!json_int(r, &y)) goto cleanup;
+				break;
+			case K_WIDTH: /* width */
+				if (!json_int(r, &width)) goto cleanup;
+				break;
+			case K_HEIGHT: /* height */
+				if (!json_int(r, &height)) goto cleanup;
+				break;
+			case K_IMAGE: /* image */
+				if (!(image = json_string(r, NULL))) goto cleanup;
+				break;
+			case K_IMAGEWIDTH: /* imagewidth */
+				if (!json_int(r, &image_width)) goto cleanup;
+				break;
+			case K_IMAGEHEIGHT: /* imageheight */
+				if (!json_int(r, &image_height)) goto cleanup;
+				break;
+			case K_PROPERTIES: /* properties */
+				if (!parse_properties(r, &(tile.properties))) goto cleanup;
+				break;
+			case K_OBJECTGROUP: /* tile collision */
+				if (!json_object(r)) goto cleanup;
+				while ((ret = json_member(r, &name)) == 1) {
+					if (keyword_lookup(name) == K_OBJECTS) {
+						if (!parse_objects(r, &(tile.collision), 0, doc)) goto cleanup;
+					}
+					else if (!json_skip(r)) goto cleanup;
+				}
+				if (ret < 0) goto cleanup;
+				break;
+			case K_ANIMATION: /* animation */
+				/* offset of the first frame in the pool until the whole tileset is parsed */
+				tile.user_data.integer = (int)state->frames_len;
+				if (!parse_animation(r, state, &(tile.animation_len))) goto cleanup;
+				break;
+			default:
+				if (!json_skip(r)) goto cleanup;
+				break;
+		}
+	}
+	if (ret < 0) goto cleanup;
+
+	if (!has_id) {
+		tmx_err(E_MISSEL, "json parser: missing 'id' member in a tile");
+		goto cleanup;
+	}
+	if (image && *image && !mk_image(&(tile.image), image, image_width, image_height, NULL, doc)) goto cleanup;
+
+	/* source rectangle, defaults to the whole image */
+	tile.ul_x = (unsigned int)x;
+	tile.ul_y = (unsigned int)y;
+	tile.width = width < 0 && tile.image? (unsigned int)tile.image->width: (unsigned int)width;
+	tile.height = height < 0 && tile.image? (unsigned int)tile.image->height: (unsigned int)height;
+
+	if (!(res = place_tile(state, (unsigned int)id))) goto cleanup;
+	tile.id = res->id;
+	tile.tileset = res->tileset;
+	*res = tile;
+	return 1;
+cleanup:
+	free_tiles(&tile, 1);
+	return 0;
+}
+
+/* parses a tileset within a map or a template (`ts_list` is not NULL), or in a dedicated tsj file,
+   references to external tilesets are recorded to be loaded once the document has been parsed */
+static int parse_tileset(json_reader *r, tmx_tileset *ts, tmx_tileset_list *ts_list, json_doc *doc) {
+	const char *name, *value, *image = NULL, *trans = NULL, *source = NULL;
+	char *tiles = NULL, *tiles_end;
+	int ret, value_int, has_firstgid = 0, has_tilecount = 0, has_tilewidth = 0, has_tileheight = 0;
+	int image_width = 0, image_height = 0, has_image_width = 0, has_image_height = 0;
+	tileset_state state = {NULL, 0, 0, 0, 0, 0};
+	json_reader tiles_reader;
+	ext_ref *ref;
+
+	state.tileset = ts;
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_FIRSTGID: /* firstgid */
+				if (!json_int(r, &value_int)) return 0;
+				if (value_int < 1) return json_error(r, "invalid 'firstgid'");
+				if (ts_list) ts_list->firstgid = (unsigned int)value_int;
+				has_firstgid = 1;
+				break;
+			case K_SOURCE: /* external tileset */
+				if (!(source = json_string(r, NULL))) return 0;
+				break;
+			case K_TYPE: /* type */
+				if (!(value = json_string(r, NULL))) return 0;
+				if (keyword_lookup(value) != K_TILESET) {
+					tmx_err(E_JDATA, "json parser: object of type '%s' instead of a tileset", value);
+					return 0;
+				}
+				break;
+			case K_NAME: /* name */
+				if (!json_strdup(r, &(ts->name))) return 0;
+				break;
+			case K_CLASS: /* class */
+				if (!json_strdup(r, &(ts->class_type))) return 0;
+				break;
+			case K_TILECOUNT: /* tilecount */
+				if (!json_int(r, &value_int)) return 0;
+				if (value_int < 0) return json_error(r, "negative 'tilecount'");
+				ts->tilecount = (unsigned int)value_int;
+				has_tilecount = 1;
+				break;
+			case K_TILEWIDTH: /* tile_width */
+				if (!json_int(r, &value_int)) return 0;
+				ts->tile_width = (unsigned int)value_int;
+				has_tilewidth = 1;
+				break;
+			case K_TILEHEIGHT: /* tile_height */
+				if (!json_int(r, &value_int)) return 0;
+				ts->tile_height = (unsigned int)value_int;
+				has_tileheight = 1;
+				break;
+			case K_SPACING: /* spacing */
+				if (!json_int(r, &value_int)) return 0;
+				ts->spacing = (unsigned int)value_int;
+				break;
+			case K_MARGIN: /* margin */
+				if (!json_int(r, &value_int)) return 0;
+				ts->margin = (unsigned int)value_int;
+				break;
+			case K_OBJECTALIGNMENT: /* objectalignment */
+				if (!(value = json_string(r, NULL))) return 0;
+				ts->objectalignment = parse_obj_alignment(value);
+				break;
+			case K_TILERENDERSIZE: /* tilerendersize */
+				if (!(value = json_string(r, NULL))) return 0;
+				ts->tile_render_size = parse_tile_render_size(value);
+				break;
+			case K_FILLMODE: /* fillmode */
+				if (!(value = json_string(r, NULL))) return 0;
+				ts->fill_mode = parse_fillmode(value);
+				break;
+			case K_IMAGE: /* image */
+				if (!(image = json_string(r, NULL))) return 0;
+				break;
+			case K_IMAGEWIDTH: /* imagewidth */
+				if (!json_int(r, &image_width)) return 0;
+				has_image_width = 1;
+				break;
+			case K_IMAGEHEIGHT: /* imageheight */
+				if (!json_int(r, &image_height)) return 0;
+				has_image_height = 1;
+				break;
+			case K_TRANSPARENTCOLOR: /* transparentcolor */
+				if (!(trans = json_string(r, NULL))) return 0;
+				break;
+			case K_TILEOFFSET: /* tileoffset */
+				if (!parse_tileoffset(r, &(ts->x_offset), &(ts->y_offset))) return 0;
+				break;
+			case K_PROPERTIES: /* properties */
+				if (!parse_properties(r, &(ts->properties))) return 0;
+				break;
+			case K_TILES: /* read once the tilecount is known */
+				if (!json_locate(r, &tiles, &tiles_end)) return 0;
+				break;
+			default:
+				if (!json_skip(r)) return 0;
+				break;
+		}
+	}
+	if (ret < 0) return 0;
+
+	if (ts_list) {
+		if (!has_firstgid) {
+			tmx_err(E_MISSEL, "json parser: missing 'firstgid' member in a tileset");
+			return 0;
+		}
+		/* External Tileset, loaded once the document has been parsed */
+		if (source) {
+			free_ts(ts);
+			ts_list->tileset = NULL;
+			ts_list->is_embedded = 0;
+			if (!(ts_list->source = tmx_strdup(source))) return 0;
+			if (!(ref = add_ext_ref(&(doc->ctx), RC_TSX, source, doc->filename))) return 0;
+			ref->user.ts_list = ts_list;
+			return 1;
+		}
+	}
+
+	if (!(ts->name)) {
+		tmx_err(E_MISSEL, "json parser: missing 'name' member in a tileset");
+		return 0;
+	}
+	if (!has_tilecount) {
+		tmx_err(E_MISSEL, "json parser: missing 'tilecount' member in tileset '%s'", ts->name);
+		return 0;
+	}
+	if (!has_tilewidth) {
+		tmx_err(E_MISSEL, "json parser: missing 'tilewidth' member in tileset '%s'", ts->name);
+		return 0;
+	}
+	if (!has_tileheight) {
+		tmx_err(E_MISSEL, "json parser: missing 'tileheight' member in tileset '%s'", ts->name);
+		return 0;
+	}
+
+	if (image && *image) {
+		if (!has_image_width || !has_image_height) {
+			tmx_err(E_MISSEL, "json parser: missing '%s' member in tileset '%s'", has_image_width? "imageheight": "imagewidth", ts->name);
+			return 0;
+		}
+		if (!mk_image(&(ts->image), image, image_width, image_height, trans, doc)) return 0;
+	}
+
+	if (!(ts->tiles = alloc_tiles(ts->tilecount))) return 0;
+
+	if (tiles) {
+		tiles_reader = *r;
+		tiles_reader.pos = tiles;
+		if (!json_array(&tiles_reader)) return 0;
+		while ((ret = json_item(&tiles_reader)) == 1) {
+			if (!parse_tile(&tiles_reader, &state, doc)) return 0;
+		}
+		if (ret < 0) return 0;
+	}
+
+	return finish_tileset(&state);
+}
+
+/* Parses a tileset to be stored in a list of tilesets, prepended as the XML parser does */
+static int parse_tileset_list(json_reader *r, tmx_tileset_list **ts_headadr, json_doc *doc) {
+	tmx_tileset_list *res_list;
+
+	if (!(res_list = alloc_tileset_list())) return 0;
+	res_list->next = *ts_headadr;
+	*ts_headadr = res_list;
+
+	/* embedded unless it has a `source` */
+	if (!(res_list->tileset = alloc_tileset())) return 0;
+	res_list->is_embedded = 1;
+
+	return parse_tileset(r, res_list->tileset, res_list, doc);
+}
+
+static int parse_template(json_reader *r, tmx_template *template, json_doc *doc) {
+	const char *name, *value;
+	int ret;
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_TYPE: /* type */
+				if (!(value = json_string(r, NULL))) return 0;
+				if (keyword_lookup(value) != K_TEMPLATE) {
+					tmx_err(E_JDATA, "json parser: document of type '%s' instead of a template", value);
+					return 0;
+				}
+				break;
+			case K_TILESET: /* tileset */
+				if (!parse_tileset_list(r, &(template->tileset_ref), doc)) return 0;
+				break;
+			case K_OBJECT: /* object */
+				if (!parse_object(r, template->object, 0, doc)) return 0;
+				break;
+			default:
+				if (!json_skip(r)) return 0;
+				break;
+		}
+	}
+	return ret == 0;
+}
+
+/* tile layers of infinite maps may have no chunk, `infinite` may come after the layers */
+static int add_empty_chunks(tmx_layer *layer) {
+	for (; layer; layer = layer->next) {
+		if (layer->type == L_GROUP && !add_empty_chunks(layer->content.group_head)) return 0;
+		if (layer->type == L_LAYER && !(layer->chunks)) {
+			if (!(layer->chunks = alloc_chunks())) return 0;
+		}
+	}
+	return 1;
+}
+
+static int parse_map(json_reader *r, tmx_map *map, json_doc *doc) {
+	int ret, value_int, has_height = 0, has_width = 0, has_tileheight = 0, has_tilewidth = 0;
+	const char *name, *value;
+	data_region *region = doc->ctx.region;
+
+	/* default values of optional attributes */
+	map->stagger_axis = parse_stagger_axis(NULL);
+	map->renderorder = parse_renderorder(NULL);
+
+	if (!json_object(r)) return 0;
+	while ((ret = json_member(r, &name)) == 1) {
+		switch (keyword_lookup(name)) {
+			case K_TYPE: /* type */
+				if (!(value = json_string(r, NULL))) return 0;
+				if (keyword_lookup(value) != K_MAP) {
+					tmx_err(E_JDATA, "json parser: document of type '%s' instead of a map", value);
+					return 0;
+				}
+				break;
+			case K_VERSION: /* version, a number in older documents */
+				if (json_peek(r) != '"') {
+					if (!json_skip(r)) return 0;
+				}
+				else if (!json_strdup(r, &(map->format_version))) return 0;
+				break;
+			case K_CLASS: /* class */
+				if (!json_strdup(r, &(map->class_type))) return 0;
+				break;
+			case K_INFINITE: /* infinite */
+				if (!json_bool(r, &value_int)) return 0;
+				map->infinite = value_int;
+				break;
+			case K_ORIENTATION: /* orientation */
+				if (!(value = json_string(r, NULL))) return 0;
+				if (map->orient = parse_orient(value), map->orient == O_NONE) {
+					tmx_err(E_JDATA, "json parser: unsupported 'orientation' '%s'", value);
+					return 0;
+				}
+				break;
+			case K_STAGGERINDEX: /* staggerindex */
+				if (!(value = json_string(r, NULL))) return 0;
+				if (map->stagger_index = parse_stagger_index(value), map->stagger_index == SI_NONE) {
+					tmx_err(E_JDATA, "json parser: unsupported 'staggerindex' '%s'", value);
+					return 0;
+				}
+				break;
+			case K_STAGGERAXIS: /* staggeraxis */
+				if (!(value = json_string(r, NULL))) return 0;
+				if (map->stagger_axis = parse_stagger_axis(value), map->stagger_axis == SA_NONE) {
+					tmx_err(E_JDATA, "json parser: unsupported 'staggeraxis' '%s'", value);
+					return 0;
+				}
+				break;
+			case K_RENDERORDER: /* renderorder */
+				if (!(value = json_string(r, NULL))) return 0;
+				if (map->renderorder = parse_renderorder(value), map->renderorder == R_NONE) {
+					tmx_err(E_JDATA, "json parser: unsupported 'renderorder' '%s'", value);
+					return 0;
+				}
+				break;
+			case K_HEIGHT: /* height */
+				if (!json_int(r, &value_int)) return 0;
+				map->height = (unsigned int)value_int;
+				has_height = 1;
+				break;
+			case K_WIDTH: /* width */
+				if (!json_int(r, &value_int)) return 0;
+				map->width = (unsigned int)value_int;
+				has_width = 1;
+				break;
+			case K_TILEHEIGHT: /* tileheight */
+				if (!json_int(r, &value_int)) return 0;
+				map->tile_height = (unsigned int)value_int;
+				has_tileheight = 1;
+				break;
+			case K_TILEWIDTH: /* tilewidth */
+				if (!json_int(r, &value_int)) return 0;
+				map->tile_width = (unsigned int)value_int;
+				has_tilewidth = 1;
+				break;
+			case K_BACKGROUNDCOLOR: /* backgroundcolor */
+				if (!(value = json_string(r, NULL))) return 0;
+				map->backgroundcolor = get_color_rgb(value);
+				break;
+			case K_HEXSIDELENGTH: /* hexsidelength */
+				if (!json_int(r, &value_int)) return 0;
+				map->hexsidelength = (unsigned int)value_int;
+				break;
+			case K_PARALLAXORIGINX: /* parallaxoriginx */
+				if (!json_number(r, &(map->parallaxoriginx))) return 0;
+				break;
+			case K_PARALLAXORIGINY: /* parallaxoriginy */
+				if (!json_number(r, &(map->parallaxoriginy))) return 0;
+				break;
+			case K_PROPERTIES: /* properties */
+				if (!parse_properties(r, &(map->properties))) return 0;
+				break;
+			case K_TILESETS: /* tilesets */
+				if (!json_array(r)) return 0;
+				while ((ret = json_item(r)) == 1) {
+					if (!parse_tileset_list(r, &(map->ts_head), doc)) return 0;
+				}
+				if (ret < 0) return 0;
+				break;
+			case K_LAYERS: /* layers */
+				if (!parse_layers(r, &(map->ly_head), doc)) return 0;
+				break;
+			default:
+				if (!json_skip(r)) return 0;
+				break;
+		}
+	}
+	if (ret < 0) return 0;
+
+	if (map->orient == O_NONE) {
+		tmx_err(E_MISSEL, "json parser: missing 'orientation' member in the map");
+		return 0;
+	}
+	if (!has_height) {
+		tmx_err(E_MISSEL, "json parser: missing 'height' member in the map");
+		return 0;
+	}
+	if (!has_width) {
+		tmx_err(E_MISSEL, "json parser: missing 'width' member in the map");
+		return 0;
+	}
+	if (!has_tileheight) {
+		tmx_err(E_MISSEL, "json parser: missing 'tileheight' member in the map");
+		return 0;
+	}
+	if (!has_tilewidth) {
+		tmx_err(E_MISSEL, "json parser: missing 'tilewidth' member in the map");
+		return 0;
+	}
+
+	if (map->infinite && !add_empty_chunks(map->ly_head)) return 0;
+
+	/* the map is reduced to the region */
+	if (region) {
+		region->src_width = map->width;
+		region->src_height = map->height;
+		map->region_x = region->x;
+		map->region_y = region->y;
+		map->width = region->width;
+		map->height = region->height;
+	}
+	return 1;
+}
+
+/* decodes the data of the tile layers, once the size of the map and its zstd dictionary (a property) are known */
+static int decode_layer_data(tmx_map *map, json_doc *doc, data_decoder *decoder) {
+	tmx_property *prop;
+	layer_data *data;
+	unsigned int i;
+
+	if ((prop = tmx_get_property(map->properties, "zstd_dictionary")) &&
+	    (prop->type == PT_FILE || prop->type == PT_STRING || prop->type == PT_NONE)) {
+		if (!data_decoder_load_zstd_dict(decoder, doc->filename, prop->value.file)) return 0;
+	}
+
+	for (i=0; i<doc->data_len; i++) {
+		data = doc->data + i;
+		if (data->gids_count == 0 && doc->ctx.region) {
+			if (!data_decode_region(decoder, data->source, data->len, data->type, doc->ctx.region, data->gids)) return 0;
+		}
+		else if (!data_decode_deferred(decoder, data->source, data->len, data->type,
+		                               data->gids_count? data->gids_count: (size_t)map->width * (size_t)map->height, data->gids)) return 0;
+	}
+	return 1;
+}
+
+static void init_json_doc(json_doc *doc, json_reader *r, char *buffer, const char *filename) {
+	memset(doc, 0, sizeof(json_doc));
+	doc->filename = filename;
+	memset(r, 0, sizeof(json_reader));
+	r->buffer = r->pos = buffer;
+	if (!strncmp(buffer, "\xEF\xBB\xBF", 3)) r->pos += 3; /* BOM */
+}
+
+static void free_json_doc(json_doc *doc) {
+	free_parse_context(&(doc->ctx));
+	mem_free(doc->data);
+}
+
+/* `region` is not NULL for tmx_load_region */
+static tmx_map* parse_map_document(char *buffer, tmx_resource_manager *rc_mgr, data_region *region, const char *filename) {
+	tmx_map *res;
+	data_decoder *decoder;
+	json_reader r;
+	json_doc doc;
+	mem_arena *arena = NULL, *prev;
+
+	if (tmx_arena_allocation && !(arena = mk_arena())) return NULL;
+	prev = arena_enter(arena);
+	init_json_doc(&doc, &r, buffer, filename);
+	doc.ctx.region = region;
+
+	if ((res = alloc_map())) {
+		/* decompression contexts are shared by all the layers of the map */
+		decoder = mk_data_decoder(rc_mgr);
+		if (!decoder || !parse_map(&r, res, &doc) || !json_end(&r) || !decode_layer_data(res, &doc, decoder) ||
+		    !load_ext_resources(rc_mgr, 0, &(doc.ctx)) || !data_decoder_finish(decoder)) {
+			tmx_map_free(res);
+			unload_ext_resources(rc_mgr, &(doc.ctx));
+			res = NULL;
+		}
+		else {
+			/* after load_ext_resources, objects may take their geometry from their template */
+			if (region) crop_map_objects(res, region);
+			if (data_decoder_is_lazy(decoder)) {
+				/* the map keeps the payloads of its layers */
+				res->decoder = decoder;
+				decoder = NULL;
+			}
+			res->arena = (void*)arena;
+			arena = NULL;
+		}
+		free_data_decoder(decoder);
+	}
+	free_json_doc(&doc);
+	arena_enter(prev);
+	free_arena(arena); /* the load failed */
+	return res;
+}
+
+/* the resources referenced by the tileset are recorded in `ctx`, `filename` may be NULL */
+static int parse_tileset_document(char *buffer, tmx_tileset *ts, parse_context *ctx, const char *filename) {
+	json_reader r;
+	json_doc doc;
+	int res;
+
+	init_json_doc(&doc, &r, buffer, filename);
+	doc.ctx = *ctx;
+	res = parse_tileset(&r, ts, NULL, &doc) && json_end(&r);
+	*ctx = doc.ctx;
+	return res;
+}
+
+static int parse_template_document(char *buffer, tmx_template *template, parse_context *ctx, const char *filename) {
+	json_reader r;
+	json_doc doc;
+	int res;
+
+	init_json_doc(&doc, &r, buffer, filename);
+	doc.ctx = *ctx;
+	res = parse_template(&r, template, &doc) && json_end(&r);
+	*ctx = doc.ctx;
+	return res;
+}
+
+/*
+	Documents are read in a NUL terminated buffer that the parser modifies
+*/
+
+static char* copy_buffer(const char *buffer, size_t len) {
+	char *res;
+	if (!(res = (char*)raw_alloc(NULL, len + 1))) {
+		tmx_err_code(E_ALLOC);
+		return NULL;
+	}
+	memcpy(res, buffer, len);
+	res[len] = '\0';
+	return res;
+}
+
+static char* read_file(const char *path) {
+	mapped_file file;
+	char *res;
+
+	if (!map_file(path, &file)) {
+		tmx_err(E_UNKN, "json parser: unable to open %s", path);
+		return NULL;
+	}
+	res = copy_buffer(file.data, file.len);
+	unmap_file(&file);
+	return res;
+}
+
+static char* read_callback(tmx_read_functor callback, void *userdata) {
+	size_t len = 0, cap = 65536;
+	char *res, *tmp;
+	int read;
+
+	if (!(res = (char*)raw_alloc(NULL, cap))) {
+		tmx_err_code(E_ALLOC);
+		return NULL;
+	}
+	for (;;) {
+		if (cap - len < 2) {
+			if (!(tmp = (char*)raw_alloc(res, cap * 2))) {
+				tmx_err_code(E_ALLOC);
+				raw_free(res);
+				return NULL;
+			}
+			res = tmp;
+			cap *= 2;
+		}
+		read = callback(userdata, res + len, cap - len - 1 > INT_MAX? INT_MAX: (int)(cap - len - 1));
+		if (read < 0) {
+			tmx_err(E_UNKN, "json parser: the read callback failed");
+			raw_free(res);
+			return NULL;
+		}
+		if (read == 0) break;
+		len += (size_t)read;
+	}
+	res[len] = '\0';
+	return res;
+}
+
+int is_json_buffer(const char *buffer, size_t len) {
+	size_t i = 0;
+	if (len >= 3 && !strncmp(buffer, "\xEF\xBB\xBF", 3)) i = 3; /* BOM */
+	while (i < len && isspace((unsigned char)buffer[i])) i++;
+	return i < len && buffer[i] == '{';
+}
+
+int is_json_file(const char *path) {
+	static const char *json_ext[] = {"tmj", "tsj", "tj", "json"};
+	static const char *xml_ext[] = {"tmx", "tsx", "tx", "xml"};
+	const char *ext = strrchr(path, '.');
+	char head[64];
+	size_t len, i, j;
+	FILE *file;
+
+	if (ext && !strpbrk(ext, "/\\")) {
+		ext++;
+		for (i=0; i<4; i++) {
+			for (j=0; ext[j] && tolower((unsigned char)ext[j]) == json_ext[i][j]; j++);
+			if (!ext[j] && !json_ext[i][j]) return 1;
+			for (j=0; ext[j] && tolower((unsigned char)ext[j]) == xml_ext[i][j]; j++);
+			if (!ext[j] && !xml_ext[i][j]) return 0;
+		}
+	}
+
+	/* unknown extension, sniffs the content */
+	if (!(file = fopen(path, "rb"))) return 0;
+	len = fread(head, 1, sizeof(head), file);
+	fclose(file);
+	return is_json_buffer(head, len);
+}
+
+/*
+	Public JSON load functions
+*/
+
+tmx_map* parse_json(tmx_resource_manager *rc_mgr, const char *filename, data_region *region) {
+	tmx_map *res = NULL;
+	char *buffer;
+
+	if ((buffer = read_file(filename))) {
+		res = parse_map_document(buffer, rc_mgr, region, filename);
+		raw_free(buffer);
+	}
+	return res;
+}
+
+tmx_map* parse_json_callback(tmx_resource_manager *rc_mgr, tmx_read_functor callback, void *userdata, const char *vpath) {
+	tmx_map *res = NULL;
+	char *buffer;
+
+	if ((buffer = read_callback(callback, userdata))) {
+		res = parse_map_document(buffer, rc_mgr, NULL, vpath);
+		raw_free(buffer);
+	}
+	return res;
+}
+
+tmx_map* parse_json_buffer(tmx_resource_manager *rc_mgr, const char *buffer, size_t len, const char *vpath) {
+	tmx_map *res = NULL;
+	char *copy;
+
+	if ((copy = copy_buffer(buffer, len))) {
+		res = parse_map_document(copy, rc_mgr, NULL, vpath);
+		raw_free(copy);
+	}
+	return res;
+}
+
+static tmx_tileset* load_tileset(char *buffer, const char *filename) {
+	tmx_tileset *res = NULL;
+	parse_context ctx;
+
+	if (!buffer) return NULL;
+	memset(&ctx, 0, sizeof(parse_context));
+	if ((res = alloc_tileset())) {
+		if (!parse_tileset_document(buffer, res, &ctx, filename) || !load_ext_resources(NULL, 0, &ctx)) {
+			free_ts(res);
+			res = NULL;
+		}
+	}
+	free_parse_context(&ctx);
+	raw_free(buffer);
+	return res;
+}
+
+tmx_tileset* parse_tsj(const char *filename) {
+	return load_tileset(read_file(filename), filename);
+}
+
+tmx_tileset* parse_tsj_buffer(const char *buffer, size_t len) {
+	return load_tileset(copy_buffer(buffer, len), NULL);
+}
+
+static tmx_template* load_template(tmx_resource_manager *rc_mgr, char *buffer, const char *filename) {
+	tmx_template *res = NULL;
+	parse_context ctx;
+
+	if (!buffer) return NULL;
+	memset(&ctx, 0, sizeof(parse_context));
+	if ((res = alloc_template())) {
+		if (!parse_template_document(buffer, res, &ctx, filename) || !load_ext_resources(rc_mgr, 0, &ctx)) {
+			free_template(res);
+			unload_ext_resources(rc_mgr, &ctx);
+			res = NULL;
+		}
+	}
+	free_parse_context(&ctx);
+	raw_free(buffer);
+	return res;
+}
+
+tmx_template* parse_tj(tmx_resource_manager *rc_mgr, const char *filename) {
+	return load_template(rc_mgr, read_file(filename), filename);
+}
+
+tmx_template* parse_tj_buffer(tmx_resource_manager *rc_mgr, const char *buffer, size_t len) {
+	return load_template(rc_mgr, copy_buffer(buffer, len), NULL);
+}
+
+int parse_tsj_resource(const char *path, tmx_tileset *ts, parse_context *ctx) {
+	char *buffer;
+	int res;
+
+	if (!(buffer = read_file(path))) return 0;
+	res = parse_tileset_document(buffer, ts, ctx, path);
+	raw_free(buffer);
+	return res;
+}
+
+int parse_tj_resource(const char *path, tmx_template *tmpl, parse_context *ctx) {
+	char *buffer;
+	int res;
+
+	if (!(buffer = read_file(path))) return 0;
+	res = parse_template_document(buffer, tmpl, ctx, path);
+	raw_free(buffer);
+	return res;
+}
@@ -6,29 +6,418 @@
 #include <string.h>
 
 #include <libxml/xmlmemory.h>
+#include <libxml/parser.h>
 
 #include "tmx.h"
 #include "tmx_utils.h"
 
 void set_alloc_functions() {
+	lock_globals();
 	if (!tmx_alloc_func) tmx_alloc_func = realloc;
 	if (!tmx_free_func) tmx_free_func = free;
+	unlock_globals();
 }
 
-static void* tmx_malloc(size_t len) {
-	return tmx_alloc_func(NULL, len);
+/*
+	Load options
+*/
+
+static TMX_THREAD_LOCAL tmx_load_options thread_options; /* alloc_func is NULL for the defaults */
+
+void tmx_set_load_options(const tmx_load_options *options) {
+	if (options && options->alloc_func && options->free_func) {
+		thread_options = *options;
+	} else {
+		memset(&thread_options, 0, sizeof(tmx_load_options));
+	}
+}
+
+void* raw_alloc(void *address, size_t len) {
+	if (thread_options.alloc_func) return thread_options.alloc_func(thread_options.userdata, address, len);
+	return tmx_alloc_func(address, len);
+}
+
+void raw_free(void *address) {
+	if (thread_options.alloc_func) {
+		thread_options.free_func(thread_options.userdata, address);
+	} else {
+		tmx_free_func(address);
+	}
+}
+
+void get_load_options(tmx_load_options *options) {
+	*options = thread_options;
+}
+
+void swap_load_options(tmx_load_options *options) {
+	tmx_load_options prev = thread_options;
+	thread_options = *options;
+	*options = prev;
+}
+
+int keep_load_options(void **options) {
+	tmx_load_options *res;
+	*options = NULL;
+	if (!thread_options.alloc_func) return 1;
+	if (!(res = (tmx_load_options*)raw_alloc(NULL, sizeof(tmx_load_options)))) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	*res = thread_options;
+	*options = res;
+	return 1;
+}
+
+/*
+	Arenas
+	Blocks are bump-allocated in slabs, each block is preceded by its length; only the last block of a slab can
+	be freed (popped) or grown in place, the others are released with the arena.
+*/
+
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(len) (((len) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ALIGN
+#define ARENA_MIN_SLAB 65536
+#define ARENA_MAX_SLAB (4 * 1024 * 1024)
+
+struct _arena_slab {
+	arena_slab *next;
+	char *pos, *end; /* free space */
+};
+#define SLAB_HEADER ARENA_ROUND(sizeof(arena_slab))
+
+struct _arena_image {
+	arena_image *next;
+	void **image;
+};
+
+/* a slab has an entry for each page it overlaps, a page may be overlapped by several slabs */
+#define ARENA_PAGE_SHIFT 14
+struct _slab_entry {
+	uintptr_t page; /* 0: free entry */
+	arena_slab *slab;
+};
+
+static TMX_THREAD_LOCAL mem_arena *current_arena = NULL;
+static TMX_THREAD_LOCAL int arena_suspended = 0;
+static TMX_THREAD_LOCAL int libxml_in_arena = 0;
+
+mem_arena* mk_arena(void) {
+	mem_arena *res = (mem_arena*)raw_alloc(NULL, sizeof(mem_arena));
+	if (res) {
+		init_sub_arena(res, NULL);
+	} else {
+		tmx_err_code(E_ALLOC);
+	}
+	return res;
+}
+
+void init_sub_arena(mem_arena *arena, mem_arena *parent) {
+	memset(arena, 0, sizeof(mem_arena));
+	arena->slab_len = ARENA_MIN_SLAB;
+	arena->parent = parent;
+}
+
+static void free_slabs(arena_slab *slab) {
+	arena_slab *next;
+	for (; slab; slab = next) {
+		next = slab->next;
+		raw_free(slab);
+	}
+}
+
+void free_arena(mem_arena *arena) {
+	if (arena) {
+		free_slabs(arena->slabs);
+		raw_free(arena->index);
+		raw_free(arena);
+	}
+}
+
+static size_t page_hash(uintptr_t page, size_t index_len) {
+	return (size_t)(page * 2654435761u) & (index_len - 1);
+}
+
+static void index_page(slab_entry *index, size_t index_len, uintptr_t page, arena_slab *slab) {
+	size_t i = page_hash(page, index_len);
+	while (index[i].page) i = (i + 1) & (index_len - 1);
+	index[i].page = page;
+	index[i].slab = slab;
+}
+
+/* adds the pages of `slab` to the index of `arena`, on failure the arena stops using its index */
+static void index_slab(mem_arena *arena, arena_slab *slab) {
+	uintptr_t page, first = (uintptr_t)slab >> ARENA_PAGE_SHIFT, last = ((uintptr_t)slab->end - 1) >> ARENA_PAGE_SHIFT;
+	slab_entry *index;
+	size_t len, i;
+
+	if (arena->index_failed) return;
+	if (2 * (arena->index_count + (size_t)(last - first + 1)) > arena->index_len) {
+		for (len = arena->index_len? arena->index_len: 256; 2 * (arena->index_count + (size_t)(last - first + 1)) > len; len *= 2);
+		if (!(index = (slab_entry*)raw_alloc(NULL, len * sizeof(slab_entry)))) {
+			raw_free(arena->index);
+			arena->index = NULL;
+			arena->index_failed = 1;
+			return;
+		}
+		memset(index, 0, len * sizeof(slab_entry));
+		for (i=0; i<arena->index_len; i++) {
+			if (arena->index[i].page) index_page(index, len, arena->index[i].page, arena->index[i].slab);
+		}
+		raw_free(arena->index);
+		arena->index = index;
+		arena->index_len = len;
+	}
+	for (page=first; page<=last; page++) {
+		index_page(arena->index, arena->index_len, page, slab);
+	}
+	arena->index_count += (size_t)(last - first + 1);
+}
+
+void free_arena_images(mem_arena *arena) {
+	arena_image *img;
+	if (arena && tmx_img_free_func) {
+		for (img = arena->images; img; img = img->next) {
+			tmx_img_free_func(*(img->image));
+		}
+	}
+}
+
+void merge_sub_arena(mem_arena *arena) {
+	mem_arena *parent = arena->parent;
+	arena_slab *last_slab;
+	arena_image *last_img;
+
+	if (arena->slabs) {
+		for (last_slab = arena->slabs; last_slab->next; last_slab = last_slab->next) {
+			index_slab(parent, last_slab);
+		}
+		index_slab(parent, last_slab);
+		/* after the first slab of the parent, it is still the one blocks are allocated from */
+		if (parent->slabs) {
+			last_slab->next = parent->slabs->next;
+			parent->slabs->next = arena->slabs;
+		}
+		else parent->slabs = arena->slabs;
+	}
+	if (arena->images) {
+		for (last_img = arena->images; last_img->next; last_img = last_img->next);
+		last_img->next = parent->images;
+		parent->images = arena->images;
+	}
+	arena->slabs = NULL;
+	arena->images = NULL;
+	raw_free(arena->index);
+	arena->index = NULL;
+}
+
+mem_arena* arena_enter(mem_arena *arena) {
+	mem_arena *res = current_arena;
+	current_arena = arena;
+	return res;
+}
+
+mem_arena* arena_active(void) {
+	return arena_suspended? NULL: current_arena;
+}
+
+int arena_suspend(int suspend) {
+	int res = arena_suspended;
+	arena_suspended = suspend;
+	return res;
+}
+
+int arena_libxml(int enable) {
+	int res = libxml_in_arena;
+	libxml_in_arena = enable;
+	return res;
+}
+
+/* returns the slab of `arena` that holds `address`, NULL if it is not a block of `arena` */
+static arena_slab* find_slab(mem_arena *arena, const void *address) {
+	arena_slab *slab = arena->slabs;
+	uintptr_t addr = (uintptr_t)address, page = addr >> ARENA_PAGE_SHIFT;
+	size_t i;
+
+	/* most frees and reallocs are of the last blocks */
+	if (slab && addr > (uintptr_t)slab && addr < (uintptr_t)slab->end) return slab;
+	if (arena->index_failed) {
+		for (; slab; slab = slab->next) {
+			if (addr > (uintptr_t)slab && addr < (uintptr_t)slab->end) return slab;
+		}
+		return NULL;
+	}
+	if (!arena->index) return NULL;
+	for (i = page_hash(page, arena->index_len); arena->index[i].page; i = (i + 1) & (arena->index_len - 1)) {
+		slab = arena->index[i].slab;
+		if (arena->index[i].page == page && addr > (uintptr_t)slab && addr < (uintptr_t)slab->end) return slab;
+	}
+	return NULL;
+}
+
+/* blocks of the parent (allocated before the sub-arena) also belong to the sub-arena */
+static int arena_owns(mem_arena *arena, const void *address) {
+	for (; arena; arena = arena->parent) {
+		if (find_slab(arena, address)) return 1;
+	}
+	return 0;
+}
+
+static arena_slab* mk_slab(size_t len) {
+	arena_slab *res = (arena_slab*)raw_alloc(NULL, SLAB_HEADER + len);
+	if (res) {
+		res->next = NULL;
+		res->pos = (char*)res + SLAB_HEADER;
+		res->end = res->pos + len;
+	}
+	return res;
+}
+
+static void* arena_alloc(mem_arena *arena, size_t len) {
+	arena_slab *slab = arena->slabs;
+	size_t block_len;
+	char *res;
+
+	if (len > ((size_t)-1) / 2) return NULL;
+	block_len = ARENA_HEADER + ARENA_ROUND(len);
+
+	if (!slab || (size_t)(slab->end - slab->pos) < block_len) {
+		if (block_len > arena->slab_len / 4) {
+			/* large blocks have a slab of their own, the first slab keeps its free space */
+			if (!(slab = mk_slab(block_len))) return NULL;
+			index_slab(arena, slab);
+			if (arena->slabs) {
+				slab->next = arena->slabs->next;
+				arena->slabs->next = slab;
+			}
+			else arena->slabs = slab;
+		}
+		else {
+			if (!(slab = mk_slab(arena->slab_len))) return NULL;
+			index_slab(arena, slab);
+			slab->next = arena->slabs;
+			arena->slabs = slab;
+			if (arena->slab_len < ARENA_MAX_SLAB) arena->slab_len *= 2;
+		}
+	}
+
+	res = slab->pos;
+	slab->pos += block_len;
+	*(size_t*)res = len;
+	return res + ARENA_HEADER;
+}
+
+/* returns 1 if `block` is the last block of the slab blocks are allocated from */
+static int is_last_block(mem_arena *arena, char *block) {
+	return arena->slabs && block + ARENA_HEADER + ARENA_ROUND(*(size_t*)block) == arena->slabs->pos;
+}
+
+int arena_keep_image(void **image) {
+	mem_arena *arena = current_arena;
+	arena_image *res;
+	if (!arena || !arena_owns(arena, (void*)image)) return 1;
+	if (!(res = (arena_image*)arena_alloc(arena, sizeof(arena_image)))) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	res->image = image;
+	res->next = arena->images;
+	arena->images = res;
+	return 1;
+}
+
+void* mem_alloc(void *address, size_t len) {
+	mem_arena *arena = current_arena;
+	char *block, *res;
+	size_t old_len;
+
+	if (!arena || (address && !arena_owns(arena, address))) {
+		return raw_alloc(address, len);
+	}
+	if (!address) {
+		return arena_suspended? raw_alloc(NULL, len): arena_alloc(arena, len);
+	}
+
+	block = (char*)address - ARENA_HEADER;
+	old_len = *(size_t*)block;
+	if (!arena_suspended && is_last_block(arena, block) && len <= ((size_t)-1) / 2 &&
+	    ARENA_HEADER + ARENA_ROUND(len) <= (size_t)(arena->slabs->end - block)) {
+		arena->slabs->pos = block + ARENA_HEADER + ARENA_ROUND(len);
+		*(size_t*)block = len;
+		return address;
+	}
+	res = arena_suspended? raw_alloc(NULL, len): arena_alloc(arena, len);
+	if (res) memcpy(res, address, old_len < len? old_len: len);
+	return res;
+}
+
+void mem_free(void *address) {
+	mem_arena *arena = current_arena;
+	char *block;
+
+	if (arena && address) {
+		if (find_slab(arena, address)) {
+			block = (char*)address - ARENA_HEADER;
+			if (is_last_block(arena, block)) arena->slabs->pos = block;
+			return;
+		}
+		if (arena_owns(arena->parent, address)) return;
+	}
+	raw_free(address);
+}
+
+/*
+	libxml allocations
+	Attribute values and hashtables of the nodes of a map are allocated with the allocator of the load (see
+	arena_libxml), libxml's own allocations use tmx_alloc_func and tmx_free_func
+*/
+
+static void* libxml_malloc(size_t len) {
+	return libxml_in_arena? mem_alloc(NULL, len): tmx_alloc_func(NULL, len);
+}
+
+static void* libxml_realloc(void *address, size_t len) {
+	return libxml_in_arena? mem_alloc(address, len): tmx_alloc_func(address, len);
+}
+
+static void libxml_free(void *address) {
+	if (libxml_in_arena) {
+		mem_free(address);
+	} else {
+		tmx_free_func(address);
+	}
+}
+
+static char* libxml_strdup(const char *str) {
+	size_t len = strlen(str) + 1;
+	char *res = (char*)libxml_malloc(len);
+	if (res) memcpy(res, str, len);
+	return res;
 }
 
 void setup_libxml_mem() {
-	xmlMemSetup((xmlFreeFunc)tmx_free_func, (xmlMallocFunc)tmx_malloc, (xmlReallocFunc)tmx_alloc_func, (xmlStrdupFunc)tmx_strdup);
+	xmlFreeFunc free_func;
+	xmlMallocFunc malloc_func;
+	xmlReallocFunc realloc_func;
+	xmlStrdupFunc strdup_func;
+	set_alloc_functions(); /* the hooks call tmx_alloc_func and tmx_free_func, resource managers may be created before any load */
+	/* libxml's globals are only written when they change, maps may be loading on other threads */
+	lock_globals();
+	if (xmlMemGet(&free_func, &malloc_func, &realloc_func, &strdup_func) != 0
+	    || free_func != (xmlFreeFunc)libxml_free || malloc_func != (xmlMallocFunc)libxml_malloc
+	    || realloc_func != (xmlReallocFunc)libxml_realloc || strdup_func != (xmlStrdupFunc)libxml_strdup) {
+		xmlMemSetup((xmlFreeFunc)libxml_free, (xmlMallocFunc)libxml_malloc, (xmlReallocFunc)libxml_realloc, (xmlStrdupFunc)libxml_strdup);
+	}
+	unlock_globals();
+	xmlInitParser(); /* must be called before readers are created on other threads */
 }
 
 static void* node_alloc(size_t size) {
-	void *res = tmx_alloc_func(NULL, size);
+	void *res = mem_alloc(NULL, size);
 	if (res) {
 		memset(res, 0, size);
 	} else {
-		tmx_errno = E_ALLOC;
+		tmx_err_code(E_ALLOC);
 	}
 	return res;
 }
@@ -80,6 +469,14 @@ tmx_layer* alloc_layer(void) {
 	return res;
 }
 
+tmx_chunk* alloc_chunk(void) {
+	return (tmx_chunk*)node_alloc(sizeof(tmx_chunk));
+}
+
+tmx_chunks* alloc_chunks(void) {
+	return (tmx_chunks*)node_alloc(sizeof(tmx_chunks));
+}
+
 tmx_tile* alloc_tiles(int count) {
 	return (tmx_tile*)node_alloc(count * sizeof(tmx_tile));
 }
@@ -99,7 +496,12 @@ tmx_template* alloc_template(void) {
 }
 
 tmx_map* alloc_map(void) {
-	return (tmx_map*)node_alloc(sizeof(tmx_map));
+	tmx_map *res = (tmx_map*)node_alloc(sizeof(tmx_map));
+	if (res && !keep_load_options(&(res->options))) {
+		mem_free(res);
+		return NULL;
+	}
+	return res;
 }
 
 resource_holder* pack_tileset_resource(tmx_tileset *value) {
@@ -120,20 +522,39 @@ resource_holder* pack_template_resource(tmx_template *value) {
 	return res;
 }
 
+resource_holder* pack_zstd_dict_resource(void *value) {
+	resource_holder *res = node_alloc(sizeof(resource_holder));
+	if (res) {
+		res->type = RC_ZDICT;
+		res->resource.zstd_dict = value;
+	}
+	return res;
+}
+
+resource_holder* pack_cache_resource(map_cache *value) {
+	resource_holder *res = node_alloc(sizeof(resource_holder));
+	if (res) {
+		res->type = RC_CACHE;
+		res->resource.cache = value;
+	}
+	return res;
+}
+
 /*
 	Node free
 */
 
 void free_property(tmx_property *p) {
 	if (p) {
-		tmx_free_func(p->name);
+		mem_free(p->name);
+		mem_free(p->propertytype);
 		if (p->type == PT_STRING || p->type == PT_FILE || p->type == PT_NONE) {
-			tmx_free_func(p->value.string);
+			mem_free(p->value.string);
 		}
 		else if (p->type == PT_CUSTOM) {
 			free_props(p->value.properties);
 		}
-		tmx_free_func(p);
+		mem_free(p);
 	}
 }
 
@@ -144,56 +565,56 @@ void free_props(tmx_properties *h) {
 void free_obj(tmx_object *o) {
 	if (o) {
 		free_obj(o->next);
-		tmx_free_func(o->name);
+		mem_free(o->name);
 		if (o->obj_type == OT_POLYGON || o->obj_type == OT_POLYLINE) {
 			if (o->content.shape) {
-				if (o->content.shape->points) {
-					tmx_free_func(*(o->content.shape->points));
-					tmx_free_func(o->content.shape->points);
-				}
-				tmx_free_func(o->content.shape);
+				/* points are allocated in the same block as their coordinates */
+				mem_free(o->content.shape->coords);
+				mem_free(o->content.shape->fcoords);
+				mem_free(o->content.shape);
 			}
 		}
 		else if (o->obj_type == OT_TEXT) {
 			if (o->content.text) {
-				if (o->content.text->fontfamily) tmx_free_func(o->content.text->fontfamily);
-				if (o->content.text->text) tmx_free_func(o->content.text->text);
-				tmx_free_func(o->content.text);
+				if (o->content.text->fontfamily) mem_free(o->content.text->fontfamily);
+				if (o->content.text->text) mem_free(o->content.text->text);
+				mem_free(o->content.text);
 			}
 		}
-		tmx_free_func(o->type);
+		mem_free(o->type);
 		free_props(o->properties);
 		if (o->template_ref && o->template_ref->is_embedded) {
 			free_template(o->template_ref);
 		}
-		tmx_free_func(o);
+		mem_free(o);
 	}
 }
 
 void free_objgr(tmx_object_group* o) {
 	if (o) {
 		free_obj(o->head);
-		tmx_free_func(o);
+		mem_free(o);
 	}
 }
 
 void free_image(tmx_image *i) {
 	if (i) {
-		tmx_free_func(i->source);
+		mem_free(i->source);
 		if (tmx_img_free_func) {
 			tmx_img_free_func(i->resource_image);
 		}
-		tmx_free_func(i);
+		mem_free(i);
 	}
 }
 
 void free_layers(tmx_layer *l) {
 	if (l) {
 		free_layers(l->next);
-		tmx_free_func(l->name);
-		if (l->class_type) tmx_free_func(l->class_type);
+		mem_free(l->name);
+		if (l->class_type) mem_free(l->class_type);
 		if (l->type == L_LAYER) {
-			tmx_free_func(l->content.gids);
+			mem_free(l->content.gids);
+			free_chunks(l->chunks);
 		}
 		else if (l->type == L_OBJGR) {
 			free_objgr(l->content.objgr);
@@ -205,7 +626,20 @@ void free_layers(tmx_layer *l) {
 			free_layers(l->content.group_head);
 		}
 		free_props(l->properties);
-		tmx_free_func(l);
+		mem_free(l);
+	}
+}
+
+void free_chunks(tmx_chunks *c) {
+	unsigned int i;
+	if (c) {
+		for (i=0; i<c->count; i++) {
+			mem_free(c->list[i]->gids);
+			mem_free(c->list[i]);
+		}
+		mem_free(c->list);
+		mem_free(c->slots);
+		mem_free(c);
 	}
 }
 
@@ -216,21 +650,21 @@ void free_tiles(tmx_tile *t, int tilecount) {
 			free_props(t[i].properties);
 			free_image(t[i].image);
 			free_obj(t[i].collision);
-			tmx_free_func(t[i].animation);
-			tmx_free_func(t[i].type);
+			mem_free(t[i].type);
 		}
 	}
 }
 
 void free_ts(tmx_tileset *ts) {
 	if (ts) {
-		tmx_free_func(ts->name);
+		mem_free(ts->name);
 		free_image(ts->image);
 		free_props(ts->properties);
 		free_tiles(ts->tiles, ts->tilecount);
-		tmx_free_func(ts->tiles);
-		if (ts->class_type) tmx_free_func(ts->class_type);
-		tmx_free_func(ts);
+		mem_free(ts->tiles);
+		mem_free(ts->frames); /* animations of the tiles */
+		if (ts->class_type) mem_free(ts->class_type);
+		mem_free(ts);
 	}
 }
 
@@ -240,8 +674,8 @@ void free_ts_list(tmx_tileset_list *tsl) {
 		if (tsl->is_embedded) {
 			free_ts(tsl->tileset);
 		}
-		tmx_free_func(tsl->source);
-		tmx_free_func(tsl);
+		mem_free(tsl->source);
+		mem_free(tsl);
 	}
 }
 
@@ -250,7 +684,7 @@ void free_template(tmx_template *tmpl) {
 		free_ts_list(tmpl->tileset_ref);
 		free_obj(tmpl->object);
 	}
-	tmx_free_func(tmpl);
+	mem_free(tmpl);
 }
 
 void property_deallocator(void *val, const char *key UNUSED) {
@@ -265,6 +699,10 @@ void resource_deallocator(void *val, const char *key UNUSED) {
 			free_ts(rc_holder->resource.tileset);
 		else if (rc_holder->type == RC_TX)
 			free_template(rc_holder->resource.template);
-		tmx_free_func(val);
+		else if (rc_holder->type == RC_ZDICT)
+			free_zstd_dict(rc_holder->resource.zstd_dict);
+		else if (rc_holder->type == RC_CACHE)
+			free_map_cache(rc_holder->resource.cache);
+		mem_free(val);
 	}
 }
@@ -0,0 +1,381 @@
+/*
+	Threads
+	Runs independent jobs (such as the decoding of layers) on a few threads,
+	the calling thread takes part in the work.
+	Without WANT_THREADS, jobs are run one after the other on the calling thread.
+	The threads allocate with the allocator of the calling thread (see
+	tmx_set_load_options), if it allocates from an arena, each thread allocates
+	from a sub-arena during the jobs (see mem_arena).
+	Also provides the threads and synchronisation used by asynchronous loads.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+#ifdef WANT_THREADS
+#if defined(WIN32) || defined(__WIN32__) || defined(_WIN32)
+#define TMX_WIN32_THREADS
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600 /* condition variables */
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#endif
+
+struct job_runner {
+	job_functor job;
+	void *userdata;
+	unsigned int job_count;
+	unsigned int next_job; /* index of the next job to run, protected by `lock` */
+	tmx_load_options options; /* of the calling thread */
+#ifdef TMX_WIN32_THREADS
+	CRITICAL_SECTION lock;
+#elif defined(WANT_THREADS)
+	pthread_mutex_t lock;
+#endif
+};
+
+struct job_worker {
+	struct job_runner *runner;
+	unsigned int index;
+	mem_arena *arena; /* sub-arena of the worker, NULL if the calling thread has no active arena */
+#ifdef TMX_WIN32_THREADS
+	HANDLE handle;
+#elif defined(WANT_THREADS)
+	pthread_t handle;
+#endif
+};
+
+unsigned int cpu_count(void) {
+#ifdef TMX_WIN32_THREADS
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0? (unsigned int)info.dwNumberOfProcessors: 1;
+#elif defined(WANT_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+	long res = sysconf(_SC_NPROCESSORS_ONLN);
+	return res > 0? (unsigned int)res: 1;
+#else
+	return 1;
+#endif
+}
+
+unsigned int thread_limit(void) {
+#ifdef WANT_THREADS
+	if (tmx_thread_count > 0) return (unsigned int)tmx_thread_count;
+	return cpu_count();
+#else
+	return 1;
+#endif
+}
+
+static unsigned int take_job(struct job_runner *runner) {
+	unsigned int res;
+#ifdef TMX_WIN32_THREADS
+	EnterCriticalSection(&(runner->lock));
+	res = runner->next_job++;
+	LeaveCriticalSection(&(runner->lock));
+#elif defined(WANT_THREADS)
+	pthread_mutex_lock(&(runner->lock));
+	res = runner->next_job++;
+	pthread_mutex_unlock(&(runner->lock));
+#else
+	res = runner->next_job++;
+#endif
+	return res;
+}
+
+static void work(struct job_worker *worker) {
+	struct job_runner *runner = worker->runner;
+	tmx_load_options options = runner->options;
+	mem_arena *prev = NULL;
+	unsigned int i;
+	swap_load_options(&options);
+	if (worker->arena) prev = arena_enter(worker->arena);
+	while ((i = take_job(runner)) < runner->job_count) {
+		runner->job(runner->userdata, i, worker->index);
+	}
+	if (worker->arena) arena_enter(prev);
+	swap_load_options(&options);
+}
+
+#ifdef TMX_WIN32_THREADS
+static DWORD WINAPI work_thread(LPVOID arg) {
+	work((struct job_worker*)arg);
+	return 0;
+}
+#elif defined(WANT_THREADS)
+static void* work_thread(void *arg) {
+	work((struct job_worker*)arg);
+	return NULL;
+}
+#endif
+
+void run_jobs(job_functor job, void *userdata, unsigned int job_count, unsigned int thread_count) {
+	struct job_runner runner;
+	struct job_worker main_worker;
+	mem_arena *arena = arena_active(), main_arena;
+#ifdef WANT_THREADS
+	struct job_worker *workers = NULL;
+	mem_arena *arenas = NULL;
+	unsigned int i, started = 0;
+#endif
+
+	runner.job = job;
+	runner.userdata = userdata;
+	runner.job_count = job_count;
+	runner.next_job = 0;
+	get_load_options(&(runner.options));
+
+	/* the arena of the calling thread is not modified while the jobs run, the workers read its slabs */
+	main_worker.runner = &runner;
+	main_worker.index = 0;
+	main_worker.arena = NULL;
+	if (arena) {
+		init_sub_arena(&main_arena, arena);
+		main_worker.arena = &main_arena;
+	}
+
+#ifdef WANT_THREADS
+#ifdef TMX_WIN32_THREADS
+	InitializeCriticalSection(&(runner.lock));
+#else
+	pthread_mutex_init(&(runner.lock), NULL);
+#endif
+
+	if (thread_count > job_count) thread_count = job_count;
+	if (thread_count > 1) {
+		/* if allocation fails, the calling thread runs all the jobs */
+		workers = (struct job_worker*)raw_alloc(NULL, (thread_count-1) * sizeof(struct job_worker));
+		if (workers && arena && !(arenas = (mem_arena*)raw_alloc(NULL, (thread_count-1) * sizeof(mem_arena)))) {
+			raw_free(workers);
+			workers = NULL;
+		}
+	}
+
+	/* a thread that could not be started leaves its share of the jobs to the others */
+	for (i=0; workers && i<thread_count-1; i++) {
+		workers[started].runner = &runner;
+		workers[started].index = started + 1;
+		workers[started].arena = NULL;
+		if (arena) {
+			init_sub_arena(arenas + started, arena);
+			workers[started].arena = arenas + started;
+		}
+#ifdef TMX_WIN32_THREADS
+		workers[started].handle = CreateThread(NULL, 0, work_thread, workers + started, 0, NULL);
+		if (workers[started].handle == NULL) break;
+#else
+		if (pthread_create(&(workers[started].handle), NULL, work_thread, workers + started) != 0) break;
+#endif
+		started++;
+	}
+
+	work(&main_worker);
+
+	for (i=0; i<started; i++) {
+#ifdef TMX_WIN32_THREADS
+		WaitForSingleObject(workers[i].handle, INFINITE);
+		CloseHandle(workers[i].handle);
+#else
+		pthread_join(workers[i].handle, NULL);
+#endif
+		if (arena) merge_sub_arena(arenas + i);
+	}
+
+#ifdef TMX_WIN32_THREADS
+	DeleteCriticalSection(&(runner.lock));
+#else
+	pthread_mutex_destroy(&(runner.lock));
+#endif
+	raw_free(workers);
+	raw_free(arenas);
+#else
+	(void)thread_count;
+	work(&main_worker);
+#endif
+	if (arena) merge_sub_arena(&main_arena);
+}
+
+/*
+	Threads and synchronisation
+*/
+
+struct _thread_sync {
+#ifdef TMX_WIN32_THREADS
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE cond;
+#elif defined(WANT_THREADS)
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#else
+	int unused;
+#endif
+};
+
+struct _thread_handle {
+	void (*func)(void *arg);
+	void *arg;
+#ifdef TMX_WIN32_THREADS
+	HANDLE handle;
+#elif defined(WANT_THREADS)
+	pthread_t handle;
+#endif
+};
+
+thread_sync* mk_thread_sync(void) {
+	thread_sync *res = (thread_sync*)raw_alloc(NULL, sizeof(thread_sync));
+	if (!res) {
+		tmx_err_code(E_ALLOC);
+		return NULL;
+	}
+#ifdef TMX_WIN32_THREADS
+	InitializeCriticalSection(&(res->lock));
+	InitializeConditionVariable(&(res->cond));
+#elif defined(WANT_THREADS)
+	if (pthread_mutex_init(&(res->lock), NULL) != 0) {
+		raw_free(res);
+		tmx_err(E_UNKN, "threads: unable to create a mutex");
+		return NULL;
+	}
+	if (pthread_cond_init(&(res->cond), NULL) != 0) {
+		pthread_mutex_destroy(&(res->lock));
+		raw_free(res);
+		tmx_err(E_UNKN, "threads: unable to create a condition variable");
+		return NULL;
+	}
+#endif
+	return res;
+}
+
+void free_thread_sync(thread_sync *sync) {
+	if (sync) {
+#ifdef TMX_WIN32_THREADS
+		DeleteCriticalSection(&(sync->lock));
+#elif defined(WANT_THREADS)
+		pthread_cond_destroy(&(sync->cond));
+		pthread_mutex_destroy(&(sync->lock));
+#endif
+		raw_free(sync);
+	}
+}
+
+void thread_sync_lock(thread_sync *sync) {
+#ifdef TMX_WIN32_THREADS
+	EnterCriticalSection(&(sync->lock));
+#elif defined(WANT_THREADS)
+	pthread_mutex_lock(&(sync->lock));
+#else
+	(void)sync;
+#endif
+}
+
+void thread_sync_unlock(thread_sync *sync) {
+#ifdef TMX_WIN32_THREADS
+	LeaveCriticalSection(&(sync->lock));
+#elif defined(WANT_THREADS)
+	pthread_mutex_unlock(&(sync->lock));
+#else
+	(void)sync;
+#endif
+}
+
+void thread_sync_wait(thread_sync *sync) {
+#ifdef TMX_WIN32_THREADS
+	SleepConditionVariableCS(&(sync->cond), &(sync->lock), INFINITE);
+#elif defined(WANT_THREADS)
+	pthread_cond_wait(&(sync->cond), &(sync->lock));
+#else
+	(void)sync;
+#endif
+}
+
+void thread_sync_broadcast(thread_sync *sync) {
+#ifdef TMX_WIN32_THREADS
+	WakeAllConditionVariable(&(sync->cond));
+#elif defined(WANT_THREADS)
+	pthread_cond_broadcast(&(sync->cond));
+#else
+	(void)sync;
+#endif
+}
+
+/* the first loads may run on several threads at once, they all set the defaults of the globals */
+#ifdef TMX_WIN32_THREADS
+static SRWLOCK globals_lock = SRWLOCK_INIT;
+#elif defined(WANT_THREADS)
+static pthread_mutex_t globals_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void lock_globals(void) {
+#ifdef TMX_WIN32_THREADS
+	AcquireSRWLockExclusive(&globals_lock);
+#elif defined(WANT_THREADS)
+	pthread_mutex_lock(&globals_lock);
+#endif
+}
+
+void unlock_globals(void) {
+#ifdef TMX_WIN32_THREADS
+	ReleaseSRWLockExclusive(&globals_lock);
+#elif defined(WANT_THREADS)
+	pthread_mutex_unlock(&globals_lock);
+#endif
+}
+
+#ifdef TMX_WIN32_THREADS
+static DWORD WINAPI start_thread_func(LPVOID arg) {
+	thread_handle *thread = (thread_handle*)arg;
+	thread->func(thread->arg);
+	return 0;
+}
+#elif defined(WANT_THREADS)
+static void* start_thread_func(void *arg) {
+	thread_handle *thread = (thread_handle*)arg;
+	thread->func(thread->arg);
+	return NULL;
+}
+#endif
+
+thread_handle* start_thread(void (*func)(void *arg), void *arg) {
+	thread_handle *res = (thread_handle*)raw_alloc(NULL, sizeof(thread_handle));
+	if (!res) {
+		tmx_err_code(E_ALLOC);
+		return NULL;
+	}
+	res->func = func;
+	res->arg = arg;
+#ifdef TMX_WIN32_THREADS
+	if ((res->handle = CreateThread(NULL, 0, start_thread_func, res, 0, NULL)) == NULL) {
+		raw_free(res);
+		tmx_err(E_UNKN, "threads: unable to start a thread");
+		return NULL;
+	}
+#elif defined(WANT_THREADS)
+	if (pthread_create(&(res->handle), NULL, start_thread_func, res) != 0) {
+		raw_free(res);
+		tmx_err(E_UNKN, "threads: unable to start a thread");
+		return NULL;
+	}
+#else
+	func(arg);
+#endif
+	return res;
+}
+
+void join_thread(thread_handle *thread) {
+	if (thread) {
+#ifdef TMX_WIN32_THREADS
+		WaitForSingleObject(thread->handle, INFINITE);
+		CloseHandle(thread->handle);
+#elif defined(WANT_THREADS)
+		pthread_join(thread->handle, NULL);
+#endif
+		raw_free(thread);
+	}
+}
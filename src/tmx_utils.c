@@ -27,9 +27,9 @@ char* b64_encode(const char *source, unsigned int length) {
 		mlen += 4;
 	}
 
-	res = (char*) tmx_alloc_func(NULL, mlen);
+	res = (char*) raw_alloc(NULL, mlen);
 	if (!res) {
-		tmx_errno = E_ALLOC;
+		tmx_err_code(E_ALLOC);
 		return NULL;
 	}
 	res[mlen-1] = '\0';
@@ -63,251 +63,1410 @@ char* b64_encode(const char *source, unsigned int length) {
 	return res;
 }
 
-static char b64_value(char c) {
-	if (c>='A' && c<='Z') {
-		return c - 'A';
-	} else if (c>='a' && c<='z') {
-		return c - 'a' + 26;
-	} else if (c>='0' && c<='9') {
-		return c - '0' + 52;
-	} else if (c=='+') {
-		return 62;
-	} else if (c=='/') {
-		return 63;
-	} else if (c=='=') {
-		return 0;
+/* decoding table, 0xFF marks chars that are not part of the base64 alphabet */
+static const unsigned char b64dec[256] = {
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,  62,0xFF,0xFF,0xFF,  63,
+	  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+	  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+	  41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
+	0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF
+};
+
+/* Scalar decoder, decodes complete quads only (no padding)
+   returns the number of consumed chars, stops at the first invalid char */
+static size_t b64_decode_scalar(const unsigned char *src, size_t src_len, unsigned char *dest) {
+	size_t i;
+	uint32_t a, b, c, d;
+
+	for (i=0; i+4<=src_len; i+=4) {
+		a = b64dec[src[i]];
+		b = b64dec[src[i+1]];
+		c = b64dec[src[i+2]];
+		d = b64dec[src[i+3]];
+		if ((a | b | c | d) & 0x80u) break;
+		a = a << 18u | b << 12u | c << 6u | d;
+		*dest++ = (unsigned char)(a >> 16);
+		*dest++ = (unsigned char)(a >>  8);
+		*dest++ = (unsigned char)(a);
+	}
+	return i;
+}
+
+typedef size_t (*b64_block_decoder)(const unsigned char *src, size_t src_len, unsigned char *dest);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TMX_B64_SIMD
+#include <immintrin.h>
+
+/* Vectorized decoders, see http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html
+   Each iteration reads 16 (SSE) or 32 (AVX2) chars and stores 16 or 32 bytes of which only
+   12 or 24 are meaningful: the caller must leave enough chars (see b64_simd_decoder) to
+   the scalar decoder so these extra bytes are overwritten and never written past `dest`.
+   Returns the number of consumed chars, the remains are left to the scalar decoder. */
+
+__attribute__((target("sse4.1")))
+static size_t b64_decode_sse41(const unsigned char *src, size_t src_len, unsigned char *dest) {
+	size_t i = 0;
+	__m128i in, hi_nibbles, lo_nibbles, lo, hi, roll, eq_2F, merged;
+	const __m128i lut_lo   = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                                       0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi   = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                                       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i pack     = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m128i nibble   = _mm_set1_epi8(0x0F);
+	const __m128i slash    = _mm_set1_epi8(0x2F);
+
+	for (; i+16<=src_len; i+=16, dest+=12) {
+		in = _mm_loadu_si128((const __m128i*)(src+i));
+		hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+		lo_nibbles = _mm_and_si128(in, nibble);
+		lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		if (!_mm_testz_si128(lo, hi)) break; /* invalid char in this block */
+
+		eq_2F = _mm_cmpeq_epi8(in, slash);
+		roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2F, hi_nibbles));
+		in = _mm_add_epi8(in, roll);
+
+		merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+		merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((__m128i*)dest, _mm_shuffle_epi8(merged, pack));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t b64_decode_avx2(const unsigned char *src, size_t src_len, unsigned char *dest) {
+	size_t i = 0;
+	__m256i in, hi_nibbles, lo_nibbles, lo, hi, roll, eq_2F, merged;
+	const __m256i lut_lo   = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                                          0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+	                                          0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                                          0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi   = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                                          0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	                                          0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                                          0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                          0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack     = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+	                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i lanes    = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+	const __m256i nibble   = _mm256_set1_epi8(0x0F);
+	const __m256i slash    = _mm256_set1_epi8(0x2F);
+
+	for (; i+32<=src_len; i+=32, dest+=24) {
+		in = _mm256_loadu_si256((const __m256i*)(src+i));
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), nibble);
+		lo_nibbles = _mm256_and_si256(in, nibble);
+		lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		if (!_mm256_testz_si256(lo, hi)) break; /* invalid char in this block */
+
+		eq_2F = _mm256_cmpeq_epi8(in, slash);
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2F, hi_nibbles));
+		in = _mm256_add_epi8(in, roll);
+
+		merged = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+		merged = _mm256_shuffle_epi8(merged, pack);
+		_mm256_storeu_si256((__m256i*)dest, _mm256_permutevar8x32_epi32(merged, lanes));
+	}
+	return i;
+}
+
+static size_t b64_decode_none(const unsigned char *src UNUSED, size_t src_len UNUSED, unsigned char *dest UNUSED) {
+	return 0;
+}
+
+struct b64_simd {
+	b64_block_decoder decode;
+	size_t tail; /* number of trailing chars that must be left to the scalar decoder */
+};
+
+static const struct b64_simd b64_avx2 = {b64_decode_avx2, 16}; /* at least 10 bytes, 8 needed */
+static const struct b64_simd b64_sse41 = {b64_decode_sse41, 8}; /* at least 4 bytes, 4 needed */
+static const struct b64_simd b64_none = {b64_decode_none, 0};
+
+/* Selects the best decoder supported by the CPU, once
+   the choice is shared under lock_globals, each thread keeps a copy: no lock per block */
+static b64_block_decoder b64_simd_decoder(size_t *tail) {
+	static const struct b64_simd *selected = NULL;
+	static TMX_THREAD_LOCAL const struct b64_simd *thread_selected = NULL;
+	if (!thread_selected) {
+		lock_globals();
+		if (!selected) {
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2")) selected = &b64_avx2;
+			else if (__builtin_cpu_supports("sse4.1")) selected = &b64_sse41;
+			else selected = &b64_none;
+		}
+		thread_selected = selected;
+		unlock_globals();
 	}
-	return -1;
+	*tail = thread_selected->tail;
+	return thread_selected->decode;
 }
 
-char* b64_decode(const char *source, unsigned int *rlength) { /* NULL terminated string */
-	char *res, v;
-	short j;
-	unsigned int i;
-	unsigned int in = 0;
-	unsigned int src_len = (unsigned int)(strlen(source));
+#endif /* x86 SIMD */
 
-	if (!source) {
-		tmx_err(E_INVAL, "Base64: invalid argument: source is NULL");
-		return NULL;
+/* Returns the length of the decoded data for a base64 string of length `src_len` */
+size_t b64_decoded_len(const char *source, size_t src_len) {
+	size_t res = (src_len/4)*3;
+	if (src_len >= 4) {
+		if (source[src_len-1] == '=') res--;
+		if (source[src_len-2] == '=') res--;
+	}
+	return res;
+}
+
+/* Decodes `src_len` chars from `source` in the `dest` buffer
+   `dest` must be at least b64_decoded_len(source, src_len) long
+   returns 1 on success, 0 on failure and sets tmx_errno */
+int b64_decode_to(const char *source, size_t src_len, char *dest) {
+	const unsigned char *src = (const unsigned char*)source;
+	unsigned char *out = (unsigned char*)dest;
+	unsigned char last[3];
+	size_t body_len, i = 0, j, r;
+	uint32_t in;
+#ifdef TMX_B64_SIMD
+	b64_block_decoder simd;
+	size_t tail;
+#endif
+
+	if (!source || !dest) {
+		tmx_err(E_INVAL, "Base64: invalid argument: source or dest is NULL");
+		return 0;
 	}
 
 	if (src_len%4) {
 		tmx_err(E_BDATA, "Base64: invalid source");
-		return NULL; /* invalid source */
+		return 0; /* invalid source */
 	}
+	if (src_len == 0) return 1;
 
-	*rlength = (src_len/4)*3;
-	res = (char*) tmx_alloc_func(NULL, *rlength);
-	if (!res) {
-		tmx_errno = E_ALLOC;
-		return NULL;
+	/* the last quad may contain padding, it is decoded separately */
+	body_len = src_len - 4;
+
+#ifdef TMX_B64_SIMD
+	simd = b64_simd_decoder(&tail);
+	if (src_len > tail) {
+		i = simd(src, src_len - tail, out);
 	}
+	out += (i/4)*3;
+#endif
 
-	for (i=0; i<src_len; i+=4) {
-		in = 0;
+	r = b64_decode_scalar(src+i, body_len-i, out);
+	out += (r/4)*3;
+	i += r;
+	if (i != body_len) goto invalid;
 
-		for (j=0; j<4; j++) {
-			v = b64_value(source[i+j]);
-			if (v == -1) {
-				tmx_err(E_BDATA, "Base64: invalid char '%c' in source", source[i+j]);
-				goto cleanup;
-			}
-			in = in << 6u;
-			in += v; /* add 6b */
-		}
-		for (j=0; j<3; j++) {
-			memcpy(res+(i/4)*3+j, ((char*)&in)+2-j, 1); /* copy 3 bytes in reverse order */
+	/* last quad */
+	for (j=0, in=0; j<4; j++) {
+		r = b64dec[src[i+j]];
+		if (r & 0x80u) {
+			/* padding only allowed in the last two positions */
+			if (src[i+j] != '=' || j < 2 || (j == 2 && src[i+3] != '=')) goto invalid;
+			r = 0;
 		}
+		in = in << 6u | (uint32_t)r;
 	}
+	last[0] = (unsigned char)(in >> 16);
+	last[1] = (unsigned char)(in >>  8);
+	last[2] = (unsigned char)(in);
+	memcpy(out, last, b64_decoded_len(source + i, 4));
 
-	if (source[src_len-1] == '=') {
-		(*rlength)--;
-	}
-	if (source[src_len-2] == '=') {
-		(*rlength)--;
+	return 1;
+
+invalid:
+	/* locate the first invalid char to report it */
+	for (; i<src_len && b64dec[src[i]] != 0xFF; i++);
+	tmx_err(E_BDATA, "Base64: invalid char '%c' in source", i<src_len? source[i]: '=');
+	return 0;
+}
+
+/* Decodes the part of a base64 payload at `pos`, like b64_decode_to
+   padding is only allowed at the end of the whole payload (`pos + len == src_len`) */
+static int b64_decode_part(const char *source, size_t pos, size_t len, size_t src_len, char *dest) {
+	if (pos + len < src_len && len >= 4 && source[pos+len-1] == '=') {
+		tmx_err(E_BDATA, "Base64: invalid char '=' in source");
+		return 0;
 	}
+	return b64_decode_to(source + pos, len, dest);
+}
 
-	return res;
+/*
+	Regions
+	Layers loaded with tmx_load_region are decoded in order, the cells in the
+	region are copied to its gid array as they come, the rest is dropped.
+*/
 
-cleanup:
-	tmx_free_func(res);
-	return NULL;
+struct region_sink {
+	const data_region *region;
+	uint32_t *gids;    /* region->width * region->height cells */
+	size_t col_begin;  /* columns of the layer in the region */
+	size_t col_end;
+	size_t pos;        /* index in the layer of the next cell */
+	size_t end;        /* index in the layer of the cell after the last cell in the region, 0 if none */
+};
+
+static void init_region_sink(struct region_sink *sink, const data_region *region, uint32_t *gids) {
+	long row_begin = region->y > 0? region->y: 0;
+	long row_end = (long)region->y + region->height;
+	long col_begin = region->x > 0? region->x: 0;
+	long col_end = (long)region->x + region->width;
+
+	if (row_end > region->src_height) row_end = region->src_height;
+	if (col_end > region->src_width) col_end = region->src_width;
+
+	sink->region = region;
+	sink->gids = gids;
+	sink->pos = 0;
+	sink->end = 0;
+	sink->col_begin = sink->col_end = 0;
+	if (row_begin < row_end && col_begin < col_end) {
+		sink->col_begin = (size_t)col_begin;
+		sink->col_end = (size_t)col_end;
+		sink->end = (size_t)(row_end-1) * (size_t)region->src_width + sink->col_end;
+	}
+}
+
+/* Copies the cells in the region from the `count` next cells of the layer (`cells` may be unaligned)
+   returns 0 once the last cell of the region has been copied */
+static int region_sink_put(struct region_sink *sink, const char *cells, size_t count) {
+	const data_region *region = sink->region;
+	size_t row, col, n, from, to;
+
+	while (count > 0 && sink->pos < sink->end) {
+		row = sink->pos / (size_t)region->src_width;
+		col = sink->pos % (size_t)region->src_width;
+		n = (size_t)region->src_width - col; /* rest of the row */
+		if (n > count) n = count;
+
+		from = col > sink->col_begin? col: sink->col_begin;
+		to = col+n < sink->col_end? col+n: sink->col_end;
+		if ((long)row >= region->y && from < to) {
+			memcpy(sink->gids + (size_t)((long)row - region->y) * (size_t)region->width + (size_t)((long)from - region->x),
+			       cells + (from - col) * sizeof(uint32_t), (to - from) * sizeof(uint32_t));
+		}
+		sink->pos += n;
+		cells += n * sizeof(uint32_t);
+		count -= n;
+	}
+	return sink->pos < sink->end;
 }
 
 /*
-	ZLib
+	Decompression
+	The base64 payload is decoded by blocks of B64_BLOCK_LEN chars that are
+	fed to the decompressor, which writes directly in the gid array.
+	For regions (`sink` is not NULL), `dest` is a buffer of REGION_BUFFER_LEN
+	bytes, it is handed to the sink every time it is full.
+	Decompression contexts are held by a data_decoder, they are created on
+	first use and reused for all the layers decoded with the same decoder.
 */
 
-#ifdef WANT_ZLIB
-#include <zlib.h>
+#define B64_BLOCK_LEN 16384 /* must be a multiple of 4 */
+#define REGION_BUFFER_LEN 65536 /* must be a multiple of 4 */
 
-void* z_alloc(void *opaque UNUSED, unsigned int items, unsigned int size) {
-	return tmx_alloc_func(NULL, items *size);
+#ifdef WANT_LIBDEFLATE
+#include <libdeflate.h>
+#elif defined(WANT_ZLIB)
+#include <zlib.h>
+#endif
+#ifdef WANT_ZSTD
+#include <zstd.h>
+#endif
+
+struct _data_decoder {
+#ifdef WANT_LIBDEFLATE
+	struct libdeflate_decompressor *deflate;
+	char *buffer; /* the whole compressed payload, libdeflate does not stream */
+	size_t buffer_len;
+#elif defined(WANT_ZLIB)
+	int zstrm_ready;
+	z_stream zstrm;
+#endif
+#ifdef WANT_ZSTD
+	ZSTD_DCtx *zstd;
+	tmx_resource_manager *rc_mgr; /* to lookup dictionaries, may be NULL */
+	ZSTD_DDict *map_dict; /* referenced by the map, used for frames without dictionary ID */
+	int owns_map_dict;
+	ZSTD_DDict *last_dict; /* last dictionary found by ID */
+#endif
+	int layer_count; /* number of decoded layers */
+	unsigned int thread_limit;
+	int lazy; /* payloads are decoded on first access (tmx_layer_gids), not by data_decoder_finish */
+	unsigned int lazy_hint; /* where the next lookup of a lazy payload starts */
+	struct decode_job *jobs; /* deferred payloads */
+	unsigned int jobs_len, jobs_cap;
+	size_t jobs_src_len; /* total length of the deferred payloads */
+};
+
+/* a payload to decode once the whole document has been parsed */
+struct decode_job {
+	char *source; /* copy of the payload */
+	size_t src_len;
+	enum enccmp_t type;
+	size_t gids_count;
+	uint32_t **gids;
+	error_state err; /* error raised by the thread that decoded it */
+};
+
+data_decoder* mk_data_decoder(tmx_resource_manager *rc_mgr UNUSED) {
+	data_decoder *res = (data_decoder*)raw_alloc(NULL, sizeof(data_decoder));
+	if (res) {
+		memset(res, 0, sizeof(data_decoder));
+#ifdef WANT_ZSTD
+		res->rc_mgr = rc_mgr;
+#endif
+		res->thread_limit = thread_limit();
+		res->lazy = tmx_lazy_decoding;
+	} else {
+		tmx_err_code(E_ALLOC);
+	}
+	return res;
 }
 
-void z_free(void *opaque UNUSED, void *address) {
-	tmx_free_func(address);
+void free_data_decoder(data_decoder *decoder) {
+	unsigned int i;
+	if (decoder) {
+		for (i=0; i<decoder->jobs_len; i++) {
+			raw_free(decoder->jobs[i].source);
+		}
+		raw_free(decoder->jobs);
+#ifdef WANT_LIBDEFLATE
+		if (decoder->deflate) libdeflate_free_decompressor(decoder->deflate);
+		raw_free(decoder->buffer);
+#elif defined(WANT_ZLIB)
+		if (decoder->zstrm_ready) inflateEnd(&(decoder->zstrm));
+#endif
+#ifdef WANT_ZSTD
+		if (decoder->zstd) ZSTD_freeDCtx(decoder->zstd);
+		if (decoder->owns_map_dict) ZSTD_freeDDict(decoder->map_dict);
+#endif
+		raw_free(decoder);
+	}
 }
 
-char* zlib_decompress(const char *source, unsigned int slength, unsigned int rlength) {
-	int ret;
-	char *res = NULL;
-	z_stream strm;
+#ifdef WANT_LIBDEFLATE
+
+/* libdeflate only decompresses whole buffers: decodes the base64 `source` in a
+   buffer reused across layers, then decompresses it straight into `dest`
+   regions are decompressed whole in a temporary buffer */
+static int zlib_decompress(data_decoder *decoder, const char *source, size_t src_len, char *dest, unsigned int rlength, struct region_sink *sink) {
+	enum libdeflate_result ret;
+	size_t len, out_len;
+	char *buffer;
+	int res;
+
+	if (sink) {
+		rlength = (unsigned int)((size_t)sink->region->src_width * (size_t)sink->region->src_height * sizeof(uint32_t));
+		if (!(buffer = (char*)raw_alloc(NULL, rlength))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+		if ((res = zlib_decompress(decoder, source, src_len, buffer, rlength, NULL))) {
+			region_sink_put(sink, buffer, rlength / sizeof(uint32_t));
+		}
+		raw_free(buffer);
+		return res;
+	}
 
-	if (!source) {
-		tmx_err(E_INVAL, "zlib_decompress: invalid argument: source is NULL");
-		return NULL;
+	if (!(decoder->deflate)) {
+		if (!(decoder->deflate = libdeflate_alloc_decompressor())) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
 	}
 
-	strm.zalloc = z_alloc;
-	strm.zfree = z_free;
-	strm.opaque = Z_NULL;
-	strm.next_in = (Bytef*)source;
-	strm.avail_in = slength;
+	len = b64_decoded_len(source, src_len);
+	if (len > decoder->buffer_len) {
+		if (!(buffer = (char*)raw_alloc(decoder->buffer, len))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+		decoder->buffer = buffer;
+		decoder->buffer_len = len;
+	}
+	if (!b64_decode_to(source, src_len, decoder->buffer)) return 0;
 
-	res = (char*) tmx_alloc_func(NULL, rlength);
-	if (!res) {
-		tmx_errno = E_ALLOC;
-		return NULL;
+	/* gzip streams start with the 1F 8B magic number, zlib streams never do */
+	if (len >= 2 && (unsigned char)decoder->buffer[0] == 0x1F && (unsigned char)decoder->buffer[1] == 0x8B) {
+		ret = libdeflate_gzip_decompress(decoder->deflate, decoder->buffer, len, dest, rlength, &out_len);
+	} else {
+		ret = libdeflate_zlib_decompress(decoder->deflate, decoder->buffer, len, dest, rlength, &out_len);
+	}
+
+	if (ret == LIBDEFLATE_INSUFFICIENT_SPACE) {
+		tmx_err(E_ZDATA, "layer contains too many tiles");
+		return 0;
+	}
+	if (ret != LIBDEFLATE_SUCCESS) {
+		tmx_err(E_ZDATA, "zlib_decompress: libdeflate returned %d\n", (int)ret);
+		return 0;
+	}
+	if (out_len != rlength) {
+		tmx_err(E_ZDATA, "layer contains not enough tiles");
+		return 0;
 	}
 
-	strm.next_out = (Bytef*)res;
-	strm.avail_out = rlength;
+	return 1;
+}
+
+#elif defined(WANT_ZLIB)
+
+void* z_alloc(void *opaque UNUSED, unsigned int items, unsigned int size) {
+	return raw_alloc(NULL, items *size);
+}
 
-	/* 15+32 to enable zlib and gzip decoding with automatic header detection */
-	if ((ret=inflateInit2(&strm, 15 + 32)) != Z_OK) {
-		tmx_err(E_UNKN, "zlib_decompress: inflateInit2 returned %d\n", ret);
-		goto cleanup;
+void z_free(void *opaque UNUSED, void *address) {
+	raw_free(address);
+}
+
+/* Decodes the base64 `source` by blocks and inflates each block straight into `dest` */
+static int zlib_decompress(data_decoder *decoder, const char *source, size_t src_len, char *dest, unsigned int rlength, struct region_sink *sink) {
+	int ret = Z_OK;
+	size_t pos, len;
+	z_stream *strm = &(decoder->zstrm);
+	char block[B64_BLOCK_LEN/4*3];
+
+	strm->next_in = Z_NULL;
+	strm->avail_in = 0;
+
+	if (!(decoder->zstrm_ready)) {
+		strm->zalloc = z_alloc;
+		strm->zfree = z_free;
+		strm->opaque = Z_NULL;
+		/* 15+32 to enable zlib and gzip decoding with automatic header detection */
+		if ((ret=inflateInit2(strm, 15 + 32)) != Z_OK) {
+			tmx_err(E_UNKN, "zlib_decompress: inflateInit2 returned %d\n", ret);
+			return 0;
+		}
+		decoder->zstrm_ready = 1;
 	}
+	else if ((ret=inflateReset(strm)) != Z_OK) {
+		tmx_err(E_UNKN, "zlib_decompress: inflateReset returned %d\n", ret);
+		return 0;
+	}
+
+	strm->next_out = (Bytef*)dest;
+	strm->avail_out = rlength;
 
-	ret = inflate(&strm, Z_FINISH);
-	inflateEnd(&strm);
+	for (pos=0; pos<src_len && ret!=Z_STREAM_END; pos+=len) {
+		len = src_len-pos < B64_BLOCK_LEN? src_len-pos: B64_BLOCK_LEN;
+		if (!b64_decode_part(source, pos, len, src_len, block)) return 0;
+		strm->next_in = (Bytef*)block;
+		strm->avail_in = (uInt)b64_decoded_len(source+pos, len);
 
-	if (ret != Z_OK && ret != Z_STREAM_END) {
-		tmx_err(E_ZDATA, "zlib_decompress: inflate returned %d\n", ret);
-		goto cleanup;
+		for (;;) {
+			ret = inflate(strm, Z_NO_FLUSH);
+			if (ret == Z_BUF_ERROR && sink && strm->avail_in == 0) break; /* no pending output */
+			if (ret == Z_BUF_ERROR && strm->avail_out == 0) {
+				/* `dest` was filled by a previous block, the stream has not ended */
+				tmx_err(E_ZDATA, "layer contains too many tiles");
+				return 0;
+			}
+			if (ret != Z_OK && ret != Z_STREAM_END) {
+				tmx_err(E_ZDATA, "zlib_decompress: inflate returned %d\n", ret);
+				return 0;
+			}
+			if (!sink || strm->avail_out != 0 || ret == Z_STREAM_END) break;
+			/* the buffer is full, inflate may have more output for it */
+			if (!region_sink_put(sink, dest, rlength / sizeof(uint32_t))) return 1; /* the rest is out of the region */
+			strm->next_out = (Bytef*)dest;
+			strm->avail_out = rlength;
+		}
+		if (ret != Z_STREAM_END && strm->avail_in != 0) {
+			/* `dest` is full but the stream has not ended */
+			tmx_err(E_ZDATA, "layer contains too many tiles");
+			return 0;
+		}
 	}
 
-	if (strm.avail_out != 0) {
+	if (sink) {
+		if (region_sink_put(sink, dest, (rlength - strm->avail_out) / sizeof(uint32_t))) {
+			tmx_err(E_ZDATA, "layer contains not enough tiles");
+			return 0;
+		}
+		return 1;
+	}
+	if (strm->avail_out != 0) {
 		tmx_err(E_ZDATA, "layer contains not enough tiles");
-		goto cleanup;
+		return 0;
 	}
-	if (strm.avail_in != 0) {
-		/* FIXME There is remains in the source */
+	if (ret != Z_STREAM_END) {
+		tmx_err(E_ZDATA, "zlib_decompress: truncated layer data");
+		return 0;
 	}
 
-	return res;
-cleanup:
-	tmx_free_func(res);
-	return NULL;
+	return 1;
 }
 
 #else
 
-char* zlib_decompress(UNUSED const char *source, UNUSED unsigned int slength, UNUSED unsigned int rlength) {
+static int zlib_decompress(data_decoder *decoder UNUSED, const char *source UNUSED, size_t src_len UNUSED, char *dest UNUSED, unsigned int rlength UNUSED, struct region_sink *sink UNUSED) {
 	tmx_err(E_FONCT, "This library was not built with the zlib/gzip support");
-	return NULL;
+	return 0;
 }
 
-#endif /* WANT_ZLIB */
+#endif /* WANT_LIBDEFLATE, WANT_ZLIB */
 
 #ifdef WANT_ZSTD
 
-#include <zstd.h>
+/*
+	zstd dictionaries
+	Dictionaries are matched to frames by their dictionary ID, they are looked
+	up in the map's dictionary, in the Resource Manager, then in the registry.
+	A DDict is read-only once created, it is shared by all the decoders.
+*/
 
-char* zstd_decompress(const char *source, unsigned int slength, unsigned int rlength) {
-	char *res;
-	size_t ret;
+static void *zstd_dict_registry = NULL; /* hashtable of resource_holder, the key is the dictionary ID */
 
-	if (!source) {
-		tmx_err(E_INVAL, "zstd_decompress: invalid argument: source is NULL");
-		return NULL;
+void* mk_zstd_dict(const char *buffer, size_t len) {
+	ZSTD_DDict *res = ZSTD_createDDict(buffer, len);
+	if (!res) {
+		tmx_err(E_ZSDATA, "zstd: invalid dictionary");
 	}
+	return (void*)res;
+}
 
-	res = (char*) tmx_alloc_func(NULL, rlength);
-	if (!res) {
-		tmx_errno = E_ALLOC;
-		return NULL;
+void free_zstd_dict(void *dict) {
+	ZSTD_freeDDict((ZSTD_DDict*)dict);
+}
+
+/* the registry is global, it is allocated with tmx_alloc_func whatever the allocator of the calling thread */
+int register_zstd_dict(void *dict) {
+	tmx_load_options options;
+	char key[16];
+	int res = 0;
+	if (!dict) return 0;
+	memset(&options, 0, sizeof(tmx_load_options));
+	swap_load_options(&options);
+	if (!zstd_dict_registry && !(zstd_dict_registry = mk_hashtable(5))) {
+		free_zstd_dict(dict);
+		tmx_err_code(E_ALLOC);
+	} else {
+		sprintf(key, "%u", ZSTD_getDictID_fromDDict((ZSTD_DDict*)dict));
+		res = add_zstd_dict(zstd_dict_registry, key, dict);
+	}
+	swap_load_options(&options);
+	return res;
+}
+
+void free_zstd_dict_registry(void) {
+	tmx_load_options options;
+	if (zstd_dict_registry) {
+		memset(&options, 0, sizeof(tmx_load_options));
+		swap_load_options(&options);
+		free_hashtable(zstd_dict_registry, resource_deallocator);
+		zstd_dict_registry = NULL;
+		swap_load_options(&options);
+	}
+}
+
+struct zstd_dict_search {
+	unsigned int id;
+	ZSTD_DDict *res;
+};
+
+static void zstd_dict_search_functor(void *val, void *userdata, const char *key UNUSED) {
+	resource_holder *rc_holder = (resource_holder*)val;
+	struct zstd_dict_search *search = (struct zstd_dict_search*)userdata;
+	if (!(search->res) && rc_holder->type == RC_ZDICT &&
+	    ZSTD_getDictID_fromDDict((ZSTD_DDict*)rc_holder->resource.zstd_dict) == search->id) {
+		search->res = (ZSTD_DDict*)rc_holder->resource.zstd_dict;
+	}
+}
+
+static ZSTD_DDict* find_zstd_dict(data_decoder *decoder, unsigned int id) {
+	struct zstd_dict_search search;
+	char key[16];
+	resource_holder *rc_holder;
+
+	if (decoder->map_dict && ZSTD_getDictID_fromDDict(decoder->map_dict) == id) return decoder->map_dict;
+	if (decoder->last_dict && ZSTD_getDictID_fromDDict(decoder->last_dict) == id) return decoder->last_dict;
+
+	search.id = id;
+	search.res = NULL;
+	if (decoder->rc_mgr) {
+		hashtable_foreach(decoder->rc_mgr, zstd_dict_search_functor, &search);
 	}
+	if (!(search.res) && zstd_dict_registry) {
+		sprintf(key, "%u", id);
+		if ((rc_holder = (resource_holder*)hashtable_get(zstd_dict_registry, key))) {
+			search.res = (ZSTD_DDict*)rc_holder->resource.zstd_dict;
+		}
+	}
+	if (search.res) decoder->last_dict = search.res;
+	return search.res;
+}
 
-	ret = ZSTD_decompress(res, rlength, source, slength);
+/* References the dictionary needed by the frame starting in `block` (if any) */
+static int zstd_ref_dict(data_decoder *decoder, const char *block, size_t len) {
+	ZSTD_DDict *dict = NULL;
+	size_t ret;
+	unsigned int id = ZSTD_getDictID_fromFrame(block, len);
 
+	if (id == 0) {
+		dict = decoder->map_dict;
+	}
+	else if (!(dict = find_zstd_dict(decoder, id))) {
+		tmx_err(E_ZSDATA, "zstd_decompress: dictionary %u not found", id);
+		return 0;
+	}
+	ret = ZSTD_DCtx_refDDict(decoder->zstd, dict); /* NULL: no dictionary */
 	if (ZSTD_isError(ret)) {
-		tmx_err(E_ZSDATA, "zstd_decompress: %s\n", ZSTD_getErrorName(ret));
-		goto cleanup;
+		tmx_err(E_ZSDATA, "zstd_decompress: %s", ZSTD_getErrorName(ret));
+		return 0;
 	}
-	if (ret < rlength) {
+	return 1;
+}
+
+/* Loads the dictionary referenced by a map, `rel_path` is its key in the Resource Manager */
+int data_decoder_load_zstd_dict(data_decoder *decoder, const char *base_path, const char *rel_path) {
+	resource_holder *rc_holder;
+	ZSTD_DDict *dict;
+	char *ab_path;
+
+	if (decoder->owns_map_dict) {
+		ZSTD_freeDDict(decoder->map_dict);
+		decoder->owns_map_dict = 0;
+	}
+	decoder->map_dict = NULL;
+
+	if (decoder->rc_mgr) {
+		rc_holder = (resource_holder*)hashtable_get(decoder->rc_mgr, rel_path);
+		if (rc_holder && rc_holder->type == RC_ZDICT) {
+			decoder->map_dict = (ZSTD_DDict*)rc_holder->resource.zstd_dict;
+			return 1;
+		}
+	}
+
+	if (!(ab_path = mk_absolute_path(base_path, rel_path))) return 0;
+	dict = (ZSTD_DDict*)load_zstd_dict(ab_path);
+	mem_free(ab_path);
+	if (!dict) return 0;
+
+	if (decoder->rc_mgr) {
+		if (!add_zstd_dict(decoder->rc_mgr, rel_path, dict)) return 0;
+	}
+	else {
+		decoder->owns_map_dict = 1;
+	}
+	decoder->map_dict = dict;
+	return 1;
+}
+
+/* Decodes the base64 `source` by blocks and decompresses each block straight into `dest` */
+static int zstd_decompress(data_decoder *decoder, const char *source, size_t src_len, char *dest, unsigned int rlength, struct region_sink *sink) {
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t ret = 1, pos, len, in_pos, out_pos;
+	char block[B64_BLOCK_LEN/4*3];
+	int flushed = 0;
+
+	if (!(decoder->zstd)) {
+		if (!(decoder->zstd = ZSTD_createDCtx())) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+	}
+	else {
+		ZSTD_DCtx_reset(decoder->zstd, ZSTD_reset_session_only);
+	}
+
+	out.dst = dest;
+	out.size = rlength;
+	out.pos = 0;
+
+	for (pos=0; pos<src_len && ret!=0; pos+=len) {
+		len = src_len-pos < B64_BLOCK_LEN? src_len-pos: B64_BLOCK_LEN;
+		if (!b64_decode_part(source, pos, len, src_len, block)) return 0;
+		in.src = block;
+		in.size = b64_decoded_len(source+pos, len);
+		in.pos = 0;
+		if (pos == 0 && !zstd_ref_dict(decoder, block, in.size)) return 0;
+
+		while ((in.pos < in.size || flushed) && ret != 0) {
+			in_pos = in.pos;
+			out_pos = out.pos;
+			ret = ZSTD_decompressStream(decoder->zstd, &out, &in);
+			if (ZSTD_isError(ret)) {
+				tmx_err(E_ZSDATA, "zstd_decompress: %s\n", ZSTD_getErrorName(ret));
+				return 0;
+			}
+			if (in.pos == in_pos && out.pos == out_pos) {
+				if (sink) break; /* no pending output */
+				/* `dest` is full but the frame has not ended */
+				tmx_err(E_ZSDATA, "layer contains too many tiles");
+				return 0;
+			}
+			/* the buffer is full, the frame may have more output for it */
+			if ((flushed = sink && out.pos == out.size)) {
+				if (!region_sink_put(sink, dest, out.pos / sizeof(uint32_t))) return 1; /* the rest is out of the region */
+				out.pos = 0;
+			}
+		}
+	}
+
+	if (sink) {
+		if (region_sink_put(sink, dest, out.pos / sizeof(uint32_t))) {
+			tmx_err(E_ZSDATA, "layer contains not enough tiles");
+			return 0;
+		}
+		return 1;
+	}
+	if (out.pos < rlength) {
 		tmx_err(E_ZSDATA, "layer contains not enough tiles");
-		goto cleanup;
+		return 0;
+	}
+	if (ret != 0) {
+		tmx_err(E_ZSDATA, "zstd_decompress: truncated layer data");
+		return 0;
 	}
 
-	return res;
-cleanup:
-	tmx_free_func(res);
-	return NULL;
+	return 1;
 }
 
 #else
 
-char* zstd_decompress(UNUSED const char *source, UNUSED unsigned int slength, UNUSED unsigned int rlength) {
+void* mk_zstd_dict(const char *buffer UNUSED, size_t len UNUSED) {
 	tmx_err(E_FONCT, "This library was not built with zstd support");
 	return NULL;
 }
 
+void free_zstd_dict(void *dict UNUSED) {
+}
+
+int register_zstd_dict(void *dict UNUSED) {
+	return 0;
+}
+
+void free_zstd_dict_registry(void) {
+}
+
+/* zstd compressed layers will fail to decode anyway */
+int data_decoder_load_zstd_dict(data_decoder *decoder UNUSED, const char *base_path UNUSED, const char *rel_path UNUSED) {
+	return 1;
+}
+
+static int zstd_decompress(data_decoder *decoder UNUSED, const char *source UNUSED, size_t src_len UNUSED, char *dest UNUSED, unsigned int rlength UNUSED, struct region_sink *sink UNUSED) {
+	tmx_err(E_FONCT, "This library was not built with zstd support");
+	return 0;
+}
+
 #endif /* WANT_ZSTD */
 
+void* load_zstd_dict(const char *path) {
+	FILE *file;
+	long len;
+	char *buffer;
+	void *res = NULL;
+
+	if (!(file = fopen(path, "rb"))) {
+		tmx_err(E_NOENT, "zstd: cannot open dictionary '%s'", path);
+		return NULL;
+	}
+	if (fseek(file, 0, SEEK_END) || (len = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET)) {
+		tmx_err(E_UNKN, "zstd: cannot read dictionary '%s'", path);
+	}
+	else if (!(buffer = (char*)raw_alloc(NULL, (size_t)len))) {
+		tmx_err_code(E_ALLOC);
+	}
+	else {
+		if (fread(buffer, 1, (size_t)len, file) == (size_t)len) {
+			res = mk_zstd_dict(buffer, (size_t)len); /* the DDict holds a copy of the dictionary */
+		} else {
+			tmx_err(E_UNKN, "zstd: cannot read dictionary '%s'", path);
+		}
+		raw_free(buffer);
+	}
+	fclose(file);
+	return res;
+}
+
+/*
+	CSV
+*/
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define TMX_CSV_SIMD
+#include <emmintrin.h>
+#endif
+
+#define csv_isdigit(c) ((unsigned char)((c) - '0') < 10)
+#define csv_isspace(c) ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+/* Parses `n` digits, returns 0 if the value does not fit in 32 bits */
+static int csv_parse_digits(const char *str, int n, uint32_t *value) {
+	uint64_t res = 0;
+	int i;
+	for (; n > 1 && *str == '0'; str++, n--); /* leading zeros */
+	if (n > 10) return 0;
+	for (i=0; i<n; i++) {
+		res = res * 10 + (uint64_t)(str[i] - '0');
+	}
+	if (res > 0xFFFFFFFFu) return 0;
+	*value = (uint32_t)res;
+	return 1;
+}
+
+#ifdef TMX_CSV_SIMD
+/* Classifies 16 chars at once and consumes every "<digits>," sequence they contain
+   stops at the first sequence that is not complete within the 16 chars or that
+   contains other chars (whitespaces, ...), these are left to the scalar parser.
+   Returns the number of consumed chars, `*index` is incremented for each tile */
+static size_t csv_decode_block(const char *str, size_t *index, size_t last, uint32_t *gids) {
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i comma = _mm_set1_epi8(',');
+	__m128i chunk, d;
+	unsigned int digits, commas, n, off = 0;
+
+	chunk = _mm_loadu_si128((const __m128i*)str);
+	d = _mm_sub_epi8(chunk, zero);
+	digits = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, nine), d));
+	commas = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, comma));
+
+	while (*index < last) {
+		n = (unsigned int)__builtin_ctz((~digits | 0x10000u) >> off); /* length of the digit run */
+		if (n == 0 || off+n >= 16 || !((commas >> (off+n)) & 1u)) break;
+		if (!csv_parse_digits(str+off, (int)n, gids + *index)) break;
+		(*index)++;
+		off += n+1;
+	}
+	return off;
+}
+#endif
+
+/* Parses comma separated gids, whitespaces are allowed around gids */
+static int csv_decode(const char *source, size_t src_len, size_t gids_count, uint32_t *gids) {
+	const char *end = source + src_len;
+	size_t i = 0;
+	int n;
+
+	while (i < gids_count) {
+#ifdef TMX_CSV_SIMD
+		if (end - source >= 16) {
+			n = (int)csv_decode_block(source, &i, gids_count-1, gids);
+			if (n > 0) {
+				source += n;
+				continue;
+			}
+		}
+#endif
+		while (source < end && csv_isspace(*source)) source++;
+		for (n=0; source+n < end && csv_isdigit(source[n]); n++);
+		if (n == 0 || !csv_parse_digits(source, n, gids+i)) {
+			tmx_err(E_CDATA, "error in CVS while reading tile #%d", (int)i);
+			return 0;
+		}
+		source += n;
+		while (source < end && csv_isspace(*source)) source++;
+		if (source < end && *source == ',') {
+			source++;
+		} else if (i != gids_count-1) {
+			tmx_err(E_CDATA, "error in CVS after reading tile #%d", (int)i);
+			return 0;
+		}
+		i++;
+	}
+	return 1;
+}
+
+/* Parses the comma separated gids of a layer up to the last cell of the region */
+static int csv_decode_region(const char *source, size_t src_len, struct region_sink *sink) {
+	const char *end = source + src_len;
+	size_t i = 0, gids_count = (size_t)sink->region->src_width * (size_t)sink->region->src_height;
+	uint32_t cells[256];
+	unsigned int len = 0;
+	int n;
+
+	while (i < sink->end) {
+		while (source < end && csv_isspace(*source)) source++;
+		for (n=0; source+n < end && csv_isdigit(source[n]); n++);
+		if (n == 0 || !csv_parse_digits(source, n, cells+len)) {
+			tmx_err(E_CDATA, "error in CVS while reading tile #%d", (int)i);
+			return 0;
+		}
+		source += n;
+		while (source < end && csv_isspace(*source)) source++;
+		if (source < end && *source == ',') {
+			source++;
+		} else if (i != gids_count-1) {
+			tmx_err(E_CDATA, "error in CVS after reading tile #%d", (int)i);
+			return 0;
+		}
+		i++;
+		if (++len == sizeof(cells)/sizeof(cells[0]) || i == sink->end) {
+			region_sink_put(sink, (const char*)cells, len);
+			len = 0;
+		}
+	}
+	return 1;
+}
+
 /*
 	Layer data decoders
 */
 
-int data_decode(const char *source, enum enccmp_t type, size_t gids_count, uint32_t **gids) {
-	char *b64dec;
-	unsigned int b64_len, i;
+int data_decode(data_decoder *decoder, const char *source, size_t src_len, enum enccmp_t type, size_t gids_count, uint32_t **gids) {
+	size_t b64_len;
+	int res;
+
+	if (!decoder) {
+		/* one-shot decoder */
+		if (!(decoder = mk_data_decoder(NULL))) return 0;
+		res = data_decode(decoder, source, src_len, type, gids_count, gids);
+		free_data_decoder(decoder);
+		return res;
+	}
+	decoder->layer_count++;
 
 	if (type==CSV) {
-		if (!(*gids = (uint32_t*)tmx_alloc_func(NULL, gids_count * sizeof(int32_t)))) {
-			tmx_errno = E_ALLOC;
+		if (!(*gids = (uint32_t*)mem_alloc(NULL, gids_count * sizeof(int32_t)))) {
+			tmx_err_code(E_ALLOC);
 			return 0;
 		}
-		for (i=0; i<gids_count; i++) {
-			if (sscanf(source, "%u", (*gids)+i) != 1) {
-				tmx_err(E_CDATA, "error in CVS while reading tile #%d", i);
-				return 0;
-			}
-			if (!(source = strchr(source, ',')) && i!=gids_count-1) {
-				tmx_err(E_CDATA, "error in CVS after reading tile #%d", i);
-				return 0;
-			}
-			source++;
+		if (!csv_decode(source, src_len, gids_count, *gids)) return 0;
+	}
+	else if (type==B64) {
+		/* decodes straight into the gid array */
+		b64_len = b64_decoded_len(source, src_len);
+		if (b64_len < gids_count * sizeof(int32_t)) {
+			tmx_err(E_BDATA, "layer contains not enough tiles");
+			return 0;
 		}
+		if (!(*gids = (uint32_t*)mem_alloc(NULL, b64_len))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+		if (!b64_decode_to(source, src_len, (char*)*gids)) return 0;
 	}
-	else if (type==B64 || type==B64Z || type==B64ZSTD) {
-		if (!(b64dec = b64_decode(source, &b64_len))) return 0;
+	else if (type==B64Z || type==B64ZSTD) {
+		if (!(*gids = (uint32_t*)mem_alloc(NULL, gids_count * sizeof(int32_t)))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
 		if (type==B64ZSTD) {
-			*gids = (uint32_t*)zstd_decompress(b64dec, b64_len, (unsigned int)(gids_count*sizeof(int32_t)));
-			tmx_free_func(b64dec);
+			if (!zstd_decompress(decoder, source, src_len, (char*)*gids, (unsigned int)(gids_count*sizeof(int32_t)), NULL)) return 0;
 		}
-		else if (type==B64Z) {
-			*gids = (uint32_t*)zlib_decompress(b64dec, b64_len, (unsigned int)(gids_count*sizeof(int32_t)));
-			tmx_free_func(b64dec);
+		else {
+			if (!zlib_decompress(decoder, source, src_len, (char*)*gids, (unsigned int)(gids_count*sizeof(int32_t)), NULL)) return 0;
+		}
+	}
+
+	return 1;
+}
+
+int data_decode_region(data_decoder *decoder, const char *source, size_t src_len, enum enccmp_t type, const data_region *region, uint32_t **gids) {
+	struct region_sink sink;
+	size_t count = (size_t)region->width * (size_t)region->height;
+	size_t row, first, last, b64_begin, b64_end;
+	char *buffer = NULL;
+	int res = 0;
+
+	if (!decoder) {
+		/* one-shot decoder */
+		if (!(decoder = mk_data_decoder(NULL))) return 0;
+		res = data_decode_region(decoder, source, src_len, type, region, gids);
+		free_data_decoder(decoder);
+		return res;
+	}
+	decoder->layer_count++;
+
+	if (!(*gids = (uint32_t*)mem_alloc(NULL, count * sizeof(uint32_t)))) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	memset(*gids, 0, count * sizeof(uint32_t));
+	init_region_sink(&sink, region, *gids);
+	if (sink.end == 0) return 1; /* the region is out of the layer */
+
+	if (type==CSV) {
+		return csv_decode_region(source, src_len, &sink);
+	}
+	if (type==B64) {
+		/* only the part of each row that is in the region is decoded */
+		if (b64_decoded_len(source, src_len) < (size_t)region->src_width * (size_t)region->src_height * sizeof(uint32_t)) {
+			tmx_err(E_BDATA, "layer contains not enough tiles");
+			return 0;
+		}
+		if (!(buffer = (char*)raw_alloc(NULL, (sink.col_end - sink.col_begin) * sizeof(uint32_t) + 8))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+		for (row = (size_t)(region->y > 0? region->y: 0); row * (size_t)region->src_width < sink.end; row++) {
+			first = (row * (size_t)region->src_width + sink.col_begin) * sizeof(uint32_t);
+			last = (row * (size_t)region->src_width + sink.col_end) * sizeof(uint32_t);
+			b64_begin = first / 3 * 4;
+			b64_end = (last + 2) / 3 * 4;
+			if (b64_end > src_len) b64_end = src_len;
+			if (!b64_decode_part(source, b64_begin, b64_end - b64_begin, src_len, buffer)) goto cleanup;
+			sink.pos = row * (size_t)region->src_width + sink.col_begin;
+			region_sink_put(&sink, buffer + (first - b64_begin / 4 * 3), sink.col_end - sink.col_begin);
+		}
+		res = 1;
+	}
+	else if (type==B64Z || type==B64ZSTD) {
+		if (!(buffer = (char*)raw_alloc(NULL, REGION_BUFFER_LEN))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+		if (type==B64ZSTD) {
+			res = zstd_decompress(decoder, source, src_len, buffer, REGION_BUFFER_LEN, &sink);
 		}
 		else {
-			*gids = (uint32_t*)b64dec;
+			res = zlib_decompress(decoder, source, src_len, buffer, REGION_BUFFER_LEN, &sink);
+		}
+	}
+
+cleanup:
+	raw_free(buffer);
+	return res;
+}
+
+/*
+	Deferred decoding
+	Payloads are copied during the XML pass, then decoded in parallel before
+	map_post_parsing, each thread has its own decoder (decompression contexts
+	are not shareable), the zstd dictionaries are shared.
+*/
+
+#define DECODE_BYTES_PER_THREAD 65536 /* smaller payloads are not worth a thread */
+#define DECODE_MAX_THREADS 64
+
+int data_decode_deferred(data_decoder *decoder, const char *source, size_t src_len, enum enccmp_t type, size_t gids_count, uint32_t **gids) {
+	struct decode_job *jobs, *job;
+	unsigned int cap;
+
+	if (decoder->thread_limit <= 1 && !(decoder->lazy)) {
+		return data_decode(decoder, source, src_len, type, gids_count, gids);
+	}
+
+	if (decoder->jobs_len == decoder->jobs_cap) {
+		cap = decoder->jobs_cap? decoder->jobs_cap * 2: 8;
+		if (!(jobs = (struct decode_job*)raw_alloc(decoder->jobs, cap * sizeof(struct decode_job)))) {
+			tmx_err_code(E_ALLOC);
+			return 0;
+		}
+		decoder->jobs = jobs;
+		decoder->jobs_cap = cap;
+	}
+
+	job = decoder->jobs + decoder->jobs_len;
+	if (!(job->source = (char*)raw_alloc(NULL, src_len + 1))) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	memcpy(job->source, source, src_len);
+	job->src_len = src_len;
+	job->type = type;
+	job->gids_count = gids_count;
+	job->gids = gids;
+	job->err.code = E_NONE;
+	decoder->jobs_len++;
+	decoder->jobs_src_len += src_len;
+	return 1;
+}
+
+/* a decoder for another thread, shares the dictionaries of `decoder` */
+static data_decoder* clone_data_decoder(data_decoder *decoder UNUSED) {
+	data_decoder *res = mk_data_decoder(NULL);
+#ifdef WANT_ZSTD
+	if (res) {
+		res->rc_mgr = decoder->rc_mgr;
+		res->map_dict = decoder->map_dict; /* not owned */
+	}
+#endif
+	return res;
+}
+
+struct decode_run {
+	struct decode_job *jobs;
+	data_decoder **decoders; /* one per thread */
+};
+
+static void decode_job_functor(void *userdata, unsigned int index, unsigned int worker) {
+	struct decode_run *run = (struct decode_run*)userdata;
+	struct decode_job *job = run->jobs + index;
+
+	if (!data_decode(run->decoders[worker], job->source, job->src_len, job->type, job->gids_count, job->gids)) {
+		save_error(&(job->err));
+	}
+	raw_free(job->source);
+	job->source = NULL;
+}
+
+int data_decoder_finish(data_decoder *decoder) {
+	struct decode_run run;
+	data_decoder *decoders[DECODE_MAX_THREADS];
+	unsigned int i, thread_count;
+	int res = 1;
+
+	if (decoder->jobs_len == 0 || decoder->lazy) return 1;
+
+	thread_count = decoder->thread_limit;
+	if (thread_count > decoder->jobs_len) thread_count = decoder->jobs_len;
+	if (thread_count > decoder->jobs_src_len / DECODE_BYTES_PER_THREAD + 1) {
+		thread_count = (unsigned int)(decoder->jobs_src_len / DECODE_BYTES_PER_THREAD + 1);
+	}
+	if (thread_count > DECODE_MAX_THREADS) thread_count = DECODE_MAX_THREADS;
+
+	decoders[0] = decoder;
+	for (i=1; i<thread_count; i++) {
+		if (!(decoders[i] = clone_data_decoder(decoder))) break;
+	}
+	thread_count = i; /* less threads if a decoder could not be allocated */
+
+	run.jobs = decoder->jobs;
+	run.decoders = decoders;
+	run_jobs(decode_job_functor, &run, decoder->jobs_len, thread_count);
+
+	for (i=1; i<thread_count; i++) {
+		free_data_decoder(decoders[i]);
+	}
+
+	/* reports the error of the first layer (in document order) that failed */
+	for (i=0; i<decoder->jobs_len; i++) {
+		if (decoder->jobs[i].err.code != E_NONE) {
+			restore_error(&(decoder->jobs[i].err));
+			res = 0;
+			break;
 		}
-		if (!(*gids)) return 0;
 	}
 
+	decoder->jobs_len = 0;
+	decoder->jobs_src_len = 0;
+	return res;
+}
+
+/*
+	Lazy decoding
+	The deferred payloads are kept by the decoder, which is then kept by the
+	map, each one is decoded on first access to its layer.
+*/
+
+int data_decoder_is_lazy(data_decoder *decoder) {
+	return decoder->lazy && decoder->jobs_len > 0;
+}
+
+int data_decoder_decode_lazy(data_decoder *decoder, uint32_t **gids) {
+	struct decode_job *job;
+	unsigned int i, j;
+
+	/* payloads are usually accessed in document order (all the chunks of a layer) */
+	for (j=0; j<decoder->jobs_len; j++) {
+		i = (decoder->lazy_hint + j) % decoder->jobs_len;
+		job = decoder->jobs + i;
+		if (job->gids != gids || !(job->source)) continue;
+		decoder->lazy_hint = i + 1;
+
+		if (!data_decode(decoder, job->source, job->src_len, job->type, job->gids_count, gids)) {
+			/* the payload is kept, the next access reports the same error */
+			mem_free(*gids);
+			*gids = NULL;
+			return 0;
+		}
+		raw_free(job->source);
+		job->source = NULL;
+		return 1;
+	}
+	return 1;
+}
+
+/*
+	Chunks
+	The chunks of a layer have the same size and are aligned on a grid, they
+	are indexed by their coordinates in the grid in an open addressing table.
+*/
+
+/* rounds towards negative infinity, `b` > 0 */
+static long floor_div(long a, long b) {
+	long res = a / b;
+	if (a % b != 0 && a < 0) res--;
+	return res;
+}
+
+static unsigned int chunk_hash(long col, long row) {
+	uint32_t res = (uint32_t)col * 0x9E3779B1u ^ (uint32_t)row * 0x85EBCA6Bu;
+	return (unsigned int)(res ^ (res >> 15));
+}
+
+static int chunk_contains(const tmx_chunk *chunk, long x, long y) {
+	return x >= chunk->x && x < (long)chunk->x + chunk->width && y >= chunk->y && y < (long)chunk->y + chunk->height;
+}
+
+int index_chunks(tmx_chunks *chunks) {
+	tmx_chunk *chunk;
+	unsigned int i, slot, slots_len = 16;
+	long col, row;
+
+	if (chunks->count == 0) return 1;
+
+	chunk = chunks->list[0];
+	chunks->chunk_width = chunk->width;
+	chunks->chunk_height = chunk->height;
+	chunks->origin_x = (int)(chunk->x - floor_div(chunk->x, chunk->width) * chunk->width);
+	chunks->origin_y = (int)(chunk->y - floor_div(chunk->y, chunk->height) * chunk->height);
+
+	while (slots_len < chunks->count * 2) slots_len *= 2;
+	if (!(chunks->slots = (tmx_chunk**)mem_alloc(NULL, slots_len * sizeof(tmx_chunk*)))) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	memset(chunks->slots, 0, slots_len * sizeof(tmx_chunk*));
+	chunks->slots_mask = slots_len - 1;
+
+	for (i=0; i<chunks->count; i++) {
+		chunk = chunks->list[i];
+		if (chunk->width != chunks->chunk_width || chunk->height != chunks->chunk_height ||
+		    ((long)chunk->x - chunks->origin_x) % chunks->chunk_width != 0 ||
+		    ((long)chunk->y - chunks->origin_y) % chunks->chunk_height != 0) {
+			tmx_err(E_XDATA, "chunk at (%d, %d) is not aligned with the other chunks of its layer", chunk->x, chunk->y);
+			return 0;
+		}
+		col = floor_div((long)chunk->x - chunks->origin_x, chunks->chunk_width);
+		row = floor_div((long)chunk->y - chunks->origin_y, chunks->chunk_height);
+		for (slot = chunk_hash(col, row) & chunks->slots_mask; chunks->slots[slot]; slot = (slot + 1) & chunks->slots_mask) {
+			if (chunks->slots[slot]->x == chunk->x && chunks->slots[slot]->y == chunk->y) {
+				tmx_err(E_XDATA, "duplicate chunk at (%d, %d)", chunk->x, chunk->y);
+				return 0;
+			}
+		}
+		chunks->slots[slot] = chunk;
+	}
 	return 1;
 }
 
+tmx_chunk* find_chunk(const tmx_chunks *chunks, int x, int y) {
+	tmx_chunk *chunk;
+	unsigned int slot;
+	long col, row;
+
+	if (chunks->count == 0) return NULL;
+
+	col = floor_div((long)x - chunks->origin_x, chunks->chunk_width);
+	row = floor_div((long)y - chunks->origin_y, chunks->chunk_height);
+	for (slot = chunk_hash(col, row) & chunks->slots_mask; (chunk = chunks->slots[slot]); slot = (slot + 1) & chunks->slots_mask) {
+		if (chunk_contains(chunk, x, y)) return chunk;
+	}
+	return NULL;
+}
+
+/*
+	Keywords
+	Perfect hash (no collision) of the names and values known by the parsers,
+	hash = (len + asso[first char] + asso[middle char] + asso[last char]) % 256
+	The weights were found by a random search, adding a keyword to the set
+	requires to search new weights that keep the hash collision free.
+*/
+
+static const char *keyword_names[] = {
+	NULL,
+	/* elements */
+	"map", "tileset", "tile", "layer", "objectgroup", "imagelayer",
+	"group", "object", "properties", "property", "image", "data",
+	"tileoffset", "animation", "frame", "ellipse", "polygon", "polyline",
+	"text", "template", "chunk",
+	/* attributes */
+	"id", "x", "y", "name", "type", "class",
+	"visible", "height", "width", "gid", "rotation", "opacity",
+	"offsetx", "offsety", "parallaxx", "parallaxy", "tintcolor", "color",
+	"draworder", "repeatx", "repeaty", "tilecount", "tilewidth", "tileheight",
+	"spacing", "margin", "objectalignment", "tilerendersize", "fillmode", "version",
+	"infinite", "orientation", "staggerindex", "staggeraxis", "renderorder", "backgroundcolor",
+	"hexsidelength", "parallaxoriginx", "parallaxoriginy", "layers", "tilesets", "chunks",
+	"compression", "encoding", "imagewidth", "imageheight", "objects", "transparentcolor",
+	"point", "bold", "fontfamily", "italic", "kerning", "pixelsize",
+	"strikeout", "underline", "wrap", "halign", "valign", "firstgid",
+	"source", "tiles", "duration", "tileid", "propertytype", "value",
+	/* values */
+	"orthogonal", "isometric", "staggered", "hexagonal", "right-down", "right-up",
+	"left-down", "left-up", "top", "left", "bottom", "right",
+	"center", "topleft", "topright", "bottomleft", "bottomright", "stretch",
+	"preserve-aspect-fit", "grid", "topdown", "index", "odd", "even",
+	"columns", "string", "int", "float", "bool", "file",
+	"justify", "true", "base64", "zstd", "zlib", "gzip",
+	"xml", "csv", "tilelayer"
+};
+
+/* weight of a character, non-ASCII characters weight 0 */
+static const unsigned char keyword_asso[256] = {
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  7,  0,  0,
+	  0,  0,  0,  0,254,  0, 29,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	  0, 27, 13,186,149, 72,148,105,242, 15,229, 90,128,155,158, 50,
+	 37,  0,169, 63, 51,144,144, 34,130, 66,175,  0,  0,  0,  0,  0
+};
+
+/* hash -> keyword, 0 is an empty slot */
+static const unsigned char keyword_slots[256] = {
+	  0,  0,  0, 20, 13,  0, 56,  0,  0, 93,  0,  0, 17, 61, 53,119,
+	 31,107,  0,  0,  0,  0, 85,  9,  0, 27, 89,  0,  0,  0, 49,  0,
+	  0,  0,  0,  0,  0, 88, 71,  0,  0, 43,  0,109,  0, 66, 94,  0,
+	 36,  0,111,  0, 69, 33, 82,  0, 59, 58, 42, 22,  0,  0,  0, 67,
+	  0,  0,  6, 80,  0,  0, 90,  0,  0,  0, 99, 97,  0,  0, 65, 73,
+	 44,  0,  0,  0,  0, 57,  0,  0, 92,120,  0,  0,  0, 87,  0,110,
+	117,118,  0,  0, 81,126, 78,  0, 74, 46,  0,  0, 70,108, 84,  0,
+	  4,  0,  0,  0, 51,  0, 54, 11,  0, 40, 41,121,  0,102,  0, 50,
+	105,  0, 32,  0,  0, 25,106, 23,  0,  0, 77,  0,125, 96,  0,  0,
+	112,  0,  0,  0, 29,  5,  0,  0,  0,  0,  0,  0,100, 63,  0, 38,
+	124,123,  0,  0, 26, 79, 16,  0, 47, 21,  0, 64, 86,  0, 30,  0,
+	  0,  0,  0,  8,  0,  2,  0, 10, 45, 62, 35,  0,  0,113,  0,  0,
+	 68,  0,  0,116,  0,  7,  0, 24,  0,  0,  0,  0,  0,  0,  0,122,
+	  0, 55,  0,  0,  0, 76,  0,  0,  0,  0,  0,  0,  0, 14,  1, 95,
+	  0, 98,  0,114, 91,103,104, 12, 39,  0,  0,  0, 19,101, 28,  0,
+	 37,  0,  0,  0, 48, 18, 75, 83, 60,  0, 34, 72, 15, 52,115,  3
+};
+
+enum keyword keyword_lookup(const char *str) {
+	size_t len;
+	unsigned int hash;
+	unsigned char slot;
+
+	if (str == NULL || *str == '\0') return K_NONE;
+	len = strlen(str);
+	hash = (unsigned int)len;
+	hash += keyword_asso[(unsigned char)str[0]];
+	hash += keyword_asso[(unsigned char)str[len/2]];
+	hash += keyword_asso[(unsigned char)str[len-1]];
+
+	slot = keyword_slots[hash & 0xFF];
+	if (slot && !strcmp(str, keyword_names[slot])) {
+		return (enum keyword)slot;
+	}
+	return K_NONE;
+}
+
 /*
 	Misc
 */
 
 void map_post_parsing(tmx_map **map) {
+	mem_arena *prev;
+	int res;
 	if (*map) {
-		if (!mk_map_tile_array(*map)) {
+		prev = arena_enter((mem_arena*)(*map)->arena);
+		res = mk_map_tile_array(*map);
+		arena_enter(prev);
+		if (!res) {
 			tmx_map_free(*map);
 			*map = NULL;
 		}
@@ -316,7 +1475,7 @@ void map_post_parsing(tmx_map **map) {
 
 /* Sets tile->tileset and tile->ul_x,y */
 int set_tiles_runtime_props(tmx_tileset *ts) {
-	unsigned int i, j;
+	unsigned int i;
 	unsigned int tiles_x_count, ts_w, tx, ty;
 
 	if (ts == NULL) {
@@ -324,23 +1483,19 @@ int set_tiles_runtime_props(tmx_tileset *ts) {
 		return 0;
 	}
 
-	/* reindex tiles (tiles are sorted, but not indexed correctly) */
-	for (i=ts->tilecount-1, j=0; j<ts->tilecount; j++, i--) {
-		if (ts->tiles[i].id > 0L && ts->tiles[i].id != i) {
-			memcpy(ts->tiles+(ts->tiles[i].id), ts->tiles+i, sizeof(tmx_tile));
-			memset(ts->tiles+i, 0, sizeof(tmx_tile));
-		}
+	/* set bitmap's region x and y coordinates */
+	ts_w = ts->image->width - 2 * (ts->margin) + ts->spacing;
+	tiles_x_count = ts->tile_width + ts->spacing > 0? ts_w / (ts->tile_width + ts->spacing): 0;
+	if (tiles_x_count == 0 && ts->tilecount > 0) {
+		tmx_err(E_XDATA, "the image of tileset '%s' is narrower than its tiles", ts->name);
+		return 0;
 	}
 
+	/* tiles are indexed by id (see arrange_tiles in tmx_xml.c) */
 	for (i=0; i<ts->tilecount; i++) {
 		ts->tiles[i].id = i;
 		ts->tiles[i].tileset = ts;
 
-		/* set bitmap's region x and y coordinates */
-		ts_w = ts->image->width - 2 * (ts->margin) + ts->spacing;
-
-		tiles_x_count = ts_w / (ts->tile_width + ts->spacing);
-
 		tx = i % tiles_x_count;
 		ty = i / tiles_x_count;
 
@@ -380,13 +1535,14 @@ int mk_map_tile_array(tmx_map *map) {
 		map->tilecount = max_ts->firstgid + max_ts->tileset->tilecount;
 	}
 	else {
-		/* Gets the last id, ts->tiles is sorted by id */
-		map->tilecount = max_ts->firstgid + max_ts->tileset->tiles[max_ts->tileset->tilecount - 1].id + 1;
+		/* Gets the last id, ts->tiles is sorted by id, unused slots are at the end */
+		for (i = max_ts->tileset->tilecount; i > 0 && !(max_ts->tileset->tiles[i-1].tileset); i--);
+		map->tilecount = max_ts->firstgid + (i > 0? max_ts->tileset->tiles[i-1].id + 1: 0);
 	}
 
 	/* Allocates the GID indexed tile array */
-	if (!(map->tiles = tmx_alloc_func(NULL, map->tilecount * sizeof(void*)))) {
-		tmx_errno = E_ALLOC;
+	if (!(map->tiles = mem_alloc(NULL, map->tilecount * sizeof(void*)))) {
+		tmx_err_code(E_ALLOC);
 		return 0;
 	}
 	memset(map->tiles, 0, map->tilecount * sizeof(void*));
@@ -396,6 +1552,7 @@ int mk_map_tile_array(tmx_map *map) {
 	ts = map->ts_head;
 	while (ts != NULL) {
 		for (i=0; i<ts->tileset->tilecount; i++) {
+			if (!(ts->tileset->tiles[i].tileset)) continue; /* unused slot of a collection of images */
 			map->tiles[ts->firstgid + ts->tileset->tiles[i].id] = &(ts->tileset->tiles[i]);
 		}
 		ts = ts->next;
@@ -406,214 +1563,149 @@ int mk_map_tile_array(tmx_map *map) {
 
 /* "orthogonal" -> ORT */
 enum tmx_map_orient parse_orient(const char *orient_str) {
-	if (!strcmp(orient_str, "orthogonal")) {
-		return O_ORT;
-	}
-	if (!strcmp(orient_str, "isometric")) {
-		return O_ISO;
-	}
-	if (!strcmp(orient_str, "staggered")) {
-		return O_STA;
+	switch (keyword_lookup(orient_str)) {
+		case K_ORTHOGONAL: return O_ORT;
+		case K_ISOMETRIC:  return O_ISO;
+		case K_STAGGERED:  return O_STA;
+		case K_HEXAGONAL:  return O_HEX;
+		default:           return O_NONE;
 	}
-	if (!strcmp(orient_str, "hexagonal")) {
-		return O_HEX;
-	}
-	return O_NONE;
 }
 
 /* "left-up" -> R_LEFTUP */
 enum tmx_map_renderorder parse_renderorder(const char *renderorder) {
-	if (renderorder == NULL || !strcmp(renderorder, "right-down")) {
+	if (renderorder == NULL) {
 		return R_RIGHTDOWN;
 	}
-	if (!strcmp(renderorder, "right-up")) {
-		return R_RIGHTUP;
-	}
-	if (!strcmp(renderorder, "left-down")) {
-		return R_LEFTDOWN;
+	switch (keyword_lookup(renderorder)) {
+		case K_RIGHT_DOWN: return R_RIGHTDOWN;
+		case K_RIGHT_UP:   return R_RIGHTUP;
+		case K_LEFT_DOWN:  return R_LEFTDOWN;
+		case K_LEFT_UP:    return R_LEFTUP;
+		default:           return R_NONE;
 	}
-	if (!strcmp(renderorder, "left-up")) {
-		return R_LEFTUP;
-	}
-	return R_NONE;
 }
 
 /* "topleft" -> OA_TOPLEFT */
 enum tmx_obj_alignment parse_obj_alignment(const char *objalign_str) {
-	if (!strcmp("top", objalign_str)) {
-		return OA_TOP;
-	}
-	if (!strcmp("left", objalign_str)) {
-		return OA_LEFT;
-	}
-	if (!strcmp("bottom", objalign_str)) {
-		return OA_BOTTOM;
-	}
-	if (!strcmp("right", objalign_str)) {
-		return OA_RIGHT;
-	}
-	if (!strcmp("center", objalign_str)) {
-		return OA_CENTER;
-	}
-	if (!strcmp("topleft", objalign_str)) {
-		return OA_TOPLEFT;
-	}
-	if (!strcmp("topright", objalign_str)) {
-		return OA_TOPRIGHT;
-	}
-	if (!strcmp("bottomleft", objalign_str)) {
-		return OA_BOTTOMLEFT;
-	}
-	if (!strcmp("bottomright", objalign_str)) {
-		return OA_BOTTOMRIGHT;
+	switch (keyword_lookup(objalign_str)) {
+		case K_TOP:         return OA_TOP;
+		case K_LEFT:        return OA_LEFT;
+		case K_BOTTOM:      return OA_BOTTOM;
+		case K_RIGHT:       return OA_RIGHT;
+		case K_CENTER:      return OA_CENTER;
+		case K_TOPLEFT:     return OA_TOPLEFT;
+		case K_TOPRIGHT:    return OA_TOPRIGHT;
+		case K_BOTTOMLEFT:  return OA_BOTTOMLEFT;
+		case K_BOTTOMRIGHT: return OA_BOTTOMRIGHT;
+		default:            return OA_NONE;
 	}
-	return OA_NONE;
 }
 
 /* "stretch" -> FM_STRETCH */
 enum tmx_fill_mode parse_fillmode(const char *fillmode) {
-	if (!strcmp(fillmode, "stretch")) {
-		return FM_STRETCH;
+	switch (keyword_lookup(fillmode)) {
+		case K_STRETCH:             return FM_STRETCH;
+		case K_PRESERVE_ASPECT_FIT: return FM_PRESERVE_ASPECT_FIT;
+		default:                    return FM_NONE;
 	}
-	if (!strcmp(fillmode, "preserve-aspect-fit")) {
-		return FM_PRESERVE_ASPECT_FIT;
-	}
-	return FM_NONE;
 }
 
 /* "tile" -> TRS_TILE */
 enum tmx_tile_render_size parse_tile_render_size(const char *tile_render_size) {
-	if (!strcmp(tile_render_size, "tile")) {
-		return TRS_TILE;
-	}
-	if (!strcmp(tile_render_size, "grid")) {
-		return TRS_GRID;
+	switch (keyword_lookup(tile_render_size)) {
+		case K_TILE: return TRS_TILE;
+		case K_GRID: return TRS_GRID;
+		default:     return TRS_NONE;
 	}
-	return TRS_NONE;
 }
 
 /* "index" -> G_INDEX */
 enum tmx_objgr_draworder parse_objgr_draworder(const char *draworder) {
-	if (draworder == NULL || !strcmp(draworder, "topdown")) {
+	if (draworder == NULL) {
 		return G_TOPDOWN;
 	}
-	if (!strcmp(draworder, "index")) {
-		return G_INDEX;
+	switch (keyword_lookup(draworder)) {
+		case K_TOPDOWN: return G_TOPDOWN;
+		case K_INDEX:   return G_INDEX;
+		default:        return G_NONE;
 	}
-	return G_NONE;
 }
 
 /* "even" -> SI_EVEN */
 enum tmx_stagger_index parse_stagger_index(const char *staggerindex) {
-	if (staggerindex == NULL || !strcmp(staggerindex, "odd")) {
+	if (staggerindex == NULL) {
 		return SI_ODD;
 	}
-	if (!strcmp(staggerindex, "even")) {
-		return SI_EVEN;
+	switch (keyword_lookup(staggerindex)) {
+		case K_ODD:  return SI_ODD;
+		case K_EVEN: return SI_EVEN;
+		default:     return SI_NONE;
 	}
-	return SI_NONE;
 }
 
 /* "y" -> SA_Y */
 enum tmx_stagger_axis parse_stagger_axis(const char *staggeraxis) {
-	if (staggeraxis == NULL || !strcmp(staggeraxis, "y")) {
+	if (staggeraxis == NULL) {
 		return SA_Y;
 	}
-	if (!strcmp(staggeraxis, "columns")) {
-		return SA_X;
+	switch (keyword_lookup(staggeraxis)) {
+		case K_Y:       return SA_Y;
+		case K_COLUMNS: return SA_X;
+		default:        return SA_NONE;
 	}
-	return SA_NONE;
 }
 
 /* "integer" -> PT_INT */
 enum tmx_property_type parse_property_type(const char *propertytype) {
-	if (propertytype == NULL || !strcmp(propertytype, "string")) {
+	if (propertytype == NULL) {
 		return PT_STRING;
 	}
-	if (!strcmp(propertytype, "int")) {
-		return PT_INT;
-	}
-	if (!strcmp(propertytype, "float")) {
-		return PT_FLOAT;
-	}
-	if (!strcmp(propertytype, "bool")) {
-		return PT_BOOL;
-	}
-	if (!strcmp(propertytype, "color")) {
-		return PT_COLOR;
-	}
-	if (!strcmp(propertytype, "file")) {
-		return PT_FILE;
-	}
-	if (!strcmp(propertytype, "object")) {
-		return PT_OBJECT;
-	}
-	if (!strcmp(propertytype, "class")) {
-		return PT_CUSTOM;
+	switch (keyword_lookup(propertytype)) {
+		case K_STRING: return PT_STRING;
+		case K_INT:    return PT_INT;
+		case K_FLOAT:  return PT_FLOAT;
+		case K_BOOL:   return PT_BOOL;
+		case K_COLOR:  return PT_COLOR;
+		case K_FILE:   return PT_FILE;
+		case K_OBJECT: return PT_OBJECT;
+		case K_CLASS:  return PT_CUSTOM;
+		default:       return PT_NONE;
 	}
-	return PT_NONE;
 }
 
 enum tmx_horizontal_align parse_horizontal_align(const char *horalign) {
-	if (horalign == NULL) {
-		return HA_NONE;
+	switch (keyword_lookup(horalign)) {
+		case K_LEFT:    return HA_LEFT;
+		case K_CENTER:  return HA_CENTER;
+		case K_RIGHT:   return HA_RIGHT;
+		case K_JUSTIFY: return HA_JUSTIFY;
+		default:        return HA_NONE;
 	}
-	if (!strcmp(horalign, "left")) {
-		return HA_LEFT;
-	}
-	if (!strcmp(horalign, "center")) {
-		return HA_CENTER;
-	}
-	if (!strcmp(horalign, "right")) {
-		return HA_RIGHT;
-	}
-	if (!strcmp(horalign, "justify")) {
-		return HA_JUSTIFY;
-	}
-	return HA_NONE;
 }
 
 enum tmx_vertical_align parse_vertical_align(const char *veralign) {
-	if (veralign == NULL) {
-		return VA_NONE;
-	}
-	if (!strcmp(veralign, "top")) {
-		return VA_TOP;
-	}
-	if (!strcmp(veralign, "center")) {
-		return VA_CENTER;
-	}
-	if (!strcmp(veralign, "bottom")) {
-		return VA_BOTTOM;
+	switch (keyword_lookup(veralign)) {
+		case K_TOP:    return VA_TOP;
+		case K_CENTER: return VA_CENTER;
+		case K_BOTTOM: return VA_BOTTOM;
+		default:       return VA_NONE;
 	}
-	return VA_NONE;
 }
 
-enum tmx_layer_type parse_layer_type(const char *nodename) {
-	if (nodename == NULL) {
-		return L_NONE;
+enum tmx_layer_type parse_layer_type(enum keyword element) {
+	switch (element) {
+		case K_LAYER:       return L_LAYER;
+		case K_OBJECTGROUP: return L_OBJGR;
+		case K_IMAGELAYER:  return L_IMAGE;
+		case K_GROUP:       return L_GROUP;
+		default:            return L_NONE;
 	}
-	if (!strcmp(nodename, "layer")) {
-		return L_LAYER;
-	}
-	if (!strcmp(nodename, "objectgroup")) {
-		return L_OBJGR;
-	}
-	if (!strcmp(nodename, "imagelayer")) {
-		return L_IMAGE;
-	}
-	if (!strcmp(nodename, "group")) {
-		return L_GROUP;
-	}
-	return L_NONE;
 }
 
 /* "false" -> 0 */
 int parse_boolean(const char *boolean) {
-	if (boolean != NULL && !strcmp(boolean, "true")) {
-		return 1;
-	}
-	return 0;
+	return keyword_lookup(boolean) == K_TRUE;
 }
 
 /* HTML col  -> (uint32) AARRGGBB
@@ -664,19 +1756,82 @@ int count_char_occurences(const char *str, char c) {
 	return res;
 }
 
-/* trim 'str' to avoid blank characters at its beginning and end */
-char* str_trim(char *str) {
-	int end = (int)(strlen(str)-1);
-	while (end>=0 && isspace((unsigned char) str[end])) end--;
-	str[end+1] = '\0';
+/* like strtod, but locale independent and limited to the decimal notation
+   (no hexadecimal, inf or nan), on failure `end` is set to `str`
+   results are exact if they have at most 15 significant digits and an exponent
+   in [-22, 22], otherwise they may be a few ULPs off */
+double str_to_double(const char *str, const char **end) {
+	static const double pow10[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *s = str, *e;
+	uint64_t mantissa = 0;
+	int negative = 0, exp_negative = 0, digits = 0, exponent = 0, exp_value = 0;
+	double res;
+
+	while (isspace((unsigned char)*s)) s++;
+	if (*s == '-' || *s == '+') negative = (*s++ == '-');
+
+	/* significant digits past the 18th are dropped */
+	for (; *s >= '0' && *s <= '9'; s++, digits++) {
+		if (mantissa < UINT64_C(100000000000000000)) mantissa = mantissa * 10 + (*s - '0');
+		else exponent++;
+	}
+	if (*s == '.') {
+		for (s++; *s >= '0' && *s <= '9'; s++, digits++) {
+			if (mantissa < UINT64_C(100000000000000000)) {
+				mantissa = mantissa * 10 + (*s - '0');
+				exponent--;
+			}
+		}
+	}
+	if (digits == 0) {
+		if (end) *end = str;
+		return 0.;
+	}
+
+	if (*s == 'e' || *s == 'E') {
+		e = s + 1;
+		if (*e == '-' || *e == '+') exp_negative = (*e++ == '-');
+		if (*e >= '0' && *e <= '9') {
+			for (; *e >= '0' && *e <= '9'; e++) {
+				if (exp_value < 10000) exp_value = exp_value * 10 + (*e - '0');
+			}
+			exponent += exp_negative? -exp_value: exp_value;
+			s = e;
+		}
+	}
+	if (end) *end = s;
+
+	res = (double)mantissa;
+	if (mantissa != 0) {
+		/* mantissa and power of ten are exact doubles if mantissa < 2^53: a single rounding */
+		for (; exponent > 22; exponent -= 22) res *= 1e22;
+		for (; exponent < -22; exponent += 22) res /= 1e22;
+		if (exponent < 0) res /= pow10[-exponent];
+		else              res *= pow10[exponent];
+	}
+	return negative? -res: res;
+}
 
-	while(isspace((unsigned char) str[0])) str++;
+/* trim 'str' to avoid blank characters at its beginning and end, does not modify 'str'
+   `len` is the length of 'str' on input, and the length of the trimmed string on output */
+const char* str_trim(const char *str, size_t *len) {
+	const char *end = str + *len;
+	while (str < end && isspace((unsigned char) *str)) str++;
+	while (end > str && isspace((unsigned char) end[-1])) end--;
+	*len = (size_t)(end - str);
 	return str;
 }
 
 /* duplicate a string */
 char* tmx_strdup(const char *str) {
-	char *res =  (char*)tmx_alloc_func(NULL, strlen(str)+1);
+	char *res =  (char*)mem_alloc(NULL, strlen(str)+1);
+	if (!res) {
+		tmx_err_code(E_ALLOC);
+		return NULL;
+	}
 	strcpy(res, str);
 	return res;
 }
@@ -705,9 +1860,9 @@ char* mk_absolute_path(const char *base_path, const char *rel_path) {
 	rp_len = strlen(rel_path);
 	ap_len = dp_len + rp_len;
 
-	res = (char*)tmx_alloc_func(NULL, ap_len+1);
+	res = (char*)mem_alloc(NULL, ap_len+1);
 	if (!res) {
-		tmx_errno = E_ALLOC;
+		tmx_err_code(E_ALLOC);
 		return NULL;
 	}
 
@@ -725,33 +1880,158 @@ void* load_image(void **ptr, const char *base_path, const char *rel_path) {
 		ap_img = mk_absolute_path(base_path, rel_path);
 		if (!ap_img) return 0;
 		*ptr = tmx_img_load_func(ap_img);
-		tmx_free_func(ap_img);
+		mem_free(ap_img);
+		/* images of the nodes of an arena are freed with the arena */
+		if (*ptr && !arena_keep_image(ptr)) {
+			if (tmx_img_free_func) tmx_img_free_func(*ptr);
+			*ptr = NULL;
+		}
 		return(*ptr);
 	}
 	return (void*)1;
 }
 
+/*
+	Memory mapped files
+	The mapping is read-only and private (map_file_cow: writable, the pages written
+	are copied), the file must not be truncated while it is mapped (accessing the
+	lost pages would raise SIGBUS).
+*/
+
+#if defined(WIN32) || defined(__WIN32__) || defined(_WIN32)
+#include <windows.h>
+
+static int map_file_mode(const char *path, mapped_file *file, int cow) {
+	HANDLE fh;
+	LARGE_INTEGER size;
+
+	fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fh == INVALID_HANDLE_VALUE) {
+		tmx_err(GetLastError() == ERROR_ACCESS_DENIED? E_ACCESS: E_NOENT, "cannot open '%s'", path);
+		return 0;
+	}
+	if (!GetFileSizeEx(fh, &size) || size.QuadPart == 0 || (uint64_t)size.QuadPart > (size_t)-1) {
+		tmx_err(E_UNKN, "cannot map '%s'", path);
+		CloseHandle(fh);
+		return 0;
+	}
+	file->len = (size_t)size.QuadPart;
+	file->handle = CreateFileMappingA(fh, NULL, cow? PAGE_WRITECOPY: PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(fh); /* the mapping holds a reference to the file */
+	if (!(file->handle) || !(file->data = (const char*)MapViewOfFile(file->handle, cow? FILE_MAP_COPY: FILE_MAP_READ, 0, 0, 0))) {
+		tmx_err(E_UNKN, "cannot map '%s'", path);
+		if (file->handle) CloseHandle(file->handle);
+		return 0;
+	}
+	return 1;
+}
+
+int map_file(const char *path, mapped_file *file) {
+	return map_file_mode(path, file, 0);
+}
+
+int map_file_cow(const char *path, mapped_file *file) {
+	return map_file_mode(path, file, 1);
+}
+
+void unmap_file(mapped_file *file) {
+	UnmapViewOfFile(file->data);
+	CloseHandle(file->handle);
+}
+
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static int map_file_mode(const char *path, mapped_file *file, int cow) {
+	struct stat st;
+	void *data;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		tmx_err(errno == EACCES? E_ACCESS: E_NOENT, "cannot open '%s': %s", path, strerror(errno));
+		return 0;
+	}
+	if (fstat(fd, &st) || st.st_size <= 0 || (uint64_t)st.st_size > (size_t)-1) {
+		tmx_err(E_UNKN, "cannot map '%s'", path);
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL, (size_t)st.st_size, cow? PROT_READ|PROT_WRITE: PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); /* the mapping holds a reference to the file */
+	if (data == MAP_FAILED) {
+		tmx_err(E_UNKN, "cannot map '%s': %s", path, strerror(errno));
+		return 0;
+	}
+#ifdef MADV_SEQUENTIAL
+	/* the parser reads the file once from start to end: aggressive read-ahead */
+	if (!cow) madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+	file->data = (const char*)data;
+	file->len = (size_t)st.st_size;
+	return 1;
+}
+
+int map_file(const char *path, mapped_file *file) {
+	return map_file_mode(path, file, 0);
+}
+
+int map_file_cow(const char *path, mapped_file *file) {
+	return map_file_mode(path, file, 1);
+}
+
+void unmap_file(mapped_file *file) {
+	munmap((void*)file->data, file->len);
+}
+
+#endif
+
 /* Resource Manager helper functions */
+/* resources outlive the maps that are loading, they are not allocated in their arenas */
 int add_tileset(tmx_resource_manager *rc_mgr, const char *key, tmx_tileset *value) {
 	resource_holder *rc_holder;
+	int suspended, res = 0;
 	if (value) {
+		suspended = arena_suspend(1);
 		rc_holder = pack_tileset_resource(value);
 		if (rc_holder) {
 			hashtable_set((void*)rc_mgr, key, (void*)rc_holder, resource_deallocator);
-			return 1;
+			res = 1;
 		}
+		arena_suspend(suspended);
 	}
-	return 0;
+	return res;
 }
 int add_template(tmx_resource_manager *rc_mgr, const char *key, tmx_template *value) {
 	resource_holder *rc_holder;
+	int suspended, res = 0;
 	if (value)
 	{
+		suspended = arena_suspend(1);
 		rc_holder = pack_template_resource(value);
 		if (rc_holder) {
 			hashtable_set((void*)rc_mgr, key, (void*)rc_holder, resource_deallocator);
-			return 1;
+			res = 1;
 		}
+		arena_suspend(suspended);
 	}
-	return 0;
+	return res;
+}
+int add_zstd_dict(tmx_resource_manager *rc_mgr, const char *key, void *value) {
+	resource_holder *rc_holder;
+	int suspended, res = 0;
+	if (value) {
+		suspended = arena_suspend(1);
+		rc_holder = pack_zstd_dict_resource(value);
+		if (rc_holder) {
+			hashtable_set((void*)rc_mgr, key, (void*)rc_holder, resource_deallocator);
+			res = 1;
+		}
+		else free_zstd_dict(value);
+		arena_suspend(suspended);
+	}
+	return res;
 }
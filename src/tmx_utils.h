@@ -14,24 +14,45 @@
 #define UNUSED
 #endif
 
+/* thread-local storage with MSVC, GCC, CLANG and C11 compilers
+   the worker threads swap the load options and the arena of the calling thread */
+#if defined(_MSC_VER)
+#define TMX_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define TMX_THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define TMX_THREAD_LOCAL _Thread_local
+#elif defined(WANT_THREADS)
+#error "WANT_THREADS needs a compiler with thread-local storage"
+#else
+#define TMX_THREAD_LOCAL /* no threads: the per-thread states are globals, see build.rst */
+#endif
+
 /*
 	Resource holder type an deallocator - tmx_rc.c
 */
-enum resource_type { RC_TSX, RC_TX };
+enum resource_type { RC_TSX, RC_TX, RC_ZDICT, RC_CACHE };
+typedef struct _map_cache map_cache; /* see tmx_cache.c */
 typedef struct _rc_holder {
 	enum resource_type type;
 	union {
 		tmx_tileset  *tileset;
 		tmx_template *template;
+		void         *zstd_dict; /* ZSTD_DDict */
+		map_cache    *cache;
 	} resource;
 } resource_holder;
 int add_tileset(tmx_resource_manager *rc_mgr, const char *key, tmx_tileset *value);
 int add_template(tmx_resource_manager *rc_mgr, const char *key, tmx_template *value);
+int add_zstd_dict(tmx_resource_manager *rc_mgr, const char *key, void *value);
 
 /*
 	XML Parser implementation - tmx_xml.c
 */
 tmx_map* parse_xml(tmx_resource_manager *rc_mgr, const char *filename);
+tmx_map* parse_xml_mmap(tmx_resource_manager *rc_mgr, const char *filename);
+struct _data_region;
+tmx_map* parse_xml_region(tmx_resource_manager *rc_mgr, const char *filename, struct _data_region *region);
 tmx_map* parse_xml_buffer(tmx_resource_manager *rc_mgr, const char *buffer, int len);
 tmx_map* parse_xml_buffer_vpath(tmx_resource_manager *rc_mgr, const char *buffer, int len, const char *vpath);
 tmx_map* parse_xml_fd(tmx_resource_manager *rc_mgr, int fd);
@@ -49,11 +70,98 @@ tmx_template* parse_tx_xml_buffer(tmx_resource_manager *rc_mgr, const char *buff
 tmx_template* parse_tx_xml_fd(tmx_resource_manager *rc_mgr, int fd);
 tmx_template* parse_tx_xml_callback(tmx_resource_manager *rc_mgr, tmx_read_functor callback, void *userdata);
 
+/*
+	Shared by the parsers - tmx_xml.c
+*/
+
+/* references to the tilesets and templates of a document, loaded once it is parsed (see load_ext_resources) */
+typedef struct _ext_ref {
+	enum resource_type type; /* RC_TSX or RC_TX */
+	char *key;  /* value of the `source` or `template` attribute, key in the resource manager */
+	char *path; /* absolute path */
+	union {
+		tmx_tileset_list *ts_list; /* RC_TSX */
+		tmx_object *object;        /* RC_TX */
+	} user;
+	int registered; /* added to the resource manager by this load */
+} ext_ref;
+
+typedef struct _parse_context {
+	ext_ref *refs;
+	unsigned int refs_len, refs_cap;
+	int images_deferred; /* not on the loading thread, images are loaded later */
+	tmx_image **images;
+	unsigned int images_len, images_cap;
+	struct _data_region *region; /* loaded with tmx_load_region, NULL otherwise */
+} parse_context;
+
+int grow_array(void **array, unsigned int *cap, unsigned int len, size_t elem_size); /* grows `*array` if it is full */
+ext_ref* add_ext_ref(parse_context *ctx, enum resource_type type, const char *key, const char *filename);
+void free_parse_context(parse_context *ctx);
+int load_or_defer_image(parse_context *ctx, tmx_image *image, const char *filename); /* `image->source` is set */
+/* loads the resources referenced in `ctx` (and the resources they reference), on several threads */
+int load_ext_resources(tmx_resource_manager *rc_mgr, int use_mmap, parse_context *ctx);
+/* removes the resources added to the resource manager by a load that failed */
+void unload_ext_resources(tmx_resource_manager *rc_mgr, parse_context *ctx);
+
+/* state of a tileset being parsed:
+   the frames of the animations of all its tiles are appended to a single growable array
+   (tileset->frames), tiles are pointed to their frames once the tileset is parsed.
+   tiles are placed at tiles[id] as long as their ids are unique and below tilecount, otherwise the
+   array is compacted and the next tiles are appended, then sorted once the tileset is parsed */
+typedef struct _tileset_state {
+	tmx_tileset *tileset;
+	unsigned int frames_len, frames_cap;
+	unsigned int tiles_len; /* number of tiles parsed */
+	int tiles_appended, tiles_sorted;
+} tileset_state;
+
+tmx_tile* place_tile(tileset_state *state, unsigned int id); /* returns the slot of a new tile in tiles[] */
+int add_anim_frame(tileset_state *state, tmx_anim_frame frame);
+int finish_tileset(tileset_state *state); /* once all the tiles are parsed */
+
+/* removes the objects out of the region, once the templates are loaded */
+void crop_map_objects(tmx_map *map, const struct _data_region *region);
+
+/*
+	JSON Parser implementation - tmx_json.c
+*/
+int is_json_file(const char *path);  /* by extension (.tmj, .tsj, .tj, .json), else by content */
+int is_json_buffer(const char *buffer, size_t len);
+tmx_map* parse_json(tmx_resource_manager *rc_mgr, const char *filename, struct _data_region *region);
+tmx_map* parse_json_buffer(tmx_resource_manager *rc_mgr, const char *buffer, size_t len, const char *vpath);
+tmx_map* parse_json_callback(tmx_resource_manager *rc_mgr, tmx_read_functor callback, void *userdata, const char *vpath);
+tmx_tileset* parse_tsj(const char *filename);
+tmx_tileset* parse_tsj_buffer(const char *buffer, size_t len);
+tmx_template* parse_tj(tmx_resource_manager *rc_mgr, const char *filename);
+tmx_template* parse_tj_buffer(tmx_resource_manager *rc_mgr, const char *buffer, size_t len);
+/* external resources of a document being loaded, see load_ext_resources */
+int parse_tsj_resource(const char *path, tmx_tileset *ts, parse_context *ctx);
+int parse_tj_resource(const char *path, tmx_template *tmpl, parse_context *ctx);
+
+/*
+	Compiled maps - tmx_bin.c
+*/
+void free_binary_map(tmx_map *map); /* called by tmx_map_free */
+tmx_map* load_binary_map(const char *path, const char *images_base); /* images are relative to `images_base` */
+
+/*
+	Compiled maps cache - tmx_cache.c
+*/
+map_cache* get_map_cache(tmx_resource_manager *rc_mgr); /* NULL if the cache is not enabled */
+void free_map_cache(map_cache *cache);
+/* loads the compiled map of `path` if it is up to date, returns NULL otherwise */
+tmx_map* load_cached_map(map_cache *cache, const char *path);
+/* saves the compiled map of the map just loaded from `path`, failures are ignored */
+void save_cached_map(map_cache *cache, tmx_map *map, const char *path);
+/* records the documents referenced by a map being loaded, called by load_ext_resources */
+void record_cache_deps(tmx_resource_manager *rc_mgr, parse_context *ctx);
+
 /*
 	Memory management, node allocation and free - tmx_mem.c
 */
 void set_alloc_functions();
-void setup_libxml_mem();
+void setup_libxml_mem(); /* also initialises libxml, call before parsing */
 
 tmx_property*        alloc_prop(void);
 tmx_image*           alloc_image(void);
@@ -62,6 +170,8 @@ tmx_text*            alloc_text(void);
 tmx_object*          alloc_object(void);
 tmx_object_group*    alloc_objgr(void);
 tmx_layer*           alloc_layer(void);
+tmx_chunk*           alloc_chunk(void);
+tmx_chunks*          alloc_chunks(void);
 tmx_tile*            alloc_tiles(int count);
 tmx_tileset*         alloc_tileset(void);
 tmx_tileset_list*    alloc_tileset_list(void);
@@ -70,6 +180,8 @@ tmx_map*             alloc_map(void);
 
 resource_holder* pack_tileset_resource(tmx_tileset *value);
 resource_holder* pack_template_resource(tmx_template *value);
+resource_holder* pack_zstd_dict_resource(void *value);
+resource_holder* pack_cache_resource(map_cache *value);
 
 void free_property(tmx_property *p);
 void free_props(tmx_properties *h);
@@ -77,6 +189,7 @@ void free_obj(tmx_object *o);
 void free_objgr(tmx_object_group *o);
 void free_image(tmx_image *i);
 void free_layers(tmx_layer *l);
+void free_chunks(tmx_chunks *c);
 void free_tiles(tmx_tile *t, int tilecount);
 void free_ts(tmx_tileset *ts);
 void free_ts_list(tmx_tileset_list *tsl);
@@ -85,18 +198,121 @@ void free_template(tmx_template *tmpl);
 void resource_deallocator(void *val, const char *key);
 void property_deallocator(void *val, const char *key);
 
+/* Arenas (see tmx_arena_allocation): the nodes of a map are allocated in slabs released with the map,
+   each thread allocates from the arena it entered; the threads of run_jobs allocate from sub-arenas that are
+   merged into the arena of the calling thread once the jobs are done */
+typedef struct _arena_slab arena_slab;
+typedef struct _arena_image arena_image;
+typedef struct _slab_entry slab_entry;
+typedef struct _mem_arena {
+	arena_slab *slabs; /* blocks are allocated from the first one */
+	size_t slab_len; /* length of the next slab */
+	slab_entry *index; /* slabs by page of memory, to find the slab of a block in constant time */
+	size_t index_len, index_count; /* index_len is a power of 2 */
+	int index_failed; /* the index could not grow, slabs are searched one by one */
+	arena_image *images; /* images loaded for the nodes of the arena, see arena_keep_image */
+	struct _mem_arena *parent; /* of a sub-arena */
+} mem_arena;
+
+mem_arena* mk_arena(void);
+void free_arena(mem_arena *arena); /* releases the blocks, not the images */
+void free_arena_images(mem_arena *arena);
+void init_sub_arena(mem_arena *arena, mem_arena *parent);
+void merge_sub_arena(mem_arena *arena); /* moves the blocks and the images of a sub-arena to its parent */
+mem_arena* arena_enter(mem_arena *arena); /* returns the arena of the calling thread before this call, may be NULL */
+mem_arena* arena_active(void); /* the arena allocations come from, NULL if none or suspended */
+/* while suspended, allocations do not come from the arena (resources of a resource manager outlive the map),
+   returns the previous state */
+int arena_suspend(int suspend);
+/* libxml allocations only come from the arena while enabled, returns the previous state */
+int arena_libxml(int enable);
+int arena_keep_image(void **image); /* `*image` is to be freed with the arena if it holds `image` */
+
+/* allocator of the calling thread (see tmx_set_load_options), tmx_alloc_func and tmx_free_func by default */
+void* raw_alloc(void *address, size_t len);
+void raw_free(void *address);
+void get_load_options(tmx_load_options *options); /* options of the calling thread */
+void swap_load_options(tmx_load_options *options); /* exchanges `*options` and the options of the calling thread */
+int keep_load_options(void **options); /* copy of the options of the calling thread, NULL if default */
+
+/* raw_alloc and raw_free, or the arena of the calling thread */
+void* mem_alloc(void *address, size_t len);
+void mem_free(void *address);
+
 /*
 	Misc - tmx_utils.c
 */
 #define MAX(a,b) (a<b) ? b: a;
 
-enum enccmp_t { CSV, B64Z, B64, B64ZSTD };
-int data_decode(const char *source, enum enccmp_t type, size_t gids_count, uint32_t **gids);
+enum enccmp_t { CSV, B64Z, B64, B64ZSTD, XML }; /* XML: 'tile' elements, read by the parser */
+size_t b64_decoded_len(const char *source, size_t src_len);
+int b64_decode_to(const char *source, size_t src_len, char *dest);
+typedef struct _data_decoder data_decoder; /* holds reusable decompression contexts */
+data_decoder* mk_data_decoder(tmx_resource_manager *rc_mgr); /* `rc_mgr` may be NULL */
+void free_data_decoder(data_decoder *decoder);
+int data_decoder_load_zstd_dict(data_decoder *decoder, const char *base_path, const char *rel_path);
+/* `decoder` may be NULL */
+int data_decode(data_decoder *decoder, const char *source, size_t src_len, enum enccmp_t type, size_t gids_count, uint32_t **gids);
+/* copies the payload to decode it in data_decoder_finish, or decodes it right away if only one thread is to be used */
+int data_decode_deferred(data_decoder *decoder, const char *source, size_t src_len, enum enccmp_t type, size_t gids_count, uint32_t **gids);
+int data_decoder_finish(data_decoder *decoder); /* decodes the deferred payloads on several threads */
+int data_decoder_is_lazy(data_decoder *decoder); /* 1 if deferred payloads are kept until data_decoder_decode_lazy */
+int data_decoder_decode_lazy(data_decoder *decoder, uint32_t **gids); /* decodes the payload deferred for `gids` */
+
+/* rectangle of cells kept by tmx_load_region, may extend outside of the layers */
+typedef struct _data_region {
+	int x, y, width, height;
+	int src_width, src_height; /* size of the layers in the document */
+} data_region;
+/* decodes the cells of the layer in `region` (the cells outside of the layer are 0), the payload is only read
+   up to the end of the region, decoded right away */
+int data_decode_region(data_decoder *decoder, const char *source, size_t src_len, enum enccmp_t type, const data_region *region, uint32_t **gids);
+
+void* mk_zstd_dict(const char *buffer, size_t len); /* returns a ZSTD_DDict */
+void* load_zstd_dict(const char *path);
+void free_zstd_dict(void *dict);
+int register_zstd_dict(void *dict);
+void free_zstd_dict_registry(void);
+
+/* builds the lookup table of the chunks of a layer, fails if they are not aligned on a grid */
+int index_chunks(tmx_chunks *chunks);
+tmx_chunk* find_chunk(const tmx_chunks *chunks, int x, int y);
 
 void map_post_parsing(tmx_map **map);
 int set_tiles_runtime_props(tmx_tileset *ts);
 int mk_map_tile_array(tmx_map *map);
 
+/* names of elements and attributes, and enumerated attribute values */
+enum keyword {
+	K_NONE,
+	/* elements */
+	K_MAP, K_TILESET, K_TILE, K_LAYER, K_OBJECTGROUP, K_IMAGELAYER,
+	K_GROUP, K_OBJECT, K_PROPERTIES, K_PROPERTY, K_IMAGE, K_DATA,
+	K_TILEOFFSET, K_ANIMATION, K_FRAME, K_ELLIPSE, K_POLYGON, K_POLYLINE,
+	K_TEXT, K_TEMPLATE, K_CHUNK,
+	/* attributes */
+	K_ID, K_X, K_Y, K_NAME, K_TYPE, K_CLASS,
+	K_VISIBLE, K_HEIGHT, K_WIDTH, K_GID, K_ROTATION, K_OPACITY,
+	K_OFFSETX, K_OFFSETY, K_PARALLAXX, K_PARALLAXY, K_TINTCOLOR, K_COLOR,
+	K_DRAWORDER, K_REPEATX, K_REPEATY, K_TILECOUNT, K_TILEWIDTH, K_TILEHEIGHT,
+	K_SPACING, K_MARGIN, K_OBJECTALIGNMENT, K_TILERENDERSIZE, K_FILLMODE, K_VERSION,
+	K_INFINITE, K_ORIENTATION, K_STAGGERINDEX, K_STAGGERAXIS, K_RENDERORDER, K_BACKGROUNDCOLOR,
+	K_HEXSIDELENGTH, K_PARALLAXORIGINX, K_PARALLAXORIGINY, K_LAYERS, K_TILESETS, K_CHUNKS,
+	K_COMPRESSION, K_ENCODING, K_IMAGEWIDTH, K_IMAGEHEIGHT, K_OBJECTS, K_TRANSPARENTCOLOR,
+	K_POINT, K_BOLD, K_FONTFAMILY, K_ITALIC, K_KERNING, K_PIXELSIZE,
+	K_STRIKEOUT, K_UNDERLINE, K_WRAP, K_HALIGN, K_VALIGN, K_FIRSTGID,
+	K_SOURCE, K_TILES, K_DURATION, K_TILEID, K_PROPERTYTYPE, K_VALUE,
+	/* values */
+	K_ORTHOGONAL, K_ISOMETRIC, K_STAGGERED, K_HEXAGONAL, K_RIGHT_DOWN, K_RIGHT_UP,
+	K_LEFT_DOWN, K_LEFT_UP, K_TOP, K_LEFT, K_BOTTOM, K_RIGHT,
+	K_CENTER, K_TOPLEFT, K_TOPRIGHT, K_BOTTOMLEFT, K_BOTTOMRIGHT, K_STRETCH,
+	K_PRESERVE_ASPECT_FIT, K_GRID, K_TOPDOWN, K_INDEX, K_ODD, K_EVEN,
+	K_COLUMNS, K_STRING, K_INT, K_FLOAT, K_BOOL, K_FILE,
+	K_JUSTIFY, K_TRUE, K_BASE64, K_ZSTD, K_ZLIB, K_GZIP,
+	K_XML, K_CSV, K_TILELAYER
+};
+enum keyword keyword_lookup(const char *str); /* K_NONE if `str` is NULL or not a keyword */
+
 enum tmx_map_orient parse_orient(const char *orient_str);
 enum tmx_map_renderorder parse_renderorder(const char *renderorder);
 enum tmx_obj_alignment parse_obj_alignment(const char *objalign_str);
@@ -108,18 +324,31 @@ enum tmx_stagger_axis parse_stagger_axis(const char *staggeraxis);
 enum tmx_property_type parse_property_type(const char *propertytype);
 enum tmx_horizontal_align parse_horizontal_align(const char *horalign);
 enum tmx_vertical_align parse_vertical_align(const char *veralign);
-enum tmx_layer_type parse_layer_type(const char *nodename);
+enum tmx_layer_type parse_layer_type(enum keyword element);
 int parse_boolean(const char *boolean);
 uint32_t get_color_rgb(const char *c);
 
 int count_char_occurences(const char *str, char c);
-char* str_trim(char *str);
+double str_to_double(const char *str, const char **end);
+const char* str_trim(const char *str, size_t *len);
 char* tmx_strdup(const char *str);
 
 size_t dirpath_len(const char *str);
 char* mk_absolute_path(const char *base_path, const char *rel_path);
 void* load_image(void **ptr, const char *base_path, const char *rel_path);
 
+/* read-only (map_file) or copy-on-write (map_file_cow) memory mapping of a whole file */
+typedef struct _mapped_file {
+	const char *data;
+	size_t len;
+#if defined(WIN32) || defined(__WIN32__) || defined(_WIN32)
+	void *handle; /* file mapping object */
+#endif
+} mapped_file;
+int map_file(const char *path, mapped_file *file);
+int map_file_cow(const char *path, mapped_file *file);
+void unmap_file(mapped_file *file);
+
 /*
 	Hashtable - tmx_hash.c
 */
@@ -133,6 +362,35 @@ void  hashtable_rm(void *hashtable, const char *key, hashtable_entry_deallocator
 void  hashtable_foreach(void *hashtable, hashtable_foreach_functor functor, void *userdata);
 void  free_hashtable(void *hashtable, hashtable_entry_deallocator deallocator);
 
+/*
+	Threads - tmx_thread.c
+*/
+/* runs the job at `index`, `worker` identifies the thread (0 is the calling thread) */
+typedef void (*job_functor)(void *userdata, unsigned int index, unsigned int worker);
+
+unsigned int cpu_count(void);
+unsigned int thread_limit(void); /* max number of threads to use, set by tmx_thread_count, 1 without WANT_THREADS */
+/* runs `job_count` jobs on at most `thread_count` threads, returns once all the jobs are done */
+void run_jobs(job_functor job, void *userdata, unsigned int job_count, unsigned int thread_count);
+
+/* a mutex and its condition variable, wait and broadcast must be called with the lock held */
+typedef struct _thread_sync thread_sync;
+thread_sync* mk_thread_sync(void);
+void free_thread_sync(thread_sync *sync);
+void thread_sync_lock(thread_sync *sync);
+void thread_sync_unlock(thread_sync *sync);
+void thread_sync_wait(thread_sync *sync);
+void thread_sync_broadcast(thread_sync *sync);
+
+/* protects the defaults the library sets in the configuration globals (see set_alloc_functions) */
+void lock_globals(void);
+void unlock_globals(void);
+
+/* starts a thread running `func`, without WANT_THREADS `func` is run before start_thread returns */
+typedef struct _thread_handle thread_handle;
+thread_handle* start_thread(void (*func)(void *arg), void *arg);
+void join_thread(thread_handle *thread); /* waits for the thread to end and frees the handle */
+
 /*
 	Error handling - tmx_err.c
 */
@@ -140,7 +398,20 @@ void  free_hashtable(void *hashtable, hashtable_entry_deallocator deallocator);
 #define snprintf _snprintf
 #endif
 
-extern char _tmx_custom_msg[256];
-#define tmx_err(code, ...) snprintf(_tmx_custom_msg, 256, __VA_ARGS__); tmx_errno = code
+/* error state of a thread, copied to report the error of a job or of an asynchronous load on another thread */
+typedef struct _error_state {
+	tmx_error_codes code; /* E_NONE if no error */
+	char msg[256];
+	const char *file;
+	int line;
+} error_state;
+
+/* sets tmx_errno to `code` and the message to `fmt` (if not NULL), records where the error was raised */
+void set_error(tmx_error_codes code, const char *file, int line, const char *fmt, ...);
+void save_error(error_state *err); /* copies the error of the calling thread */
+void restore_error(const error_state *err); /* makes `err` the error of the calling thread */
+
+#define tmx_err(code, ...) set_error(code, __FILE__, __LINE__, __VA_ARGS__)
+#define tmx_err_code(code) set_error(code, __FILE__, __LINE__, NULL) /* codes with a fixed message (see tmx_strerr) */
 
 #endif /* TMXUTILS_H */
@@ -7,12 +7,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 
 #include <libxml/xmlreader.h>
 
 #include "tmx.h"
 #include "tmx_utils.h"
 
+/* layer data is decoded in place from its text node, whose size is limited
+   to 10MB unless the XML_PARSE_HUGE option is set */
+#define READER_OPTIONS XML_PARSE_HUGE
+
 /*
 	 - Parsers -
 	Each function is called when the XML reader is on an element
@@ -39,47 +44,145 @@ static int check_reader(xmlTextReaderPtr reader) {
 	return 1;
 }
 
+/* keyword of the name of the current node (element or attribute), see keyword_lookup */
+static enum keyword node_keyword(xmlTextReaderPtr reader) {
+	return keyword_lookup((const char*)xmlTextReaderConstName(reader));
+}
+
+/* values returned by libxml are kept by the nodes, they are allocated in the arena of the map (see arena_libxml) */
+static char* get_attribute(xmlTextReaderPtr reader, const char *name) {
+	int prev = arena_libxml(1);
+	char *res = (char*)xmlTextReaderGetAttribute(reader, (const xmlChar*)name);
+	arena_libxml(prev);
+	return res;
+}
+
+/* xmlTextReaderReadInnerXml expands the current node, these nodes are owned by the reader: copy its value */
+static char* read_inner_xml(xmlTextReaderPtr reader) {
+	char *value, *res;
+	if (!(value = (char*)xmlTextReaderReadInnerXml(reader))) return NULL;
+	res = tmx_strdup(value);
+	xmlFree(value);
+	return res;
+}
+
+/* Opens a reader on the file at `path`, if `use_mmap` the file is mapped in `file`
+   and parsed from memory, unmap it once the reader is freed */
+static xmlTextReaderPtr file_reader(const char *path, int use_mmap, mapped_file *file) {
+	xmlTextReaderPtr res;
+
+	if (!use_mmap) {
+		return xmlReaderForFile(path, NULL, READER_OPTIONS);
+	}
+	if (!map_file(path, file)) return NULL;
+	if (file->len > INT_MAX || !(res = xmlReaderForMemory(file->data, (int)file->len, path, NULL, READER_OPTIONS))) {
+		unmap_file(file);
+		return NULL;
+	}
+	return res;
+}
+
+/*
+	External resources
+	Tilesets and templates referenced by a document are not loaded while it is
+	parsed, their references are recorded in the parse_context, then they are
+	loaded several at once (see load_ext_resources).
+*/
+
+int grow_array(void **array, unsigned int *cap, unsigned int len, size_t elem_size) {
+	void *res;
+	unsigned int new_cap;
+	if (len < *cap) return 1;
+	new_cap = *cap? *cap * 2: 8;
+	if (!(res = mem_alloc(*array, new_cap * elem_size))) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	*array = res;
+	*cap = new_cap;
+	return 1;
+}
+
+ext_ref* add_ext_ref(parse_context *ctx, enum resource_type type, const char *key, const char *filename) {
+	ext_ref *res;
+	if (!grow_array((void**)&(ctx->refs), &(ctx->refs_cap), ctx->refs_len, sizeof(ext_ref))) return NULL;
+	res = ctx->refs + ctx->refs_len;
+	memset(res, 0, sizeof(ext_ref));
+	res->type = type;
+	if (!(res->key = tmx_strdup(key))) return NULL;
+	if (!(res->path = mk_absolute_path(filename, key))) {
+		mem_free(res->key);
+		return NULL;
+	}
+	ctx->refs_len++;
+	return res;
+}
+
+void free_parse_context(parse_context *ctx) {
+	unsigned int i;
+	for (i=0; i<ctx->refs_len; i++) {
+		mem_free(ctx->refs[i].key);
+		mem_free(ctx->refs[i].path);
+	}
+	mem_free(ctx->refs);
+	mem_free(ctx->images);
+	memset(ctx, 0, sizeof(parse_context));
+}
+
+int load_or_defer_image(parse_context *ctx, tmx_image *image, const char *filename) {
+	if (ctx->images_deferred) {
+		/* the image loading function is only called from the loading thread */
+		if (!grow_array((void**)&(ctx->images), &(ctx->images_cap), ctx->images_len, sizeof(tmx_image*))) return 0;
+		ctx->images[ctx->images_len++] = image;
+	}
+	else if (!(load_image(&(image->resource_image), filename, image->source))) {
+		tmx_err(E_UNKN, "an error occured in the delegated image loading function");
+		return 0;
+	}
+	return 1;
+}
+
 static int parse_property(xmlTextReaderPtr reader, tmx_property *prop) {
 	char *value;
 	int curr_depth;
-	const char* name;
+	enum keyword kw;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"name"))) { /* name */
+	if ((value = get_attribute(reader, "name"))) { /* name */
 		prop->name = value;
 	} else {
 		tmx_err(E_MISSEL, "xml parser: missing 'name' attribute in the 'property' element");
 		return 0;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"propertytype"))) { /* propertytype */
+	if ((value = get_attribute(reader, "propertytype"))) { /* propertytype */
 		prop->propertytype = value;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*) "type"))) { /* type */
+	if ((value = get_attribute(reader, "type"))) { /* type */
 		prop->type = parse_property_type(value);
-		tmx_free_func(value);
+		mem_free(value);
 	} else {
 		prop->type = PT_STRING;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*) "value"))) { /* source */
+	if ((value = get_attribute(reader, "value"))) { /* source */
 		switch (prop->type) {
 			case PT_OBJECT:
 			case PT_INT:
 				prop->value.integer = atoi(value);
-				tmx_free_func(value);
+				mem_free(value);
 				break;
 			case PT_FLOAT:
 				prop->value.decimal = (float)atof(value);
-				tmx_free_func(value);
+				mem_free(value);
 				break;
 			case PT_BOOL:
 				prop->value.integer = parse_boolean(value);
-				tmx_free_func(value);
+				mem_free(value);
 				break;
 			case PT_COLOR:
 				prop->value.integer = get_color_rgb(value);
-				tmx_free_func(value);
+				mem_free(value);
 				break;
 			case PT_NONE:
 			case PT_STRING:
@@ -89,7 +192,7 @@ static int parse_property(xmlTextReaderPtr reader, tmx_property *prop) {
 				break;
 		}
 	} else if (prop->type == PT_NONE || prop->type == PT_STRING) {
-		if (!(value = (char*)xmlTextReaderReadInnerXml(reader))) {
+		if (!(value = read_inner_xml(reader))) {
 			tmx_err(E_MISSEL, "xml parser: missing 'value' attribute or inner XML for the 'property' element");
 		}
 		prop->value.string = value;
@@ -105,8 +208,8 @@ static int parse_property(xmlTextReaderPtr reader, tmx_property *prop) {
 			if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
 
 			if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-				name = (char*)xmlTextReaderConstName(reader);
-				if (!strcmp(name, "properties")) {
+				kw = node_keyword(reader);
+				if (kw == K_PROPERTIES) {
 					if (!parse_properties(reader, &(prop->value.properties))) return 0;
 				} else if (xmlTextReaderNext(reader) != 1) {
 					return 0;
@@ -122,7 +225,7 @@ static int parse_property(xmlTextReaderPtr reader, tmx_property *prop) {
 static int parse_properties(xmlTextReaderPtr reader, tmx_properties **prop_hashptr) {
 	tmx_property *res;
 	int curr_depth;
-	const char *name;
+	enum keyword kw;
 
 	curr_depth = xmlTextReaderDepth(reader);
 
@@ -137,8 +240,8 @@ static int parse_properties(xmlTextReaderPtr reader, tmx_properties **prop_hashp
 		if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
 
 		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-			name = (char*)xmlTextReaderConstName(reader);
-			if (!strcmp(name, "property")) {
+			kw = node_keyword(reader);
+			if (kw == K_PROPERTY) {
 				if (!(res = alloc_prop())) return 0;
 				if (!parse_property(reader, res)) return 0;
 				hashtable_set((void*)*prop_hashptr, res->name, (void*)res, NULL);
@@ -152,214 +255,220 @@ static int parse_properties(xmlTextReaderPtr reader, tmx_properties **prop_hashp
 }
 
 static int parse_points(xmlTextReaderPtr reader, tmx_shape *shape) {
-	char *value, *v;
+	const char *value, *v, *end;
+	double x, y;
+	void *block;
 	int i;
 
-	if (!(value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"points"))) { /* points */
+	if (xmlTextReaderMoveToAttribute(reader, (xmlChar*)"points") != 1) { /* points */
 		tmx_err(E_MISSEL, "xml parser: missing 'points' attribute in the 'object' element");
 		return 0;
 	}
+	value = (const char*)xmlTextReaderConstValue(reader);
 
-	shape->points_len = 1 + count_char_occurences(value, ' ');
-
-	shape->points = (double**)tmx_alloc_func(NULL, shape->points_len * sizeof(double*)); /* points[i][x,y] */
-	if (!(shape->points)) {
-		tmx_errno = E_ALLOC;
-		return 0;
+	/* one comma per "x,y" point */
+	if (!value || !(shape->points_len = count_char_occurences(value, ','))) {
+		tmx_err(E_XDATA, "xml parser: corrupted point list");
+		goto cleanup;
 	}
 
-	shape->points[0] = (double*)tmx_alloc_func(NULL, shape->points_len * 2 * sizeof(double));
-	if (!(shape->points[0])) {
-		tmx_free_func(shape->points);
-		tmx_errno = E_ALLOC;
-		return 0;
+	/* a single block: the coordinates followed by the (double precision only) points[i] array */
+	if (tmx_shape_float32) {
+		block = mem_alloc(NULL, shape->points_len * 2 * sizeof(float));
+	} else {
+		block = mem_alloc(NULL, shape->points_len * (2 * sizeof(double) + sizeof(double*)));
 	}
-
-	for (i=1; i<shape->points_len; i++) {
-		shape->points[i] = shape->points[0]+(i*2);
+	if (!block) {
+		tmx_err_code(E_ALLOC);
+		goto cleanup;
+	}
+	if (tmx_shape_float32) {
+		shape->fcoords = (float*)block;
+	} else {
+		shape->coords = (double*)block;
+		shape->points = (double**)(shape->coords + shape->points_len * 2); /* points[i][x,y] */
+		for (i=0; i<shape->points_len; i++) {
+			shape->points[i] = shape->coords + i * 2;
+		}
 	}
 
 	v = value;
 	for (i=0; i<shape->points_len; i++) {
-		if (sscanf(v, "%lf,%lf", shape->points[i], shape->points[i]+1) != 2) {
-			tmx_err(E_XDATA, "xml parser: corrupted point list");
-			return 0;
+		x = str_to_double(v, &end);
+		if (end == v || *end != ',') break;
+		v = end + 1;
+		y = str_to_double(v, &end);
+		if (end == v || (*end != ' ' && *end != '\0')) break;
+		v = end;
+
+		if (tmx_shape_float32) {
+			shape->fcoords[i * 2]     = (float)x;
+			shape->fcoords[i * 2 + 1] = (float)y;
+		} else {
+			shape->coords[i * 2]     = x;
+			shape->coords[i * 2 + 1] = y;
 		}
-		v = 1 + strchr(v, ' ');
+	}
+	if (i != shape->points_len) {
+		tmx_err(E_XDATA, "xml parser: corrupted point list");
+		goto cleanup;
 	}
 
-	tmx_free_func(value);
+	xmlTextReaderMoveToElement(reader);
 	return 1;
+cleanup:
+	xmlTextReaderMoveToElement(reader);
+	return 0;
 }
 
 static int parse_text(xmlTextReaderPtr reader, tmx_text *text) {
 	char *value;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"fontfamily"))) { /* fontfamily */
+	if ((value = get_attribute(reader, "fontfamily"))) { /* fontfamily */
 		text->fontfamily = value;
 	} else {
 		text->fontfamily = tmx_strdup("sans-serif");
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"pixelsize"))) { /* pixelsize */
+	if ((value = get_attribute(reader, "pixelsize"))) { /* pixelsize */
 		text->pixelsize = (int)atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"color"))) { /* color */
+	if ((value = get_attribute(reader, "color"))) { /* color */
 		text->color = get_color_rgb(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"wrap"))) { /* wrap */
+	if ((value = get_attribute(reader, "wrap"))) { /* wrap */
 		text->wrap = (int)atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"bold"))) { /* bold */
+	if ((value = get_attribute(reader, "bold"))) { /* bold */
 		text->bold = (int)atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"italic"))) { /* italic */
+	if ((value = get_attribute(reader, "italic"))) { /* italic */
 		text->italic = (int)atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"underline"))) { /* underline */
+	if ((value = get_attribute(reader, "underline"))) { /* underline */
 		text->underline = (int)atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"strikeout"))) { /* strikeout */
+	if ((value = get_attribute(reader, "strikeout"))) { /* strikeout */
 		text->strikeout = (int)atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"kerning"))) { /* kerning */
+	if ((value = get_attribute(reader, "kerning"))) { /* kerning */
 		text->kerning = (int)atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"halign"))) { /* halign */
+	if ((value = get_attribute(reader, "halign"))) { /* halign */
 		text->halign = parse_horizontal_align(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"valign"))) { /* valign */
+	if ((value = get_attribute(reader, "valign"))) { /* valign */
 		text->valign = parse_vertical_align(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
-	if ((value = (char*)xmlTextReaderReadInnerXml(reader))) {
+	if ((value = read_inner_xml(reader))) {
 		text->text = value;
 	}
 
 	return 1;
 }
 
-static tmx_template* parse_template_document(xmlTextReaderPtr reader, tmx_resource_manager *rc_mgr, const char *filename);
-
-static int parse_object(xmlTextReaderPtr reader, tmx_object *obj, int is_on_map, tmx_resource_manager *rc_mgr, const char *filename) {
-	int curr_depth;
-	const char *name;
-	char *value, *ab_path;
-	resource_holder *tmpl;
-	xmlTextReaderPtr sub_reader;
-
-	/* parses each attribute */
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"id"))) { /* id */
-		obj->id = atoi(value);
-		tmx_free_func(value);
-	} else if (is_on_map) {
-		tmx_err(E_MISSEL, "xml parser: missing 'id' attribute in the 'object' element");
-		return 0;
-	}
+static int parse_object(xmlTextReaderPtr reader, tmx_object *obj, int is_on_map, parse_context *ctx, const char *filename) {
+	int curr_depth, has_id = 0, has_x = 0, has_y = 0, has_height = 0, has_gid = 0, has_type = 0, has_template = 0;
+	const char *value;
+	enum keyword kw;
+	ext_ref *ref;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"x"))) { /* x */
-		obj->x = atof(value);
-		tmx_free_func(value);
-	} else if (is_on_map) {
-		tmx_err(E_MISSEL, "xml parser: missing 'x' attribute in the 'object' element");
-		return 0;
-	}
+	/* parses each attribute in a single pass, only kept strings are duplicated */
+	while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+		if (!(value = (const char*)xmlTextReaderConstValue(reader))) continue;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"y"))) { /* y */
-		obj->y = atof(value);
-		tmx_free_func(value);
-	} else if (is_on_map) {
-		tmx_err(E_MISSEL, "xml parser: missing 'y' attribute in the 'object' element");
-		return 0;
+		switch (node_keyword(reader)) {
+			case K_ID: /* id */
+				obj->id = atoi(value);
+				has_id = 1;
+				break;
+			case K_X: /* x */
+				obj->x = atof(value);
+				has_x = 1;
+				break;
+			case K_Y: /* y */
+				obj->y = atof(value);
+				has_y = 1;
+				break;
+			case K_TEMPLATE: /* template, loaded once the document has been parsed */
+				if (!(ref = add_ext_ref(ctx, RC_TX, value, filename))) return 0;
+				ref->user.object = obj;
+				has_template = 1;
+				break;
+			case K_NAME: /* name */
+				if (!(obj->name = tmx_strdup(value))) return 0;
+				break;
+			case K_CLASS: /* class */
+				if (has_type) break; /* `type` prevails over `class` */
+				mem_free(obj->type);
+				if (!(obj->type = tmx_strdup(value))) return 0;
+				break;
+			case K_TYPE: /* type */
+				mem_free(obj->type);
+				if (!(obj->type = tmx_strdup(value))) return 0;
+				has_type = 1;
+				break;
+			case K_VISIBLE: /* visible */
+				obj->visible = (char)atoi(value);
+				break;
+			case K_HEIGHT: /* height */
+				obj->height = atof(value);
+				has_height = 1;
+				break;
+			case K_WIDTH: /* width */
+				obj->width = atof(value);
+				break;
+			case K_GID: /* gid */
+				obj->content.gid = atoi(value);
+				has_gid = 1;
+				break;
+			case K_ROTATION: /* rotation */
+				obj->rotation = atof(value);
+				break;
+			default:
+				break;
+		}
 	}
+	xmlTextReaderMoveToElement(reader);
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"template"))) { /* template */
-		if (rc_mgr) {
-			tmpl = (resource_holder*) hashtable_get((void*)rc_mgr, value);
-			if (tmpl && tmpl->type == RC_TX) {
-				obj->template_ref = tmpl->resource.template;
-			}
+	if (is_on_map) {
+		if (!has_id) {
+			tmx_err(E_MISSEL, "xml parser: missing 'id' attribute in the 'object' element");
+			return 0;
 		}
-		if (!(obj->template_ref)) {
-			if (!(ab_path = mk_absolute_path(filename, value))) return 0;
-			if (!(sub_reader = xmlReaderForFile(ab_path, NULL, 0))) { /* opens */
-				tmx_err(E_XDATA, "xml parser: cannot open object template file '%s'", ab_path);
-				tmx_free_func(ab_path);
-				tmx_free_func(value);
-				return 0;
-			}
-			obj->template_ref = parse_template_document(sub_reader, rc_mgr, ab_path); /* and parses the template file */
-			tmx_free_func(ab_path);
-			if (!(obj->template_ref))
-			{
-				tmx_free_func(value);
-				return 0;
-			}
-			if (rc_mgr) {
-				add_template(rc_mgr, value, obj->template_ref);
-			} else {
-				obj->template_ref->is_embedded = 1;
-			}
+		if (!has_x) {
+			tmx_err(E_MISSEL, "xml parser: missing 'x' attribute in the 'object' element");
+			return 0;
+		}
+		if (!has_y) {
+			tmx_err(E_MISSEL, "xml parser: missing 'y' attribute in the 'object' element");
+			return 0;
 		}
-		obj->obj_type = obj->template_ref->object->obj_type;
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"name"))) { /* name */
-		obj->name = value;
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"type"))) { /* type */
-		obj->type = value;
-	} else if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"class"))) { /* type */
-		obj->type = value;
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"visible"))) { /* visible */
-		obj->visible = (char)atoi(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"height"))) { /* height */
-		obj->obj_type = OT_SQUARE;
-		obj->height = atof(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"width"))) { /* width */
-		obj->width = atof(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"gid"))) { /* gid */
-		obj->obj_type = OT_TILE;
-		obj->content.gid = atoi(value);
-		tmx_free_func(value);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"rotation"))) { /* rotation */
-		obj->rotation = atof(value);
-		tmx_free_func(value);
-	}
+	/* the type of the object: height, then gid, then its template (see link_templates) */
+	if (has_height) obj->obj_type = OT_SQUARE;
+	if (has_gid) obj->obj_type = OT_TILE;
 
 	/* If it has a child, then it's a polygon or a polyline or an ellipse */
 	curr_depth = xmlTextReaderDepth(reader);
@@ -368,17 +477,17 @@ static int parse_object(xmlTextReaderPtr reader, tmx_object *obj, int is_on_map,
 			if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
 
 			if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-				name = (char*)xmlTextReaderConstName(reader);
-				if (!strcmp(name, "properties")) {
+				kw = node_keyword(reader);
+				if (kw == K_PROPERTIES) {
 					if (!parse_properties(reader, &(obj->properties))) return 0;
-				} else if (!strcmp(name, "ellipse")) {
+				} else if (kw == K_ELLIPSE) {
 					obj->obj_type = OT_ELLIPSE;
 				} else {
-					if (!strcmp(name, "polygon")) {
+					if (kw == K_POLYGON) {
 						obj->obj_type = OT_POLYGON;
-					} else if (!strcmp(name, "polyline")) {
+					} else if (kw == K_POLYLINE) {
 						obj->obj_type = OT_POLYLINE;
-					} else if (!strcmp(name, "text")) {
+					} else if (kw == K_TEXT) {
 						obj->obj_type = OT_TEXT;
 					}
 					/* Unknow element, skip its tree */
@@ -396,112 +505,314 @@ static int parse_object(xmlTextReaderPtr reader, tmx_object *obj, int is_on_map,
 		} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
 		         xmlTextReaderDepth(reader) != curr_depth);
 	}
-	if (obj->obj_type == OT_NONE)
+	if (obj->obj_type == OT_NONE && !has_template)
 	{
 		obj->obj_type = OT_POINT;
 	}
 	return 1;
 }
 
-static int parse_data(xmlTextReaderPtr reader, uint32_t **gidsadr, size_t gidscount) {
-	char *value, *inner_xml;
-	enum enccmp_t data_type;
+/* Skips the tree of the current element, the reader is left on its end */
+static int skip_element(xmlTextReaderPtr reader) {
+	int curr_depth = xmlTextReaderDepth(reader);
+	if (xmlTextReaderIsEmptyElement(reader)) return 1;
+	do {
+		if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
+	} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
+	         xmlTextReaderDepth(reader) != curr_depth);
+	return 1;
+}
+
+/* reads the gids of the 'tile' children of the current element ('data' or 'chunk') straight into the gid array */
+static int parse_data_tiles(xmlTextReaderPtr reader, uint32_t **gidsadr, size_t gidscount, const data_region *region, const char *element) {
+	uint32_t *gids, gid;
+	const char *value;
+	size_t i = 0, count = gidscount;
+	long row = 0, col = 0;
+	int curr_depth;
+
+	if (region) count = (size_t)region->src_width * (size_t)region->src_height;
+	if (!(gids = (uint32_t*)mem_alloc(NULL, gidscount * sizeof(uint32_t)))) {
+		tmx_err_code(E_ALLOC);
+		return 0;
+	}
+	memset(gids, 0, gidscount * sizeof(uint32_t)); /* the cells of a region out of the map are 0 */
+	*gidsadr = gids;
+
+	curr_depth = xmlTextReaderDepth(reader);
+	if (!xmlTextReaderIsEmptyElement(reader)) {
+		do {
+			if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
+
+			if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) continue;
+			if (node_keyword(reader) == K_TILE) {
+				if (i == count) {
+					tmx_err(E_XDATA, "xml parser: too many 'tile' elements in the '%s' element", element);
+					return 0;
+				}
+				gid = 0; /* empty cell */
+				while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+					if (node_keyword(reader) == K_GID && (value = (const char*)xmlTextReaderConstValue(reader))) {
+						gid = (uint32_t)strtoul(value, NULL, 10);
+					}
+				}
+				xmlTextReaderMoveToElement(reader);
+
+				if (!region) {
+					gids[i] = gid;
+				}
+				else {
+					if (row >= region->y && row < (long)region->y + region->height &&
+					    col >= region->x && col < (long)region->x + region->width) {
+						gids[(size_t)(row - region->y) * (size_t)region->width + (size_t)(col - region->x)] = gid;
+					}
+					if (++col == region->src_width) {
+						col = 0;
+						row++;
+					}
+				}
+				i++;
+			}
+			/* children of 'tile' and unknow elements are skipped */
+			if (!skip_element(reader)) return 0;
+		} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
+		         xmlTextReaderDepth(reader) != curr_depth);
+	}
 
-	if (!(value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"encoding"))) { /* encoding */
-		tmx_err(E_MISSEL, "xml parser: missing 'encoding' attribute in the 'data' element");
+	if (i < count) {
+		tmx_err(E_XDATA, "layer contains not enough tiles");
 		return 0;
 	}
+	return 1;
+}
+
+/* decodes the text content of the current element ('data' or 'chunk'), only the cells in `region` are kept if it
+   is not NULL */
+static int parse_data_content(xmlTextReaderPtr reader, enum enccmp_t data_type, uint32_t **gidsadr, size_t gidscount, const data_region *region, data_decoder *decoder, const char *element) {
+	const char *content;
+	size_t content_len;
+	int curr_depth, node_type, decoded = 0;
+
+	if (data_type == XML) {
+		return parse_data_tiles(reader, gidsadr, gidscount, region, element);
+	}
+
+	/* the content of the text node is decoded in place, or copied to be decoded on another thread */
+	curr_depth = xmlTextReaderDepth(reader);
+	if (!xmlTextReaderIsEmptyElement(reader)) {
+		do {
+			if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
+
+			node_type = xmlTextReaderNodeType(reader);
+			if (node_type == XML_READER_TYPE_TEXT || node_type == XML_READER_TYPE_CDATA) {
+				if (decoded) {
+					tmx_err(E_XDATA, "xml parser: unexpected content in the '%s' element", element);
+					return 0;
+				}
+				content = (const char*)xmlTextReaderConstValue(reader);
+				content_len = strlen(content);
+				content = str_trim(content, &content_len);
+				if (region) {
+					if (!data_decode_region(decoder, content, content_len, data_type, region, gidsadr)) return 0;
+				}
+				else if (!data_decode_deferred(decoder, content, content_len, data_type, gidscount, gidsadr)) return 0;
+				decoded = 1;
+			} else if (node_type == XML_READER_TYPE_ELEMENT) {
+				/* Unknow element, skip its tree */
+				if (xmlTextReaderNext(reader) != 1) return 0;
+			}
+		} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
+		         xmlTextReaderDepth(reader) != curr_depth);
+	}
 
-	if (!(inner_xml = (char*)xmlTextReaderReadInnerXml(reader))) {
-		tmx_err(E_XDATA, "xml parser: missing content in the 'data' element");
-		tmx_free_func(value);
+	if (!decoded) {
+		tmx_err(E_XDATA, "xml parser: missing content in the '%s' element", element);
 		return 0;
 	}
+	return 1;
+}
 
-	if (!strcmp(value, "base64")) {
-		tmx_free_func(value);
-		value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"compression"); /* compression */
+/* chunks out of `region` (if not NULL) are skipped */
+static int parse_chunk(xmlTextReaderPtr reader, tmx_chunks *chunks, unsigned int *chunks_cap, enum enccmp_t data_type, const data_region *region, data_decoder *decoder) {
+	tmx_chunk *res;
+	const char *value;
+	int has_x = 0, has_y = 0, has_width = 0, has_height = 0;
 
-		data_type = B64;
-		if (value && !strcmp(value, "zstd")) {
-			data_type = B64ZSTD;
-		} else if (value && !(strcmp(value, "zlib") && strcmp(value, "gzip"))) {
-			data_type = B64Z;
-		} else {
-			tmx_err(E_ENCCMP, "xml parser: unsupported data compression: '%s'", value); /* unsupported compression */
-			goto cleanup;
+	if (!grow_array((void**)&(chunks->list), chunks_cap, chunks->count, sizeof(tmx_chunk*))) return 0;
+	if (!(res = alloc_chunk())) return 0;
+	chunks->list[chunks->count++] = res;
+
+	while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+		if (!(value = (const char*)xmlTextReaderConstValue(reader))) continue;
+
+		switch (node_keyword(reader)) {
+			case K_X: /* x */
+				res->x = atoi(value);
+				has_x = 1;
+				break;
+			case K_Y: /* y */
+				res->y = atoi(value);
+				has_y = 1;
+				break;
+			case K_WIDTH: /* width */
+				res->width = atoi(value);
+				has_width = 1;
+				break;
+			case K_HEIGHT: /* height */
+				res->height = atoi(value);
+				has_height = 1;
+				break;
+			default:
+				break;
 		}
-		if (!data_decode(str_trim(inner_xml), data_type, gidscount, gidsadr)) goto cleanup;
+	}
+	xmlTextReaderMoveToElement(reader);
 
-	} else if (!strcmp(value, "xml")) {
-		tmx_err(E_ENCCMP, "xml parser: unimplemented data encoding: XML");
-		goto cleanup;
-	} else if (!strcmp(value, "csv")) {
-		if (!data_decode(str_trim(inner_xml), CSV, gidscount, gidsadr)) goto cleanup;
-	} else {
-		tmx_err(E_ENCCMP, "xml parser: unknown data encoding: %s", value);
-		goto cleanup;
+	if (!has_x || !has_y || !has_width || !has_height) {
+		tmx_err(E_MISSEL, "xml parser: missing '%s' attribute in the 'chunk' element",
+		        !has_x? "x": !has_y? "y": !has_width? "width": "height");
+		return 0;
+	}
+	if (res->width <= 0 || res->height <= 0 || (size_t)res->width * (size_t)res->height > INT_MAX / sizeof(uint32_t)) {
+		tmx_err(E_XDATA, "xml parser: invalid size %dx%d of the chunk at (%d, %d)", res->width, res->height, res->x, res->y);
+		return 0;
+	}
+
+	if (region && ((long)res->x + res->width <= region->x || res->x >= (long)region->x + region->width ||
+	               (long)res->y + res->height <= region->y || res->y >= (long)region->y + region->height)) {
+		chunks->count--;
+		mem_free(res);
+		return skip_element(reader);
+	}
+
+	return parse_data_content(reader, data_type, &(res->gids), (size_t)res->width * (size_t)res->height, NULL, decoder, "chunk");
+}
+
+/* the data of infinite maps is made of chunks (`chunks` is not NULL), each one is decoded on its own
+   with a `region`, only the cells (or the chunks) in the region are kept */
+static int parse_data(xmlTextReaderPtr reader, uint32_t **gidsadr, size_t gidscount, tmx_chunks *chunks, const data_region *region, data_decoder *decoder) {
+	char *value;
+	int curr_depth;
+	unsigned int chunks_cap = 0;
+	enum enccmp_t data_type;
+
+	/* without encoding, the cells are 'tile' elements */
+	value = get_attribute(reader, "encoding"); /* encoding */
+
+	switch (value? keyword_lookup(value): K_XML) {
+		case K_BASE64:
+			mem_free(value);
+			value = get_attribute(reader, "compression"); /* compression */
+
+			if (!value) {
+				data_type = B64;
+				break;
+			}
+			switch (keyword_lookup(value)) {
+				case K_ZSTD:
+					data_type = B64ZSTD;
+					break;
+				case K_ZLIB:
+				case K_GZIP:
+					data_type = B64Z;
+					break;
+				default:
+					tmx_err(E_ENCCMP, "xml parser: unsupported data compression: '%s'", value); /* unsupported compression */
+					goto cleanup;
+			}
+			break;
+		case K_XML:
+			data_type = XML;
+			break;
+		case K_CSV:
+			data_type = CSV;
+			break;
+		default:
+			tmx_err(E_ENCCMP, "xml parser: unknown data encoding: %s", value);
+			goto cleanup;
+	}
+	mem_free(value);
+
+	if (!chunks) {
+		return parse_data_content(reader, data_type, gidsadr, gidscount, region, decoder, "data");
 	}
-	tmx_free_func(value);
-	tmx_free_func(inner_xml);
-	return 1;
+
+	/* chunks of an infinite map */
+	if (chunks->list) {
+		tmx_err(E_XDATA, "xml parser: more than one 'data' element in the layer");
+		return 0;
+	}
+	curr_depth = xmlTextReaderDepth(reader);
+	if (!xmlTextReaderIsEmptyElement(reader)) {
+		do {
+			if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
+
+			if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
+				if (node_keyword(reader) == K_CHUNK) {
+					if (!parse_chunk(reader, chunks, &chunks_cap, data_type, region, decoder)) return 0;
+				} else {
+					/* Unknow element, skip its tree */
+					if (xmlTextReaderNext(reader) != 1) return 0;
+				}
+			}
+		} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
+		         xmlTextReaderDepth(reader) != curr_depth);
+	}
+	return index_chunks(chunks);
 
 cleanup:
-	tmx_free_func(value);
-	tmx_free_func(inner_xml);
+	mem_free(value);
 	return 0;
 }
 
-static int parse_image(xmlTextReaderPtr reader, tmx_image **img_adr, short strict, const char *filename) {
+static int parse_image(xmlTextReaderPtr reader, tmx_image **img_adr, short strict, parse_context *ctx, const char *filename) {
 	tmx_image *res;
 	char *value;
 
 	if (!(res = alloc_image())) return 0;
 	*img_adr = res;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"source"))) { /* source */
+	if ((value = get_attribute(reader, "source"))) { /* source */
 		res->source = value;
-		if (!(load_image(&(res->resource_image), filename, value))) {
-			tmx_err(E_UNKN, "xml parser: an error occured in the delegated image loading function");
-			return 0;
-		}
+		if (!load_or_defer_image(ctx, res, filename)) return 0;
 	} else {
 		tmx_err(E_MISSEL, "xml parser: missing 'source' attribute in the 'image' element");
 		return 0;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"height"))) { /* height */
+	if ((value = get_attribute(reader, "height"))) { /* height */
 		res->height = atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	} else if (strict) {
 		tmx_err(E_MISSEL, "xml parser: missing 'height' attribute in the 'image' element");
 		return 0;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"width"))) { /* width */
+	if ((value = get_attribute(reader, "width"))) { /* width */
 		res->width = atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	} else if (strict) {
 		tmx_err(E_MISSEL, "xml parser: missing 'width' attribute in the 'image' element");
 		return 0;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"trans"))) { /* trans */
+	if ((value = get_attribute(reader, "trans"))) { /* trans */
 		res->trans = get_color_rgb(value);
 		res->uses_trans = 1;
-		tmx_free_func(value);
+		mem_free(value);
 	}
 
 	return 1;
 }
 
 /* parse layers and objectgroups */
-static int parse_layer(xmlTextReaderPtr reader, tmx_layer **layer_headadr, int map_h, int map_w, enum tmx_layer_type type, tmx_resource_manager *rc_mgr, const char *filename) {
+static int parse_layer(xmlTextReaderPtr reader, tmx_layer **layer_headadr, tmx_map *map, enum tmx_layer_type type, parse_context *ctx, data_decoder *decoder, const char *filename) {
 	tmx_layer *res;
 	tmx_object *obj;
+	tmx_object_group *objgr = NULL;
 	int curr_depth;
-	const char *name;
-	char *value;
+	const char *value;
+	enum keyword kw;
 	enum tmx_layer_type child_type;
 
 	curr_depth = xmlTextReaderDepth(reader);
@@ -513,109 +824,100 @@ static int parse_layer(xmlTextReaderPtr reader, tmx_layer **layer_headadr, int m
 	}
 	*layer_headadr = res;
 
-	/* parses each attribute */
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"id"))) { /* id */
-		res->id = atoi(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"name"))) { /* name */
-		res->name = value;
-	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'name' attribute in the 'layer' element");
-		return 0;
+	/* objectgroups have more properties */
+	if (type == L_OBJGR) {
+		if (!(objgr = alloc_objgr())) return 0;
+		res->content.objgr = objgr;
+		objgr->draworder = parse_objgr_draworder(NULL);
 	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"class"))) {
-		res->class_type = value;
+	/* tile layers of infinite maps */
+	if (type == L_LAYER && map->infinite) {
+		if (!(res->chunks = alloc_chunks())) return 0;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"visible"))) { /* visible */
-		res->visible = (char)atoi(value);
-		tmx_free_func(value);
-	}
+	/* parses each attribute in a single pass, only kept strings are duplicated */
+	while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+		if (!(value = (const char*)xmlTextReaderConstValue(reader))) continue;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"opacity"))) { /* opacity */
-		res->opacity = atof(value);
-		tmx_free_func(value);
+		switch (node_keyword(reader)) {
+			case K_ID: /* id */
+				res->id = atoi(value);
+				break;
+			case K_NAME: /* name */
+				if (!(res->name = tmx_strdup(value))) return 0;
+				break;
+			case K_CLASS:
+				if (!(res->class_type = tmx_strdup(value))) return 0;
+				break;
+			case K_VISIBLE: /* visible */
+				res->visible = (char)atoi(value);
+				break;
+			case K_OPACITY: /* opacity */
+				res->opacity = atof(value);
+				break;
+			case K_OFFSETX: /* offsetx */
+				res->offsetx = (int)atoi(value);
+				break;
+			case K_OFFSETY: /* offsety */
+				res->offsety = (int)atoi(value);
+				break;
+			case K_PARALLAXX: /* parallaxx */
+				res->parallaxx = atof(value);
+				break;
+			case K_PARALLAXY: /* parallaxy */
+				res->parallaxy = atof(value);
+				break;
+			case K_TINTCOLOR: /* tintcolor */
+				res->tintcolor = get_color_rgb(value);
+				break;
+			case K_COLOR: /* color */
+				if (type == L_OBJGR) objgr->color = get_color_rgb(value);
+				break;
+			case K_DRAWORDER: /* draworder */
+				if (type == L_OBJGR) objgr->draworder = parse_objgr_draworder(value);
+				break;
+			case K_REPEATX: /* repeatx */
+				if (type == L_IMAGE) res->repeatx = atoi(value);
+				break;
+			case K_REPEATY: /* repeaty */
+				if (type == L_IMAGE) res->repeaty = atoi(value);
+				break;
+			default:
+				break;
+		}
 	}
+	xmlTextReaderMoveToElement(reader);
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"offsetx"))) { /* offsetx */
-		res->offsetx = (int)atoi(value);
-		tmx_free_func(value);
+	if (!(res->name)) {
+		tmx_err(E_MISSEL, "xml parser: missing 'name' attribute in the 'layer' element");
+		return 0;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"offsety"))) { /* offsety */
-		res->offsety = (int)atoi(value);
-		tmx_free_func(value);
+	/* object groups and layers of infinite maps may be empty */
+	if ((type == L_OBJGR || res->chunks) && xmlTextReaderIsEmptyElement(reader)) {
+		return 1;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"parallaxx"))) { /* parallaxx */
-		res->parallaxx = atof(value);
-		tmx_free_func(value);
-	}
+	do {
+		if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"parallaxy"))) { /* parallaxy */
-		res->parallaxy = atof(value);
-		tmx_free_func(value);
-	}
+		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
+			kw = node_keyword(reader);
+			if (kw == K_PROPERTIES) {
+				if (!parse_properties(reader, &(res->properties))) return 0;
+			} else if (kw == K_DATA) {
+				if (!parse_data(reader, &(res->content.gids), map->height * map->width, res->chunks, ctx->region, decoder)) return 0;
+			} else if (kw == K_IMAGE) {
+				if (!parse_image(reader, &(res->content.image), 0, ctx, filename)) return 0;
+			} else if (kw == K_OBJECT) {
+				if (!(obj = alloc_object())) return 0;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tintcolor"))) { /* tintcolor */
-		res->tintcolor = get_color_rgb(value);
-		tmx_free_func(value);
-	}
+				obj->next = res->content.objgr->head;
+				res->content.objgr->head = obj;
 
-	/* objectgroups have more properties */
-	if (type == L_OBJGR) {
-		tmx_object_group *objgr = alloc_objgr();
-		res->content.objgr = objgr;
-
-		if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"color"))) { /* color */
-			objgr->color = get_color_rgb(value);
-			tmx_free_func(value);
-		}
-
-		value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"draworder"); /* draworder */
-		objgr->draworder = parse_objgr_draworder(value);
-		tmx_free_func(value);
-	}
-
-	if (type == L_OBJGR && xmlTextReaderIsEmptyElement(reader)) {
-		return 1;
-	}
-
-	if (type == L_IMAGE) {
-		if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"repeatx"))) { /* repeatx */
-			res->repeatx = atoi(value);
-			tmx_free_func(value);
-		}
-
-		if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"repeaty"))) { /* repeaty */
-			res->repeaty = atoi(value);
-			tmx_free_func(value);
-		}
-	}
-
-	do {
-		if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
-
-		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-			name = (char*)xmlTextReaderConstName(reader);
-			if (!strcmp(name, "properties")) {
-				if (!parse_properties(reader, &(res->properties))) return 0;
-			} else if (!strcmp(name, "data")) {
-				if (!parse_data(reader, &(res->content.gids), map_h * map_w)) return 0;
-			} else if (!strcmp(name, "image")) {
-				if (!parse_image(reader, &(res->content.image), 0, filename)) return 0;
-			} else if (!strcmp(name, "object")) {
-				if (!(obj = alloc_object())) return 0;
-
-				obj->next = res->content.objgr->head;
-				res->content.objgr->head = obj;
-
-				if (!parse_object(reader, obj, 1, rc_mgr, filename)) return 0;
-			} else if (type == L_GROUP && (child_type = parse_layer_type(name)) != L_NONE) {
-				if (!parse_layer(reader, &(res->content.group_head), map_h, map_w, child_type, rc_mgr, filename)) return 0;
+				if (!parse_object(reader, obj, 1, ctx, filename)) return 0;
+			} else if (type == L_GROUP && (child_type = parse_layer_type(kw)) != L_NONE) {
+				if (!parse_layer(reader, &(res->content.group_head), map, child_type, ctx, decoder, filename)) return 0;
 			} else {
 				/* Unknow element, skip its tree */
 				if (xmlTextReaderNext(reader) != 1) return 0;
@@ -629,17 +931,17 @@ static int parse_layer(xmlTextReaderPtr reader, tmx_layer **layer_headadr, int m
 
 static int parse_tileoffset(xmlTextReaderPtr reader, int *x, int *y) {
 	char *value;
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"x"))) { /* x offset */
+	if ((value = get_attribute(reader, "x"))) { /* x offset */
 		*x = atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	} else {
 		tmx_err(E_MISSEL, "xml parser: missing 'x' attribute in the 'tileoffset' element");
 		return 0;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"y"))) { /* y offset */
+	if ((value = get_attribute(reader, "y"))) { /* y offset */
 		*y = atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	} else {
 		tmx_err(E_MISSEL, "xml parser: missing 'y' attribute in the 'tileoffset' element");
 		return 0;
@@ -648,107 +950,197 @@ static int parse_tileoffset(xmlTextReaderPtr reader, int *x, int *y) {
 	return 1;
 }
 
-/* recursive function that alloc tmx_anim_frames on the stack and then move them to the heap */
-static tmx_anim_frame* parse_animation(xmlTextReaderPtr reader, int frame_count, unsigned int *length) {
-	char *value;
+static int parse_animation(xmlTextReaderPtr reader, tileset_state *state, unsigned int *length) {
+	const char *value;
 	int curr_depth;
 	tmx_anim_frame frame;
-	tmx_anim_frame *res;
 
 	curr_depth = xmlTextReaderDepth(reader);
+	*length = 0;
+	if (xmlTextReaderIsEmptyElement(reader)) return 1;
 
-	value = (char*)xmlTextReaderConstName(reader);
-	if (strcmp(value, "frame")) {
-		tmx_err(E_XDATA, "xml parser: invalid element '%s' within an 'animation'", value);
-		return 0;
+	do {
+		if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
+
+		if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT || xmlTextReaderDepth(reader) != curr_depth+1) continue;
+
+		value = (const char*)xmlTextReaderConstName(reader);
+		if (keyword_lookup(value) != K_FRAME) {
+			tmx_err(E_XDATA, "xml parser: invalid element '%s' within an 'animation'", value);
+			return 0;
+		}
+
+		if (xmlTextReaderMoveToAttribute(reader, (xmlChar*)"tileid") == 1 && (value = (const char*)xmlTextReaderConstValue(reader))) { /* tileid */
+			frame.tile_id = atoi(value);
+		}
+		else {
+			tmx_err(E_MISSEL, "xml parser: missing 'tileid' attribute in the 'frame' element");
+			return 0;
+		}
+
+		if (xmlTextReaderMoveToAttribute(reader, (xmlChar*)"duration") == 1 && (value = (const char*)xmlTextReaderConstValue(reader))) { /* duration */
+			frame.duration = atoi(value);
+		}
+		else {
+			tmx_err(E_MISSEL, "xml parser: missing 'duration' attribute in the 'frame' element");
+			return 0;
+		}
+		xmlTextReaderMoveToElement(reader);
+
+		if (!add_anim_frame(state, frame)) return 0;
+		*length += 1;
+	} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
+	         xmlTextReaderDepth(reader) != curr_depth);
+
+	return 1;
+}
+
+/* appends `frame` to the frame pool */
+int add_anim_frame(tileset_state *state, tmx_anim_frame frame) {
+	unsigned int cap;
+	tmx_anim_frame *frames;
+
+	/* amortized growth */
+	if (state->frames_len == state->frames_cap) {
+		cap = state->frames_cap? state->frames_cap * 2: 16;
+		if (!(frames = (tmx_anim_frame*)mem_alloc(state->tileset->frames, cap * sizeof(tmx_anim_frame)))) {
+			tmx_err(E_ALLOC, "failed to alloc %u animation frames", cap);
+			return 0;
+		}
+		state->tileset->frames = frames;
+		state->frames_cap = cap;
 	}
+	state->tileset->frames[state->frames_len++] = frame;
+	return 1;
+}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tileid"))) { /* tileid */
-		frame.tile_id = atoi(value);
-		tmx_free_func(value);
+/* moves the tiles to the beginning of tiles[], keeps their order, returns their count */
+static unsigned int compact_tiles(tmx_tileset *ts) {
+	unsigned int i, len;
+	for (i=0, len=0; i<ts->tilecount; i++) {
+		if (ts->tiles[i].tileset) { /* set by place_tile */
+			if (i != len) {
+				ts->tiles[len] = ts->tiles[i];
+				memset(ts->tiles+i, 0, sizeof(tmx_tile));
+			}
+			len++;
+		}
 	}
-	else {
-		tmx_err(E_MISSEL, "xml parser: missing 'tileid' attribute in the 'frame' element");
-		return 0;
+	return len;
+}
+
+tmx_tile* place_tile(tileset_state *state, unsigned int id) {
+	tmx_tileset *ts = state->tileset;
+	tmx_tile *res;
+
+	if (state->tiles_len == ts->tilecount) {
+		tmx_err(E_XDATA, "more tiles than 'tilecount' in tileset '%s'", ts->name);
+		return NULL;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"duration"))) { /* duration */
-		frame.duration = atoi(value);
-		tmx_free_func(value);
+	if (!state->tiles_appended) {
+		if (id < ts->tilecount && !(ts->tiles[id].tileset)) {
+			res = &(ts->tiles[id]);
+		} else { /* switches to append mode, tiles placed by id stay sorted */
+			compact_tiles(ts);
+			state->tiles_appended = state->tiles_sorted = 1;
+		}
 	}
-	else {
-		tmx_err(E_MISSEL, "xml parser: missing 'duration' attribute in the 'frame' element");
-		return 0;
+	if (state->tiles_appended) {
+		res = &(ts->tiles[state->tiles_len]);
+		if (state->tiles_len > 0 && res[-1].id > id) {
+			state->tiles_sorted = 0;
+		}
+	}
+
+	state->tiles_len++;
+	res->id = id;
+	res->tileset = ts;
+	return res;
+}
+
+static int tile_id_cmp(const void *a, const void *b) {
+	unsigned int id_a = ((const tmx_tile*)a)->id, id_b = ((const tmx_tile*)b)->id;
+	return (id_a > id_b) - (id_a < id_b);
+}
+
+/* final layout of tiles[]: indexed by id for image based tilesets,
+   sorted by id and without hole for collection of images tilesets */
+static int arrange_tiles(tileset_state *state) {
+	tmx_tileset *ts = state->tileset;
+	unsigned int i, id;
+
+	if (!state->tiles_appended) {
+		if (!(ts->image)) compact_tiles(ts);
+		return 1;
 	}
 
-	if (xmlTextReaderNext(reader) != 1) return 0;
+	if (!state->tiles_sorted) {
+		qsort(ts->tiles, state->tiles_len, sizeof(tmx_tile), tile_id_cmp);
+	}
+	if (!(ts->image)) return 1;
 
-	/* skips unwanted nodes */
-	while (xmlTextReaderDepth(reader)  > curr_depth ||
-		  (xmlTextReaderDepth(reader) == curr_depth && xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)) {
-		if (xmlTextReaderNext(reader) != 1) return 0;
+	for (i=0; i<state->tiles_len; i++) {
+		if (ts->tiles[i].id >= ts->tilecount) {
+			tmx_err(E_XDATA, "tile id %u out of range in tileset '%s'", ts->tiles[i].id, ts->name);
+			return 0;
+		}
+		if (i > 0 && ts->tiles[i].id == ts->tiles[i-1].id) {
+			tmx_err(E_XDATA, "duplicate tile id %u in tileset '%s'", ts->tiles[i].id, ts->name);
+			return 0;
+		}
+	}
+	/* ids are sorted and unique (tiles[i].id >= i), moves the tiles from the last one */
+	for (i=state->tiles_len; i-- > 0;) {
+		id = ts->tiles[i].id;
+		if (id != i) {
+			ts->tiles[id] = ts->tiles[i];
+			memset(ts->tiles+i, 0, sizeof(tmx_tile));
+		}
 	}
+	return 1;
+}
+
+int finish_tileset(tileset_state *state) {
+	tmx_tileset *ts = state->tileset;
+	tmx_anim_frame *frames;
+	unsigned int i;
 
-	/* no more frames, alloc on the heap and returns */
-	if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_END_ELEMENT && xmlTextReaderDepth(reader) < curr_depth) {
-		res = (tmx_anim_frame*)tmx_alloc_func(NULL, (frame_count+1) * sizeof(tmx_anim_frame));
-		if (res == NULL) {
-			tmx_err(E_ALLOC, "xml parser: failed to alloc %d animation frames", frame_count+1);
-			return NULL;
+	if (!arrange_tiles(state)) return 0;
+
+	/* the frame pool is complete, points the animated tiles to their frames */
+	if (state->frames_len > 0) {
+		if ((frames = (tmx_anim_frame*)mem_alloc(ts->frames, state->frames_len * sizeof(tmx_anim_frame)))) {
+			ts->frames = frames; /* shrinks to fit */
 		}
-		res[frame_count] = frame;
-		*length = frame_count+1;
-		return res;
-	}
-	/* recurse */
-	else if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-		res = parse_animation(reader, frame_count+1, length);
-		if (res != NULL) {
-			res[frame_count] = frame;
+		for (i=0; i<ts->tilecount; i++) {
+			if (ts->tiles[i].animation_len > 0) {
+				ts->tiles[i].animation = ts->frames + ts->tiles[i].user_data.integer;
+			}
+			ts->tiles[i].user_data.integer = 0;
 		}
-		return res;
 	}
 
-	tmx_err(E_XDATA, "xml parser: unexpected element '%s' within 'animation'", (char*)xmlTextReaderConstName(reader));
-	return NULL;
+	/* if this is not a collection-of-images tileset, determine the bounding rects for each tile */
+	if (ts->image && !set_tiles_runtime_props(ts)) return 0;
+
+	return 1;
 }
 
-static int parse_tile(xmlTextReaderPtr reader, tmx_tileset *tileset, tmx_resource_manager *rc_mgr, const char *filename) {
+static int parse_tile(xmlTextReaderPtr reader, tileset_state *state, parse_context *ctx, const char *filename) {
 	tmx_tile *res = NULL;
 	tmx_object *obj;
-	unsigned int id;
 	int curr_depth;
-	int len, to_move;
 	int has_width = 0, has_height = 0;
-	const char *name;
+	enum keyword kw;
 	char *value;
 
 	curr_depth = xmlTextReaderDepth(reader);
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"id"))) { /* id */
-		id = atoi(value);
-		/* Insertion sort */
-		len = tileset->user_data.integer;
-		for (to_move=0; (len-1)-to_move >= 0; to_move++) {
-			if (tileset->tiles[(len-1)-to_move].id < id) {
-				break;
-			}
-		}
-		if (to_move > 0) {
-			memmove((tileset->tiles)+(len-to_move+1), (tileset->tiles)+(len-to_move), to_move * sizeof(tmx_tile));
-		}
-		res = &(tileset->tiles[len-to_move]);
-
-		if ((unsigned int)(tileset->user_data.integer) == tileset->tilecount) {
-			tileset->user_data.integer = 0;
-		}
-		else {
-			tileset->user_data.integer += 1;
-		}
-		/* --- */
-		res->id = id;
-		res->tileset = tileset;
-		tmx_free_func(value);
+	if ((value = get_attribute(reader, "id"))) { /* id */
+		res = place_tile(state, (unsigned int)atoi(value));
+		mem_free(value);
+		if (!res) return 0;
 	}
 	else {
 		tmx_err(E_MISSEL, "xml parser: missing 'id' attribute in the 'tile' element");
@@ -759,28 +1151,28 @@ static int parse_tile(xmlTextReaderPtr reader, tmx_tileset *tileset, tmx_resourc
 	res->ul_x = res->ul_y = 0;
 	res->width = res->height = -1;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"type"))) { /* type */
+	if ((value = get_attribute(reader, "type"))) { /* type */
 		res->type = value;
-	} else if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"class"))) { 
+	} else if ((value = get_attribute(reader, "class"))) { 
 		res->type = value;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"x"))) { /* x */
+	if ((value = get_attribute(reader, "x"))) { /* x */
 		res->ul_x = atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"y"))) { /* y */
+	if ((value = get_attribute(reader, "y"))) { /* y */
 		res->ul_y = atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	}
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"width"))) { /* width */
+	if ((value = get_attribute(reader, "width"))) { /* width */
 		res->width = atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 		has_width = 1;
 	}
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"height"))) { /* height */
+	if ((value = get_attribute(reader, "height"))) { /* height */
 		res->height = atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 		has_height = 1;
 	}
 
@@ -789,42 +1181,34 @@ static int parse_tile(xmlTextReaderPtr reader, tmx_tileset *tileset, tmx_resourc
 			if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
 
 			if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-				name = (char*)xmlTextReaderConstName(reader);
-				if (!strcmp(name, "properties")) {
+				kw = node_keyword(reader);
+				if (kw == K_PROPERTIES) {
 					if (!parse_properties(reader, &(res->properties))) return 0;
 				}
-				else if (!strcmp(name, "image")) {
-					if (!parse_image(reader, &(res->image), 0, filename)) return 0;
+				else if (kw == K_IMAGE) {
+					if (!parse_image(reader, &(res->image), 0, ctx, filename)) return 0;
 				}
-				else if (!strcmp(name, "objectgroup")) { /* tile collision */
+				else if (kw == K_OBJECTGROUP) { /* tile collision */
 					if (xmlTextReaderIsEmptyElement(reader)) continue;
 					do {
 						if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
-						name = (char*)xmlTextReaderConstName(reader);
-						if (!strcmp(name, "object")) {
+						kw = node_keyword(reader);
+						if (kw == K_OBJECT) {
 							if (!(obj = alloc_object())) return 0;
 
 							obj->next = res->collision;
 							res->collision = obj;
 
-							if (!parse_object(reader, obj, 0, rc_mgr, filename)) return 0;
+							if (!parse_object(reader, obj, 0, ctx, filename)) return 0;
 						}
 						/* else: ignore */
 					} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
 							 xmlTextReaderDepth(reader) != curr_depth+1);
 				}
-				else if (!strcmp(name, "animation")) {
-					/* reads the first frame */
-					do {
-						if (xmlTextReaderRead(reader) != 1) return 0;
-						name = (char*)xmlTextReaderConstName(reader);
-						if (!strcmp(name, "frame")) {
-							res->animation = parse_animation(reader, 0, &(res->animation_len));
-							if (!(res->animation)) return 0;
-						}
-						/* else: ignore */
-					} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
-							 xmlTextReaderDepth(reader) != curr_depth+1);
+				else if (kw == K_ANIMATION) {
+					/* offset of the first frame in the pool until the whole tileset is parsed */
+					res->user_data.integer = (int)state->frames_len;
+					if (!parse_animation(reader, state, &(res->animation_len))) return 0;
 				}
 				else {
 					/* Unknow element, skip its tree */
@@ -844,74 +1228,77 @@ static int parse_tile(xmlTextReaderPtr reader, tmx_tileset *tileset, tmx_resourc
 }
 
 /* parses a tileset within the tmx file or in a dedicated tsx file */
-static int parse_tileset(xmlTextReaderPtr reader, tmx_tileset *ts_addr, tmx_resource_manager *rc_mgr, const char *filename) {
-	int curr_depth;
-	const char *name;
-	char *value;
+static int parse_tileset(xmlTextReaderPtr reader, tmx_tileset *ts_addr, parse_context *ctx, const char *filename) {
+	int curr_depth, has_tilecount = 0, has_tilewidth = 0, has_tileheight = 0;
+	const char *value;
+	enum keyword kw;
+	tileset_state state = {NULL, 0, 0, 0, 0, 0};
+
+	state.tileset = ts_addr;
 
 	curr_depth = xmlTextReaderDepth(reader);
 
-	/* parses each attribute */
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"name"))) { /* name */
-		ts_addr->name = value;
-	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'name' attribute in the 'tileset' element");
-		return 0;
-	}
+	/* parses each attribute in a single pass, only kept strings are duplicated */
+	while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+		if (!(value = (const char*)xmlTextReaderConstValue(reader))) continue;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"class"))) {
-		ts_addr->class_type = value;
+		switch (node_keyword(reader)) {
+			case K_NAME: /* name */
+				if (!(ts_addr->name = tmx_strdup(value))) return 0;
+				break;
+			case K_CLASS:
+				if (!(ts_addr->class_type = tmx_strdup(value))) return 0;
+				break;
+			case K_TILECOUNT: /* tilecount */
+				ts_addr->tilecount = atoi(value);
+				has_tilecount = 1;
+				break;
+			case K_TILEWIDTH: /* tile_width */
+				ts_addr->tile_width = atoi(value);
+				has_tilewidth = 1;
+				break;
+			case K_TILEHEIGHT: /* tile_height */
+				ts_addr->tile_height = atoi(value);
+				has_tileheight = 1;
+				break;
+			case K_SPACING: /* spacing */
+				ts_addr->spacing = atoi(value);
+				break;
+			case K_MARGIN: /* margin */
+				ts_addr->margin = atoi(value);
+				break;
+			case K_OBJECTALIGNMENT: /* objectalignment */
+				ts_addr->objectalignment = parse_obj_alignment(value);
+				break;
+			case K_TILERENDERSIZE: /* tilerendersize */
+				ts_addr->tile_render_size = parse_tile_render_size(value);
+				break;
+			case K_FILLMODE: /* fillmode */
+				ts_addr->fill_mode = parse_fillmode(value);
+				break;
+			default:
+				break;
+		}
 	}
+	xmlTextReaderMoveToElement(reader);
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tilecount"))) { /* tilecount */
-		ts_addr->tilecount = atoi(value);
-		tmx_free_func(value);
-	} else {
+	if (!(ts_addr->name)) {
+		tmx_err(E_MISSEL, "xml parser: missing 'name' attribute in the 'tileset' element");
+		return 0;
+	}
+	if (!has_tilecount) {
 		tmx_err(E_MISSEL, "xml parser: missing 'tilecount' attribute in the 'tileset' element");
 		return 0;
 	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tilewidth"))) { /* tile_width */
-		ts_addr->tile_width = atoi(value);
-		tmx_free_func(value);
-	} else {
+	if (!has_tilewidth) {
 		tmx_err(E_MISSEL, "xml parser: missing 'tilewidth' attribute in the 'tileset' element");
 		return 0;
 	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tileheight"))) { /* tile_height */
-		ts_addr->tile_height = atoi(value);
-		tmx_free_func(value);
-	} else {
+	if (!has_tileheight) {
 		tmx_err(E_MISSEL, "xml parser: missing 'tileheight' attribute in the 'tileset' element");
 		return 0;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"spacing"))) { /* spacing */
-		ts_addr->spacing = atoi(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"margin"))) { /* margin */
-		ts_addr->margin = atoi(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"objectalignment"))) { /* objectalignment */
-		ts_addr->objectalignment = parse_obj_alignment(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tilerendersize"))) { /* tilerendersize */
-		ts_addr->tile_render_size = parse_tile_render_size(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"fillmode"))) { /* fillmode */
-		ts_addr->fill_mode = parse_fillmode(value);
-		tmx_free_func(value);
-	}
-
 	if (!(ts_addr->tiles = alloc_tiles(ts_addr->tilecount))) return 0;
 
 	/* Parse each child */
@@ -919,15 +1306,15 @@ static int parse_tileset(xmlTextReaderPtr reader, tmx_tileset *ts_addr, tmx_reso
 		if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
 
 		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-			name = (char*)xmlTextReaderConstName(reader);
-			if (!strcmp(name, "image")) {
-				if (!parse_image(reader, &(ts_addr->image), 1, filename)) return 0;
-			} else if (!strcmp(name, "tileoffset")) {
+			kw = node_keyword(reader);
+			if (kw == K_IMAGE) {
+				if (!parse_image(reader, &(ts_addr->image), 1, ctx, filename)) return 0;
+			} else if (kw == K_TILEOFFSET) {
 				if (!parse_tileoffset(reader, &(ts_addr->x_offset), &(ts_addr->y_offset))) return 0;
-			} else if (!strcmp(name, "properties")) {
+			} else if (kw == K_PROPERTIES) {
 				if (!parse_properties(reader, &(ts_addr->properties))) return 0;
-			} else if (!strcmp(name, "tile")) {
-				if (!parse_tile(reader, ts_addr, rc_mgr, filename)) return 0;
+			} else if (kw == K_TILE) {
+				if (!parse_tile(reader, &state, ctx, filename)) return 0;
 			} else {
 				/* Unknown element, skip its tree */
 				if (xmlTextReaderNext(reader) != 1) return 0;
@@ -936,67 +1323,35 @@ static int parse_tileset(xmlTextReaderPtr reader, tmx_tileset *ts_addr, tmx_reso
 	} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
 	         xmlTextReaderDepth(reader) != curr_depth);
 
-	/* if this is not a collection-of-images tileset, determine the bounding rects for each tile */
-	if (ts_addr->image && !set_tiles_runtime_props(ts_addr)) return 0;
-
-	return 1;
+	return finish_tileset(&state);
 }
 
 /* Parses a tileset to be stored in a list of tilesets */
-static int parse_tileset_list(xmlTextReaderPtr reader, tmx_tileset_list **ts_headadr, tmx_resource_manager *rc_mgr, const char *filename) {
+static int parse_tileset_list(xmlTextReaderPtr reader, tmx_tileset_list **ts_headadr, parse_context *ctx, const char *filename) {
 	tmx_tileset_list *res_list = NULL;
 	tmx_tileset *res = NULL;
-	resource_holder *rc_holder;
-	int ret;
-	char *value, *ab_path;
-	xmlTextReaderPtr sub_reader;
+	char *value;
+	ext_ref *ref;
 
 	if (!(res_list = alloc_tileset_list())) return 0;
 	res_list->next = *ts_headadr;
 	*ts_headadr = res_list;
 
 	/* parses each attribute */
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"firstgid"))) { /* fisrtgid */
+	if ((value = get_attribute(reader, "firstgid"))) { /* fisrtgid */
 		res_list->firstgid = atoi(value);
-		tmx_free_func(value);
+		mem_free(value);
 	} else {
 		tmx_err(E_MISSEL, "xml parser: missing 'firstgid' attribute in the 'tileset' element");
 		return 0;
 	}
 
-	/* External Tileset */
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"source"))) { /* source */
+	/* External Tileset, loaded once the document has been parsed */
+	if ((value = get_attribute(reader, "source"))) { /* source */
 		res_list->source = value;
-		if (rc_mgr) {
-			rc_holder = (resource_holder*) hashtable_get((void*)rc_mgr, value);
-			if (rc_holder && rc_holder->type == RC_TSX) {
-				res = rc_holder->resource.tileset;
-				if (res) {
-					res_list->tileset = res;
-					return 1;
-				}
-			}
-		}
-		if (!(res = alloc_tileset())) {
-			return 0;
-		}
-		res_list->tileset = res;
-		if (rc_mgr) {
-			add_tileset(rc_mgr, value, res);
-		}
-		else {
-			res_list->is_embedded = 1;
-		}
-		if (!(ab_path = mk_absolute_path(filename, value))) return 0;
-		if (!(sub_reader = xmlReaderForFile(ab_path, NULL, 0)) || !check_reader(sub_reader)) { /* opens */
-			tmx_err(E_XDATA, "xml parser: cannot open extern tileset '%s'", ab_path);
-			tmx_free_func(ab_path);
-			return 0;
-		}
-		ret = parse_tileset(sub_reader, res, rc_mgr, ab_path); /* and parses the tsx file */
-		xmlFreeTextReader(sub_reader);
-		tmx_free_func(ab_path);
-		return ret;
+		if (!(ref = add_ext_ref(ctx, RC_TSX, value, filename))) return 0;
+		ref->user.ts_list = res_list;
+		return 1;
 	}
 
 	/* Embedded tileset */
@@ -1004,11 +1359,11 @@ static int parse_tileset_list(xmlTextReaderPtr reader, tmx_tileset_list **ts_hea
 	res_list->is_embedded = 1;
 	res_list->tileset = res;
 
-	return parse_tileset(reader, res, rc_mgr, filename);
+	return parse_tileset(reader, res, ctx, filename);
 }
 
-static int parse_template(xmlTextReaderPtr reader, tmx_template *template, tmx_resource_manager *rc_mgr, const char *filename) {
-	char *name;
+static int parse_template(xmlTextReaderPtr reader, tmx_template *template, parse_context *ctx, const char *filename) {
+	enum keyword kw;
 	int curr_depth;
 
 	curr_depth = xmlTextReaderDepth(reader);
@@ -1018,11 +1373,11 @@ static int parse_template(xmlTextReaderPtr reader, tmx_template *template, tmx_r
 		if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
 
 		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-			name = (char*)xmlTextReaderConstName(reader);
-			if (!strcmp(name, "tileset")) {
-				parse_tileset_list(reader, &(template->tileset_ref), rc_mgr, filename);
-			} else if (!strcmp(name, "object")) {
-				if (!parse_object(reader, template->object, 0, rc_mgr, filename)) return 0;
+			kw = node_keyword(reader);
+			if (kw == K_TILESET) {
+				parse_tileset_list(reader, &(template->tileset_ref), ctx, filename);
+			} else if (kw == K_OBJECT) {
+				if (!parse_object(reader, template->object, 0, ctx, filename)) return 0;
 			} else {
 				/* Unknow element, skip its tree */
 				if (xmlTextReaderNext(reader) != 1) return 0;
@@ -1033,115 +1388,342 @@ static int parse_template(xmlTextReaderPtr reader, tmx_template *template, tmx_r
 	return 1;
 }
 
-static int parse_map(xmlTextReaderPtr reader, tmx_map *map, tmx_resource_manager *rc_mgr, const char *filename) {
-	int curr_depth, flag;
-	const char *name;
-	char *value;
-	enum tmx_layer_type type;
+/*
+	Loading of the external resources
+	Each round loads the resources referenced by the documents of the previous
+	round, on several threads, the documents of a round only record their own
+	references. The resource manager and the image loading function are only
+	used by the loading thread, between rounds.
+*/
 
-	curr_depth = xmlTextReaderDepth(reader);
+typedef struct _ext_job {
+	enum resource_type type;
+	const char *path; /* owned by its ext_ref */
+	union {
+		tmx_tileset  *tileset;
+		tmx_template *template;
+	} resource;
+	parse_context ctx; /* references found in the document */
+	int failed;
+	error_state err;
+} ext_job;
+
+typedef struct _ext_round {
+	ext_job *jobs;
+	unsigned int jobs_len;
+	int use_mmap;
+} ext_round;
+
+static void ext_job_functor(void *userdata, unsigned int index, unsigned int worker UNUSED) {
+	ext_round *round = (ext_round*)userdata;
+	ext_job *job = round->jobs + index;
+	xmlTextReaderPtr reader;
+	mapped_file file;
+	int res = 0;
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"version"))) {
-		map->format_version = value;
+	if (is_json_file(job->path)) {
+		if (job->type == RC_TSX) {
+			res = parse_tsj_resource(job->path, job->resource.tileset, &(job->ctx));
+		} else {
+			res = parse_tj_resource(job->path, job->resource.template, &(job->ctx));
+		}
+	}
+	else if (!(reader = file_reader(job->path, round->use_mmap, &file))) { /* opens */
+		if (job->type == RC_TSX) {
+			tmx_err(E_XDATA, "xml parser: cannot open extern tileset '%s'", job->path);
+		} else {
+			tmx_err(E_XDATA, "xml parser: cannot open object template file '%s'", job->path);
+		}
+	}
+	else {
+		if (!check_reader(reader)) {
+			if (job->type == RC_TSX) {
+				tmx_err(E_XDATA, "xml parser: cannot open extern tileset '%s'", job->path);
+			}
+		}
+		else if (job->type == RC_TSX) {
+			res = parse_tileset(reader, job->resource.tileset, &(job->ctx), job->path); /* and parses the tsx file */
+		}
+		else if (node_keyword(reader) != K_TEMPLATE) {
+			tmx_err(E_XDATA, "xml parser: root of template document is not a 'template' element");
+		}
+		else {
+			res = parse_template(reader, job->resource.template, &(job->ctx), job->path); /* and parses the template file */
+		}
+		xmlFreeTextReader(reader);
+		if (round->use_mmap) unmap_file(&file);
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"class"))) {
-		map->class_type = value;
+	if (!res) {
+		job->failed = 1;
+		save_error(&(job->err));
 	}
+}
 
-	/* infinite maps not supported */
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"infinite"))) {
-		flag = atoi(value);
-		tmx_free_func(value);
-		if (flag == 1) {
-			tmx_err(E_XDATA, "xml parser: chunked layer data is not supported, edit this map to remove the infinite flag");
-			return 0;
+/* Links `ref` to its resource, found in the resource manager or to load in `round` */
+static int link_ext_ref(tmx_resource_manager *rc_mgr, ext_ref *ref, ext_round *round) {
+	resource_holder *rc_holder = NULL;
+	ext_job *job = round->jobs + round->jobs_len;
+
+	if (rc_mgr) {
+		rc_holder = (resource_holder*) hashtable_get((void*)rc_mgr, ref->key);
+		if (rc_holder && rc_holder->type != ref->type) rc_holder = NULL;
+	}
+
+	memset(job, 0, sizeof(ext_job));
+	job->type = ref->type;
+	job->path = ref->path;
+	job->ctx.images_deferred = 1;
+
+	if (ref->type == RC_TSX) {
+		if (rc_holder && rc_holder->resource.tileset) {
+			ref->user.ts_list->tileset = rc_holder->resource.tileset;
+			return 1;
+		}
+		if (!(job->resource.tileset = alloc_tileset())) return 0;
+		if (rc_mgr) {
+			if (!add_tileset(rc_mgr, ref->key, job->resource.tileset)) {
+				free_ts(job->resource.tileset);
+				tmx_err_code(E_ALLOC);
+				return 0;
+			}
+			ref->registered = 1;
+		}
+		else {
+			ref->user.ts_list->is_embedded = 1;
+		}
+		ref->user.ts_list->tileset = job->resource.tileset;
+	}
+	else {
+		if (rc_holder && rc_holder->resource.template) {
+			ref->user.object->template_ref = rc_holder->resource.template;
+			return 1;
+		}
+		if (!(job->resource.template = alloc_template())) return 0;
+		if (rc_mgr) {
+			if (!add_template(rc_mgr, ref->key, job->resource.template)) {
+				free_template(job->resource.template);
+				tmx_err_code(E_ALLOC);
+				return 0;
+			}
+			ref->registered = 1;
+		}
+		else {
+			job->resource.template->is_embedded = 1;
 		}
+		ref->user.object->template_ref = job->resource.template;
 	}
 
-	/* parses each attribute */
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"orientation"))) { /* orientation */
-		if (map->orient = parse_orient(value), map->orient == O_NONE) {
-			tmx_err(E_XDATA, "xml parser: unsupported 'orientation' '%s'", value);
+	round->jobs_len++;
+	return 1;
+}
+
+/* Moves the references of `src` at the end of `dst` */
+static int move_ext_refs(parse_context *dst, parse_context *src) {
+	unsigned int i;
+	for (i=0; i<src->refs_len; i++) {
+		if (!grow_array((void**)&(dst->refs), &(dst->refs_cap), dst->refs_len, sizeof(ext_ref))) {
+			/* those left are freed with `src` */
+			memmove(src->refs, src->refs + i, (src->refs_len - i) * sizeof(ext_ref));
+			src->refs_len -= i;
 			return 0;
 		}
-		tmx_free_func(value);
-	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'orientation' attribute in the 'map' element");
-		return 0;
+		dst->refs[dst->refs_len++] = src->refs[i];
 	}
+	src->refs_len = 0;
+	return 1;
+}
 
-	value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"staggerindex"); /* staggerindex */
-	if (value != NULL && (map->stagger_index = parse_stagger_index(value), map->stagger_index == SI_NONE)) {
-		tmx_err(E_XDATA, "xml parser: unsupported 'staggerindex' '%s'", value);
-		return 0;
+/* Objects without a type of their own take the type of their template */
+static void link_templates(parse_context *ctx) {
+	unsigned int i = ctx->refs_len;
+	tmx_object *obj;
+
+	/* in reverse order, objects of templates are after the objects that reference these templates */
+	while (i-- > 0) {
+		if (ctx->refs[i].type != RC_TX) continue;
+		obj = ctx->refs[i].user.object;
+		if (obj->obj_type == OT_NONE && obj->template_ref) obj->obj_type = obj->template_ref->object->obj_type;
+		if (obj->obj_type == OT_NONE) obj->obj_type = OT_POINT;
 	}
-	tmx_free_func(value);
+}
 
-	value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"staggeraxis"); /* staggeraxis */
-	if (map->stagger_axis = parse_stagger_axis(value), map->stagger_axis == SA_NONE) {
-		tmx_err(E_XDATA, "xml parser: unsupported 'staggeraxis' '%s'", value);
-		return 0;
+int load_ext_resources(tmx_resource_manager *rc_mgr, int use_mmap, parse_context *ctx) {
+	ext_round round;
+	ext_job *job;
+	unsigned int i, j, done = 0;
+	int res = 1, suspended = 0;
+
+	round.use_mmap = use_mmap;
+	/* resources of the resource manager outlive the map, they are not allocated in its arena */
+	if (rc_mgr) suspended = arena_suspend(1);
+
+	while (res && done < ctx->refs_len) {
+		if (!(round.jobs = (ext_job*)raw_alloc(NULL, (ctx->refs_len - done) * sizeof(ext_job)))) {
+			tmx_err_code(E_ALLOC);
+			res = 0;
+			break;
+		}
+		round.jobs_len = 0;
+		for (; res && done < ctx->refs_len; done++) {
+			res = link_ext_ref(rc_mgr, ctx->refs + done, &round);
+		}
+
+		if (res) run_jobs(ext_job_functor, &round, round.jobs_len, thread_limit());
+
+		for (i=0; i<round.jobs_len; i++) {
+			job = round.jobs + i;
+			/* reports the error of the first document that failed */
+			if (res && job->failed) {
+				restore_error(&(job->err));
+				res = 0;
+			}
+			for (j=0; res && j<job->ctx.images_len; j++) {
+				if (!(load_image(&(job->ctx.images[j]->resource_image), job->path, job->ctx.images[j]->source))) {
+					tmx_err(E_UNKN, "an error occured in the delegated image loading function");
+					res = 0;
+				}
+			}
+			/* the references of the document are loaded in the next round */
+			if (!move_ext_refs(ctx, &(job->ctx))) res = 0;
+			free_parse_context(&(job->ctx));
+		}
+		raw_free(round.jobs);
 	}
-	tmx_free_func(value);
 
-	value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"renderorder"); /* renderorder */
-	if (map->renderorder = parse_renderorder(value), map->renderorder == R_NONE) {
-		tmx_err(E_XDATA, "xml parser: unsupported 'renderorder' '%s'", value);
-		return 0;
+	if (res) {
+		link_templates(ctx);
+		record_cache_deps(rc_mgr, ctx);
 	}
-	tmx_free_func(value);
+	if (rc_mgr) arena_suspend(suspended);
+	return res;
+}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"height"))) { /* height */
-		map->height = atoi(value);
-		tmx_free_func(value);
-	} else {
+/* to be called once the document that references the resources has been freed */
+void unload_ext_resources(tmx_resource_manager *rc_mgr, parse_context *ctx) {
+	unsigned int i;
+	if (!rc_mgr) return;
+	for (i=0; i<ctx->refs_len; i++) {
+		if (ctx->refs[i].registered) {
+			hashtable_rm((void*)rc_mgr, ctx->refs[i].key, resource_deallocator);
+		}
+	}
+}
+
+static int parse_map(xmlTextReaderPtr reader, tmx_map *map, parse_context *ctx, data_decoder *decoder, const char *filename) {
+	int curr_depth, has_height = 0, has_width = 0, has_tileheight = 0, has_tilewidth = 0;
+	const char *value;
+	enum keyword kw;
+	enum tmx_layer_type type;
+	tmx_property *prop;
+
+	curr_depth = xmlTextReaderDepth(reader);
+
+	/* default values of optional attributes */
+	map->stagger_axis = parse_stagger_axis(NULL);
+	map->renderorder = parse_renderorder(NULL);
+
+	/* parses each attribute in a single pass, only kept strings are duplicated */
+	while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+		if (!(value = (const char*)xmlTextReaderConstValue(reader))) continue;
+
+		switch (node_keyword(reader)) {
+			case K_VERSION:
+				if (!(map->format_version = tmx_strdup(value))) return 0;
+				break;
+			case K_CLASS:
+				if (!(map->class_type = tmx_strdup(value))) return 0;
+				break;
+			case K_INFINITE: /* infinite */
+				map->infinite = atoi(value) == 1;
+				break;
+			case K_ORIENTATION: /* orientation */
+				if (map->orient = parse_orient(value), map->orient == O_NONE) {
+					tmx_err(E_XDATA, "xml parser: unsupported 'orientation' '%s'", value);
+					return 0;
+				}
+				break;
+			case K_STAGGERINDEX: /* staggerindex */
+				if (map->stagger_index = parse_stagger_index(value), map->stagger_index == SI_NONE) {
+					tmx_err(E_XDATA, "xml parser: unsupported 'staggerindex' '%s'", value);
+					return 0;
+				}
+				break;
+			case K_STAGGERAXIS: /* staggeraxis */
+				if (map->stagger_axis = parse_stagger_axis(value), map->stagger_axis == SA_NONE) {
+					tmx_err(E_XDATA, "xml parser: unsupported 'staggeraxis' '%s'", value);
+					return 0;
+				}
+				break;
+			case K_RENDERORDER: /* renderorder */
+				if (map->renderorder = parse_renderorder(value), map->renderorder == R_NONE) {
+					tmx_err(E_XDATA, "xml parser: unsupported 'renderorder' '%s'", value);
+					return 0;
+				}
+				break;
+			case K_HEIGHT: /* height */
+				map->height = atoi(value);
+				has_height = 1;
+				break;
+			case K_WIDTH: /* width */
+				map->width = atoi(value);
+				has_width = 1;
+				break;
+			case K_TILEHEIGHT: /* tileheight */
+				map->tile_height = atoi(value);
+				has_tileheight = 1;
+				break;
+			case K_TILEWIDTH: /* tilewidth */
+				map->tile_width = atoi(value);
+				has_tilewidth = 1;
+				break;
+			case K_BACKGROUNDCOLOR: /* backgroundcolor */
+				map->backgroundcolor = get_color_rgb(value);
+				break;
+			case K_HEXSIDELENGTH: /* hexsidelength */
+				map->hexsidelength = atoi(value);
+				break;
+			case K_PARALLAXORIGINX: /* parallaxoriginx */
+				map->parallaxoriginx = atof(value);
+				break;
+			case K_PARALLAXORIGINY: /* parallaxoriginy */
+				map->parallaxoriginy = atof(value);
+				break;
+			default:
+				break;
+		}
+	}
+	xmlTextReaderMoveToElement(reader);
+
+	if (map->orient == O_NONE) {
+		tmx_err(E_MISSEL, "xml parser: missing 'orientation' attribute in the 'map' element");
+		return 0;
+	}
+	if (!has_height) {
 		tmx_err(E_MISSEL, "xml parser: missing 'height' attribute in the 'map' element");
 		return 0;
 	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"width"))) { /* width */
-		map->width = atoi(value);
-		tmx_free_func(value);
-	} else {
+	if (!has_width) {
 		tmx_err(E_MISSEL, "xml parser: missing 'width' attribute in the 'map' element");
 		return 0;
 	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tileheight"))) { /* tileheight */
-		map->tile_height = atoi(value);
-		tmx_free_func(value);
-	} else {
+	if (!has_tileheight) {
 		tmx_err(E_MISSEL, "xml parser: missing 'tileheight' attribute in the 'map' element");
 		return 0;
 	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tilewidth"))) { /* tilewidth */
-		map->tile_width = atoi(value);
-		tmx_free_func(value);
-	} else {
+	if (!has_tilewidth) {
 		tmx_err(E_MISSEL, "xml parser: missing 'tilewidth' attribute in the 'map' element");
 		return 0;
 	}
 
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"backgroundcolor"))) { /* backgroundcolor */
-		map->backgroundcolor = get_color_rgb(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"hexsidelength"))) { /* hexsidelength */
-		map->hexsidelength = atoi(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"parallaxoriginx"))) { /* parallaxoriginx */
-		map->parallaxoriginx = atof(value);
-		tmx_free_func(value);
-	}
-
-	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"parallaxoriginy"))) { /* parallaxoriginy */
-		map->parallaxoriginy = atof(value);
-		tmx_free_func(value);
+	/* the map is reduced to the region */
+	if (ctx->region) {
+		ctx->region->src_width = map->width;
+		ctx->region->src_height = map->height;
+		map->region_x = ctx->region->x;
+		map->region_y = ctx->region->y;
+		map->width = ctx->region->width;
+		map->height = ctx->region->height;
 	}
 
 	/* Parse each child */
@@ -1149,13 +1731,18 @@ static int parse_map(xmlTextReaderPtr reader, tmx_map *map, tmx_resource_manager
 		if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
 
 		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-			name = (char*)xmlTextReaderConstName(reader);
-			if (!strcmp(name, "tileset")) {
-				if (!parse_tileset_list(reader, &(map->ts_head), rc_mgr, filename)) return 0;
-			} else if (!strcmp(name, "properties")) {
+			kw = node_keyword(reader);
+			if (kw == K_TILESET) {
+				if (!parse_tileset_list(reader, &(map->ts_head), ctx, filename)) return 0;
+			} else if (kw == K_PROPERTIES) {
 				if (!parse_properties(reader, &(map->properties))) return 0;
-			} else if ((type = parse_layer_type(name)) != L_NONE) {
-				if (!parse_layer(reader, &(map->ly_head), map->height, map->width, type, rc_mgr, filename)) return 0;
+				/* zstd dictionary used by the layers (properties precede layers) */
+				if ((prop = tmx_get_property(map->properties, "zstd_dictionary")) &&
+				    (prop->type == PT_FILE || prop->type == PT_STRING || prop->type == PT_NONE)) {
+					if (!data_decoder_load_zstd_dict(decoder, filename, prop->value.file)) return 0;
+				}
+			} else if ((type = parse_layer_type(kw)) != L_NONE) {
+				if (!parse_layer(reader, &(map->ly_head), map, type, ctx, decoder, filename)) return 0;
 			} else {
 				/* Unknow element, skip its tree */
 				if (xmlTextReaderNext(reader) != 1) return 0;
@@ -1166,9 +1753,107 @@ static int parse_map(xmlTextReaderPtr reader, tmx_map *map, tmx_resource_manager
 	return 1;
 }
 
-static tmx_map* parse_map_document(xmlTextReaderPtr reader, tmx_resource_manager *rc_mgr, const char *filename) {
+/* Bounds of an object (x_min, y_min, x_max, y_max), in pixels */
+static void object_bounds(tmx_object *obj, double *bounds) {
+	tmx_object *tmpl = obj->template_ref? obj->template_ref->object: NULL;
+	tmx_shape *shape = NULL;
+	double width = obj->width, height = obj->height, radius, x, y;
+	int i;
+
+	if (width == 0 && height == 0 && tmpl) {
+		width = tmpl->width;
+		height = tmpl->height;
+	}
+	bounds[0] = obj->x;
+	bounds[1] = obj->obj_type == OT_TILE? obj->y - height: obj->y; /* tile objects are aligned on their bottom */
+	bounds[2] = obj->x + width;
+	bounds[3] = bounds[1] + height;
+
+	if (obj->obj_type == OT_POLYGON || obj->obj_type == OT_POLYLINE) {
+		shape = obj->content.shape? obj->content.shape: tmpl? tmpl->content.shape: NULL;
+	}
+	if (shape) {
+		for (i=0; i<shape->points_len; i++) {
+			x = obj->x + (shape->fcoords? shape->fcoords[2*i]: shape->coords[2*i]);
+			y = obj->y + (shape->fcoords? shape->fcoords[2*i+1]: shape->coords[2*i+1]);
+			if (x < bounds[0]) bounds[0] = x;
+			if (y < bounds[1]) bounds[1] = y;
+			if (x > bounds[2]) bounds[2] = x;
+			if (y > bounds[3]) bounds[3] = y;
+		}
+	}
+
+	if (obj->rotation != 0) {
+		/* rotated around (x, y), the object stays within the largest |dx| + |dy| of its corners from (x, y) */
+		radius = 0;
+		for (i=0; i<4; i++) {
+			x = bounds[i%2 * 2] - obj->x;
+			y = bounds[1 + i/2 * 2] - obj->y;
+			if ((x < 0? -x: x) + (y < 0? -y: y) > radius) radius = (x < 0? -x: x) + (y < 0? -y: y);
+		}
+		bounds[0] = obj->x - radius;
+		bounds[1] = obj->y - radius;
+		bounds[2] = obj->x + radius;
+		bounds[3] = obj->y + radius;
+	}
+}
+
+/* Removes the objects out of the region (`bounds`, in pixels) from the object groups */
+static void crop_objects(tmx_layer *layer, const double *region_bounds) {
+	tmx_object **objadr, *obj;
+	double bounds[4];
+
+	for (; layer; layer = layer->next) {
+		if (layer->type == L_GROUP) {
+			crop_objects(layer->content.group_head, region_bounds);
+		}
+		else if (layer->type == L_OBJGR) {
+			objadr = &(layer->content.objgr->head);
+			while ((obj = *objadr)) {
+				object_bounds(obj, bounds);
+				if (bounds[2] < region_bounds[0] || bounds[0] > region_bounds[2] ||
+				    bounds[3] < region_bounds[1] || bounds[1] > region_bounds[3]) {
+					*objadr = obj->next;
+					obj->next = NULL;
+					free_obj(obj);
+				}
+				else {
+					objadr = &(obj->next);
+				}
+			}
+		}
+	}
+}
+
+/* Objects of isometric maps are positioned in tile_height units on both axes */
+void crop_map_objects(tmx_map *map, const data_region *region) {
+	double bounds[4];
+	double unit_x = map->orient == O_ISO? map->tile_height: map->tile_width;
+	double unit_y = map->tile_height;
+
+	bounds[0] = region->x * unit_x;
+	bounds[1] = region->y * unit_y;
+	bounds[2] = ((double)region->x + region->width) * unit_x;
+	bounds[3] = ((double)region->y + region->height) * unit_y;
+	crop_objects(map->ly_head, bounds);
+}
+
+/* `region` is not NULL for tmx_load_region */
+static tmx_map* parse_map_document(xmlTextReaderPtr reader, tmx_resource_manager *rc_mgr, int use_mmap, data_region *region, const char *filename) {
 	tmx_map *res = NULL;
-	char *name;
+	data_decoder *decoder;
+	parse_context ctx;
+	mem_arena *arena = NULL, *prev;
+	enum keyword kw;
+
+	memset(&ctx, 0, sizeof(parse_context));
+	ctx.region = region;
+
+	if (tmx_arena_allocation && !(arena = mk_arena())) {
+		xmlFreeTextReader(reader);
+		return NULL;
+	}
+	prev = arena_enter(arena);
 
 	if (check_reader(reader)) {
 		/* DTD before root element */
@@ -1177,60 +1862,84 @@ static tmx_map* parse_map_document(xmlTextReaderPtr reader, tmx_resource_manager
 			if (xmlTextReaderRead(reader) != 1) goto cleanup;
 		}
 
-		name = (char*) xmlTextReaderConstName(reader);
-		if (strcmp(name, "map")) {
+		kw = node_keyword(reader);
+		if (kw != K_MAP) {
 			tmx_err(E_XDATA, "xml parser: root of map document is not a 'map' element");
 		}
 		else if ((res = alloc_map())) {
-			if (!parse_map(reader, res, rc_mgr, filename)) {
+			/* decompression contexts are shared by all the layers of the map */
+			decoder = mk_data_decoder(rc_mgr);
+			if (!decoder || !parse_map(reader, res, &ctx, decoder, filename) ||
+			    !load_ext_resources(rc_mgr, use_mmap, &ctx) || !data_decoder_finish(decoder)) {
 				tmx_map_free(res);
+				unload_ext_resources(rc_mgr, &ctx);
 				res = NULL;
 			}
+			else {
+				/* after load_ext_resources, objects may take their geometry from their template */
+				if (region) crop_map_objects(res, region);
+				if (data_decoder_is_lazy(decoder)) {
+					/* the map keeps the payloads of its layers */
+					res->decoder = decoder;
+					decoder = NULL;
+				}
+				res->arena = (void*)arena;
+				arena = NULL;
+			}
+			free_data_decoder(decoder);
 		}
 	}
 cleanup:
+	free_parse_context(&ctx);
 	xmlFreeTextReader(reader);
+	arena_enter(prev);
+	free_arena(arena); /* the load failed */
 	return res;
 }
 
 static tmx_tileset* parse_tileset_document(xmlTextReaderPtr reader, const char *filename) {
 	tmx_tileset *res = NULL;
-	char *name;
+	parse_context ctx;
+	enum keyword kw;
 
+	memset(&ctx, 0, sizeof(parse_context));
 	if (check_reader(reader)) {
-		name = (char*) xmlTextReaderConstName(reader);
-		if (strcmp(name, "tileset")) {
+		kw = node_keyword(reader);
+		if (kw != K_TILESET) {
 			tmx_err(E_XDATA, "xml parser: root of tileset document is not a 'tileset' element");
-			return NULL;
 		}
 		else if ((res = alloc_tileset())) {
-			if (!parse_tileset(reader, res, NULL, filename)) {
+			if (!parse_tileset(reader, res, &ctx, filename) || !load_ext_resources(NULL, 0, &ctx)) {
 				free_ts(res);
 				res = NULL;
 			}
 		}
 	}
+	free_parse_context(&ctx);
 	xmlFreeTextReader(reader);
 	return res;
 }
 
 static tmx_template* parse_template_document(xmlTextReaderPtr reader, tmx_resource_manager *rc_mgr, const char *filename) {
 	tmx_template *res = NULL;
-	char *name;
+	parse_context ctx;
+	enum keyword kw;
 
+	memset(&ctx, 0, sizeof(parse_context));
 	if (check_reader(reader)) {
-		name = (char*) xmlTextReaderConstName(reader);
-		if (strcmp(name, "template")) {
+		kw = node_keyword(reader);
+		if (kw != K_TEMPLATE) {
 			tmx_err(E_XDATA, "xml parser: root of template document is not a 'template' element");
-			return NULL;
 		}
 		else if ((res = alloc_template())) {
-			if (!parse_template(reader, res, rc_mgr, filename)) {
+			if (!parse_template(reader, res, &ctx, filename) || !load_ext_resources(rc_mgr, 0, &ctx)) {
 				free_template(res);
+				unload_ext_resources(rc_mgr, &ctx);
 				res = NULL;
 			}
 		}
 	}
+	free_parse_context(&ctx);
 	xmlFreeTextReader(reader);
 	return res;
 }
@@ -1240,16 +1949,39 @@ static tmx_template* parse_template_document(xmlTextReaderPtr reader, tmx_resour
 */
 
 tmx_map *parse_xml(tmx_resource_manager *rc_mgr, const char *filename) {
+	return parse_xml_region(rc_mgr, filename, NULL);
+}
+
+tmx_map *parse_xml_region(tmx_resource_manager *rc_mgr, const char *filename, data_region *region) {
 	xmlTextReaderPtr reader;
 	tmx_map *res = NULL;
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForFile(filename, NULL, 0))) {
-		res = parse_map_document(reader, rc_mgr, filename);
+	if ((reader = xmlReaderForFile(filename, NULL, READER_OPTIONS))) {
+		res = parse_map_document(reader, rc_mgr, 0, region, filename);
+	} else {
+		tmx_err(E_UNKN, "xml parser: unable to open %s", filename);
+	}
+
+	return res;
+}
+
+tmx_map *parse_xml_mmap(tmx_resource_manager *rc_mgr, const char *filename) {
+	xmlTextReaderPtr reader;
+	mapped_file file;
+	tmx_map *res = NULL;
+
+	setup_libxml_mem();
+
+	if (!map_file(filename, &file)) return NULL;
+
+	if (file.len <= INT_MAX && (reader = xmlReaderForMemory(file.data, (int)file.len, filename, NULL, READER_OPTIONS))) {
+		res = parse_map_document(reader, rc_mgr, 1, NULL, filename); /* external tilesets and templates are mapped too */
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable to open %s", filename);
 	}
+	unmap_file(&file);
 
 	return res;
 }
@@ -1264,8 +1996,8 @@ tmx_map* parse_xml_buffer_vpath(tmx_resource_manager *rc_mgr, const char *buffer
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForMemory(buffer, len, NULL, NULL, 0))) {
-		res = parse_map_document(reader, rc_mgr, vpath);
+	if ((reader = xmlReaderForMemory(buffer, len, NULL, NULL, READER_OPTIONS))) {
+		res = parse_map_document(reader, rc_mgr, 0, NULL, vpath);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable to create parser for buffer");
 	}
@@ -1283,8 +2015,8 @@ tmx_map* parse_xml_fd_vpath(tmx_resource_manager *rc_mgr, int fd, const char *vp
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForFd(fd, NULL, NULL, 0))) {
-		res = parse_map_document(reader, rc_mgr, vpath);
+	if ((reader = xmlReaderForFd(fd, NULL, NULL, READER_OPTIONS))) {
+		res = parse_map_document(reader, rc_mgr, 0, NULL, vpath);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable create parser for file descriptor");
 	}
@@ -1302,8 +2034,8 @@ tmx_map* parse_xml_callback_vpath(tmx_resource_manager *rc_mgr, tmx_read_functor
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForIO((xmlInputReadCallback)callback, NULL, userdata, NULL, NULL, 0))) {
-		res = parse_map_document(reader, rc_mgr, vpath);
+	if ((reader = xmlReaderForIO((xmlInputReadCallback)callback, NULL, userdata, NULL, NULL, READER_OPTIONS))) {
+		res = parse_map_document(reader, rc_mgr, 0, NULL, vpath);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable to create parser for input callback");
 	}
@@ -1321,7 +2053,7 @@ tmx_tileset* parse_tsx_xml(const char *filename) {
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForFile(filename, NULL, 0))) {
+	if ((reader = xmlReaderForFile(filename, NULL, READER_OPTIONS))) {
 		res = parse_tileset_document(reader, filename);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable to open %s", filename);
@@ -1336,7 +2068,7 @@ tmx_tileset* parse_tsx_xml_buffer(const char *buffer, int len) {
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForMemory(buffer, len, NULL, NULL, 0))) {
+	if ((reader = xmlReaderForMemory(buffer, len, NULL, NULL, READER_OPTIONS))) {
 		res = parse_tileset_document(reader, NULL);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable to create parser for buffer");
@@ -1351,7 +2083,7 @@ tmx_tileset* parse_tsx_xml_fd(int fd) {
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForFd(fd, NULL, NULL, 0))) {
+	if ((reader = xmlReaderForFd(fd, NULL, NULL, READER_OPTIONS))) {
 		res = parse_tileset_document(reader, NULL);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable create parser for file descriptor");
@@ -1366,7 +2098,7 @@ tmx_tileset* parse_tsx_xml_callback(tmx_read_functor callback, void *userdata) {
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForIO((xmlInputReadCallback)callback, NULL, userdata, NULL, NULL, 0))) {
+	if ((reader = xmlReaderForIO((xmlInputReadCallback)callback, NULL, userdata, NULL, NULL, READER_OPTIONS))) {
 		res = parse_tileset_document(reader, NULL);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable to create parser for input callback");
@@ -1385,7 +2117,7 @@ tmx_template* parse_tx_xml(tmx_resource_manager *rc_mgr, const char *filename) {
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForFile(filename, NULL, 0))) {
+	if ((reader = xmlReaderForFile(filename, NULL, READER_OPTIONS))) {
 		res = parse_template_document(reader, rc_mgr, filename);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable to open %s", filename);
@@ -1400,7 +2132,7 @@ tmx_template* parse_tx_xml_buffer(tmx_resource_manager *rc_mgr, const char *buff
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForMemory(buffer, len, NULL, NULL, 0))) {
+	if ((reader = xmlReaderForMemory(buffer, len, NULL, NULL, READER_OPTIONS))) {
 		res = parse_template_document(reader, rc_mgr, NULL);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable to create parser for buffer");
@@ -1415,7 +2147,7 @@ tmx_template* parse_tx_xml_fd(tmx_resource_manager *rc_mgr, int fd) {
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForFd(fd, NULL, NULL, 0))) {
+	if ((reader = xmlReaderForFd(fd, NULL, NULL, READER_OPTIONS))) {
 		res = parse_template_document(reader, rc_mgr, NULL);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable create parser for file descriptor");
@@ -1430,7 +2162,7 @@ tmx_template* parse_tx_xml_callback(tmx_resource_manager *rc_mgr, tmx_read_funct
 
 	setup_libxml_mem();
 
-	if ((reader = xmlReaderForIO((xmlInputReadCallback)callback, NULL, userdata, NULL, NULL, 0))) {
+	if ((reader = xmlReaderForIO((xmlInputReadCallback)callback, NULL, userdata, NULL, NULL, READER_OPTIONS))) {
 		res = parse_template_document(reader, rc_mgr, NULL);
 	} else {
 		tmx_err(E_UNKN, "xml parser: unable to create parser for input callback");